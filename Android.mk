@@ -7,6 +7,8 @@ OBJS += cmds_reg.c
 OBJS += basic.c
 OBJS += sta.c
 OBJS += traffic.c
+OBJS += iperf.c
+OBJS += ping.c
 OBJS += p2p.c
 OBJS += dev.c
 OBJS += ap.c
@@ -111,3 +113,10 @@ LOCAL_SRC_FILES:= e_loop.c
 LOCAL_MODULE := e_loop
 LOCAL_CFLAGS := -DWITHOUT_IFADDRS -Wno-sign-compare
 include $(BUILD_EXECUTABLE)
+
+# Add building of sigma_dut_bench
+include $(CLEAR_VARS)
+LOCAL_SRC_FILES:= sigma_dut_bench.c
+LOCAL_MODULE := sigma_dut_bench
+LOCAL_MODULE_TAGS := optional
+include $(BUILD_EXECUTABLE)
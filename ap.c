@@ -192,6 +192,7 @@ void kill_hostapd_process_pid(struct sigma_dut *dut)
 	snprintf(path, sizeof(path), "/proc/%d", pid);
 	for (count = 0; count < 20 && file_exists(path); count++)
 		usleep(100000);
+	flush_hapd_ctrl_conns(NULL);
 }
 
 
@@ -618,12 +619,26 @@ static enum ap_mode get_mode(const char *str)
 }
 
 
+static const char * hostapd_ctrl_dir(struct sigma_dut *dut)
+{
+	if (get_driver_type(dut) != DRIVER_OPENWRT || sigma_hapd_ctrl)
+		return sigma_hapd_ctrl;
+
+	if (sigma_radio_ifname[0] &&
+	    strcmp(sigma_radio_ifname[0], "wifi1") == 0)
+		return "/var/run/hostapd-wifi1";
+	if (sigma_radio_ifname[0] &&
+	    strcmp(sigma_radio_ifname[0], "wifi2") == 0)
+		return "/var/run/hostapd-wifi2";
+	return "/var/run/hostapd-wifi0";
+}
+
+
 static int run_hostapd_cli(struct sigma_dut *dut, char *buf)
 {
 	char command[1000];
 	const char *bin;
-	enum driver_type drv = get_driver_type(dut);
-	char *sigma_hapd_file = sigma_hapd_ctrl;
+	const char *sigma_hapd_file = hostapd_ctrl_dir(dut);
 	const char *ifname = get_hostapd_ifname(dut);
 
 	if (file_exists("hostapd_cli"))
@@ -633,17 +648,6 @@ static int run_hostapd_cli(struct sigma_dut *dut, char *buf)
 	else
 		bin = "hostapd_cli";
 
-	if (drv == DRIVER_OPENWRT && sigma_hapd_ctrl == NULL) {
-		sigma_hapd_file = "/var/run/hostapd-wifi0";
-
-		if (sigma_radio_ifname[0] &&
-		    strcmp(sigma_radio_ifname[0], "wifi1") == 0)
-			sigma_hapd_file = "/var/run/hostapd-wifi1";
-		else if (sigma_radio_ifname[0] &&
-			 strcmp(sigma_radio_ifname[0], "wifi2") == 0)
-			sigma_hapd_file = "/var/run/hostapd-wifi2";
-	}
-
 	if (sigma_hapd_file)
 		snprintf(command, sizeof(command), "%s -p %s -i %s %s",
 			 bin, sigma_hapd_file, ifname, buf);
@@ -654,6 +658,21 @@ static int run_hostapd_cli(struct sigma_dut *dut, char *buf)
 }
 
 
+#define HOSTAPD_READY_TIMEOUT_MS 5000
+
+/* Wait for a freshly started hostapd to complete interface setup */
+static int wait_hostapd(struct sigma_dut *dut)
+{
+	if (wait_hostapd_ready(dut, hostapd_ctrl_dir(dut),
+			       get_hostapd_ifname(dut),
+			       HOSTAPD_READY_TIMEOUT_MS) == 0)
+		return 0;
+
+	/* Control interface may be somewhere hostapd_cli knows better */
+	return run_hostapd_cli(dut, "ping");
+}
+
+
 static int ath_set_lci_config(struct sigma_dut *dut, const char *val,
 			      struct sigma_cmd *cmd)
 {
@@ -5213,11 +5232,7 @@ static int owrt_ap_post_config_commit(struct sigma_dut *dut,
 	if (dut->ap_key_mgmt != AP_OPEN)
 		ap_security = 1;
 	if (ap_security) {
-		/* allow some time for hostapd to start before returning
-		 * success */
-		usleep(500000);
-
-		if (run_hostapd_cli(dut, "ping") != 0) {
+		if (wait_hostapd(dut) != 0) {
 			send_resp(dut, conn, SIGMA_ERROR,
 				  "errorCode,Failed to talk to hostapd");
 			return 0;
@@ -6743,7 +6758,7 @@ static void mubrp_commands(struct sigma_dut *dut, const char *ifname)
 }
 
 
-static void ath_ap_set_params(struct sigma_dut *dut)
+static void ath_ap_set_driver_params(struct sigma_dut *dut)
 {
 	const char *basedev = "wifi0";
 	const char *basedev_radio = "wifi1";
@@ -6876,14 +6891,14 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 
 		snprintf(buf, sizeof(buf),
 			 "wifitool %s senddelba 1 0 1 4", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool senddelba failed");
 		}
 
 		snprintf(buf, sizeof(buf), "wifitool %s sendsingleamsdu 1 0",
 			 ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool sendsingleamsdu failed");
 		}
@@ -6955,13 +6970,13 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 
 	if (dut->ap_sig_rts == VALUE_ENABLED) {
 		snprintf(buf, sizeof(buf), "iwconfig %s rts 64", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"iwconfig rts 64 failed");
 		}
 	} else if (dut->ap_sig_rts == VALUE_DISABLED) {
 		snprintf(buf, sizeof(buf), "iwconfig %s rts 2347", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"iwconfig rts 2347 failed");
 		}
@@ -7001,13 +7016,13 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 		run_iwpriv(dut, ifname, "l2tif 1");
 		snprintf(buf, sizeof(buf),
 			"echo 1 > /sys/class/net/br0/brif/ath0/hotspot_l2tif");
-		if (system(buf) != 0)
+		if (run_system(dut, buf) != 0)
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 				"l2tif br failed");
 
 		snprintf(buf, sizeof(buf),
 			"echo 1 > /sys/class/net/br0/brif/eth0/hotspot_wan");
-		if (system(buf) != 0)
+		if (run_system(dut, buf) != 0)
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 				"l2tif brif failed");
 		sigma_dut_print(dut, DUT_MSG_INFO, "Enabled l2tif");
@@ -7016,13 +7031,13 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 	if (dut->ap_ndpa_frame == 0) {
 		snprintf(buf, sizeof(buf),
 			 "wifitool %s beeliner_fw_test 117 192", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool beeliner_fw_test 117 192 failed");
 		}
 		snprintf(buf, sizeof(buf),
 			 "wifitool %s beeliner_fw_test 118 192", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool beeliner_fw_test 117 192 failed");
 		}
@@ -7031,13 +7046,13 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 	} else if (dut->ap_ndpa_frame == 2) {
 		snprintf(buf, sizeof(buf),
 			 "wifitool %s beeliner_fw_test 115 1", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool beeliner_fw_test 117 192 failed");
 		}
 		snprintf(buf, sizeof(buf),
 			 "wifitool %s beeliner_fw_test 116 1", ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool beeliner_fw_test 117 192 failed");
 		}
@@ -7176,7 +7191,7 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 		snprintf(buf, sizeof(buf),
 			 "wifitool %s setbssidpref 00:00:00:00:00:00 0 00 00",
 			 ifname);
-		if (system(buf) != 0) {
+		if (run_system(dut, buf) != 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"wifitool clear bssidpref failed");
 		}
@@ -7802,6 +7817,16 @@ static void ath_ap_set_params(struct sigma_dut *dut)
 }
 
 
+static void ath_ap_set_params(struct sigma_dut *dut)
+{
+	iwpriv_batch_start(dut);
+	ath_ap_set_driver_params(dut);
+	if (iwpriv_batch_end(dut))
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"Failed to set some driver parameters");
+}
+
+
 static int cmd_ath_ap_config_commit(struct sigma_dut *dut,
 				    struct sigma_conn *conn,
 				    struct sigma_cmd *cmd)
@@ -8194,10 +8219,7 @@ static int cmd_ath_ap_config_commit(struct sigma_dut *dut,
 
 	if (dut->ap_key_mgmt != AP_OPEN) {
 		int res;
-		/* allow some time for hostapd to start before returning
-		 * success */
-		usleep(500000);
-		if (run_hostapd_cli(dut, "ping") != 0) {
+		if (wait_hostapd(dut) != 0) {
 			send_resp(dut, conn, SIGMA_ERROR,
 				  "errorCode,Failed to talk to hostapd");
 			return 0;
@@ -8210,8 +8232,7 @@ static int cmd_ath_ap_config_commit(struct sigma_dut *dut,
 				return res;
 
 			/* wait for hostapd to be ready */
-			usleep(500000);
-			if (run_hostapd_cli(dut, "ping") != 0) {
+			if (wait_hostapd(dut) != 0) {
 				send_resp(dut, conn, SIGMA_ERROR,
 					  "errorCode,Failed to talk to "
 					  "hostapd");
@@ -8896,6 +8917,304 @@ static int cipher_support(int ciphers_capa, enum ap_cipher cipher)
 }
 
 
+/*
+ * In-memory model of the hostapd configuration file: one list of key=value
+ * entries per BSS, in file order. The first BSS holds the interface-level
+ * parameters; every "bss=<ifname>" line starts a new BSS.
+ */
+struct hapd_conf_entry {
+	char *key;
+	char *value;
+};
+
+struct hapd_conf_bss {
+	char ifname[IFNAMSIZ + 1];
+	struct hapd_conf_entry *entries;
+	size_t num_entries;
+};
+
+struct hapd_conf {
+	struct hapd_conf_bss *bss;
+	size_t num_bss;
+};
+
+
+static void hapd_conf_free(struct hapd_conf *conf)
+{
+	size_t i, j;
+
+	if (!conf)
+		return;
+	for (i = 0; i < conf->num_bss; i++) {
+		for (j = 0; j < conf->bss[i].num_entries; j++) {
+			free(conf->bss[i].entries[j].key);
+			free(conf->bss[i].entries[j].value);
+		}
+		free(conf->bss[i].entries);
+	}
+	free(conf->bss);
+	free(conf);
+}
+
+
+static struct hapd_conf_bss * hapd_conf_add_bss(struct hapd_conf *conf,
+						const char *ifname)
+{
+	struct hapd_conf_bss *bss;
+
+	bss = realloc(conf->bss, (conf->num_bss + 1) * sizeof(*bss));
+	if (!bss)
+		return NULL;
+	conf->bss = bss;
+	bss = &conf->bss[conf->num_bss++];
+	memset(bss, 0, sizeof(*bss));
+	strlcpy(bss->ifname, ifname, sizeof(bss->ifname));
+	return bss;
+}
+
+
+static int hapd_conf_add(struct hapd_conf_bss *bss, const char *key,
+			 const char *value)
+{
+	struct hapd_conf_entry *e;
+
+	e = realloc(bss->entries, (bss->num_entries + 1) * sizeof(*e));
+	if (!e)
+		return -1;
+	bss->entries = e;
+	e = &bss->entries[bss->num_entries];
+	e->key = strdup(key);
+	e->value = strdup(value);
+	if (!e->key || !e->value) {
+		free(e->key);
+		free(e->value);
+		return -1;
+	}
+	bss->num_entries++;
+	return 0;
+}
+
+
+static struct hapd_conf * hapd_conf_load(const char *path, const char *ifname)
+{
+	struct hapd_conf *conf;
+	struct hapd_conf_bss *bss;
+	char buf[MAX_CONF_LINE_LEN + 1];
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return NULL;
+	conf = calloc(1, sizeof(*conf));
+	bss = conf ? hapd_conf_add_bss(conf, ifname) : NULL;
+	if (!bss)
+		goto fail;
+
+	while (fgets(buf, sizeof(buf), f)) {
+		char *pos;
+
+		pos = strchr(buf, '\n');
+		if (pos)
+			*pos = '\0';
+		if (buf[0] == '#' || buf[0] == '\0')
+			continue;
+		pos = strchr(buf, '=');
+		if (!pos)
+			continue;
+		*pos++ = '\0';
+
+		if (strcmp(buf, "interface") == 0 && conf->num_bss == 1)
+			strlcpy(bss->ifname, pos, sizeof(bss->ifname));
+		if (strcmp(buf, "bss") == 0) {
+			bss = hapd_conf_add_bss(conf, pos);
+			if (!bss)
+				goto fail;
+		}
+		if (hapd_conf_add(bss, buf, pos) < 0)
+			goto fail;
+	}
+
+	fclose(f);
+	return conf;
+fail:
+	fclose(f);
+	hapd_conf_free(conf);
+	return NULL;
+}
+
+
+/* Parameters that hostapd applies on RELOAD after a control interface SET */
+static const char *hapd_reload_keys[] = {
+	"ssid", "utf8_ssid", "ignore_broadcast_ssid", "wpa", "wpa_key_mgmt",
+	"wpa_pairwise", "rsn_pairwise", "wpa_passphrase", "ieee80211w",
+	"group_mgmt_cipher", "beacon_int", "dtim_period", "max_num_sta",
+	"ap_max_inactivity", "wpa_group_rekey", NULL
+};
+
+/* Parameters regenerated on every commit that need not match a running AP */
+static const char *hapd_volatile_keys[] = {
+	"he_bss_color", NULL
+};
+
+
+static bool hapd_key_in(const char **list, const char *key)
+{
+	int i;
+
+	for (i = 0; list[i]; i++) {
+		if (strcmp(list[i], key) == 0)
+			return true;
+	}
+	return false;
+}
+
+
+static int hapd_conf_count(const struct hapd_conf_bss *bss, const char *key,
+			   const char **value)
+{
+	size_t i;
+	int count = 0;
+
+	for (i = 0; i < bss->num_entries; i++) {
+		if (strcmp(bss->entries[i].key, key) != 0)
+			continue;
+		if (count++ == 0 && value)
+			*value = bss->entries[i].value;
+	}
+	return count;
+}
+
+
+static bool hapd_conf_same_values(const struct hapd_conf_bss *a,
+				  const struct hapd_conf_bss *b,
+				  const char *key)
+{
+	size_t i = 0, j = 0;
+
+	for (;;) {
+		while (i < a->num_entries && strcmp(a->entries[i].key, key))
+			i++;
+		while (j < b->num_entries && strcmp(b->entries[j].key, key))
+			j++;
+		if (i == a->num_entries || j == b->num_entries)
+			return i == a->num_entries && j == b->num_entries;
+		if (strcmp(a->entries[i].value, b->entries[j].value) != 0)
+			return false;
+		i++;
+		j++;
+	}
+}
+
+
+/*
+ * Compare a BSS of the running configuration with its new version. Returns
+ * the number of changed parameters that can be SET at runtime, or -1 if the
+ * change needs hostapd to be restarted. When apply is set, the SET commands
+ * are also issued.
+ */
+static int hapd_conf_diff_bss(struct sigma_dut *dut,
+			      const struct hapd_conf_bss *cur,
+			      const struct hapd_conf_bss *next, bool apply)
+{
+	size_t i;
+	int changed = 0;
+
+	for (i = 0; i < cur->num_entries; i++) {
+		const char *key = cur->entries[i].key;
+
+		if (!hapd_conf_count(next, key, NULL) &&
+		    !hapd_key_in(hapd_volatile_keys, key)) {
+			sigma_dut_print(dut, DUT_MSG_DEBUG,
+					"hostapd %s: %s removed", cur->ifname,
+					key);
+			return -1;
+		}
+	}
+
+	for (i = 0; i < next->num_entries; i++) {
+		const struct hapd_conf_entry *e = &next->entries[i];
+		const char *old = NULL;
+		char buf[MAX_CONF_LINE_LEN + 10];
+		int count;
+
+		/* Handle each key once, at its first occurrence */
+		if (hapd_conf_count(next, e->key, &old) > 1 &&
+		    old != e->value)
+			continue;
+		if (hapd_key_in(hapd_volatile_keys, e->key) ||
+		    hapd_conf_same_values(cur, next, e->key))
+			continue;
+
+		count = hapd_conf_count(cur, e->key, NULL);
+		if (count > 1 || hapd_conf_count(next, e->key, NULL) > 1 ||
+		    !hapd_key_in(hapd_reload_keys, e->key)) {
+			sigma_dut_print(dut, DUT_MSG_DEBUG,
+					"hostapd %s: %s changed", cur->ifname,
+					e->key);
+			return -1;
+		}
+
+		changed++;
+		if (!apply)
+			continue;
+		snprintf(buf, sizeof(buf), "SET %s %s", e->key, e->value);
+		if (hapd_command(cur->ifname, buf) < 0)
+			return -1;
+	}
+
+	return changed;
+}
+
+
+/*
+ * Try to move the running hostapd to the new configuration without a restart.
+ * Even with an unchanged configuration, the PMKSA caches are flushed and
+ * hostapd is reloaded so that, as with a restart, no associated stations or
+ * values SET at runtime carry over into the next test. Returns 0 if the
+ * running instance now uses the new configuration, -1 if hostapd has to be
+ * restarted.
+ */
+static int hapd_conf_update(struct sigma_dut *dut, struct hapd_conf *next)
+{
+	struct hapd_conf *cur = dut->hapd_conf;
+	size_t i;
+	int res, changed = 0;
+
+	if (!cur || !next || !dut->hostapd_running ||
+	    cur->num_bss != next->num_bss)
+		return -1;
+	for (i = 0; i < cur->num_bss; i++) {
+		if (strcmp(cur->bss[i].ifname, next->bss[i].ifname) != 0)
+			return -1;
+		res = hapd_conf_diff_bss(dut, &cur->bss[i], &next->bss[i],
+					 false);
+		if (res < 0)
+			return -1;
+		changed += res;
+	}
+
+	if (hapd_command(cur->bss[0].ifname, "PING") < 0)
+		return -1;
+
+	for (i = 0; i < cur->num_bss; i++) {
+		if (changed &&
+		    hapd_conf_diff_bss(dut, &cur->bss[i], &next->bss[i],
+				       true) < 0)
+			return -1;
+		if (hapd_command(cur->bss[i].ifname, "PMKSA_FLUSH") < 0)
+			return -1;
+	}
+	/* Rereads the configuration file and disconnects all stations */
+	if (hapd_command(cur->bss[0].ifname, "RELOAD") < 0)
+		return -1;
+
+	sigma_dut_print(dut, DUT_MSG_INFO,
+			"Reloaded hostapd with %d configuration change(s) without restart",
+			changed);
+	return 0;
+}
+
+
 enum sigma_cmd_result cmd_ap_config_commit(struct sigma_dut *dut,
 					   struct sigma_conn *conn,
 					   struct sigma_cmd *cmd)
@@ -8907,6 +9226,7 @@ enum sigma_cmd_result cmd_ap_config_commit(struct sigma_dut *dut,
 	char path[100];
 	char ap_conf_path[100];
 	char ap_conf_path_1[100];
+	struct hapd_conf *next_conf = NULL;
 	enum driver_type drv;
 	const char *key_mgmt;
 	int conf_counter = 0;
@@ -10139,6 +10459,17 @@ skip_vht_parameters_set:
 		goto write_conf;
 	}
 
+	if (!dut->ap_is_dual && drv != DRIVER_QNXNTO) {
+		next_conf = hapd_conf_load(ap_conf_path, ifname);
+		if (hapd_conf_update(dut, next_conf) == 0) {
+			hapd_conf_free(dut->hapd_conf);
+			dut->hapd_conf = next_conf;
+			goto hostapd_started;
+		}
+	}
+	hapd_conf_free(dut->hapd_conf);
+	dut->hapd_conf = NULL;
+
 	if (dut->use_hostapd_pid_file)
 		kill_hostapd_process_pid(dut);
 #ifdef __QNXNTO__
@@ -10217,10 +10548,7 @@ skip_vht_parameters_set:
 		 * beaconing, so remove it (if injection was used) before
 		 * starting hostapd.
 		 */
-		if (if_nametoindex("sigmadut") > 0 &&
-		    system("iw dev sigmadut del") != 0)
-			sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to remove "
-					"monitor interface");
+		inject_close(dut, true);
 
 		snprintf(path, sizeof(path), "%shostapd",
 			 file_exists("hostapd") ? "./" : "");
@@ -10243,19 +10571,21 @@ skip_vht_parameters_set:
 
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "hostapd command: %s", buf);
 	if (system(buf) != 0) {
+		hapd_conf_free(next_conf);
 		send_resp(dut, conn, SIGMA_ERROR,
 			  "errorCode,Failed to start hostapd");
 		return 0;
 	}
 
-	/* allow some time for hostapd to start before returning success */
-	usleep(500000);
-	if (run_hostapd_cli(dut, "ping") != 0) {
+	if (wait_hostapd(dut) != 0) {
+		hapd_conf_free(next_conf);
 		send_resp(dut, conn, SIGMA_ERROR,
 			  "errorCode,Failed to talk to hostapd");
 		return 0;
 	}
+	dut->hapd_conf = next_conf;
 
+hostapd_started:
 	if (dut->ap_ba_bufsize != BA_BUFSIZE_NOT_SET) {
 		int buf_size;
 
@@ -11483,10 +11813,7 @@ static enum sigma_cmd_result cmd_ap_reset_default(struct sigma_dut *dut,
 		}
 	}
 
-	if (if_nametoindex("sigmadut") > 0 &&
-	    system("iw dev sigmadut del") != 0)
-		sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to remove "
-				"monitor interface");
+	inject_close(dut, true);
 
 	ifname = get_hostapd_ifname(dut);
 	snprintf(ifname2, sizeof(ifname2), "%s_1", ifname);
@@ -11660,11 +11987,6 @@ static enum sigma_cmd_result cmd_ap_deauth_sta(struct sigma_dut *dut,
 }
 
 
-#ifdef __linux__
-int inject_frame(int s, const void *data, size_t len, int encrypt);
-int open_monitor(const char *ifname);
-#endif /* __linux__ */
-
 enum send_frame_type {
 		DISASSOC, DEAUTH, SAQUERY, CHANNEL_SWITCH
 };
@@ -11676,15 +11998,16 @@ enum send_frame_protection {
 static int ap_inject_frame(struct sigma_dut *dut, struct sigma_conn *conn,
 			   enum send_frame_type frame,
 			   enum send_frame_protection protected,
-			   const char *sta_addr)
+			   const char *sta_addr, struct sigma_cmd *cmd)
 {
 #ifdef __linux__
 	unsigned char buf[1000], *pos;
 	int s, res;
 	unsigned char addr_sta[6], addr_own[6];
 	char *ifname;
-	char cbuf[100];
 	struct ifreq ifr;
+	struct inject_params params;
+	unsigned int acked;
 
 	if ((dut->ap_mode == AP_11a || dut->ap_mode == AP_11na ||
 	     dut->ap_mode == AP_11ac) &&
@@ -11709,23 +12032,15 @@ static int ap_inject_frame(struct sigma_dut *dut, struct sigma_conn *conn,
 	close(s);
 	memcpy(addr_own, ifr.ifr_hwaddr.sa_data, 6);
 
-	if (if_nametoindex("sigmadut") == 0) {
-		snprintf(cbuf, sizeof(cbuf),
-			 "iw dev %s interface add sigmadut type monitor",
-			 ifname);
-		if (system(cbuf) != 0 ||
-		    if_nametoindex("sigmadut") == 0) {
-			sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to add "
-					"monitor interface with '%s'", cbuf);
-			return -2;
-		}
+	if (inject_params_parse(cmd, &params) < 0) {
+		send_resp(dut, conn, SIGMA_ERROR,
+			  "errorCode,Invalid frame injection parameters");
+		return 0;
 	}
+	params.encrypt = protected == CORRECT_KEY;
 
-	if (system("ifconfig sigmadut up") != 0) {
-		sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to set "
-				"monitor interface up");
+	if (inject_open(dut, ifname) < 0)
 		return -2;
-	}
 
 	pos = buf;
 
@@ -11823,28 +12138,27 @@ static int ap_inject_frame(struct sigma_dut *dut, struct sigma_conn *conn,
 		}
 	}
 
-	s = open_monitor("sigmadut");
-	if (s < 0) {
-		send_resp(dut, conn, SIGMA_ERROR, "errorCode,Failed to open "
-			  "monitor socket");
-		return 0;
-	}
-
-	res = inject_frame(s, buf, pos - buf, protected == CORRECT_KEY);
+	res = inject_frames(dut, &params, buf, pos - buf);
 	if (res < 0) {
 		send_resp(dut, conn, SIGMA_ERROR, "errorCode,Failed to "
 			  "inject frame");
-		close(s);
 		return 0;
 	}
-	if (res < pos - buf) {
-		send_resp(dut, conn, SIGMA_ERROR, "errorCode,Only partial "
-			  "frame sent");
-		close(s);
+	if (res < params.count) {
+		char resp[60];
+
+		snprintf(resp, sizeof(resp),
+			 "errorCode,Only %d of %d frames sent",
+			 res, params.count);
+		send_resp(dut, conn, SIGMA_ERROR, resp);
 		return 0;
 	}
 
-	close(s);
+	res = inject_tx_status(dut, INJECT_TX_STATUS_TIMEOUT_MS, &acked);
+	if (res > 0)
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"Injected %d frame(s): %d with TX status, %u acknowledged",
+				params.count, res, acked);
 
 	return 1;
 #else /* __linux__ */
@@ -12614,7 +12928,7 @@ enum sigma_cmd_result cmd_ap_send_frame(struct sigma_dut *dut,
 
 	if (val && (protected == INCORRECT_KEY ||
 		    (protected == UNPROTECTED && frame == SAQUERY)))
-		return ap_inject_frame(dut, conn, frame, protected, val);
+		return ap_inject_frame(dut, conn, frame, protected, val, cmd);
 
 	if (!val && frame != CHANNEL_SWITCH) {
 		sigma_dut_print(dut, DUT_MSG_ERROR, "stationID not specified");
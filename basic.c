@@ -260,7 +260,8 @@ static enum sigma_cmd_result cmd_device_list_interfaces(struct sigma_dut *dut,
 
 void basic_register_cmds(void)
 {
-	sigma_dut_reg_cmd("ca_get_version", NULL, cmd_ca_get_version);
+	sigma_dut_reg_cmd_flags("ca_get_version", NULL, cmd_ca_get_version,
+				SIGMA_CMD_ASYNC);
 	sigma_dut_reg_cmd("device_get_info", NULL, cmd_device_get_info);
 	sigma_dut_reg_cmd("device_list_interfaces",
 			  check_device_list_interfaces,
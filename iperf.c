@@ -0,0 +1,1123 @@
+/*
+ * Sigma Control API DUT (built-in iperf compatible throughput engine)
+ * Copyright (c) 2018-2020, The Linux Foundation
+ * All Rights Reserved.
+ * Licensed under the Clear BSD license. See README for more details.
+ */
+
+#include "sigma_dut.h"
+#include <limits.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+/*
+ * The engine runs traffic_start_iperf sessions in-process. Forward traffic
+ * uses the iperf2 wire format: plain TCP byte streams and UDP datagrams that
+ * start with a 32-bit datagram ID and the send time, with a negative ID
+ * marking the end of the test. An iperf2 peer can therefore be on the other
+ * end. Reverse mode needs this engine on both ends: the client opens the
+ * connection with an iperf_reverse_req and the server sends to it.
+ *
+ * Latency is the one-way delay of UDP datagrams, from the send time in the
+ * datagram header to the receive time, so the clocks of the two ends need to
+ * be synchronized as with iperf2 --trip-times. TCP carries no timestamps.
+ */
+
+#define IPERF_MAX_STREAMS 16
+#define IPERF_TCP_LEN (128 * 1024)
+#define IPERF_UDP_LEN 1470
+#define IPERF_UDP_HDR_LEN 12
+#define IPERF_UDP_FIN_COUNT 3
+#define IPERF_UDP_DEFAULT_RATE (1024 * 1024)
+/* Blocking socket calls wake up this often to check the stop flag */
+#define IPERF_POLL_MSEC 300
+#define IPERF_INTERVAL_NS 1000000000LL
+/* 1 ms latency bins; later datagrams are counted in the last bin */
+#define IPERF_LAT_BINS 10000
+
+static const u8 iperf_reverse_magic[8] = "SDIPERFR";
+
+struct iperf_reverse_req {
+	u8 magic[8];
+	u8 duration[4]; /* seconds, big endian */
+	u8 rate_kbps[4];
+	u8 burst_size[4];
+};
+
+struct iperf_session;
+
+struct iperf_stream {
+	struct iperf_session *sess;
+	pthread_t thr;
+	bool running;
+	int sock;
+	bool own_sock;
+	bool sending;
+	bool udp;
+
+	/* Reverse mode sender on the shared UDP server socket */
+	struct sockaddr_storage peer;
+	socklen_t peer_len;
+	int duration;
+	long long rate;
+	int burst_size;
+
+	unsigned long long bytes;
+	unsigned long long *intervals;
+	unsigned int num_intervals;
+	long long first_ns;
+	long long last_ns;
+
+	/* UDP receiver */
+	int next_id;
+	unsigned int datagrams;
+	unsigned int lost;
+	unsigned int out_of_order;
+	unsigned int *lat_bins;
+};
+
+struct iperf_session {
+	struct iperf_session *next;
+	struct sigma_dut *dut;
+	bool server;
+	bool tcp;
+	bool udp;
+	bool ipv6;
+	bool reverse;
+	bool latency;
+	double lower_ci, upper_ci;
+	int port;
+	int duration;
+	long long rate;
+	int burst_size;
+	int tos;
+	int parallel;
+	char dst[INET6_ADDRSTRLEN];
+	char ifname[IFNAMSIZ];
+	char src_ip[INET6_ADDRSTRLEN];
+	int src_port;
+
+	int listen_sock;
+	pthread_t accept_thr;
+	bool accept_started;
+	int udp_sock;
+
+	pthread_mutex_t lock; /* protects streams and num_streams */
+	struct iperf_stream *streams[IPERF_MAX_STREAMS];
+	int num_streams;
+
+	int stop;
+	long long start_ns;
+};
+
+
+static long long iperf_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void iperf_sleep_until(long long deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000LL;
+	ts.tv_nsec = deadline % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR)
+		;
+}
+
+
+static int iperf_sockaddr(const char *addr, int port, bool ipv6,
+			  const char *ifname, struct sockaddr_storage *ss,
+			  socklen_t *len)
+{
+	memset(ss, 0, sizeof(*ss));
+
+	if (ipv6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		if (addr && inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1)
+			return -1;
+		if (!addr)
+			sin6->sin6_addr = in6addr_any;
+		if (ifname && ifname[0] &&
+		    (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr) ||
+		     IN6_IS_ADDR_MC_LINKLOCAL(&sin6->sin6_addr)))
+			sin6->sin6_scope_id = if_nametoindex(ifname);
+		*len = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		if (addr && inet_pton(AF_INET, addr, &sin->sin_addr) != 1)
+			return -1;
+		if (!addr)
+			sin->sin_addr.s_addr = htonl(INADDR_ANY);
+		*len = sizeof(*sin);
+	}
+
+	return 0;
+}
+
+
+static bool iperf_is_multicast(const struct iperf_session *sess)
+{
+	struct sockaddr_storage ss;
+	socklen_t len;
+
+	if (!sess->dst[0] ||
+	    iperf_sockaddr(sess->dst, 0, sess->ipv6, NULL, &ss, &len) < 0)
+		return false;
+	if (sess->ipv6)
+		return IN6_IS_ADDR_MULTICAST(
+			&((struct sockaddr_in6 *) &ss)->sin6_addr);
+	return IN_MULTICAST(ntohl(((struct sockaddr_in *) &ss)->sin_addr.s_addr));
+}
+
+
+static void iperf_set_tos(struct iperf_session *sess, int sock)
+{
+	int res;
+
+	if (sess->tos < 0)
+		return;
+	if (sess->ipv6)
+		res = setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &sess->tos,
+				 sizeof(sess->tos));
+	else
+		res = setsockopt(sock, IPPROTO_IP, IP_TOS, &sess->tos,
+				 sizeof(sess->tos));
+	if (res < 0)
+		sigma_dut_print(sess->dut, DUT_MSG_INFO,
+				"iperf: Failed to set TOS 0x%02x: %s",
+				sess->tos, strerror(errno));
+}
+
+
+static int iperf_join_group(struct iperf_session *sess, int sock)
+{
+	unsigned int ifindex = sess->ifname[0] ?
+		if_nametoindex(sess->ifname) : 0;
+
+	if (sess->ipv6) {
+		struct ipv6_mreq mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		if (inet_pton(AF_INET6, sess->dst, &mreq.ipv6mr_multiaddr) != 1)
+			return -1;
+		mreq.ipv6mr_interface = ifindex;
+		return setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq,
+				  sizeof(mreq));
+	} else {
+		struct ip_mreqn mreq;
+
+		memset(&mreq, 0, sizeof(mreq));
+		if (inet_pton(AF_INET, sess->dst, &mreq.imr_multiaddr) != 1)
+			return -1;
+		mreq.imr_ifindex = ifindex;
+		return setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+				  sizeof(mreq));
+	}
+}
+
+
+static int iperf_socket(struct iperf_session *sess, int type)
+{
+	struct timeval tv;
+	int sock, val = 1;
+
+	sock = socket(sess->ipv6 ? AF_INET6 : AF_INET, type, 0);
+	if (sock < 0)
+		return -1;
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	if (sess->ipv6)
+		setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &val, sizeof(val));
+	tv.tv_sec = 0;
+	tv.tv_usec = IPERF_POLL_MSEC * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	iperf_set_tos(sess, sock);
+
+	return sock;
+}
+
+
+static struct iperf_stream * iperf_add_stream(struct iperf_session *sess,
+					      int sock, bool udp)
+{
+	struct iperf_stream *st;
+
+	pthread_mutex_lock(&sess->lock);
+	if (sess->num_streams == IPERF_MAX_STREAMS) {
+		pthread_mutex_unlock(&sess->lock);
+		return NULL;
+	}
+	st = calloc(1, sizeof(*st));
+	if (st) {
+		st->sess = sess;
+		st->sock = sock;
+		st->udp = udp;
+		st->duration = sess->duration;
+		st->rate = sess->rate;
+		st->burst_size = sess->burst_size;
+		sess->streams[sess->num_streams++] = st;
+	}
+	pthread_mutex_unlock(&sess->lock);
+
+	return st;
+}
+
+
+/* Account transferred payload into the 1 s interval it falls into */
+static void iperf_account(struct iperf_stream *st, size_t bytes)
+{
+	long long now = iperf_now_ns();
+	unsigned int idx;
+	unsigned long long *intervals;
+
+	if (!st->first_ns)
+		st->first_ns = now;
+	st->last_ns = now;
+	st->bytes += bytes;
+
+	idx = (now - st->sess->start_ns) / IPERF_INTERVAL_NS;
+	if (idx >= st->num_intervals) {
+		unsigned int num = idx + 16;
+
+		intervals = realloc(st->intervals, num * sizeof(*intervals));
+		if (!intervals)
+			return;
+		memset(&intervals[st->num_intervals], 0,
+		       (num - st->num_intervals) * sizeof(*intervals));
+		st->intervals = intervals;
+		st->num_intervals = num;
+	}
+	st->intervals[idx] += bytes;
+}
+
+
+static void iperf_latency_account(struct iperf_stream *st, const u8 *pkt)
+{
+	struct timeval tv;
+	long long delay;
+	unsigned int bin;
+
+	if (!st->lat_bins) {
+		st->lat_bins = calloc(IPERF_LAT_BINS, sizeof(*st->lat_bins));
+		if (!st->lat_bins)
+			return;
+	}
+
+	gettimeofday(&tv, NULL);
+	delay = ((long long) tv.tv_sec - WPA_GET_BE32(pkt + 4)) * 1000000LL +
+		tv.tv_usec - WPA_GET_BE32(pkt + 8);
+	if (delay < 0)
+		delay = 0; /* clocks are not quite in sync */
+	bin = delay / 1000;
+	if (bin >= IPERF_LAT_BINS)
+		bin = IPERF_LAT_BINS - 1;
+	st->lat_bins[bin]++;
+}
+
+
+/* Smallest latency in ms that pct percent of the datagrams did not exceed */
+static unsigned int iperf_latency_percentile(const unsigned int *bins,
+					     unsigned long long count,
+					     double pct)
+{
+	unsigned long long sum = 0, target;
+	unsigned int i;
+
+	target = (unsigned long long) (count * pct / 100.0 + 0.5);
+	if (target < 1)
+		target = 1;
+	for (i = 0; i < IPERF_LAT_BINS - 1; i++) {
+		sum += bins[i];
+		if (sum >= target)
+			break;
+	}
+
+	return i + 1;
+}
+
+
+static void iperf_udp_account(struct iperf_stream *st, const u8 *pkt,
+			      size_t len)
+{
+	int id;
+
+	if (len < IPERF_UDP_HDR_LEN) {
+		iperf_account(st, len);
+		return;
+	}
+
+	id = (int) WPA_GET_BE32(pkt);
+	if (id < 0)
+		return; /* end of test marker */
+	iperf_account(st, len);
+	st->datagrams++;
+	if (st->sess->latency)
+		iperf_latency_account(st, pkt);
+	if (id > st->next_id)
+		st->lost += id - st->next_id;
+	else if (id < st->next_id)
+		st->out_of_order++;
+	if (id >= st->next_id)
+		st->next_id = id + 1;
+}
+
+
+static void iperf_send(struct iperf_stream *st)
+{
+	struct iperf_session *sess = st->sess;
+	size_t len = st->udp ? IPERF_UDP_LEN : IPERF_TCP_LEN;
+	long long start, stop = LLONG_MAX, next, interval = 0;
+	unsigned int burst = 1, i;
+	struct timeval tv;
+	int id = 0;
+	ssize_t res;
+	u8 *buf;
+
+	if (st->udp && st->rate <= 0)
+		st->rate = IPERF_UDP_DEFAULT_RATE;
+	if (st->burst_size > 0 && st->rate > 0) {
+		/* Isochronous: one burst of burst_size bytes per period */
+		burst = (st->burst_size + len - 1) / len;
+		interval = 8LL * st->burst_size * 1000000000LL / st->rate;
+	} else if (st->rate > 0) {
+		if (!st->udp)
+			len = 8 * 1024;
+		interval = 8LL * len * 1000000000LL / st->rate;
+	}
+
+	buf = calloc(1, len);
+	if (!buf)
+		return;
+
+	start = next = iperf_now_ns();
+	if (st->duration > 0)
+		stop = start + st->duration * 1000000000LL;
+
+	while (!sess->stop && next < stop) {
+		for (i = 0; i < burst && !sess->stop; i++) {
+			if (st->udp) {
+				gettimeofday(&tv, NULL);
+				WPA_PUT_BE32(buf, id);
+				WPA_PUT_BE32(buf + 4, tv.tv_sec);
+				WPA_PUT_BE32(buf + 8, tv.tv_usec);
+				id++;
+			}
+			if (st->peer_len)
+				res = sendto(st->sock, buf, len, 0,
+					     (struct sockaddr *) &st->peer,
+					     st->peer_len);
+			else
+				res = send(st->sock, buf, len, MSG_NOSIGNAL);
+			if (res > 0) {
+				iperf_account(st, res);
+			} else if (res < 0 && errno != EAGAIN &&
+				   errno != ENOBUFS && errno != EINTR &&
+				   errno != ECONNREFUSED) {
+				sigma_dut_print(sess->dut, DUT_MSG_DEBUG,
+						"iperf: send failed: %s",
+						strerror(errno));
+				goto out;
+			}
+		}
+
+		if (interval) {
+			next += interval;
+			/* Do not try to catch up a long stall with a burst */
+			if (iperf_now_ns() - next > 10 * interval)
+				next = iperf_now_ns();
+			iperf_sleep_until(next);
+		} else {
+			next = iperf_now_ns();
+		}
+	}
+
+	if (st->udp) {
+		/* Tell an iperf2 server that the test is over */
+		gettimeofday(&tv, NULL);
+		WPA_PUT_BE32(buf, -id);
+		WPA_PUT_BE32(buf + 4, tv.tv_sec);
+		WPA_PUT_BE32(buf + 8, tv.tv_usec);
+		for (i = 0; i < IPERF_UDP_FIN_COUNT; i++) {
+			if (st->peer_len)
+				sendto(st->sock, buf, len, 0,
+				       (struct sockaddr *) &st->peer,
+				       st->peer_len);
+			else
+				send(st->sock, buf, len, 0);
+		}
+	}
+
+out:
+	free(buf);
+}
+
+
+static void * iperf_send_thread(void *ctx)
+{
+	iperf_send(ctx);
+	return NULL;
+}
+
+
+static bool iperf_parse_reverse(const u8 *buf, size_t len,
+				struct iperf_stream *st)
+{
+	const struct iperf_reverse_req *req = (const void *) buf;
+
+	if (len < sizeof(*req) ||
+	    memcmp(req->magic, iperf_reverse_magic, sizeof(req->magic)) != 0)
+		return false;
+	st->duration = WPA_GET_BE32(req->duration);
+	st->rate = 1000LL * WPA_GET_BE32(req->rate_kbps);
+	st->burst_size = WPA_GET_BE32(req->burst_size);
+	return true;
+}
+
+
+static void iperf_build_reverse(struct iperf_session *sess,
+				struct iperf_reverse_req *req)
+{
+	memcpy(req->magic, iperf_reverse_magic, sizeof(req->magic));
+	WPA_PUT_BE32(req->duration, sess->duration);
+	WPA_PUT_BE32(req->rate_kbps, sess->rate / 1000);
+	WPA_PUT_BE32(req->burst_size, sess->burst_size);
+}
+
+
+static void * iperf_tcp_recv_thread(void *ctx)
+{
+	struct iperf_stream *st = ctx;
+	struct iperf_session *sess = st->sess;
+	struct iperf_reverse_req req;
+	ssize_t res;
+	char *buf;
+
+	if (sess->server) {
+		/* A reverse mode client asks for data before sending any */
+		res = recv(st->sock, &req, sizeof(req),
+			   MSG_PEEK | MSG_WAITALL);
+		if (res == sizeof(req) &&
+		    iperf_parse_reverse((u8 *) &req, res, st)) {
+			if (recv(st->sock, &req, sizeof(req), 0) > 0) {
+				st->sending = true;
+				iperf_send(st);
+			}
+			return NULL;
+		}
+	}
+
+	buf = malloc(IPERF_TCP_LEN);
+	if (!buf)
+		return NULL;
+
+	while (!sess->stop) {
+		res = recv(st->sock, buf, IPERF_TCP_LEN, 0);
+		if (res > 0)
+			iperf_account(st, res);
+		else if (res == 0 ||
+			 (errno != EAGAIN && errno != EINTR))
+			break;
+		if (!sess->server && sess->duration > 0 &&
+		    iperf_now_ns() - sess->start_ns >
+		    (sess->duration + 1) * 1000000000LL)
+			break;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+static void iperf_udp_reverse(struct iperf_stream *st,
+			      struct sockaddr_storage *from,
+			      socklen_t from_len, const u8 *pkt, size_t len)
+{
+	struct iperf_session *sess = st->sess;
+	struct iperf_stream *snd;
+	int i, res;
+
+	pthread_mutex_lock(&sess->lock);
+	for (i = 0; i < sess->num_streams; i++) {
+		snd = sess->streams[i];
+		if (snd->sending && snd->peer_len == from_len &&
+		    memcmp(&snd->peer, from, from_len) == 0) {
+			/* Repeated request */
+			pthread_mutex_unlock(&sess->lock);
+			return;
+		}
+	}
+	pthread_mutex_unlock(&sess->lock);
+
+	snd = iperf_add_stream(sess, st->sock, true);
+	if (!snd)
+		return;
+	iperf_parse_reverse(pkt, len, snd);
+	memcpy(&snd->peer, from, from_len);
+	snd->peer_len = from_len;
+	snd->sending = true;
+	res = pthread_create(&snd->thr, NULL, iperf_send_thread, snd);
+	if (res)
+		sigma_dut_print(sess->dut, DUT_MSG_INFO,
+				"iperf: pthread_create failed: %d", res);
+	else
+		snd->running = true;
+}
+
+
+static void * iperf_udp_recv_thread(void *ctx)
+{
+	struct iperf_stream *st = ctx;
+	struct iperf_session *sess = st->sess;
+	struct sockaddr_storage from;
+	socklen_t from_len;
+	ssize_t res;
+	u8 *buf;
+
+	buf = malloc(65536);
+	if (!buf)
+		return NULL;
+
+	while (!sess->stop) {
+		from_len = sizeof(from);
+		res = recvfrom(st->sock, buf, 65536, 0,
+			       (struct sockaddr *) &from, &from_len);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR ||
+			    errno == ECONNREFUSED)
+				goto check_duration;
+			break;
+		}
+		if (sess->server &&
+		    (size_t) res >= sizeof(struct iperf_reverse_req) &&
+		    memcmp(buf, iperf_reverse_magic,
+			   sizeof(iperf_reverse_magic)) == 0) {
+			iperf_udp_reverse(st, &from, from_len, buf, res);
+			continue;
+		}
+		iperf_udp_account(st, buf, res);
+	check_duration:
+		if (!sess->server && sess->duration > 0 &&
+		    iperf_now_ns() - sess->start_ns >
+		    (sess->duration + 1) * 1000000000LL)
+			break;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+static void * iperf_accept_thread(void *ctx)
+{
+	struct iperf_session *sess = ctx;
+	struct iperf_stream *st;
+	struct pollfd pfd;
+	int sock, res;
+
+	while (!sess->stop) {
+		pfd.fd = sess->listen_sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, IPERF_POLL_MSEC) <= 0)
+			continue;
+
+		sock = accept(sess->listen_sock, NULL, NULL);
+		if (sock < 0)
+			continue;
+		st = iperf_add_stream(sess, sock, false);
+		if (!st) {
+			close(sock);
+			continue;
+		}
+		st->own_sock = true;
+		res = pthread_create(&st->thr, NULL, iperf_tcp_recv_thread,
+				     st);
+		if (res)
+			sigma_dut_print(sess->dut, DUT_MSG_INFO,
+					"iperf: pthread_create failed: %d",
+					res);
+		else
+			st->running = true;
+	}
+
+	return NULL;
+}
+
+
+static int iperf_start_server(struct iperf_session *sess, char *err,
+			      size_t err_len)
+{
+	struct sockaddr_storage addr;
+	struct iperf_stream *st;
+	socklen_t addr_len;
+	bool mcast = iperf_is_multicast(sess);
+	int res;
+
+	if (sess->tcp && !mcast) {
+		sess->listen_sock = iperf_socket(sess, SOCK_STREAM);
+		if (sess->listen_sock < 0 ||
+		    iperf_sockaddr(sess->dst[0] ? sess->dst : NULL, sess->port,
+				   sess->ipv6, sess->ifname, &addr,
+				   &addr_len) < 0 ||
+		    bind(sess->listen_sock, (struct sockaddr *) &addr,
+			 addr_len) < 0 ||
+		    listen(sess->listen_sock, IPERF_MAX_STREAMS) < 0) {
+			snprintf(err, err_len,
+				 "errorCode,Cannot listen on TCP port %d",
+				 sess->port);
+			return -1;
+		}
+		res = pthread_create(&sess->accept_thr, NULL,
+				     iperf_accept_thread, sess);
+		if (res)
+			return -1;
+		sess->accept_started = true;
+	}
+
+	if (sess->udp || mcast) {
+		sess->udp_sock = iperf_socket(sess, SOCK_DGRAM);
+		if (sess->udp_sock < 0 ||
+		    iperf_sockaddr(sess->dst[0] ? sess->dst : NULL, sess->port,
+				   sess->ipv6, sess->ifname, &addr,
+				   &addr_len) < 0 ||
+		    bind(sess->udp_sock, (struct sockaddr *) &addr,
+			 addr_len) < 0) {
+			snprintf(err, err_len,
+				 "errorCode,Cannot bind UDP port %d",
+				 sess->port);
+			return -1;
+		}
+		if (mcast && iperf_join_group(sess, sess->udp_sock) < 0) {
+			snprintf(err, err_len,
+				 "errorCode,Cannot join multicast group %s",
+				 sess->dst);
+			return -1;
+		}
+		st = iperf_add_stream(sess, sess->udp_sock, true);
+		if (!st ||
+		    pthread_create(&st->thr, NULL, iperf_udp_recv_thread,
+				   st) != 0)
+			return -1;
+		st->running = true;
+	}
+
+	return 0;
+}
+
+
+static int iperf_start_client(struct iperf_session *sess, char *err,
+			      size_t err_len)
+{
+	struct sockaddr_storage addr, src;
+	struct iperf_reverse_req req;
+	struct iperf_stream *st;
+	socklen_t addr_len, src_len;
+	struct timeval tv;
+	int i, sock, res, ttl = 1;
+	bool mcast = iperf_is_multicast(sess);
+
+	if (iperf_sockaddr(sess->dst, sess->port, sess->ipv6, sess->ifname,
+			   &addr, &addr_len) < 0) {
+		snprintf(err, err_len, "errorCode,Invalid destination address");
+		return -1;
+	}
+
+	for (i = 0; i < sess->parallel; i++) {
+		sock = iperf_socket(sess, sess->udp ? SOCK_DGRAM : SOCK_STREAM);
+		if (sock < 0)
+			return -1;
+
+		if (sess->src_port || sess->src_ip[0]) {
+			if (iperf_sockaddr(sess->src_ip[0] ? sess->src_ip : NULL,
+					   sess->src_port ?
+					   sess->src_port + i : 0,
+					   sess->ipv6, sess->ifname, &src,
+					   &src_len) < 0 ||
+			    bind(sock, (struct sockaddr *) &src, src_len) < 0) {
+				snprintf(err, err_len,
+					 "errorCode,Cannot bind client port %d",
+					 sess->src_port + i);
+				close(sock);
+				return -1;
+			}
+		}
+
+		if (mcast && sess->ifname[0]) {
+			unsigned int ifindex = if_nametoindex(sess->ifname);
+
+			if (sess->ipv6) {
+				setsockopt(sock, IPPROTO_IPV6,
+					   IPV6_MULTICAST_IF, &ifindex,
+					   sizeof(ifindex));
+				setsockopt(sock, IPPROTO_IPV6,
+					   IPV6_MULTICAST_HOPS, &ttl,
+					   sizeof(ttl));
+			} else {
+				struct ip_mreqn mreq;
+
+				memset(&mreq, 0, sizeof(mreq));
+				mreq.imr_ifindex = ifindex;
+				setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF,
+					   &mreq, sizeof(mreq));
+				setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL,
+					   &ttl, sizeof(ttl));
+			}
+		}
+
+		/* Bound the time a TCP connect can block the command */
+		tv.tv_sec = 5;
+		tv.tv_usec = 0;
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+		if (connect(sock, (struct sockaddr *) &addr, addr_len) < 0) {
+			snprintf(err, err_len,
+				 "errorCode,Cannot connect to %s port %d",
+				 sess->dst, sess->port);
+			close(sock);
+			return -1;
+		}
+		tv.tv_sec = 0;
+		tv.tv_usec = IPERF_POLL_MSEC * 1000;
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+		st = iperf_add_stream(sess, sock, sess->udp);
+		if (!st) {
+			close(sock);
+			return -1;
+		}
+		st->own_sock = true;
+
+		if (sess->reverse) {
+			iperf_build_reverse(sess, &req);
+			if (sess->udp) {
+				int j;
+
+				/* The server ignores duplicates */
+				for (j = 0; j < IPERF_UDP_FIN_COUNT; j++)
+					send(sock, &req, sizeof(req), 0);
+			} else if (send(sock, &req, sizeof(req),
+					MSG_NOSIGNAL) != sizeof(req)) {
+				snprintf(err, err_len,
+					 "errorCode,Cannot request reverse mode");
+				return -1;
+			}
+			res = pthread_create(&st->thr, NULL,
+					     sess->udp ?
+					     iperf_udp_recv_thread :
+					     iperf_tcp_recv_thread, st);
+		} else {
+			st->sending = true;
+			res = pthread_create(&st->thr, NULL,
+					     iperf_send_thread, st);
+		}
+		if (res) {
+			sigma_dut_print(sess->dut, DUT_MSG_INFO,
+					"iperf: pthread_create failed: %d",
+					res);
+			return -1;
+		}
+		st->running = true;
+	}
+
+	return 0;
+}
+
+
+static void iperf_session_join(struct iperf_session *sess)
+{
+	struct iperf_stream *st;
+	int i;
+
+	sess->stop = 1;
+	if (sess->accept_started) {
+		pthread_join(sess->accept_thr, NULL);
+		sess->accept_started = false;
+	}
+
+	/*
+	 * Only the acceptor and the UDP receiver add streams and both come
+	 * before the streams they add, so num_streams is final once the loop
+	 * gets past them.
+	 */
+	for (i = 0; ; i++) {
+		pthread_mutex_lock(&sess->lock);
+		st = i < sess->num_streams ? sess->streams[i] : NULL;
+		pthread_mutex_unlock(&sess->lock);
+		if (!st)
+			break;
+		if (st->running) {
+			pthread_join(st->thr, NULL);
+			st->running = false;
+		}
+	}
+}
+
+
+static void iperf_session_free(struct iperf_session *sess)
+{
+	struct iperf_stream *st;
+	int i;
+
+	iperf_session_join(sess);
+	for (i = 0; i < sess->num_streams; i++) {
+		st = sess->streams[i];
+		if (st->own_sock && st->sock >= 0)
+			close(st->sock);
+		free(st->intervals);
+		free(st->lat_bins);
+		free(st);
+	}
+	if (sess->listen_sock >= 0)
+		close(sess->listen_sock);
+	if (sess->udp_sock >= 0)
+		close(sess->udp_sock);
+	pthread_mutex_destroy(&sess->lock);
+	free(sess);
+}
+
+
+int iperf_native_start(struct sigma_dut *dut, const struct iperf_params *p,
+		       char *err, size_t err_len)
+{
+	struct iperf_session *sess;
+	int res;
+
+	snprintf(err, err_len, "errorCode,Failed to start iperf");
+
+	sess = calloc(1, sizeof(*sess));
+	if (!sess)
+		return -1;
+	sess->dut = dut;
+	sess->server = p->server;
+	sess->tcp = p->tcp;
+	sess->udp = p->udp;
+	sess->ipv6 = p->ipv6;
+	sess->reverse = p->reverse;
+	sess->latency = p->latency;
+	sess->lower_ci = p->lower_ci;
+	sess->upper_ci = p->upper_ci;
+	sess->port = p->port;
+	sess->duration = p->duration;
+	sess->rate = p->rate;
+	sess->burst_size = p->burst_size;
+	sess->tos = p->tos;
+	sess->parallel = p->parallel > 0 ? p->parallel : 1;
+	if (sess->parallel > IPERF_MAX_STREAMS)
+		sess->parallel = IPERF_MAX_STREAMS;
+	if (p->dst)
+		strlcpy(sess->dst, p->dst, sizeof(sess->dst));
+	if (p->ifname)
+		strlcpy(sess->ifname, p->ifname, sizeof(sess->ifname));
+	if (p->src_ip)
+		strlcpy(sess->src_ip, p->src_ip, sizeof(sess->src_ip));
+	sess->src_port = p->src_port;
+	sess->listen_sock = -1;
+	sess->udp_sock = -1;
+	pthread_mutex_init(&sess->lock, NULL);
+	sess->start_ns = iperf_now_ns();
+
+	if (sess->latency && !sess->udp) {
+		snprintf(err, err_len,
+			 "errorCode,Built-in iperf measures latency only for UDP");
+		iperf_session_free(sess);
+		return -1;
+	}
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"iperf: built-in %s %s%s port %d dst %s duration %d rate %lld streams %d",
+			sess->server ? "server" : "client",
+			sess->tcp ? "TCP" : "", sess->udp ? "UDP" : "",
+			sess->port, sess->dst[0] ? sess->dst : "-",
+			sess->duration, sess->rate, sess->parallel);
+
+	if (sess->server)
+		res = iperf_start_server(sess, err, err_len);
+	else
+		res = iperf_start_client(sess, err, err_len);
+	if (res < 0) {
+		iperf_session_free(sess);
+		return -1;
+	}
+
+	sess->next = dut->iperf_sessions;
+	dut->iperf_sessions = sess;
+	return 0;
+}
+
+
+/*
+ * Stop the session that traffic_stop_iperf refers to (any session if port is
+ * 0) and write the CAPI result into buf. Returns -1 if there is no built-in
+ * session so that the caller can look for an external iperf.
+ */
+int iperf_native_stop(struct sigma_dut *dut, int server, int port,
+		      char *buf, size_t buflen)
+{
+	struct iperf_session *sess, **prev;
+	struct iperf_stream *st;
+	unsigned long long total = 0, bandwidth = 0, *intervals = NULL;
+	unsigned int num_intervals = 0, first, last, lost = 0, ooo = 0;
+	unsigned int datagrams = 0, j, *lat_bins = NULL;
+	long long first_ns = 0, last_ns = 0;
+	bool udp_rx = false, receiver = false;
+	char *pos, *end;
+	int i, res;
+
+	for (prev = &dut->iperf_sessions; *prev; prev = &(*prev)->next) {
+		sess = *prev;
+		if (!port || (sess->port == port && sess->server == server))
+			break;
+	}
+	sess = *prev;
+	if (!sess)
+		return -1;
+	*prev = sess->next;
+
+	iperf_session_join(sess);
+	for (i = 0; i < sess->num_streams; i++) {
+		st = sess->streams[i];
+		total += st->bytes;
+		if (st->first_ns && (!first_ns || st->first_ns < first_ns))
+			first_ns = st->first_ns;
+		if (st->last_ns > last_ns)
+			last_ns = st->last_ns;
+		if (st->udp && !st->sending) {
+			receiver = true;
+			udp_rx = udp_rx || st->datagrams > 0;
+			datagrams += st->datagrams;
+			lost += st->lost;
+			ooo += st->out_of_order;
+		}
+		if (st->lat_bins && !lat_bins)
+			lat_bins = calloc(IPERF_LAT_BINS, sizeof(*lat_bins));
+		if (st->lat_bins && lat_bins) {
+			for (j = 0; j < IPERF_LAT_BINS; j++)
+				lat_bins[j] += st->lat_bins[j];
+		}
+		if (st->num_intervals > num_intervals) {
+			unsigned long long *tmp;
+
+			tmp = realloc(intervals,
+				      st->num_intervals * sizeof(*tmp));
+			if (!tmp)
+				continue;
+			memset(&tmp[num_intervals], 0,
+			       (st->num_intervals - num_intervals) *
+			       sizeof(*tmp));
+			intervals = tmp;
+			num_intervals = st->num_intervals;
+		}
+		for (j = 0; j < st->num_intervals; j++)
+			intervals[j] += st->intervals[j];
+	}
+
+	if (last_ns - first_ns >= 1000000)
+		bandwidth = total * 1000000000ULL / (last_ns - first_ns);
+
+	pos = buf;
+	end = buf + buflen;
+	res = snprintf(pos, end - pos, "bandwidth,%llu,totalbytes,%llu",
+		       bandwidth, total);
+	if (res < 0 || res >= end - pos)
+		goto out;
+	pos += res;
+
+	/* Like the iperf2 histogram: lower/upper/99.7% percentiles in ms */
+	if (sess->latency && receiver && lat_bins) {
+		res = snprintf(pos, end - pos, ",latency,%u/%u/%u",
+			       iperf_latency_percentile(lat_bins, datagrams,
+							sess->lower_ci),
+			       iperf_latency_percentile(lat_bins, datagrams,
+							sess->upper_ci),
+			       iperf_latency_percentile(lat_bins, datagrams,
+							99.7));
+		if (res < 0 || res >= end - pos)
+			goto out;
+		pos += res;
+	} else if (sess->latency && receiver) {
+		/* Nothing was received to measure */
+		res = snprintf(pos, end - pos, ",latency,NA");
+		if (res < 0 || res >= end - pos)
+			goto out;
+		pos += res;
+	}
+
+	if (udp_rx) {
+		res = snprintf(pos, end - pos,
+			       ",datagrams,%u,lostDatagrams,%u,outOfOrder,%u",
+			       datagrams, lost, ooo);
+		if (res < 0 || res >= end - pos)
+			goto out;
+		pos += res;
+	}
+
+	/* Per-second bytes from the first to the last active interval */
+	for (first = 0; first < num_intervals && !intervals[first]; first++)
+		;
+	for (last = num_intervals; last > first && !intervals[last - 1];
+	     last--)
+		;
+	res = snprintf(pos, end - pos, ",intervalBytes,");
+	if (res < 0 || res >= end - pos)
+		goto out;
+	pos += res;
+	if (first == last) {
+		res = snprintf(pos, end - pos, "0");
+		if (res > 0 && res < end - pos)
+			pos += res;
+	}
+	for (j = first; j < last; j++) {
+		res = snprintf(pos, end - pos, "%s%llu", j > first ? " " : "",
+			       intervals[j]);
+		if (res < 0 || res >= end - pos)
+			break;
+		pos += res;
+	}
+
+out:
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "iperf: built-in %s port %d: %s",
+			sess->server ? "server" : "client", sess->port, buf);
+	free(intervals);
+	free(lat_bins);
+	iperf_session_free(sess);
+	return 0;
+}
+
+
+/* Whether an iperf binary can be found in PATH */
+bool iperf_binary_available(const char *name)
+{
+	const char *path = getenv("PATH");
+	char dir[256], fname[300];
+	const char *pos, *end;
+
+	if (!path)
+		path = "/usr/bin:/bin";
+
+	for (pos = path; *pos; pos = end + (*end == ':')) {
+		end = strchr(pos, ':');
+		if (!end)
+			end = pos + strlen(pos);
+		if (end == pos || (size_t) (end - pos) >= sizeof(dir))
+			continue;
+		memcpy(dir, pos, end - pos);
+		dir[end - pos] = '\0';
+		snprintf(fname, sizeof(fname), "%s/%s", dir, name);
+		if (access(fname, X_OK) == 0)
+			return true;
+	}
+
+	return false;
+}
@@ -18,8 +18,13 @@ int run_system(struct sigma_dut *dut, const char *cmd)
 {
 	int res;
 
+	/* Keep the order with any queued driver private commands */
+	if (dut->iwpriv_batch_len)
+		iwpriv_batch_flush(dut);
+
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "Running '%s'", cmd);
-	res = system(cmd);
+	if (!run_cmd_direct(dut, cmd, &res))
+		res = system(cmd);
 	if (res < 0) {
 		sigma_dut_print(dut, DUT_MSG_INFO,
 				"Failed to execute command '%s'", cmd);
@@ -78,6 +83,11 @@ int run_iwpriv(struct sigma_dut *dut, const char *ifname, const char *cmd, ...)
 	va_start(ap, cmd);
 	vsnprintf(buf + prefix_len, bytes_required, cmd, ap);
 	va_end(ap);
+	if (dut->iwpriv_batching &&
+	    iwpriv_batch_add(dut, ifname, buf + prefix_len) == 0) {
+		free(buf);
+		return 0;
+	}
 	res = run_system(dut, buf);
 	free(buf);
 	return res;
@@ -0,0 +1,422 @@
+/*
+ * Sigma Control API DUT (built-in ICMP/ICMPv6 echo)
+ * Copyright (c) 2018-2020, The Linux Foundation
+ * All Rights Reserved.
+ * Licensed under the Clear BSD license. See README for more details.
+ */
+
+#include "sigma_dut.h"
+#include <poll.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/icmp6.h>
+
+/*
+ * traffic_send_ping sessions. An unprivileged ICMP datagram socket is used
+ * when net.ipv4.ping_group_range allows it and a raw socket otherwise. Each
+ * echo request carries its sequence index and send time so that replies,
+ * including multiple replies to a broadcast request, are matched without
+ * any per-request state beyond a reply bitmap.
+ */
+
+#define PING_LINGER_MSEC 1000
+
+struct ping_payload {
+	u8 index[4];
+	u8 sent_ns[8];
+};
+
+struct ping_session {
+	struct ping_session *next;
+	struct sigma_dut *dut;
+	int id;
+	u16 ident;
+	int sock;
+	bool raw;
+	bool ipv6;
+	struct sockaddr_storage dst;
+	socklen_t dst_len;
+	int size;
+	long long interval_ns;
+	int count;
+
+	pthread_t thr;
+	bool running;
+	int stop;
+
+	int sent;
+	int replies;
+	int duplicates;
+	u8 *replied;
+	long long *rtt_ns; /* replies entries */
+};
+
+
+static long long ping_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static u16 ping_checksum(const u8 *buf, size_t len)
+{
+	u32 sum = 0;
+
+	while (len > 1) {
+		sum += (buf[0] << 8) | buf[1];
+		buf += 2;
+		len -= 2;
+	}
+	if (len)
+		sum += buf[0] << 8;
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return htons(~sum & 0xffff);
+}
+
+
+static int ping_open(struct ping_session *s)
+{
+	int family = s->ipv6 ? AF_INET6 : AF_INET;
+	int proto = s->ipv6 ? IPPROTO_ICMPV6 : IPPROTO_ICMP;
+
+	s->sock = socket(family, SOCK_DGRAM, proto);
+	if (s->sock >= 0)
+		return 0;
+	s->sock = socket(family, SOCK_RAW, proto);
+	if (s->sock < 0)
+		return -1;
+	s->raw = true;
+
+	if (s->ipv6) {
+		struct icmp6_filter filter;
+
+		ICMP6_FILTER_SETBLOCKALL(&filter);
+		ICMP6_FILTER_SETPASS(ICMP6_ECHO_REPLY, &filter);
+		setsockopt(s->sock, IPPROTO_ICMPV6, ICMP6_FILTER, &filter,
+			   sizeof(filter));
+	}
+
+	return 0;
+}
+
+
+static void ping_send(struct ping_session *s, u8 *buf, size_t len)
+{
+	struct icmphdr *icmp = (struct icmphdr *) buf;
+	struct ping_payload *pl = (struct ping_payload *) (icmp + 1);
+	uint64_t now;
+
+	memset(icmp, 0, sizeof(*icmp));
+	icmp->type = s->ipv6 ? ICMP6_ECHO_REQUEST : ICMP_ECHO;
+	/* The kernel replaces the identifier on datagram sockets */
+	icmp->un.echo.id = htons(s->ident);
+	icmp->un.echo.sequence = htons(s->sent & 0xffff);
+	if (len >= sizeof(*icmp) + sizeof(*pl)) {
+		now = ping_now_ns();
+		WPA_PUT_BE32(pl->index, s->sent);
+		WPA_PUT_BE32(pl->sent_ns, now >> 32);
+		WPA_PUT_BE32(pl->sent_ns + 4, now & 0xffffffff);
+	}
+	/* ICMPv6 and datagram socket checksums are filled in by the kernel */
+	if (!s->ipv6)
+		icmp->checksum = ping_checksum(buf, len);
+
+	if (sendto(s->sock, buf, len, 0, (struct sockaddr *) &s->dst,
+		   s->dst_len) < 0)
+		sigma_dut_print(s->dut, DUT_MSG_DEBUG,
+				"ping: sendto failed: %s", strerror(errno));
+	s->sent++;
+}
+
+
+static void ping_receive(struct ping_session *s, u8 *buf, size_t buflen,
+			 long long now)
+{
+	struct icmphdr *icmp;
+	struct ping_payload *pl;
+	ssize_t len;
+	unsigned int index;
+	long long sent_ns;
+
+	len = recv(s->sock, buf, buflen, MSG_DONTWAIT);
+	if (len <= 0)
+		return;
+
+	icmp = (struct icmphdr *) buf;
+	if (s->raw && !s->ipv6) {
+		struct iphdr *ip = (struct iphdr *) buf;
+
+		if ((size_t) len < sizeof(*ip) ||
+		    (size_t) len < ip->ihl * 4U + sizeof(*icmp))
+			return;
+		icmp = (struct icmphdr *) (buf + ip->ihl * 4);
+		len -= ip->ihl * 4;
+	}
+	if ((size_t) len < sizeof(*icmp) ||
+	    icmp->type != (s->ipv6 ? ICMP6_ECHO_REPLY : ICMP_ECHOREPLY) ||
+	    (s->raw && icmp->un.echo.id != htons(s->ident)))
+		return;
+
+	pl = (struct ping_payload *) (icmp + 1);
+	if ((size_t) len >= sizeof(*icmp) + sizeof(*pl)) {
+		index = WPA_GET_BE32(pl->index);
+		sent_ns = ((uint64_t) WPA_GET_BE32(pl->sent_ns) << 32) |
+			WPA_GET_BE32(pl->sent_ns + 4);
+	} else {
+		/* Too short for a payload; only the 16-bit sequence */
+		index = ntohs(icmp->un.echo.sequence);
+		sent_ns = 0;
+	}
+	if (index >= (unsigned int) s->sent)
+		return;
+
+	if (s->replied[index / 8] & BIT(index % 8)) {
+		s->duplicates++;
+		return;
+	}
+	s->replied[index / 8] |= BIT(index % 8);
+	if (sent_ns)
+		s->rtt_ns[s->replies] = now - sent_ns;
+	else
+		s->rtt_ns[s->replies] = -1;
+	s->replies++;
+}
+
+
+static void * ping_thread(void *ctx)
+{
+	struct ping_session *s = ctx;
+	size_t len = sizeof(struct icmphdr) + s->size;
+	struct pollfd pfd;
+	long long next, now, end = 0;
+	int timeout;
+	u8 *buf;
+
+	buf = calloc(1, len + 65536);
+	if (!buf)
+		return NULL;
+
+	next = ping_now_ns();
+	for (;;) {
+		now = ping_now_ns();
+		if (s->sent < s->count && now >= next) {
+			ping_send(s, buf, len);
+			next += s->interval_ns;
+			if (s->sent == s->count)
+				end = ping_now_ns() +
+					PING_LINGER_MSEC * 1000000LL;
+			continue;
+		}
+		if (s->stop || (end && (now >= end || s->replies == s->count)))
+			break;
+
+		timeout = ((s->sent < s->count ? next : end) - now + 999999) /
+			1000000;
+		if (timeout > 100)
+			timeout = 100; /* check the stop flag */
+		pfd.fd = s->sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, timeout) > 0)
+			ping_receive(s, buf + len, 65536, ping_now_ns());
+	}
+
+	free(buf);
+	return NULL;
+}
+
+
+static void ping_session_free(struct ping_session *s)
+{
+	if (s->running) {
+		s->stop = 1;
+		pthread_join(s->thr, NULL);
+	}
+	if (s->sock >= 0)
+		close(s->sock);
+	free(s->replied);
+	free(s->rtt_ns);
+	free(s);
+}
+
+
+/*
+ * Start sending count echo requests to dst (an address with an optional
+ * %ifname scope) for traffic_send_ping stream id. Returns -1 if no ICMP
+ * socket is available so that the caller can fall back to ping(8).
+ */
+int ping_native_start(struct sigma_dut *dut, int id,
+		      const struct ping_params *p)
+{
+	struct ping_session *s;
+	char addr[INET6_ADDRSTRLEN + IFNAMSIZ + 1], *scope;
+	int res, val = 1;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -1;
+	s->dut = dut;
+	s->id = id;
+	/* Raw sockets see all replies; keep concurrent streams apart */
+	s->ident = (getpid() + id) & 0xffff;
+	s->ipv6 = p->ipv6;
+	s->size = p->size;
+	s->count = p->count > 0 ? p->count : 1;
+	s->interval_ns = 1000000000LL / p->rate;
+	s->sock = -1;
+	s->replied = calloc((s->count + 7) / 8, 1);
+	s->rtt_ns = calloc(s->count, sizeof(*s->rtt_ns));
+	if (!s->replied || !s->rtt_ns)
+		goto fail;
+
+	strlcpy(addr, p->dst, sizeof(addr));
+	scope = strchr(addr, '%');
+	if (scope)
+		*scope++ = '\0';
+	if (s->ipv6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) &s->dst;
+
+		sin6->sin6_family = AF_INET6;
+		if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) != 1)
+			goto fail;
+		if (scope)
+			sin6->sin6_scope_id = if_nametoindex(scope);
+		else if (p->ifname)
+			sin6->sin6_scope_id = if_nametoindex(p->ifname);
+		s->dst_len = sizeof(*sin6);
+	} else {
+		struct sockaddr_in *sin = (struct sockaddr_in *) &s->dst;
+
+		sin->sin_family = AF_INET;
+		if (inet_pton(AF_INET, addr, &sin->sin_addr) != 1)
+			goto fail;
+		s->dst_len = sizeof(*sin);
+	}
+
+	if (ping_open(s) < 0) {
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"ping: No ICMP socket available: %s",
+				strerror(errno));
+		goto fail;
+	}
+
+	if (p->ifname &&
+	    setsockopt(s->sock, SOL_SOCKET, SO_BINDTODEVICE, p->ifname,
+		       strlen(p->ifname)) < 0)
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"ping: Failed to bind to %s: %s",
+				p->ifname, strerror(errno));
+	if (p->broadcast)
+		setsockopt(s->sock, SOL_SOCKET, SO_BROADCAST, &val,
+			   sizeof(val));
+	if (p->tos >= 0) {
+		if (s->ipv6)
+			res = setsockopt(s->sock, IPPROTO_IPV6, IPV6_TCLASS,
+					 &p->tos, sizeof(p->tos));
+		else
+			res = setsockopt(s->sock, IPPROTO_IP, IP_TOS,
+					 &p->tos, sizeof(p->tos));
+		if (res < 0)
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"ping: Failed to set TOS: %s",
+					strerror(errno));
+	}
+
+	res = pthread_create(&s->thr, NULL, ping_thread, s);
+	if (res) {
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"ping: pthread_create failed: %d", res);
+		goto fail;
+	}
+	s->running = true;
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"ping: streamid=%d %s socket, %d x %d bytes every %lld us",
+			id, s->raw ? "raw" : "datagram", s->count, s->size,
+			s->interval_ns / 1000);
+	s->next = dut->ping_sessions;
+	dut->ping_sessions = s;
+	return 0;
+
+fail:
+	ping_session_free(s);
+	return -1;
+}
+
+
+static int ping_cmp_rtt(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static double ping_percentile(const long long *rtt, int num, int pct)
+{
+	int idx = (num * pct + 99) / 100 - 1;
+
+	if (idx < 0)
+		idx = 0;
+	return rtt[idx] / 1000000.0;
+}
+
+
+/*
+ * Stop traffic_send_ping stream id and write the CAPI result with RTT
+ * statistics in milliseconds into buf. Returns -1 if the stream is not run
+ * by the built-in engine.
+ */
+int ping_native_stop(struct sigma_dut *dut, int id, char *buf, size_t buflen)
+{
+	struct ping_session *s, **prev;
+	long long sum = 0;
+	int i, num = 0, res;
+
+	for (prev = &dut->ping_sessions; *prev; prev = &(*prev)->next) {
+		if ((*prev)->id == id)
+			break;
+	}
+	s = *prev;
+	if (!s)
+		return -1;
+	*prev = s->next;
+
+	s->stop = 1;
+	if (s->running) {
+		pthread_join(s->thr, NULL);
+		s->running = false;
+	}
+
+	/* Replies too short to carry a timestamp have no RTT */
+	for (i = 0; i < s->replies; i++) {
+		if (s->rtt_ns[i] >= 0) {
+			s->rtt_ns[num++] = s->rtt_ns[i];
+			sum += s->rtt_ns[i];
+		}
+	}
+
+	res = snprintf(buf, buflen, "sent,%d,replies,%d", s->sent,
+		       s->replies);
+	if (num && res > 0 && (size_t) res < buflen) {
+		qsort(s->rtt_ns, num, sizeof(s->rtt_ns[0]), ping_cmp_rtt);
+		snprintf(buf + res, buflen - res,
+			 ",rttMin,%.3f,rttAvg,%.3f,rttP50,%.3f,rttP90,%.3f,rttP99,%.3f,rttMax,%.3f",
+			 s->rtt_ns[0] / 1000000.0, sum / num / 1000000.0,
+			 ping_percentile(s->rtt_ns, num, 50),
+			 ping_percentile(s->rtt_ns, num, 90),
+			 ping_percentile(s->rtt_ns, num, 99),
+			 s->rtt_ns[num - 1] / 1000000.0);
+	}
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"ping: streamid=%d %s (%d duplicates)",
+			id, buf, s->duplicates);
+
+	ping_session_free(s);
+	return 0;
+}
@@ -7,6 +7,7 @@
  */
 
 #include "sigma_dut.h"
+#include <sys/stat.h>
 #include <sqlite3.h>
 
 #ifndef ROOT_DIR
@@ -22,6 +23,244 @@
 #endif /* CERT_DIR */
 
 
+#define SERVER_DB_STMTS 16
+#define SERVER_DB_POLL_MIN_MS 5
+#define SERVER_DB_POLL_MAX_MS 100
+
+/*
+ * A single connection to the server database is kept open for the lifetime
+ * of sigma_dut with the status queries prepared once. The file is shared with
+ * hostapd and the OSU server and may be replaced under us, so the connection
+ * is reopened if SERVER_DB no longer refers to the same inode.
+ */
+struct server_db {
+	sqlite3 *db;
+	dev_t dev;
+	ino_t ino;
+	unsigned int num_stmts;
+	struct {
+		char *sql;
+		sqlite3_stmt *stmt;
+	} stmts[SERVER_DB_STMTS];
+};
+
+
+static void server_db_free(struct server_db *sdb)
+{
+	unsigned int i;
+
+	for (i = 0; i < sdb->num_stmts; i++) {
+		sqlite3_finalize(sdb->stmts[i].stmt);
+		free(sdb->stmts[i].sql);
+	}
+	sdb->num_stmts = 0;
+	sqlite3_close(sdb->db);
+	sdb->db = NULL;
+}
+
+
+void server_close(struct sigma_dut *dut)
+{
+	if (!dut->server_db)
+		return;
+	server_db_free(dut->server_db);
+	free(dut->server_db);
+	dut->server_db = NULL;
+}
+
+
+static sqlite3 * server_db_open(struct sigma_dut *dut)
+{
+	struct server_db *sdb = dut->server_db;
+	struct stat st;
+	int found;
+
+	found = stat(SERVER_DB, &st) == 0;
+	if (sdb && sdb->db && found &&
+	    sdb->dev == st.st_dev && sdb->ino == st.st_ino)
+		return sdb->db;
+
+	if (!sdb) {
+		sdb = calloc(1, sizeof(*sdb));
+		if (!sdb)
+			return NULL;
+		dut->server_db = sdb;
+	} else if (sdb->db) {
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"SQLite database %s replaced - reopen",
+				SERVER_DB);
+		server_db_free(sdb);
+	}
+
+	if (sqlite3_open(SERVER_DB, &sdb->db)) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"Failed to open SQLite database %s",
+				SERVER_DB);
+		server_db_free(sdb);
+		return NULL;
+	}
+	/* hostapd and the OSU server write to the same file */
+	sqlite3_busy_timeout(sdb->db, 1000);
+
+	if (!found)
+		found = stat(SERVER_DB, &st) == 0;
+	sdb->dev = found ? st.st_dev : 0;
+	sdb->ino = found ? st.st_ino : 0;
+
+	return sdb->db;
+}
+
+
+/*
+ * Return the prepared statement for sql from the cache, preparing it on first
+ * use. The statement is ready for binding and must be reset after use so that
+ * it does not keep a read transaction open.
+ */
+static sqlite3_stmt * server_db_stmt(struct sigma_dut *dut, const char *sql)
+{
+	struct server_db *sdb = dut->server_db;
+	sqlite3_stmt *stmt;
+	unsigned int i;
+	char *sql_copy;
+
+	if (!sdb || !sdb->db)
+		return NULL;
+
+	for (i = 0; i < sdb->num_stmts; i++) {
+		if (strcmp(sdb->stmts[i].sql, sql) == 0)
+			return sdb->stmts[i].stmt;
+	}
+
+	if (sqlite3_prepare_v2(sdb->db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"SQL prepare failed: %s (%s)",
+				sqlite3_errmsg(sdb->db), sql);
+		return NULL;
+	}
+	sql_copy = strdup(sql);
+	if (!sql_copy) {
+		sqlite3_finalize(stmt);
+		return NULL;
+	}
+
+	if (sdb->num_stmts == SERVER_DB_STMTS) {
+		/* Not expected with the fixed set of queries; recycle */
+		i = SERVER_DB_STMTS - 1;
+		sqlite3_finalize(sdb->stmts[i].stmt);
+		free(sdb->stmts[i].sql);
+	} else {
+		i = sdb->num_stmts++;
+	}
+	sdb->stmts[i].sql = sql_copy;
+	sdb->stmts[i].stmt = stmt;
+
+	return stmt;
+}
+
+
+/*
+ * Run a single column query with an optional text parameter and return the
+ * last non-NULL value, or NULL if there was none.
+ */
+static char * server_db_query(struct sigma_dut *dut, const char *sql,
+			      const char *param, const char *what)
+{
+	sqlite3_stmt *stmt;
+	const char *txt;
+	char *val = NULL;
+	int res;
+
+	stmt = server_db_stmt(dut, sql);
+	if (!stmt)
+		return NULL;
+	if (param)
+		sqlite3_bind_text(stmt, 1, param, -1, SQLITE_STATIC);
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		txt = (const char *) sqlite3_column_text(stmt, 0);
+		if (!txt)
+			continue;
+		free(val);
+		val = strdup(txt);
+	}
+
+	if (res != SQLITE_DONE) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"SQL operation to fetch %s failed: %s",
+				what, sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		free(val);
+		val = NULL;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return val;
+}
+
+
+static int server_db_data_version(struct sigma_dut *dut)
+{
+	sqlite3_stmt *stmt;
+	int version = -1;
+
+	stmt = server_db_stmt(dut, "PRAGMA data_version");
+	if (!stmt)
+		return -1;
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+		version = sqlite3_column_int(stmt, 0);
+	sqlite3_reset(stmt);
+
+	return version;
+}
+
+
+static long long server_db_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+/*
+ * Wait until another connection (hostapd, the OSU server) commits a change to
+ * the database or the monotonic time end (in ms) passes. PRAGMA data_version
+ * only moves on commits from other connections, so it is cheap to poll and the
+ * caller re-runs its query only when there is something new to see. Returns 1
+ * on a change, 0 on timeout.
+ */
+static int server_db_wait_change(struct sigma_dut *dut, int *version,
+				 long long end)
+{
+	long long now;
+	int interval = SERVER_DB_POLL_MIN_MS;
+	int cur;
+
+	for (;;) {
+		cur = server_db_data_version(dut);
+		if (cur >= 0 && cur != *version) {
+			*version = cur;
+			return 1;
+		}
+
+		now = server_db_now_ms();
+		if (now >= end)
+			return 0;
+		if (interval > end - now)
+			interval = end - now;
+		usleep(interval * 1000);
+
+		/* Without data_version, re-run the query every interval */
+		if (cur < 0)
+			return 1;
+		interval *= 2;
+		if (interval > SERVER_DB_POLL_MAX_MS)
+			interval = SERVER_DB_POLL_MAX_MS;
+	}
+}
+
+
 static enum sigma_cmd_result cmd_server_ca_get_version(struct sigma_dut *dut,
 						       struct sigma_conn *conn,
 						       struct sigma_cmd *cmd)
@@ -63,12 +302,9 @@ static int server_reset_user(struct sigma_dut *dut, const char *user)
 
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "Reset user %s", user);
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return -1;
-	}
 
 	if (strcmp(user, "test01") == 0) {
 		remediation = "machine";
@@ -129,7 +365,6 @@ static int server_reset_user(struct sigma_dut *dut, const char *user)
 	} else if (strcmp(user, "testdmacc08") == 0 ||
 		   strcmp(user, "testdmacc09") == 0) {
 		/* No need to set anything separate for testdmacc* users */
-		sqlite3_close(db);
 		return 0;
 	} else {
 		sigma_dut_print(dut, DUT_MSG_INFO, "Unsupported username '%s'",
@@ -157,7 +392,6 @@ static int server_reset_user(struct sigma_dut *dut, const char *user)
 	sqlite3_free(sql);
 
 fail:
-	sqlite3_close(db);
 
 	return res;
 }
@@ -185,12 +419,9 @@ static int server_reset_serial(struct sigma_dut *dut, const char *serial)
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "Reset user %s (serial number: %s)",
 			user, serial);
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return -1;
-	}
 
 	if (strcmp(serial, "1046") == 0) {
 		remediation = "machine";
@@ -225,7 +456,6 @@ static int server_reset_serial(struct sigma_dut *dut, const char *serial)
 	sqlite3_free(sql);
 
 fail:
-	sqlite3_close(db);
 
 	return res;
 }
@@ -239,22 +469,17 @@ static int server_reset_cert_enroll(struct sigma_dut *dut, const char *addr)
 	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Reset certificate enrollment status for %s", addr);
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return -1;
-	}
 
 	if (strcasecmp(addr, "any") == 0)
 		sql = sqlite3_mprintf("DELETE FROM cert_enroll");
 	else
 		sql = sqlite3_mprintf("DELETE FROM cert_enroll WHERE mac_addr=%Q",
 				      addr);
-	if (!sql) {
-		sqlite3_close(db);
+	if (!sql)
 		return -1;
-	}
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "SQL: %s", sql);
 
 	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
@@ -262,12 +487,10 @@ static int server_reset_cert_enroll(struct sigma_dut *dut, const char *addr)
 				"SQL operation failed: %s",
 				sqlite3_errmsg(db));
 		sqlite3_free(sql);
-		sqlite3_close(db);
 		return -1;
 	}
 
 	sqlite3_free(sql);
-	sqlite3_close(db);
 
 	return 0;
 }
@@ -281,17 +504,12 @@ static int server_reset_imsi(struct sigma_dut *dut, const char *imsi)
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "Reset policy provisioning for %s",
 			imsi);
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return -1;
-	}
 	sql = sqlite3_mprintf("DELETE FROM users WHERE identity=%Q", imsi);
-	if (!sql) {
-		sqlite3_close(db);
+	if (!sql)
 		return -1;
-	}
 	sigma_dut_print(dut, DUT_MSG_DEBUG, "SQL: %s", sql);
 
 	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
@@ -299,12 +517,10 @@ static int server_reset_imsi(struct sigma_dut *dut, const char *imsi)
 				"SQL operation failed: %s",
 				sqlite3_errmsg(db));
 		sqlite3_free(sql);
-		sqlite3_close(db);
 		return -1;
 	}
 
 	sqlite3_free(sql);
-	sqlite3_close(db);
 
 	return 0;
 }
@@ -363,42 +579,11 @@ static enum sigma_cmd_result cmd_server_reset_default(struct sigma_dut *dut,
 }
 
 
-static int get_last_msk_cb(void *ctx, int argc, char *argv[], char *col[])
-{
-	char **last_msk = ctx;
-
-	if (argc < 1 || !argv[0])
-		return 0;
-
-	free(*last_msk);
-	*last_msk = strdup(argv[0]);
-
-	return 0;
-}
-
-
-static char * get_last_msk(struct sigma_dut *dut, sqlite3 *db,
-			   const char *username)
+static char * get_last_msk(struct sigma_dut *dut, const char *username)
 {
-	char *sql, *last_msk = NULL;
-
-	sql = sqlite3_mprintf("SELECT last_msk FROM users WHERE identity=%Q",
-			      username);
-	if (!sql)
-		return NULL;
-
-	if (sqlite3_exec(db, sql, get_last_msk_cb, &last_msk, NULL) !=
-	    SQLITE_OK) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"SQL operation to fetch last_msk failed: %s",
-				sqlite3_errmsg(db));
-		sqlite3_free(sql);
-		return NULL;
-	}
-
-	sqlite3_free(sql);
-
-	return last_msk;
+	return server_db_query(dut,
+			       "SELECT last_msk FROM users WHERE identity=?",
+			       username, "last_msk");
 }
 
 
@@ -408,29 +593,24 @@ aaa_auth_status(struct sigma_dut *dut, struct sigma_conn *conn,
 {
 	sqlite3 *db;
 	char *sql = NULL;
-	int i;
+	int version;
+	long long end;
 	char resp[500];
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return INVALID_SEND_STATUS;
-	}
 
 	sql = sqlite3_mprintf("UPDATE users SET last_msk=NULL WHERE identity=%Q",
 			      username);
-	if (!sql) {
-		sqlite3_close(db);
+	if (!sql)
 		return ERROR_SEND_STATUS;
-	}
 
 	if (sqlite3_exec(db, sql, NULL, NULL, NULL) != SQLITE_OK) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"SQL operation to clear last_msk failed: %s",
 				sqlite3_errmsg(db));
 		sqlite3_free(sql);
-		sqlite3_close(db);
 		return ERROR_SEND_STATUS;
 	}
 
@@ -439,16 +619,17 @@ aaa_auth_status(struct sigma_dut *dut, struct sigma_conn *conn,
 	if (sqlite3_changes(db) < 1) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"No DB rows modified (specified user not found)");
-		sqlite3_close(db);
 		return ERROR_SEND_STATUS;
 	}
 
 	snprintf(resp, sizeof(resp), "AuthStatus,TIMEOUT,MSK,NULL");
 
-	for (i = 0; i < timeout; i++) {
+	version = server_db_data_version(dut);
+	end = server_db_now_ms() + timeout * 1000LL;
+	do {
 		char *last_msk;
 
-		last_msk = get_last_msk(dut, db, username);
+		last_msk = get_last_msk(dut, username);
 		if (last_msk) {
 			if (strcmp(last_msk, "FAIL") == 0) {
 				snprintf(resp, sizeof(resp),
@@ -460,56 +641,21 @@ aaa_auth_status(struct sigma_dut *dut, struct sigma_conn *conn,
 			free(last_msk);
 			break;
 		}
-		sleep(1);
-	}
-
-	sqlite3_close(db);
+	} while (server_db_wait_change(dut, &version, end));
 
 	send_resp(dut, conn, SIGMA_COMPLETE, resp);
 	return STATUS_SENT;
 }
 
 
-static int get_last_serial_cb(void *ctx, int argc, char *argv[], char *col[])
-{
-	char **last_serial = ctx;
-
-	if (argc < 1 || !argv[0])
-		return 0;
-
-	free(*last_serial);
-	*last_serial = strdup(argv[0]);
-
-	return 0;
-}
-
-
-static char * get_last_serial(struct sigma_dut *dut, sqlite3 *db,
-			      const char *addr)
+static char * get_last_serial(struct sigma_dut *dut, const char *addr)
 {
-	char *sql, *last_serial = NULL;
-
 	if (!addr || strcasecmp(addr, "any") == 0)
-		sql = sqlite3_mprintf("SELECT serialnum FROM cert_enroll");
-	else
-		sql = sqlite3_mprintf("SELECT serialnum FROM cert_enroll WHERE mac_addr=%Q",
-				      addr);
-	if (!sql)
-		return NULL;
-	sigma_dut_print(dut, DUT_MSG_DEBUG, "SQL: %s", sql);
-
-	if (sqlite3_exec(db, sql, get_last_serial_cb, &last_serial, NULL) !=
-	    SQLITE_OK) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"SQL operation to fetch last_serial failed: %s",
-				sqlite3_errmsg(db));
-		sqlite3_free(sql);
-		return NULL;
-	}
-
-	sqlite3_free(sql);
-
-	return last_serial;
+		return server_db_query(dut, "SELECT serialnum FROM cert_enroll",
+				       NULL, "last_serial");
+	return server_db_query(dut,
+			       "SELECT serialnum FROM cert_enroll WHERE mac_addr=?",
+			       addr, "last_serial");
 }
 
 
@@ -517,23 +663,21 @@ static enum sigma_cmd_result
 osu_cert_enroll_status(struct sigma_dut *dut, struct sigma_conn *conn,
 		       struct sigma_cmd *cmd, const char *addr, int timeout)
 {
-	sqlite3 *db;
-	int i;
+	int version;
+	long long end;
 	char resp[500];
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	if (!server_db_open(dut))
 		return INVALID_SEND_STATUS;
-	}
 
 	snprintf(resp, sizeof(resp), "OSUStatus,TIMEOUT");
 
-	for (i = 0; i < timeout; i++) {
+	version = server_db_data_version(dut);
+	end = server_db_now_ms() + timeout * 1000LL;
+	do {
 		char *last_serial;
 
-		last_serial = get_last_serial(dut, db, addr);
+		last_serial = get_last_serial(dut, addr);
 		if (last_serial) {
 			if (strcmp(last_serial, "FAIL") == 0) {
 				snprintf(resp, sizeof(resp),
@@ -546,110 +690,72 @@ osu_cert_enroll_status(struct sigma_dut *dut, struct sigma_conn *conn,
 			free(last_serial);
 			break;
 		}
-		sleep(1);
-	}
-
-	sqlite3_close(db);
+	} while (server_db_wait_change(dut, &version, end));
 
 	send_resp(dut, conn, SIGMA_COMPLETE, resp);
 	return STATUS_SENT;
 }
 
 
-static int get_user_field_cb(void *ctx, int argc, char *argv[], char *col[])
-{
-	char **val = ctx;
-
-	if (argc < 1 || !argv[0])
-		return 0;
-
-	free(*val);
-	*val = strdup(argv[0]);
-
-	return 0;
-}
-
-
-static char * get_user_field_helper(struct sigma_dut *dut, sqlite3 *db,
+static char * get_user_field_helper(struct sigma_dut *dut,
 				    const char *id_field,
 				    const char *identity, const char *field)
 {
-	char *sql, *val = NULL;
+	char sql[100];
 
-	sql = sqlite3_mprintf("SELECT %s FROM users WHERE %s=%Q",
-			      field, id_field, identity);
-	if (!sql)
-		return NULL;
-	sigma_dut_print(dut, DUT_MSG_DEBUG, "SQL: %s", sql);
+	/* Column names come from the callers below, never from the peer */
+	snprintf(sql, sizeof(sql), "SELECT %s FROM users WHERE %s=?",
+		 field, id_field);
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "SQL: %s [%s]", sql, identity);
 
-	if (sqlite3_exec(db, sql, get_user_field_cb, &val, NULL) != SQLITE_OK) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"SQL operation to fetch user field failed: %s",
-				sqlite3_errmsg(db));
-		sqlite3_free(sql);
-		return NULL;
-	}
-
-	sqlite3_free(sql);
-
-	return val;
-}
-
-
-static char * get_user_field(struct sigma_dut *dut, sqlite3 *db,
-			     const char *identity, const char *field)
-{
-	return get_user_field_helper(dut, db, "identity", identity, field);
+	return server_db_query(dut, sql, identity, "user field");
 }
 
 
-static char * get_user_dmacc_field(struct sigma_dut *dut, sqlite3 *db,
-				   const char *identity, const char *field)
+static char * get_user_field(struct sigma_dut *dut, const char *identity,
+			     const char *field)
 {
-	return get_user_field_helper(dut, db, "osu_user", identity, field);
+	return get_user_field_helper(dut, "identity", identity, field);
 }
 
 
-static int get_eventlog_new_serialno_cb(void *ctx, int argc, char *argv[],
-					char *col[])
+static char * get_user_dmacc_field(struct sigma_dut *dut, const char *identity,
+				   const char *field)
 {
-	char **serialno = ctx;
-	char *val;
-
-	if (argc < 1 || !argv[0])
-		return 0;
-
-	val = argv[0];
-	if (strncmp(val, "renamed user to: cert-", 22) != 0)
-		return 0;
-	val += 22;
-	free(*serialno);
-	*serialno = strdup(val);
-
-	return 0;
+	return get_user_field_helper(dut, "osu_user", identity, field);
 }
 
 
-static char * get_eventlog_new_serialno(struct sigma_dut *dut, sqlite3 *db,
+static char * get_eventlog_new_serialno(struct sigma_dut *dut,
 					const char *username)
 {
-	char *sql, *serial = NULL;
+	sqlite3_stmt *stmt;
+	const char *val;
+	char *serial = NULL;
+	int res;
 
-	sql = sqlite3_mprintf("SELECT notes FROM eventlog WHERE user=%Q AND notes LIKE %Q",
-			      username, "renamed user to:%");
-	if (!sql)
+	stmt = server_db_stmt(dut, "SELECT notes FROM eventlog WHERE user=? AND notes LIKE 'renamed user to:%'");
+	if (!stmt)
 		return NULL;
+	sqlite3_bind_text(stmt, 1, username, -1, SQLITE_STATIC);
+
+	while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+		val = (const char *) sqlite3_column_text(stmt, 0);
+		if (!val || strncmp(val, "renamed user to: cert-", 22) != 0)
+			continue;
+		free(serial);
+		serial = strdup(val + 22);
+	}
 
-	if (sqlite3_exec(db, sql, get_eventlog_new_serialno_cb, &serial,
-			 NULL) != SQLITE_OK) {
+	if (res != SQLITE_DONE) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"SQL operation to fetch new serialno failed: %s",
-				sqlite3_errmsg(db));
-		sqlite3_free(sql);
-		return NULL;
+				sqlite3_errmsg(sqlite3_db_handle(stmt)));
+		free(serial);
+		serial = NULL;
 	}
-
-	sqlite3_free(sql);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
 
 	return serial;
 }
@@ -659,8 +765,8 @@ static enum sigma_cmd_result
 osu_remediation_status(struct sigma_dut *dut, struct sigma_conn *conn,
 		       int timeout, const char *username, const char *serialno)
 {
-	sqlite3 *db;
-	int i;
+	int version;
+	long long end;
 	char resp[500];
 	char name[100];
 	char *remediation = NULL;
@@ -673,16 +779,15 @@ osu_remediation_status(struct sigma_dut *dut, struct sigma_conn *conn,
 		username = name;
 	}
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	if (!server_db_open(dut))
 		return ERROR_SEND_STATUS;
-	}
 
-	remediation = get_user_field(dut, db, username, "remediation");
+	version = server_db_data_version(dut);
+	end = server_db_now_ms() + timeout * 1000LL;
+
+	remediation = get_user_field(dut, username, "remediation");
 	if (!remediation) {
-		remediation = get_user_dmacc_field(dut, db, username,
+		remediation = get_user_dmacc_field(dut, username,
 						   "remediation");
 		dmacc = 1;
 	}
@@ -699,22 +804,20 @@ osu_remediation_status(struct sigma_dut *dut, struct sigma_conn *conn,
 
 	snprintf(resp, sizeof(resp), "RemediationStatus,TIMEOUT");
 
-	for (i = 0; i < timeout; i++) {
-		sleep(1);
+	while (server_db_wait_change(dut, &version, end)) {
 		free(remediation);
 		if (dmacc)
-			remediation = get_user_dmacc_field(dut, db, username,
+			remediation = get_user_dmacc_field(dut, username,
 							   "remediation");
 		else
-			remediation = get_user_field(dut, db, username,
+			remediation = get_user_field(dut, username,
 						     "remediation");
 		if (!remediation && serialno) {
 			char *new_serial;
 
 			/* Certificate reenrollment through subscription
 			 * remediation - fetch the new serial number */
-			new_serial = get_eventlog_new_serialno(dut, db,
-							       username);
+			new_serial = get_eventlog_new_serialno(dut, username);
 			if (!new_serial) {
 				/* New SerialNo not known?! */
 				snprintf(resp, sizeof(resp),
@@ -735,7 +838,6 @@ osu_remediation_status(struct sigma_dut *dut, struct sigma_conn *conn,
 
 done:
 	free(remediation);
-	sqlite3_close(db);
 
 	send_resp(dut, conn, SIGMA_COMPLETE, resp);
 	return STATUS_SENT;
@@ -748,7 +850,8 @@ osu_polupd_status(struct sigma_dut *dut, struct sigma_conn *conn, int timeout,
 {
 	sqlite3 *db;
 	char *sql;
-	int i;
+	int version;
+	long long end;
 	char resp[500];
 	char name[100];
 	char *policy = NULL;
@@ -761,16 +864,13 @@ osu_polupd_status(struct sigma_dut *dut, struct sigma_conn *conn, int timeout,
 		username = name;
 	}
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return ERROR_SEND_STATUS;
-	}
 
-	policy = get_user_field(dut, db, username, "policy");
+	policy = get_user_field(dut, username, "policy");
 	if (!policy) {
-		policy = get_user_dmacc_field(dut, db, username, "policy");
+		policy = get_user_dmacc_field(dut, username, "policy");
 		dmacc = 1;
 	}
 	if (!policy) {
@@ -804,15 +904,15 @@ osu_polupd_status(struct sigma_dut *dut, struct sigma_conn *conn, int timeout,
 
 	snprintf(resp, sizeof(resp), "PolicyUpdateStatus,TIMEOUT");
 
-	for (i = 0; i < timeout; i++) {
-		sleep(1);
+	version = server_db_data_version(dut);
+	end = server_db_now_ms() + timeout * 1000LL;
+	while (server_db_wait_change(dut, &version, end)) {
 		free(policy);
 		if (dmacc)
-			policy = get_user_dmacc_field(dut, db, username,
+			policy = get_user_dmacc_field(dut, username,
 						      "polupd_done");
 		else
-			policy = get_user_field(dut, db, username,
-						"polupd_done");
+			policy = get_user_field(dut, username, "polupd_done");
 		if (policy && atoi(policy)) {
 			snprintf(resp, sizeof(resp),
 				 "PolicyUpdateStatus,UpdateComplete");
@@ -822,7 +922,6 @@ osu_polupd_status(struct sigma_dut *dut, struct sigma_conn *conn, int timeout,
 
 done:
 	free(policy);
-	sqlite3_close(db);
 
 	send_resp(dut, conn, SIGMA_COMPLETE, resp);
 	return STATUS_SENT;
@@ -834,33 +933,27 @@ osu_sim_policy_provisioning_status(struct sigma_dut *dut,
 				   struct sigma_conn *conn,
 				   const char *imsi, int timeout)
 {
-	sqlite3 *db;
-	int i;
+	int version;
+	long long end;
 	char resp[500];
 	char *id = NULL;
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	if (!server_db_open(dut))
 		return INVALID_SEND_STATUS;
-	}
 
 	snprintf(resp, sizeof(resp), "PolicyProvisioning,TIMEOUT");
 
-	for (i = 0; i < timeout; i++) {
-		free(id);
-		id = get_user_field(dut, db, imsi, "identity");
+	version = server_db_data_version(dut);
+	end = server_db_now_ms() + timeout * 1000LL;
+	do {
+		id = get_user_field(dut, imsi, "identity");
 		if (id) {
 			snprintf(resp, sizeof(resp),
 				 "PolicyProvisioning,Provisioning Complete");
+			free(id);
 			break;
 		}
-		sleep(1);
-	}
-
-	free(id);
-	sqlite3_close(db);
+	} while (server_db_wait_change(dut, &version, end));
 
 	send_resp(dut, conn, SIGMA_COMPLETE, resp);
 	return STATUS_SENT;
@@ -963,12 +1056,9 @@ static int osu_set_cert_reenroll(struct sigma_dut *dut, const char *serial,
 	char id[100];
 	int ret = -1;
 
-	if (sqlite3_open(SERVER_DB, &db)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"Failed to open SQLite database %s",
-				SERVER_DB);
+	db = server_db_open(dut);
+	if (!db)
 		return -1;
-	}
 
 	snprintf(id, sizeof(id), "cert-%s", serial);
 	sql = sqlite3_mprintf("UPDATE users SET remediation=%Q WHERE lower(identity)=lower(%Q)",
@@ -989,7 +1079,6 @@ static int osu_set_cert_reenroll(struct sigma_dut *dut, const char *serial,
 
 	ret = 0;
 fail:
-	sqlite3_close(db);
 
 	return ret;
 }
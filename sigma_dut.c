@@ -11,16 +11,18 @@
 #ifdef __linux__
 #include <signal.h>
 #include <netinet/tcp.h>
+#include <sys/epoll.h>
 #endif /* __linux__ */
 #ifdef ANDROID_MDNS
 #include <dlfcn.h>
 #endif /* ANDROID_MDNS */
+#include <fcntl.h>
 #include "wpa_ctrl.h"
 #include "wpa_helpers.h"
 #include "miracast.h"
 
 #define SIGMA_DUT_PORT 9000
-#define MAX_CONNECTIONS 4
+#define MAX_EPOLL_EVENTS 16
 
 extern enum driver_type wifi_chip_type;
 
@@ -161,21 +163,37 @@ void sigma_dut_summary(struct sigma_dut *dut, const char *fmt, ...)
 }
 
 
-int sigma_dut_reg_cmd(const char *cmd,
-		      int (*validate)(struct sigma_cmd *cmd),
-		      enum sigma_cmd_result (*process)(struct sigma_dut *dut,
-						       struct sigma_conn *conn,
-						       struct sigma_cmd *cmd))
+static struct sigma_cmd_handler * sigma_dut_find_cmd(struct sigma_dut *dut,
+						      const char *cmd)
+{
+	struct sigma_cmd_handler *h;
+
+	h = dut->cmd_hash[str_hash_nocase(cmd) & (SIGMA_CMD_HASH_SIZE - 1)];
+	for (; h; h = h->hash_next) {
+		if (strcasecmp(cmd, h->cmd) == 0)
+			return h;
+	}
+
+	return NULL;
+}
+
+
+int sigma_dut_reg_cmd_flags(const char *cmd,
+			    int (*validate)(struct sigma_cmd *cmd),
+			    enum sigma_cmd_result (*process)(
+				    struct sigma_dut *dut,
+				    struct sigma_conn *conn,
+				    struct sigma_cmd *cmd),
+			    unsigned int flags)
 {
 	struct sigma_cmd_handler *h;
 	size_t clen, len;
+	unsigned int idx;
 
-	for (h = sigma_dut.cmds; h; h = h->next) {
-		if (strcmp(h->cmd, cmd) == 0) {
-			printf("ERROR: Duplicate sigma_dut command registration for '%s'\n",
-			       cmd);
-			return -1;
-		}
+	if (sigma_dut_find_cmd(&sigma_dut, cmd)) {
+		printf("ERROR: Duplicate sigma_dut command registration for '%s'\n",
+		       cmd);
+		return -1;
 	}
 
 	clen = strlen(cmd);
@@ -188,19 +206,35 @@ int sigma_dut_reg_cmd(const char *cmd,
 	memcpy(h->cmd, cmd, clen);
 	h->validate = validate;
 	h->process= process;
+	h->flags = flags;
 
 	h->next = sigma_dut.cmds;
 	sigma_dut.cmds = h;
 
+	idx = str_hash_nocase(cmd) & (SIGMA_CMD_HASH_SIZE - 1);
+	h->hash_next = sigma_dut.cmd_hash[idx];
+	sigma_dut.cmd_hash[idx] = h;
+
 	return 0;
 }
 
 
+int sigma_dut_reg_cmd(const char *cmd,
+		      int (*validate)(struct sigma_cmd *cmd),
+		      enum sigma_cmd_result (*process)(struct sigma_dut *dut,
+						       struct sigma_conn *conn,
+						       struct sigma_cmd *cmd))
+{
+	return sigma_dut_reg_cmd_flags(cmd, validate, process, 0);
+}
+
+
 static void sigma_dut_unreg_cmds(struct sigma_dut *dut)
 {
 	struct sigma_cmd_handler *cmd, *prev;
 	cmd = dut->cmds;
 	dut->cmds = NULL;
+	memset(dut->cmd_hash, 0, sizeof(dut->cmd_hash));
 	while (cmd) {
 		prev = cmd;
 		cmd = cmd->next;
@@ -333,31 +367,44 @@ void send_resp(struct sigma_dut *dut, struct sigma_conn *conn,
 	if (sendmsg(conn->s, &msg, 0) < 0)
 		sigma_dut_print(dut, DUT_MSG_INFO, "sendmsg: %s",
 				strerror(errno));
-	dut->response_sent++;
+	conn->response_sent++;
 }
 
 
-const char * get_param(struct sigma_cmd *cmd, const char *name)
+static void sigma_cmd_build_index(struct sigma_cmd *cmd)
 {
+	unsigned int idx;
 	int i;
-	for (i = 0; i < cmd->count; i++) {
-		if (strcasecmp(name, cmd->params[i]) == 0)
-			return cmd->values[i];
+
+	memset(cmd->param_hash, 0, sizeof(cmd->param_hash));
+	/* Insert in reverse order to keep each chain in command order */
+	for (i = cmd->count - 1; i >= 0; i--) {
+		idx = str_hash_nocase(cmd->params[i]) &
+			(SIGMA_PARAM_HASH_SIZE - 1);
+		cmd->param_next[i] = cmd->param_hash[idx];
+		cmd->param_hash[idx] = i + 1;
 	}
-	return NULL;
+	memset(cmd->param_used, 0, sizeof(cmd->param_used));
+	cmd->indexed = true;
 }
 
 
 const char * get_param_indexed(struct sigma_cmd *cmd, const char *name,
 			       int index)
 {
-	int i, j;
+	int i, j = 0;
 
-	for (i = 0, j = 0; i < cmd->count; i++) {
-		if (strcasecmp(name, cmd->params[i]) == 0) {
-			j++;
-			if (j > index)
-				return cmd->values[i];
+	if (!cmd->indexed)
+		sigma_cmd_build_index(cmd);
+
+	i = cmd->param_hash[str_hash_nocase(name) &
+			    (SIGMA_PARAM_HASH_SIZE - 1)];
+	for (; i; i = cmd->param_next[i - 1]) {
+		if (strcasecmp(name, cmd->params[i - 1]) != 0)
+			continue;
+		if (j++ == index) {
+			cmd->param_used[i - 1] = true;
+			return cmd->values[i - 1];
 		}
 	}
 
@@ -365,6 +412,12 @@ const char * get_param_indexed(struct sigma_cmd *cmd, const char *name,
 }
 
 
+const char * get_param(struct sigma_cmd *cmd, const char *name)
+{
+	return get_param_indexed(cmd, name, 0);
+}
+
+
 const char * get_param_fmt(struct sigma_cmd *cmd, const char *name, ...)
 {
 	va_list ap;
@@ -382,6 +435,335 @@ const char * get_param_fmt(struct sigma_cmd *cmd, const char *name, ...)
 }
 
 
+static void log_unused_params(struct sigma_dut *dut, struct sigma_cmd *cmd)
+{
+	char buf[300], *pos = buf, *end = buf + sizeof(buf);
+	int i, res, unused = 0;
+
+	buf[0] = '\0';
+	for (i = 0; i < cmd->count; i++) {
+		if (cmd->param_used[i])
+			continue;
+		unused++;
+		res = snprintf(pos, end - pos, "%s%s", pos == buf ? "" : ",",
+			       cmd->params[i]);
+		if (res < 0 || res >= end - pos)
+			break;
+		pos += res;
+	}
+
+	if (unused)
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"Unused parameters (%d): %s", unused, buf);
+}
+
+
+static void run_cmd(struct sigma_dut *dut, struct sigma_conn *conn,
+		    struct sigma_cmd_handler *h, struct sigma_cmd *c)
+{
+	enum sigma_cmd_result res;
+
+	sigma_dut_print(dut, DUT_MSG_INFO, "Run command: %s", h->cmd);
+	res = h->process(dut, conn, c);
+	switch (res) {
+	case ERROR_SEND_STATUS:
+		send_resp(dut, conn, SIGMA_ERROR, NULL);
+		break;
+	case INVALID_SEND_STATUS:
+		send_resp(dut, conn, SIGMA_INVALID, NULL);
+		break;
+	case STATUS_SENT:
+	case STATUS_SENT_ERROR:
+		break;
+	case SUCCESS_SEND_STATUS:
+		send_resp(dut, conn, SIGMA_COMPLETE, NULL);
+		break;
+	}
+
+	if (!conn->waiting_completion && conn->response_sent != 2) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"ERROR: Unexpected number of status lines sent (%d) for command '%s'",
+				conn->response_sent, h->cmd);
+	}
+
+	if (dut->debug_level <= DUT_MSG_DEBUG)
+		log_unused_params(dut, c);
+}
+
+
+/*
+ * Asynchronous command execution
+ *
+ * Commands registered with SIGMA_CMD_ASYNC are queued to a pool of worker
+ * threads so that the main loop can keep serving other control connections
+ * while they run. Jobs that use the same Interface parameter are executed in
+ * order, one at a time; jobs for different interfaces can run in parallel.
+ * Commands without the flag are executed on the main thread only after all
+ * running asynchronous jobs have completed.
+ *
+ * Only ca_get_version, sta_is_connected, and sta_get_bssid opt in for now.
+ * Configuration commands (e.g., ap_set_wireless, sta_set_wireless) modify
+ * shared state in struct sigma_dut and keep running one at a time on the main
+ * thread, so multi-radio AP/STA commands are not yet executed in parallel.
+ *
+ * The connection that issued an asynchronous command is marked busy and no
+ * further commands are read from it until the job has completed. Completed
+ * jobs are handed back to the main loop through a pipe.
+ */
+
+#define SIGMA_CMD_WORKERS 4
+#define SIGMA_CMD_JOB_KEY_LEN 32
+
+struct sigma_cmd_job {
+	struct sigma_cmd_job *next;
+	struct sigma_conn *conn;
+	struct sigma_cmd_handler *h;
+	struct sigma_cmd c;
+	char key[SIGMA_CMD_JOB_KEY_LEN];
+	char buf[];
+};
+
+static struct {
+	pthread_t threads[SIGMA_CMD_WORKERS];
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_rwlock_t exec_lock;
+	struct sigma_cmd_job *pending;
+	struct sigma_cmd_job *done;
+	/* Serialization keys of the jobs that are currently being run */
+	char running[SIGMA_CMD_WORKERS][SIGMA_CMD_JOB_KEY_LEN];
+	int notify_pipe[2];
+	bool stop;
+} cmd_workers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.exec_lock = PTHREAD_RWLOCK_INITIALIZER,
+	.notify_pipe = { -1, -1 },
+};
+
+
+static bool cmd_job_key_running(const char *key)
+{
+	int i;
+
+	for (i = 0; i < SIGMA_CMD_WORKERS; i++) {
+		if (cmd_workers.running[i][0] &&
+		    strcasecmp(cmd_workers.running[i], key) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+static struct sigma_cmd_job * cmd_job_dequeue(int worker)
+{
+	struct sigma_cmd_job *job, *prev = NULL;
+
+	for (job = cmd_workers.pending; job; prev = job, job = job->next) {
+		if (cmd_job_key_running(job->key))
+			continue;
+		if (prev)
+			prev->next = job->next;
+		else
+			cmd_workers.pending = job->next;
+		job->next = NULL;
+		strlcpy(cmd_workers.running[worker], job->key,
+			sizeof(cmd_workers.running[worker]));
+		return job;
+	}
+
+	return NULL;
+}
+
+
+static void * cmd_worker_thread(void *ctx)
+{
+	struct sigma_dut *dut = &sigma_dut;
+	int worker = (intptr_t) ctx;
+	struct sigma_cmd_job *job;
+	char c = 0;
+
+	pthread_mutex_lock(&cmd_workers.lock);
+	while (!cmd_workers.stop) {
+		job = cmd_job_dequeue(worker);
+		if (!job) {
+			pthread_cond_wait(&cmd_workers.cond, &cmd_workers.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&cmd_workers.lock);
+
+		pthread_rwlock_rdlock(&cmd_workers.exec_lock);
+		run_cmd(dut, job->conn, job->h, &job->c);
+		pthread_rwlock_unlock(&cmd_workers.exec_lock);
+
+		pthread_mutex_lock(&cmd_workers.lock);
+		cmd_workers.running[worker][0] = '\0';
+		job->next = cmd_workers.done;
+		cmd_workers.done = job;
+		/* Jobs for the same interface may now be runnable */
+		pthread_cond_broadcast(&cmd_workers.cond);
+		if (write(cmd_workers.notify_pipe[1], &c, 1) < 0 &&
+		    errno != EAGAIN)
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"Failed to notify command completion: %s",
+					strerror(errno));
+	}
+	pthread_mutex_unlock(&cmd_workers.lock);
+
+	return NULL;
+}
+
+
+static int process_conn(struct sigma_dut *dut, struct sigma_conn *conn);
+
+static void cmd_jobs_done(struct sigma_dut *dut, int fd, void *ctx)
+{
+	struct sigma_cmd_job *job, *next;
+	char buf[64];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+
+	pthread_mutex_lock(&cmd_workers.lock);
+	job = cmd_workers.done;
+	cmd_workers.done = NULL;
+	pthread_mutex_unlock(&cmd_workers.lock);
+
+	for (; job; job = next) {
+		struct sigma_conn *conn = job->conn;
+
+		next = job->next;
+		free(job);
+		conn->busy = false;
+		/* Continue with commands received while the job was running */
+		if (conn->s >= 0)
+			process_conn(dut, conn);
+	}
+}
+
+
+static int queue_cmd_job(struct sigma_dut *dut, struct sigma_conn *conn,
+			 struct sigma_cmd_handler *h, struct sigma_cmd *c,
+			 const char *buf, size_t buf_len)
+{
+	struct sigma_cmd_job *job, **pos;
+	const char *intf;
+	int i;
+
+	job = calloc(1, sizeof(*job) + buf_len);
+	if (!job)
+		return -1;
+	job->conn = conn;
+	job->h = h;
+
+	/* Parameters point to the connection buffer; move them to the copy */
+	memcpy(job->buf, buf, buf_len);
+	job->c = *c;
+	for (i = 0; i < c->count; i++) {
+		job->c.params[i] = job->buf + (c->params[i] - buf);
+		job->c.values[i] = job->buf + (c->values[i] - buf);
+	}
+
+	intf = get_param(c, "Interface");
+	strlcpy(job->key, intf ? intf : "", sizeof(job->key));
+
+	conn->busy = true;
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"Queue command '%s' for worker thread (interface '%s')",
+			h->cmd, job->key);
+
+	pthread_mutex_lock(&cmd_workers.lock);
+	for (pos = &cmd_workers.pending; *pos; pos = &(*pos)->next)
+		;
+	*pos = job;
+	pthread_cond_signal(&cmd_workers.cond);
+	pthread_mutex_unlock(&cmd_workers.lock);
+
+	return 0;
+}
+
+
+static void start_cmd_workers(struct sigma_dut *dut)
+{
+	int i, flags;
+
+	if (pipe(cmd_workers.notify_pipe) < 0) {
+		sigma_dut_print(dut, DUT_MSG_ERROR, "pipe: %s",
+				strerror(errno));
+		return;
+	}
+	for (i = 0; i < 2; i++) {
+		flags = fcntl(cmd_workers.notify_pipe[i], F_GETFL);
+		fcntl(cmd_workers.notify_pipe[i], F_SETFL, flags | O_NONBLOCK);
+		fcntl(cmd_workers.notify_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+	if (sigma_dut_register_fd(dut, cmd_workers.notify_pipe[0],
+				  cmd_jobs_done, NULL) < 0)
+		goto fail;
+
+	cmd_workers.stop = false;
+	for (i = 0; i < SIGMA_CMD_WORKERS; i++) {
+		if (pthread_create(&cmd_workers.threads[i], NULL,
+				   cmd_worker_thread, (void *) (intptr_t) i))
+			break;
+		cmd_workers.num_threads++;
+	}
+	if (cmd_workers.num_threads == 0) {
+		sigma_dut_unregister_fd(dut, cmd_workers.notify_pipe[0]);
+		goto fail;
+	}
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"Started %d command worker threads",
+			cmd_workers.num_threads);
+	return;
+
+fail:
+	sigma_dut_print(dut, DUT_MSG_ERROR,
+			"Failed to start command worker threads; asynchronous commands will be run on the main thread");
+	close(cmd_workers.notify_pipe[0]);
+	close(cmd_workers.notify_pipe[1]);
+	cmd_workers.notify_pipe[0] = cmd_workers.notify_pipe[1] = -1;
+}
+
+
+static void stop_cmd_workers(struct sigma_dut *dut)
+{
+	struct sigma_cmd_job *job;
+	int i;
+
+	if (cmd_workers.num_threads == 0)
+		return;
+
+	pthread_mutex_lock(&cmd_workers.lock);
+	cmd_workers.stop = true;
+	pthread_cond_broadcast(&cmd_workers.cond);
+	pthread_mutex_unlock(&cmd_workers.lock);
+
+	for (i = 0; i < cmd_workers.num_threads; i++)
+		pthread_join(cmd_workers.threads[i], NULL);
+	cmd_workers.num_threads = 0;
+
+	while (cmd_workers.pending) {
+		job = cmd_workers.pending;
+		cmd_workers.pending = job->next;
+		free(job);
+	}
+	while (cmd_workers.done) {
+		job = cmd_workers.done;
+		cmd_workers.done = job->next;
+		free(job);
+	}
+
+	sigma_dut_unregister_fd(dut, cmd_workers.notify_pipe[0]);
+	close(cmd_workers.notify_pipe[0]);
+	close(cmd_workers.notify_pipe[1]);
+	cmd_workers.notify_pipe[0] = cmd_workers.notify_pipe[1] = -1;
+}
+
+
 static void process_cmd(struct sigma_dut *dut, struct sigma_conn *conn,
 			char *buf)
 {
@@ -390,7 +772,6 @@ static void process_cmd(struct sigma_dut *dut, struct sigma_conn *conn,
 	char *cmd, *pos, *pos2;
 	int len;
 	char txt[300];
-	enum sigma_cmd_result res;
 
 	while (*buf == '\r' || *buf == '\n' || *buf == '\t' || *buf == ' ')
 		buf++;
@@ -460,13 +841,8 @@ static void process_cmd(struct sigma_dut *dut, struct sigma_conn *conn,
 				*pos++ = '\0';
 		}
 	}
-	h = dut->cmds;
-	while (h) {
-		if (strcasecmp(cmd, h->cmd) == 0)
-			break;
-		h = h->next;
-	}
-
+	sigma_cmd_build_index(&c);
+	h = sigma_dut_find_cmd(dut, cmd);
 	if (h == NULL) {
 		sigma_dut_print(dut, DUT_MSG_INFO, "Unknown command: '%s'",
 				cmd);
@@ -483,30 +859,16 @@ static void process_cmd(struct sigma_dut *dut, struct sigma_conn *conn,
 		goto out;
 	}
 
-	dut->response_sent = 0;
+	conn->response_sent = 0;
 	send_resp(dut, conn, SIGMA_RUNNING, NULL);
-	sigma_dut_print(dut, DUT_MSG_INFO, "Run command: %s", cmd);
-	res = h->process(dut, conn, &c);
-	switch (res) {
-	case ERROR_SEND_STATUS:
-		send_resp(dut, conn, SIGMA_ERROR, NULL);
-		break;
-	case INVALID_SEND_STATUS:
-		send_resp(dut, conn, SIGMA_INVALID, NULL);
-		break;
-	case STATUS_SENT:
-	case STATUS_SENT_ERROR:
-		break;
-	case SUCCESS_SEND_STATUS:
-		send_resp(dut, conn, SIGMA_COMPLETE, NULL);
-		break;
-	}
 
-	if (!conn->waiting_completion && dut->response_sent != 2) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"ERROR: Unexpected number of status lines sent (%d) for command '%s'",
-				dut->response_sent, cmd);
-	}
+	if ((h->flags & SIGMA_CMD_ASYNC) && cmd_workers.num_threads > 0 &&
+	    queue_cmd_job(dut, conn, h, &c, buf, len + 1) == 0)
+		goto out;
+
+	pthread_rwlock_wrlock(&cmd_workers.exec_lock);
+	run_cmd(dut, conn, h, &c);
+	pthread_rwlock_unlock(&cmd_workers.exec_lock);
 
 out:
 	if (dut->debug_level < DUT_MSG_INFO) {
@@ -521,62 +883,254 @@ out:
 }
 
 
-static void process_conn(struct sigma_dut *dut, struct sigma_conn *conn)
+static void process_conn_buf(struct sigma_dut *dut, struct sigma_conn *conn)
 {
-	ssize_t res;
 	int i;
 
-	sigma_dut_print(dut, DUT_MSG_DEBUG, "Read from %s:%d",
-			inet_ntoa(conn->addr.sin_addr),
-			ntohs(conn->addr.sin_port));
-
-	res = recv(conn->s, conn->buf + conn->pos, MAX_CMD_LEN + 5 - conn->pos,
-		   0);
-	if (res < 0) {
-		sigma_dut_print(dut, DUT_MSG_INFO, "recv: %s",
-				strerror(errno));
-	}
-	if (res <= 0) {
-		sigma_dut_print(dut, DUT_MSG_DEBUG, "Close connection from "
-				"%s:%d",
-				inet_ntoa(conn->addr.sin_addr),
-				ntohs(conn->addr.sin_port));
-		shutdown(conn->s, SHUT_RDWR);
-		close(conn->s);
-		conn->s = -1;
-		return;
-	}
-
-	sigma_dut_print(dut, DUT_MSG_DEBUG, "Received %d bytes",
-			(int) res);
+	while (!conn->busy) {
+		for (i = 0; i < conn->pos; i++) {
+			if (conn->buf[i] != '\r' && conn->buf[i] != '\n')
+				break;
+		}
+		if (i > 0) {
+			memmove(conn->buf, &conn->buf[i], conn->pos - i);
+			conn->pos -= i;
+		}
 
-	for (;;) {
-		for (i = conn->pos; i < conn->pos + res; i++) {
+		for (i = 0; i < conn->pos; i++) {
 			if (conn->buf[i] == '\r' || conn->buf[i] == '\n')
 				break;
 		}
 
-		if (i == conn->pos + res) {
+		if (i == conn->pos) {
 			/* Full command not yet received */
-			conn->pos += res;
 			if (conn->pos >= MAX_CMD_LEN + 5) {
-				sigma_dut_print(dut, DUT_MSG_INFO, "Too long "
-						"command dropped");
+				sigma_dut_print(dut, DUT_MSG_INFO,
+						"Too long command dropped");
 				conn->pos = 0;
 			}
-			break;
+			return;
 		}
 
 		/* Full command received */
 		conn->buf[i++] = '\0';
 		process_cmd(dut, conn, conn->buf);
-		while (i < conn->pos + res &&
-		       (conn->buf[i] == '\r' || conn->buf[i] == '\n'))
-			i++;
-		memmove(conn->buf, &conn->buf[i], conn->pos + res - i);
-		res = conn->pos + res - i;
-		conn->pos = 0;
+		memmove(conn->buf, &conn->buf[i], conn->pos - i);
+		conn->pos -= i;
+	}
+}
+
+
+/*
+ * Read and process all data that is currently available on a control
+ * connection. The socket is drained until recv() would block so that this
+ * works with edge-triggered readiness notification. While a command from the
+ * connection is being processed by a worker thread, no further commands are
+ * read; processing resumes once the command has completed. Returns -1 if the
+ * connection was closed, 0 otherwise.
+ */
+static int process_conn(struct sigma_dut *dut, struct sigma_conn *conn)
+{
+	ssize_t res;
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "Read from %s:%d",
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port));
+
+	for (;;) {
+		process_conn_buf(dut, conn);
+		if (conn->busy)
+			return 0;
+
+		res = recv(conn->s, conn->buf + conn->pos,
+			   MAX_CMD_LEN + 5 - conn->pos, MSG_DONTWAIT);
+		if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (res < 0 && errno == EINTR)
+			continue;
+		if (res < 0) {
+			sigma_dut_print(dut, DUT_MSG_INFO, "recv: %s",
+					strerror(errno));
+		}
+		if (res <= 0)
+			break;
+
+		sigma_dut_print(dut, DUT_MSG_DEBUG, "Received %d bytes",
+				(int) res);
+		conn->pos += res;
+	}
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "Close connection from %s:%d",
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port));
+	sigma_dut_unregister_fd(dut, conn->s);
+	shutdown(conn->s, SHUT_RDWR);
+	close(conn->s);
+	conn->s = -1;
+	return -1;
+}
+
+
+static struct sigma_fd_handler *
+add_fd_handler(struct sigma_dut *dut, int fd, sigma_fd_cb cb, void *ctx,
+	       bool edge_triggered)
+{
+	struct sigma_fd_handler *h;
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return NULL;
+	h->fd = fd;
+	h->cb = cb;
+	h->ctx = ctx;
+	h->edge_triggered = edge_triggered;
+
+#ifdef __linux__
+	if (dut->epoll_fd >= 0) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (edge_triggered ? EPOLLET : 0);
+		ev.data.ptr = h;
+		if (epoll_ctl(dut->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"epoll_ctl(ADD, %d): %s",
+					fd, strerror(errno));
+			free(h);
+			return NULL;
+		}
 	}
+#endif /* __linux__ */
+
+	h->next = dut->fd_handlers;
+	dut->fd_handlers = h;
+	return h;
+}
+
+
+/*
+ * Register a file descriptor to be monitored for readability by the main
+ * loop. cb is called from the main loop thread whenever the descriptor is
+ * readable (level-triggered).
+ */
+int sigma_dut_register_fd(struct sigma_dut *dut, int fd, sigma_fd_cb cb,
+			  void *ctx)
+{
+	if (fd < 0 || !cb)
+		return -1;
+	return add_fd_handler(dut, fd, cb, ctx, false) ? 0 : -1;
+}
+
+
+/*
+ * Stop monitoring a file descriptor. This can be called from within a
+ * callback; the handler is released once the current round of events has
+ * been processed.
+ */
+void sigma_dut_unregister_fd(struct sigma_dut *dut, int fd)
+{
+	struct sigma_fd_handler *h;
+
+	for (h = dut->fd_handlers; h; h = h->next) {
+		if (h->removed || h->fd != fd)
+			continue;
+#ifdef __linux__
+		if (dut->epoll_fd >= 0)
+			epoll_ctl(dut->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif /* __linux__ */
+		h->removed = true;
+		h->fd = -1;
+	}
+}
+
+
+static void remove_fd_handlers(struct sigma_dut *dut, bool all)
+{
+	struct sigma_fd_handler *h, *prev = NULL, *next;
+
+	for (h = dut->fd_handlers; h; h = next) {
+		next = h->next;
+		if (!all && !h->removed) {
+			prev = h;
+			continue;
+		}
+		if (prev)
+			prev->next = next;
+		else
+			dut->fd_handlers = next;
+		free(h);
+	}
+}
+
+
+static void remove_closed_conns(struct sigma_dut *dut, bool all)
+{
+	struct sigma_conn *conn, *prev = NULL, *next;
+
+	for (conn = dut->conns; conn; conn = next) {
+		next = conn->next;
+		/*
+		 * A connection waiting for completion of a command is still
+		 * referenced by the thread that will send the final status.
+		 */
+		if (!all &&
+		    (conn->s >= 0 || conn->waiting_completion || conn->busy)) {
+			prev = conn;
+			continue;
+		}
+		if (prev)
+			prev->next = next;
+		else
+			dut->conns = next;
+		if (conn->s >= 0) {
+			shutdown(conn->s, SHUT_RDWR);
+			close(conn->s);
+		}
+		free(conn);
+	}
+}
+
+
+static void conn_receive(struct sigma_dut *dut, int fd, void *ctx)
+{
+	process_conn(dut, ctx);
+}
+
+
+static void conn_accept(struct sigma_dut *dut, int fd, void *ctx)
+{
+	struct sigma_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"No memory for new connection");
+		return;
+	}
+	conn->addrlen = sizeof(conn->addr);
+	conn->s = accept(fd, (struct sockaddr *) &conn->addr, &conn->addrlen);
+	if (conn->s < 0) {
+		sigma_dut_print(dut, DUT_MSG_INFO, "accept: %s",
+				strerror(errno));
+		free(conn);
+		return;
+	}
+
+	if (!add_fd_handler(dut, conn->s, conn_receive, conn, true)) {
+		shutdown(conn->s, SHUT_RDWR);
+		close(conn->s);
+		free(conn);
+		return;
+	}
+	conn->next = dut->conns;
+	dut->conns = conn;
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "Connection from %s:%d",
+			inet_ntoa(conn->addr.sin_addr),
+			ntohs(conn->addr.sin_port));
+
+	/* Process anything that arrived before the socket was registered */
+	process_conn(dut, conn);
 }
 
 
@@ -599,98 +1153,114 @@ static void handle_term(int sig)
 }
 #endif /* __linux__ */
 
-static void run_loop(struct sigma_dut *dut)
-{
-	struct sigma_conn conn[MAX_CONNECTIONS];
-	int i, res, maxfd, can_accept;
-	fd_set rfds;
-
-	memset(&conn, 0, sizeof(conn));
-	for (i = 0; i < MAX_CONNECTIONS; i++)
-		conn[i].s = -1;
-
 #ifdef __linux__
-	signal(SIGINT, handle_term);
-	signal(SIGTERM, handle_term);
-	signal(SIGPIPE, SIG_IGN);
-#endif /* __linux__ */
 
-	while (!stop_loop) {
-		FD_ZERO(&rfds);
-		maxfd = -1;
-		can_accept = 0;
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			if (conn[i].s >= 0) {
-				FD_SET(conn[i].s, &rfds);
-				if (conn[i].s > maxfd)
-					maxfd = conn[i].s;
-			} else if (!conn[i].waiting_completion)
-				can_accept = 1;
-		}
+static void wait_events(struct sigma_dut *dut)
+{
+	struct epoll_event events[MAX_EPOLL_EVENTS];
+	struct sigma_fd_handler *h;
+	int i, res;
 
-		if (can_accept) {
-			FD_SET(dut->s, &rfds);
-			if (dut->s > maxfd)
-				maxfd = dut->s;
+	res = epoll_wait(dut->epoll_fd, events, MAX_EPOLL_EVENTS, -1);
+	if (res < 0) {
+		if (errno != EINTR) {
+			perror("epoll_wait");
+			if (!stop_loop)
+				sleep(1);
 		}
+		return;
+	}
 
+	for (i = 0; i < res && !stop_loop; i++) {
+		h = events[i].data.ptr;
+		if (h->removed)
+			continue;
+		h->cb(dut, h->fd, h->ctx);
+	}
+}
 
-		sigma_dut_print(dut, DUT_MSG_DEBUG, "Waiting for next "
-				"command (can_accept=%d)", can_accept);
-		res = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-		if (res < 0) {
-			perror("select");
-			if (!stop_loop)
-				sleep(1);
+#else /* __linux__ */
+
+static void wait_events(struct sigma_dut *dut)
+{
+	struct sigma_fd_handler *h;
+	fd_set rfds;
+	int res, maxfd = -1;
+
+	FD_ZERO(&rfds);
+	for (h = dut->fd_handlers; h; h = h->next) {
+		if (h->removed)
 			continue;
-		}
+		FD_SET(h->fd, &rfds);
+		if (h->fd > maxfd)
+			maxfd = h->fd;
+	}
 
-		if (!res) {
-			sigma_dut_print(dut, DUT_MSG_DEBUG, "Nothing ready");
+	res = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+	if (res < 0) {
+		perror("select");
+		if (!stop_loop)
 			sleep(1);
-			continue;
-		}
+		return;
+	}
 
-		if (FD_ISSET(dut->s, &rfds)) {
-			for (i = 0; i < MAX_CONNECTIONS; i++) {
-				if (conn[i].s < 0 &&
-				    !conn[i].waiting_completion)
-					break;
-			}
-			if (i == MAX_CONNECTIONS) {
-				/*
-				 * This cannot really happen since can_accept
-				 * would not be set to one.
-				 */
-				sigma_dut_print(dut, DUT_MSG_DEBUG,
-						"No room for new connection");
-				continue;
-			}
-			conn[i].addrlen = sizeof(conn[i].addr);
-			conn[i].s = accept(dut->s,
-					   (struct sockaddr *) &conn[i].addr,
-					   &conn[i].addrlen);
-			if (conn[i].s < 0) {
-				sigma_dut_print(dut, DUT_MSG_INFO,
-						"accept: %s",
-						strerror(errno));
-				continue;
-			}
+	for (h = dut->fd_handlers; h && !stop_loop; h = h->next) {
+		if (!h->removed && FD_ISSET(h->fd, &rfds))
+			h->cb(dut, h->fd, h->ctx);
+	}
+}
 
-			sigma_dut_print(dut, DUT_MSG_DEBUG,
-					"Connection %d from %s:%d", i,
-					inet_ntoa(conn[i].addr.sin_addr),
-					ntohs(conn[i].addr.sin_port));
-			conn[i].pos = 0;
-		}
+#endif /* __linux__ */
 
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			if (conn[i].s < 0)
-				continue;
-			if (FD_ISSET(conn[i].s, &rfds))
-				process_conn(dut, &conn[i]);
-		}
+
+static void run_loop(struct sigma_dut *dut)
+{
+	struct sigma_fd_handler *h;
+
+#ifdef __linux__
+	signal(SIGINT, handle_term);
+	signal(SIGTERM, handle_term);
+	signal(SIGPIPE, SIG_IGN);
+
+	dut->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (dut->epoll_fd < 0) {
+		perror("epoll_create1");
+		return;
+	}
+
+	/* Add descriptors that were registered before the loop started */
+	for (h = dut->fd_handlers; h; h = h->next) {
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | (h->edge_triggered ? EPOLLET : 0);
+		ev.data.ptr = h;
+		if (epoll_ctl(dut->epoll_fd, EPOLL_CTL_ADD, h->fd, &ev) < 0)
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"epoll_ctl(ADD, %d): %s",
+					h->fd, strerror(errno));
 	}
+#endif /* __linux__ */
+
+	h = add_fd_handler(dut, dut->s, conn_accept, NULL, false);
+	if (!h)
+		return;
+	start_cmd_workers(dut);
+
+	while (!stop_loop) {
+		sigma_dut_print(dut, DUT_MSG_DEBUG, "Waiting for next command");
+		wait_events(dut);
+		remove_fd_handlers(dut, false);
+		remove_closed_conns(dut, false);
+	}
+
+	stop_cmd_workers(dut);
+	remove_fd_handlers(dut, true);
+	remove_closed_conns(dut, true);
+#ifdef __linux__
+	close(dut->epoll_fd);
+	dut->epoll_fd = -1;
+#endif /* __linux__ */
 }
 
 
@@ -865,6 +1435,7 @@ static void set_host_name(struct sigma_dut *dut)
 static void set_defaults(struct sigma_dut *dut)
 {
 	dut->debug_level = DUT_MSG_INFO;
+	dut->epoll_fd = -1;
 	dut->default_timeout = 120;
 	dut->dialog_token = 0;
 	dut->dpp_conf_id = -1;
@@ -1038,7 +1609,7 @@ static void print_license(void)
 
 static void usage(void)
 {
-	printf("usage: sigma_dut [-aABdfGqDIntuVW2347] [-p<port>] "
+	printf("usage: sigma_dut [-aABdfGqDIntuVW23479] [-p<port>] "
 	       "[-s<sniffer>] [-m<set_maccaddr.sh>] \\\n"
 	       "       [-M<main ifname>] [-R<radio ifname>] "
 	       "[-S<station ifname>] [-P<p2p_ifname>]\\\n"
@@ -1069,7 +1640,8 @@ static void usage(void)
 	       "       [-Z <Override default tmp dir path>] \\\n"
 	       "       [-5 <WFD timeout override>] \\\n"
 	       "       [-r <HT40 or 2.4_HT40>] \\\n"
-	       "       [-6 <ocv or bp or ocv_bp>]\n");
+	       "       [-6 <ocv or bp or ocv_bp>] \\\n"
+	       "       [-8 <traffic agent worker threads, 0 = one per CPU>]\n");
 	printf("local command: sigma_dut [-p<port>] <-l<cmd>>\n");
 }
 
@@ -1092,7 +1664,7 @@ int main(int argc, char *argv[])
 
 	for (;;) {
 		c = getopt(argc, argv,
-			   "aAb:Bc:C:dDE:e:fF:gGhH:j:J:i:Ik:K:l:L:m:M:nN:o:O:p:P:qr:R:s:S:tT:uv:VWw:x:y:z:Z:2345:6:7");
+			   "aAb:Bc:C:dDE:e:fF:gGhH:j:J:i:Ik:K:l:L:m:M:nN:o:O:p:P:qr:R:s:S:tT:uv:VWw:x:y:z:Z:2345:6:78:9");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -1325,6 +1897,16 @@ int main(int argc, char *argv[])
 		case '7':
 			sigma_dut.autoconnect_default = 0;
 			break;
+#ifdef CONFIG_TRAFFIC_AGENT
+		case '8':
+			sigma_dut.ta_workers = atoi(optarg);
+			if (sigma_dut.ta_workers <= 0)
+				sigma_dut.ta_workers = -1;
+			break;
+#endif /* CONFIG_TRAFFIC_AGENT */
+		case '9':
+			sigma_dut.iperf_native = 1;
+			break;
 		case 'h':
 		default:
 			usage();
@@ -1422,8 +2004,16 @@ int main(int argc, char *argv[])
 #ifdef CONFIG_SNIFFER
 	sniffer_close(&sigma_dut);
 #endif /* CONFIG_SNIFFER */
+#ifdef CONFIG_SERVER
+	server_close(&sigma_dut);
+#endif /* CONFIG_SERVER */
+#ifdef CONFIG_TRAFFIC_AGENT
+	traffic_agent_close(&sigma_dut);
+#endif /* CONFIG_TRAFFIC_AGENT */
 
 	close_socket(&sigma_dut);
+	flush_all_ctrl_conns();
+	inject_close(&sigma_dut, false);
 #ifdef MIRACAST
 	miracast_deinit(&sigma_dut);
 #endif /* MIRACAST */
@@ -153,21 +153,48 @@ struct dut_hw_modes {
 		(a)[3] = (u8) (((u32) (val)) & 0xff);		\
 	} while (0)
 
+/* Number of buckets in the per-command parameter index; power of two */
+#define SIGMA_PARAM_HASH_SIZE 128
+
 struct sigma_cmd {
 	char *params[MAX_PARAMS];
 	char *values[MAX_PARAMS];
 	int count;
+
+	/*
+	 * Case-insensitive index over params[] built by process_cmd(). Entries
+	 * are params[] index + 1 with 0 terminating a chain; entries with the
+	 * same name are chained in the order they appear in the command.
+	 */
+	bool indexed;
+	u8 param_hash[SIGMA_PARAM_HASH_SIZE];
+	u8 param_next[MAX_PARAMS];
+	bool param_used[MAX_PARAMS];
 };
 
 #define MAX_CMD_LEN 4096
 
 struct sigma_conn {
+	struct sigma_conn *next;
 	int s;
 	struct sockaddr_in addr;
 	socklen_t addrlen;
 	char buf[MAX_CMD_LEN + 5];
 	int pos;
 	int waiting_completion;
+	int response_sent;
+	bool busy; /* command being processed by a worker thread */
+};
+
+typedef void (*sigma_fd_cb)(struct sigma_dut *dut, int fd, void *ctx);
+
+struct sigma_fd_handler {
+	struct sigma_fd_handler *next;
+	int fd;
+	bool edge_triggered;
+	bool removed;
+	sigma_fd_cb cb;
+	void *ctx;
 };
 
 enum sigma_cmd_result {
@@ -178,9 +205,20 @@ enum sigma_cmd_result {
 	SUCCESS_SEND_STATUS = 1
 };
 
+/* sigma_cmd_handler::flags */
+/*
+ * The command can be executed on a worker thread without blocking the main
+ * loop. Such commands may run in parallel with other asynchronous commands
+ * that use a different Interface parameter, so the handler must not modify
+ * shared state in struct sigma_dut.
+ */
+#define SIGMA_CMD_ASYNC BIT(0)
+
 struct sigma_cmd_handler {
 	struct sigma_cmd_handler *next;
+	struct sigma_cmd_handler *hash_next;
 	char *cmd;
+	unsigned int flags;
 	int (*validate)(struct sigma_cmd *cmd);
 	/* process return value:
 	 * -2 = failed, caller will send status,ERROR
@@ -193,6 +231,9 @@ struct sigma_cmd_handler {
 					 struct sigma_cmd *cmd);
 };
 
+/* Number of buckets in the command handler hash table; power of two */
+#define SIGMA_CMD_HASH_SIZE 256
+
 #define P2P_GRP_ID_LEN 128
 #define IP_ADDR_STR_LEN 16
 
@@ -207,7 +248,7 @@ struct wfa_cs_p2p_group {
 
 #ifdef CONFIG_TRAFFIC_AGENT
 
-#define MAX_SIGMA_STREAMS 16
+#define MAX_SIGMA_STREAMS 1024
 #define MAX_SIGMA_STATS 6000
 
 struct sigma_frame_stats {
@@ -218,6 +259,46 @@ struct sigma_frame_stats {
 	unsigned int remote_usec;
 };
 
+/*
+ * Frame latency histogram with logarithmic buckets: values below
+ * 2^SIGMA_LAT_SUB_BITS usec are exact and every larger power of two is split
+ * into 2^SIGMA_LAT_SUB_BITS buckets (about 3% resolution).
+ */
+#define SIGMA_LAT_SUB_BITS 5
+#define SIGMA_LAT_BUCKETS ((32 - SIGMA_LAT_SUB_BITS + 1) << SIGMA_LAT_SUB_BITS)
+
+struct sigma_latency_hist {
+	unsigned long long count;
+	unsigned int negative; /* remote clock ahead of local clock */
+	unsigned int max_usec;
+	unsigned int buckets[SIGMA_LAT_BUCKETS];
+};
+
+/* Number of samples in the live statistics window; one sample per interval */
+#define SIGMA_LIVE_SAMPLES 10
+#define SIGMA_LIVE_SAMPLE_USEC 100000
+
+struct sigma_stream_sample {
+	unsigned long long time_usec; /* CLOCK_MONOTONIC */
+	unsigned int tx_frames;
+	unsigned int rx_frames;
+	unsigned int rx_max_seq;
+	unsigned int out_of_seq_frames;
+	unsigned long long tx_payload_bytes;
+	unsigned long long rx_payload_bytes;
+};
+
+/*
+ * Counters published by the stream thread for readers that do not wait for
+ * the stream to stop. Protected by a sequence lock in struct sigma_stream.
+ */
+struct sigma_stream_live {
+	struct sigma_stream_sample cur;
+	struct sigma_stream_sample window[SIGMA_LIVE_SAMPLES];
+	unsigned int window_pos;
+	unsigned int window_len;
+};
+
 struct sigma_stream {
 	enum sigma_stream_profile {
 		SIGMA_PROFILE_FILE_TRANSFER,
@@ -251,6 +332,9 @@ struct sigma_stream {
 
 	int sock;
 	pthread_t thr;
+	struct ta_worker *worker; /* event-loop engine instead of thr */
+	struct sigma_stream *worker_next;
+	int worker_done;
 	int stop;
 	int ta_send_in_progress;
 	int trans_proto;
@@ -260,6 +344,12 @@ struct sigma_stream {
 	int dscp;
 	bool use_dscp;
 
+	/* Receive tuning */
+	int busy_poll_usec;
+	int rcvbuf_size;
+	bool rx_hw_timestamp;
+	bool use_txtime; /* SO_TXTIME launch times for paced frames */
+
 	/* Statistics */
 	int tx_act_frames; /*
 			    * Number of frames generated by the traffic
@@ -271,10 +361,24 @@ struct sigma_stream {
 	unsigned long long tx_payload_bytes;
 	unsigned long long rx_payload_bytes;
 	int out_of_seq_frames;
-	struct sigma_frame_stats *stats;
+	unsigned int rx_max_seq;
+	unsigned int tx_gap_req_usec; /* paced streams: requested gap */
+	unsigned int tx_gap_avg_usec;
+	unsigned int tx_gap_dev_usec;
+	unsigned int tx_gap_max_usec;
+	struct sigma_frame_stats *stats; /* chunk of MAX_SIGMA_STATS records */
 	unsigned int num_stats;
+	int stats_fd; /* spill file for full chunks, open if stats_file[0] */
+	char stats_file[128];
+	unsigned long long num_stats_spilled;
+	struct sigma_latency_hist *latency;
 	unsigned int stream_id;
 
+	/* Live statistics; own cache line so readers do not disturb the
+	 * counters above */
+	unsigned int live_seq __attribute__((aligned(64)));
+	struct sigma_stream_live live;
+
 	/* U-APSD */
 	unsigned int sta_id;
 	unsigned int rx_cookie;
@@ -286,6 +390,10 @@ struct sigma_stream {
 	pthread_t uapsd_send_thr;
 	pthread_cond_t tx_thr_cond;
 	pthread_mutex_t tx_thr_mutex;
+	/* CLOCK_MONOTONIC; signalled under tx_thr_mutex when uapsd_rx_state
+	 * advances or the stream stops */
+	pthread_cond_t uapsd_rx_cond;
+	unsigned int *uapsd_txbuf; /* UAPSD_PKT_SIZE, owned by send_uapsd */
 	int reset_rx;
 	int num_retry;
 	char ifname[IFNAMSIZ]; /* ifname from the command */
@@ -350,12 +458,36 @@ struct mbo_pref_ap {
 
 #ifdef NL80211_SUPPORT
 #define SOCK_BUF_SIZE (32 * 1024)
+#define NL80211_EVENT_RING_SIZE 32
+
+struct nl80211_event {
+	unsigned long long seq; /* 0 for an unused ring slot */
+	uint8_t cmd;
+	uint32_t vendor_id; /* 0 if not a vendor event */
+	uint32_t vendor_subcmd;
+	int ifindex; /* 0 if not present */
+	struct nlmsghdr *msg; /* copy of the whole message */
+};
+
+struct nl80211_req;
+struct wcn_test_config_batch;
+
 struct nl80211_ctx {
 	struct nl_sock *sock;
 	int netlink_familyid;
 	int nlctrl_familyid;
 	size_t sock_buf_size;
+	struct nl_cb *cb; /* shared by all requests on sock */
+	struct nl80211_req *req; /* requests waiting for replies on sock */
 	struct nl_sock *event_sock;
+
+	/* Event dispatcher; event_sock is owned by event_thread */
+	pthread_t event_thread;
+	int event_pipe[2]; /* wakes event_thread up for shutdown */
+	pthread_mutex_t event_lock;
+	pthread_cond_t event_cond; /* CLOCK_MONOTONIC */
+	unsigned long long event_seq; /* seq of the latest event */
+	struct nl80211_event events[NL80211_EVENT_RING_SIZE];
 };
 #endif /* NL80211_SUPPORT */
 
@@ -617,10 +749,13 @@ struct sigma_dut {
 	int sta_5g_started;
 
 	int s; /* server TCP socket */
+	int epoll_fd;
+	struct sigma_fd_handler *fd_handlers;
+	struct sigma_conn *conns; /* accepted control connections */
 	int debug_level;
 	int stdout_debug;
 	struct sigma_cmd_handler *cmds;
-	int response_sent;
+	struct sigma_cmd_handler *cmd_hash[SIGMA_CMD_HASH_SIZE];
 
 	const char *sigma_tmpdir;
 
@@ -1051,12 +1186,24 @@ struct sigma_dut {
 
 #ifdef CONFIG_TRAFFIC_AGENT
 	/* Traffic Agent */
-	struct sigma_stream streams[MAX_SIGMA_STREAMS];
+	/* streams[i] has stream_id == stream_id_base + 1 + i */
+	struct sigma_stream **streams;
+	int streams_alloc;
 	int stream_id;
+	int stream_id_base;
 	int num_streams;
 	pthread_t thr;
+	int ta_workers; /* event-loop workers; 0 = thread per stream,
+			 * -1 = one per CPU */
+	struct ta_engine *ta_engine;
 #endif /* CONFIG_TRAFFIC_AGENT */
 
+	/* traffic_start_iperf sessions run by the built-in engine */
+	struct iperf_session *iperf_sessions;
+	/* traffic_send_ping sessions run by the built-in pinger */
+	struct ping_session *ping_sessions;
+	int iperf_native; /* use the built-in engine even if iperf is found */
+
 	unsigned int throughput_pktsize; /* If non-zero, override pktsize for
 					  * throughput tests */
 	int no_timestamps;
@@ -1092,6 +1239,10 @@ struct sigma_dut {
 	char sniffer_filename[200];
 #endif /* CONFIG_SNIFFER */
 
+#ifdef CONFIG_SERVER
+	struct server_db *server_db;
+#endif /* CONFIG_SERVER */
+
 	int last_set_ip_config_ipv6;
 #ifdef MIRACAST
 	pthread_t rtsp_thread_handle;
@@ -1232,6 +1383,7 @@ struct sigma_dut {
 	int use_hostapd_pid_file;
 	const char *hostapd_ifname;
 	int hostapd_running;
+	struct hapd_conf *hapd_conf; /* configuration of running hostapd */
 
 	char *dpp_peer_uri;
 	int dpp_local_bootstrap;
@@ -1244,9 +1396,11 @@ struct sigma_dut {
 
 #ifdef NL80211_SUPPORT
 	struct nl80211_ctx *nl_ctx;
+	struct wcn_test_config_batch *test_config_batch;
 	int config_rsnie;
 	int config_random_pmkid;
 #endif /* NL80211_SUPPORT */
+	struct inject_ctx *inject; /* frame injection channel */
 
 	int sta_nss;
 
@@ -1257,6 +1411,11 @@ struct sigma_dut {
 #endif /* ANDROID */
 
 	const char *priv_cmd; /* iwpriv / cfg80211tool command name */
+	/* Pending run_iwpriv() calls while batching is active */
+	bool iwpriv_batching;
+	struct iwpriv_batch_item *iwpriv_batch;
+	size_t iwpriv_batch_len;
+	size_t iwpriv_batch_size;
 
 	unsigned int wpa_log_size;
 	char dev_start_test_runtime_id[100];
@@ -1361,6 +1520,16 @@ int sigma_dut_reg_cmd(const char *cmd,
 		      enum sigma_cmd_result (*process)(struct sigma_dut *dut,
 						       struct sigma_conn *conn,
 						       struct sigma_cmd *cmd));
+int sigma_dut_reg_cmd_flags(const char *cmd,
+			    int (*validate)(struct sigma_cmd *cmd),
+			    enum sigma_cmd_result (*process)(
+				    struct sigma_dut *dut,
+				    struct sigma_conn *conn,
+				    struct sigma_cmd *cmd),
+			    unsigned int flags);
+int sigma_dut_register_fd(struct sigma_dut *dut, int fd, sigma_fd_cb cb,
+			  void *ctx);
+void sigma_dut_unregister_fd(struct sigma_dut *dut, int fd);
 
 void sigma_dut_register_cmds(void);
 
@@ -1427,6 +1596,7 @@ enum sigma_cmd_result cmd_wlantest_set_channel(struct sigma_dut *dut,
 					       struct sigma_cmd *cmd);
 void wlantest_register_cmds(void);
 void sniffer_close(struct sigma_dut *dut);
+void server_close(struct sigma_dut *dut);
 
 /* sigma_dut.c */
 int wifi_hal_initialize(struct sigma_dut *dut);
@@ -1462,6 +1632,7 @@ int sta_set_60g_abft_len(struct sigma_dut *dut, struct sigma_conn *conn,
 int wil6210_send_frame_60g(struct sigma_dut *dut, struct sigma_conn *conn,
 			   struct sigma_cmd *cmd);
 int hwaddr_aton(const char *txt, unsigned char *addr);
+int open_monitor(const char *ifname);
 int set_ipv4_addr(struct sigma_dut *dut, const char *ifname,
 		  const char *ip, const char *mask);
 int set_ipv4_gw(struct sigma_dut *dut, const char *gw);
@@ -1547,6 +1718,79 @@ int random_get_bytes(char *buf, size_t len);
 int random_mac_addr(u8 *addr);
 int get_enable_disable(const char *val);
 int wcn_driver_cmd(const char *ifname, char *buf);
+unsigned int str_hash_nocase(const char *str);
+int run_argv(struct sigma_dut *dut, char *const argv[]);
+int set_ifc_up(struct sigma_dut *dut, const char *ifname, bool up);
+bool run_cmd_direct(struct sigma_dut *dut, const char *cmd, int *status);
+void iwpriv_batch_start(struct sigma_dut *dut);
+int iwpriv_batch_add(struct sigma_dut *dut, const char *ifname,
+		     const char *args);
+int iwpriv_batch_flush(struct sigma_dut *dut);
+int iwpriv_batch_end(struct sigma_dut *dut);
+
+struct inject_params {
+	int encrypt; /* let the driver protect the frame */
+	int rate; /* legacy rate in 500 kbps units; 0 = driver choice */
+	int mcs; /* HT MCS, or VHT MCS if nss is set; -1 = driver choice */
+	int nss; /* spatial streams of a VHT rate */
+	int bw; /* MHz; 0 = driver choice */
+	int count; /* copies of the frame to inject */
+};
+
+/* How long to wait for the TX status of injected frames */
+#define INJECT_TX_STATUS_TIMEOUT_MS 200
+
+void inject_params_init(struct inject_params *params);
+int inject_params_parse(struct sigma_cmd *cmd, struct inject_params *params);
+int inject_open(struct sigma_dut *dut, const char *ifname);
+void inject_close(struct sigma_dut *dut, bool remove_iface);
+int inject_frames(struct sigma_dut *dut, const struct inject_params *params,
+		  const void *frame, size_t len);
+int inject_tx_status(struct sigma_dut *dut, int timeout_ms,
+		     unsigned int *acked);
+
+/* iperf.c */
+struct iperf_params {
+	bool server;
+	bool tcp;
+	bool udp;
+	bool ipv6;
+	bool reverse;
+	bool latency;
+	double lower_ci, upper_ci; /* latency percentiles to report */
+	const char *dst; /* client: server address; server: multicast group */
+	const char *ifname;
+	int port;
+	const char *src_ip;
+	int src_port;
+	int duration; /* seconds, 0 = until traffic_stop_iperf */
+	long long rate; /* bits/s, 0 = default */
+	int burst_size; /* bytes per isochronous burst, 0 = none */
+	int tos; /* -1 = default */
+	int parallel;
+};
+
+int iperf_native_start(struct sigma_dut *dut, const struct iperf_params *p,
+		       char *err, size_t err_len);
+int iperf_native_stop(struct sigma_dut *dut, int server, int port,
+		      char *buf, size_t buflen);
+bool iperf_binary_available(const char *name);
+
+/* ping.c */
+struct ping_params {
+	bool ipv6;
+	const char *dst; /* address with optional %ifname scope */
+	const char *ifname; /* bind to this interface, NULL for any */
+	int size; /* ICMP payload bytes */
+	double rate; /* requests per second */
+	int count;
+	int tos; /* -1 = default */
+	bool broadcast;
+};
+
+int ping_native_start(struct sigma_dut *dut, int id,
+		      const struct ping_params *p);
+int ping_native_stop(struct sigma_dut *dut, int id, char *buf, size_t buflen);
 
 /* uapsd_stream.c */
 void receive_uapsd(struct sigma_stream *s);
@@ -1602,6 +1846,11 @@ struct nl80211_ctx * nl80211_init(struct sigma_dut *dut);
 void nl80211_deinit(struct sigma_dut *dut, struct nl80211_ctx *ctx);
 int nl80211_open_event_sock(struct sigma_dut *dut);
 void nl80211_close_event_sock(struct sigma_dut *dut);
+unsigned long long nl80211_event_seq(struct sigma_dut *dut);
+int nl80211_event_wait(struct sigma_dut *dut, unsigned long long *seq,
+		       int (*match)(struct sigma_dut *dut,
+				    const struct nl80211_event *ev, void *ctx),
+		       void *ctx, unsigned int timeout_ms);
 struct nl_msg * nl80211_drv_msg(struct sigma_dut *dut, struct nl80211_ctx *ctx,
 				int ifindex, int flags,
 				uint8_t cmd);
@@ -1609,6 +1858,13 @@ int send_and_recv_msgs(struct sigma_dut *dut, struct nl80211_ctx *ctx,
 		       struct nl_msg *nlmsg,
 		       int (*valid_handler)(struct nl_msg *, void *),
 		       void *valid_data);
+int nl80211_send_msgs(struct sigma_dut *dut, struct nl80211_ctx *ctx,
+		      struct nl_msg **msgs, int *res, unsigned int count,
+		      int (*valid_handler)(struct nl_msg *, void *),
+		      void *valid_data);
+void wcn_wifi_test_config_batch_start(struct sigma_dut *dut, const char *intf);
+int wcn_wifi_test_config_batch_commit(struct sigma_dut *dut);
+int wcn_wifi_test_config_flush(struct sigma_dut *dut);
 int wcn_wifi_test_config_set_flag(struct sigma_dut *dut, const char *intf,
 				  int attr_id);
 int wcn_wifi_test_config_set_u8(struct sigma_dut *dut, const char *intf,
@@ -1619,6 +1875,7 @@ int wcn_wifi_test_config_set_u16(struct sigma_dut *dut, const char *intf,
 
 void traffic_register_cmds(void);
 void traffic_agent_register_cmds(void);
+void traffic_agent_close(struct sigma_dut *dut);
 void powerswitch_register_cmds(void);
 void atheros_register_cmds(void);
 void dev_register_cmds(void);
@@ -0,0 +1,614 @@
+/*
+ * sigma_dut control plane benchmark
+ * Copyright (c) 2018-2020, The Linux Foundation
+ * All Rights Reserved.
+ * Licensed under the Clear BSD license. See README for more details.
+ *
+ * Starts sigma_dut against stub wpa_supplicant/hostapd control interfaces
+ * and measures CAPI command latency over the TCP control port, throughput
+ * with pipelined commands, and the cost of a sigma_dut -l invocation. No
+ * radio or wpa_supplicant is needed.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define BENCH_IFNAME "bench0"
+#define MAX_BENCH_CMDS 16
+#define MAX_CONNS 64
+
+static const char *default_cmds[] = {
+	/* Parsing, dispatch and send_resp() only */
+	"ca_get_version",
+	/* Adds a wpa_ctrl round trip to the stub (STATUS) */
+	"sta_is_connected,interface," BENCH_IFNAME,
+	"sta_get_bssid,interface," BENCH_IFNAME,
+	NULL
+};
+
+static const char *sigma_dut_bin = "./sigma_dut";
+static int port = 9100;
+static int iterations = 2000;
+static int warmup = 100;
+static int pipeline = 32;
+static int connections = 4;
+static int local_iterations = 50;
+static int errors;
+static char work_dir[64];
+static char ctrl_dir[100];
+static pid_t dut_pid = -1;
+
+static int stub_sock = -1;
+static unsigned long stub_requests;
+static long long stub_busy_ns;
+
+
+static long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	errors++;
+}
+
+
+/* Minimal wpa_supplicant/hostapd control interface */
+static const char * stub_reply(const char *req)
+{
+	if (strcmp(req, "PING") == 0)
+		return "PONG\n";
+	if (strncmp(req, "STATUS", 6) == 0)
+		return "bssid=02:00:00:00:01:00\n"
+			"freq=2412\n"
+			"ssid=bench\n"
+			"id=0\n"
+			"mode=station\n"
+			"pairwise_cipher=CCMP\n"
+			"group_cipher=CCMP\n"
+			"key_mgmt=WPA2-PSK\n"
+			"wpa_state=COMPLETED\n"
+			"ip_address=192.168.1.2\n"
+			"address=02:00:00:00:00:00\n";
+	if (strcmp(req, "ATTACH") == 0 || strcmp(req, "DETACH") == 0)
+		return "OK\n";
+	if (strncmp(req, "GET ", 4) == 0 || strncmp(req, "GET_", 4) == 0)
+		return "FAIL\n";
+	return "OK\n";
+}
+
+
+static void * stub_thread(void *ctx)
+{
+	struct sockaddr_un from;
+	socklen_t from_len;
+	char buf[4096];
+	const char *reply;
+	long long start;
+	ssize_t len;
+
+	for (;;) {
+		from_len = sizeof(from);
+		len = recvfrom(stub_sock, buf, sizeof(buf) - 1, 0,
+			       (struct sockaddr *) &from, &from_len);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		start = now_ns();
+		buf[len] = '\0';
+		reply = stub_reply(buf);
+		sendto(stub_sock, reply, strlen(reply), 0,
+		       (struct sockaddr *) &from, from_len);
+		__sync_fetch_and_add(&stub_requests, 1);
+		__sync_fetch_and_add(&stub_busy_ns, now_ns() - start);
+	}
+
+	return NULL;
+}
+
+
+static int start_stub(void)
+{
+	struct sockaddr_un addr;
+	pthread_t thr;
+
+	stub_sock = socket(PF_UNIX, SOCK_DGRAM, 0);
+	if (stub_sock < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s" BENCH_IFNAME,
+		 ctrl_dir);
+	if (bind(stub_sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return -1;
+	}
+	if (pthread_create(&thr, NULL, stub_thread, NULL)) {
+		fprintf(stderr, "pthread_create failed\n");
+		return -1;
+	}
+	pthread_detach(thr);
+	return 0;
+}
+
+
+static int connect_dut(void)
+{
+	struct sockaddr_in addr;
+	int s, one = 1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+
+	s = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (s < 0)
+		return -1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (connect(s, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		close(s);
+		return -1;
+	}
+	return s;
+}
+
+
+static int start_dut(void)
+{
+	char port_str[20], tmp_dir[100];
+	int i, s, fd;
+
+	snprintf(port_str, sizeof(port_str), "%d", port);
+	snprintf(tmp_dir, sizeof(tmp_dir), "%s/tmp", work_dir);
+	mkdir(tmp_dir, 0700);
+
+	dut_pid = fork();
+	if (dut_pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (dut_pid == 0) {
+		fd = open("/dev/null", O_WRONLY);
+		if (fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
+			close(fd);
+		}
+		execl(sigma_dut_bin, sigma_dut_bin, "-p", port_str,
+		      "-w", ctrl_dir, "-M", BENCH_IFNAME, "-S", BENCH_IFNAME,
+		      "-Z", tmp_dir, (char *) NULL);
+		_exit(127);
+	}
+
+	/* Wait for the control port */
+	for (i = 0; i < 100; i++) {
+		s = connect_dut();
+		if (s >= 0) {
+			close(s);
+			return 0;
+		}
+		if (waitpid(dut_pid, NULL, WNOHANG) == dut_pid) {
+			fprintf(stderr, "%s exited during startup\n",
+				sigma_dut_bin);
+			dut_pid = -1;
+			return -1;
+		}
+		usleep(50000);
+	}
+
+	fprintf(stderr, "%s did not open port %d\n", sigma_dut_bin, port);
+	return -1;
+}
+
+
+static void stop_dut(void)
+{
+	if (dut_pid > 0) {
+		kill(dut_pid, SIGTERM);
+		waitpid(dut_pid, NULL, 0);
+		dut_pid = -1;
+	}
+}
+
+
+struct conn {
+	int s;
+	char buf[8192];
+	size_t len;
+};
+
+
+/*
+ * Read the final (non-RUNNING) response line of one command. Returns 1 for
+ * status,COMPLETE, 0 for any other final status, -1 on connection error.
+ */
+static int read_resp(struct conn *c)
+{
+	char *eol;
+	ssize_t res;
+	size_t line_len;
+	int ret;
+
+	for (;;) {
+		eol = memchr(c->buf, '\n', c->len);
+		if (eol) {
+			line_len = eol - c->buf + 1;
+			if (strncasecmp(c->buf, "status,RUNNING", 14) == 0) {
+				ret = -2;
+			} else {
+				ret = strncasecmp(c->buf, "status,COMPLETE",
+						  15) == 0;
+				if (!ret)
+					fail("unexpected response: %.*s",
+					     (int) line_len, c->buf);
+			}
+			memmove(c->buf, c->buf + line_len, c->len - line_len);
+			c->len -= line_len;
+			if (ret != -2)
+				return ret;
+			continue;
+		}
+		if (c->len == sizeof(c->buf))
+			c->len = 0;
+		res = recv(c->s, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+		if (res <= 0)
+			return -1;
+		c->len += res;
+	}
+}
+
+
+static int send_all(int s, const char *buf, size_t len)
+{
+	ssize_t res;
+
+	while (len > 0) {
+		res = send(s, buf, len, MSG_NOSIGNAL);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += res;
+		len -= res;
+	}
+	return 0;
+}
+
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(const long long *) a, y = *(const long long *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+
+static void print_dist(const char *label, long long *ns, int n)
+{
+	long long sum = 0;
+	int i;
+
+	if (n <= 0)
+		return;
+	qsort(ns, n, sizeof(*ns), cmp_ll);
+	for (i = 0; i < n; i++)
+		sum += ns[i];
+	printf("%-40.40s %6d %8.1f %8.1f %8.1f %8.1f %8.1f\n", label, n,
+	       sum / n / 1000.0, ns[n / 2] / 1000.0,
+	       ns[(n * 90 + 99) / 100 - 1] / 1000.0,
+	       ns[(n * 99 + 99) / 100 - 1] / 1000.0, ns[n - 1] / 1000.0);
+}
+
+
+/* One command at a time on one connection */
+static void bench_latency(const char *cmd)
+{
+	struct conn *c;
+	char line[1024];
+	long long *ns, start;
+	int i, len;
+
+	c = calloc(1, sizeof(*c));
+	ns = calloc(iterations, sizeof(*ns));
+	if (!c || !ns)
+		goto out;
+	c->s = connect_dut();
+	if (c->s < 0) {
+		fail("cannot connect to port %d", port);
+		goto out;
+	}
+
+	len = snprintf(line, sizeof(line), "%s\r\n", cmd);
+	for (i = -warmup; i < iterations; i++) {
+		start = now_ns();
+		if (send_all(c->s, line, len) < 0 || read_resp(c) < 0) {
+			fail("%s: connection lost", cmd);
+			break;
+		}
+		if (i >= 0)
+			ns[i] = now_ns() - start;
+	}
+	print_dist(cmd, ns, i < 0 ? 0 : i);
+	close(c->s);
+
+out:
+	free(ns);
+	free(c);
+}
+
+
+struct pipe_ctx {
+	const char *cmd;
+	int count;
+	int done;
+};
+
+
+static void * pipe_thread(void *ctx)
+{
+	struct pipe_ctx *p = ctx;
+	struct conn *c;
+	char *batch;
+	size_t line_len;
+	int i, n;
+
+	c = calloc(1, sizeof(*c));
+	line_len = strlen(p->cmd) + 2;
+	batch = malloc(line_len * pipeline);
+	if (!c || !batch)
+		goto out;
+	for (i = 0; i < pipeline; i++) {
+		memcpy(batch + i * line_len, p->cmd, line_len - 2);
+		memcpy(batch + i * line_len + line_len - 2, "\r\n", 2);
+	}
+
+	c->s = connect_dut();
+	if (c->s < 0)
+		goto out;
+	while (p->done < p->count) {
+		n = p->count - p->done;
+		if (n > pipeline)
+			n = pipeline;
+		if (send_all(c->s, batch, line_len * n) < 0)
+			break;
+		for (i = 0; i < n; i++) {
+			if (read_resp(c) < 0)
+				goto out;
+			p->done++;
+		}
+	}
+
+out:
+	if (c && c->s > 0)
+		close(c->s);
+	free(batch);
+	free(c);
+	return NULL;
+}
+
+
+/* Pipelined commands from several connections at once */
+static void bench_throughput(const char *cmd)
+{
+	struct pipe_ctx ctx[MAX_CONNS];
+	pthread_t thr[MAX_CONNS];
+	long long start, elapsed;
+	int i, done = 0;
+
+	start = now_ns();
+	for (i = 0; i < connections; i++) {
+		ctx[i].cmd = cmd;
+		ctx[i].count = iterations / connections;
+		ctx[i].done = 0;
+		if (pthread_create(&thr[i], NULL, pipe_thread, &ctx[i])) {
+			fail("pthread_create failed");
+			connections = i;
+			break;
+		}
+	}
+	for (i = 0; i < connections; i++) {
+		pthread_join(thr[i], NULL);
+		done += ctx[i].done;
+		if (ctx[i].done < ctx[i].count)
+			fail("%s: connection %d completed %d/%d", cmd, i,
+			     ctx[i].done, ctx[i].count);
+	}
+	elapsed = now_ns() - start;
+
+	printf("%-40.40s %6d %8.0f cmd/s (%d conn x depth %d)\n", cmd, done,
+	       elapsed ? done * 1000000000.0 / elapsed : 0.0, connections,
+	       pipeline);
+}
+
+
+/* sigma_dut -l: process start, connect and one command */
+static void bench_local(const char *cmd)
+{
+	char port_str[20];
+	long long *ns, start;
+	int i, status, fd;
+	pid_t pid;
+
+	ns = calloc(local_iterations, sizeof(*ns));
+	if (!ns)
+		return;
+	snprintf(port_str, sizeof(port_str), "%d", port);
+
+	for (i = 0; i < local_iterations; i++) {
+		start = now_ns();
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			break;
+		}
+		if (pid == 0) {
+			fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0) {
+				dup2(fd, STDOUT_FILENO);
+				close(fd);
+			}
+			execl(sigma_dut_bin, sigma_dut_bin, "-p", port_str,
+			      "-l", cmd, (char *) NULL);
+			_exit(127);
+		}
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status) != 0) {
+			fail("sigma_dut -l %s failed", cmd);
+			break;
+		}
+		ns[i] = now_ns() - start;
+	}
+	print_dist(cmd, ns, i);
+	free(ns);
+}
+
+
+static void print_header(const char *title)
+{
+	printf("\n%s\n%-40s %6s %8s %8s %8s %8s %8s\n", title, "command", "n",
+	       "mean", "p50", "p90", "p99", "max");
+}
+
+
+static void usage(void)
+{
+	printf("usage: sigma_dut_bench [-s <sigma_dut binary>] [-p <port>] "
+	       "[-n <iterations>] \\\n"
+	       "       [-w <warmup iterations>] [-P <pipeline depth>] "
+	       "[-C <connections>] \\\n"
+	       "       [-l <sigma_dut -l iterations>] [-c <CAPI command>]...\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *cmds[MAX_BENCH_CMDS + 1];
+	char path[200];
+	int c, i, num_cmds = 0;
+
+	for (;;) {
+		c = getopt(argc, argv, "c:C:hl:n:p:P:s:w:");
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'c':
+			if (num_cmds < MAX_BENCH_CMDS)
+				cmds[num_cmds++] = optarg;
+			break;
+		case 'C':
+			connections = atoi(optarg);
+			if (connections < 1)
+				connections = 1;
+			if (connections > MAX_CONNS)
+				connections = MAX_CONNS;
+			break;
+		case 'l':
+			local_iterations = atoi(optarg);
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			pipeline = atoi(optarg);
+			if (pipeline < 1)
+				pipeline = 1;
+			break;
+		case 's':
+			sigma_dut_bin = optarg;
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			usage();
+			return c == 'h' ? 0 : 1;
+		}
+	}
+	if (iterations < 1)
+		iterations = 1;
+	if (num_cmds == 0) {
+		for (i = 0; default_cmds[i]; i++)
+			cmds[num_cmds++] = default_cmds[i];
+	}
+	cmds[num_cmds] = NULL;
+
+	snprintf(work_dir, sizeof(work_dir), "/tmp/sigma_dut_bench.XXXXXX");
+	if (!mkdtemp(work_dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(ctrl_dir, sizeof(ctrl_dir), "%s/ctrl/", work_dir);
+	mkdir(ctrl_dir, 0700);
+
+	if (start_stub() < 0 || start_dut() < 0) {
+		errors++;
+		goto out;
+	}
+
+	print_header("Latency per command over TCP (usec)");
+	for (i = 0; i < num_cmds; i++)
+		bench_latency(cmds[i]);
+
+	printf("\nPipelined throughput over TCP\n");
+	for (i = 0; i < num_cmds; i++)
+		bench_throughput(cmds[i]);
+
+	if (local_iterations > 0) {
+		print_header("sigma_dut -l per command (usec)");
+		for (i = 0; i < num_cmds; i++)
+			bench_local(cmds[i]);
+	}
+
+	printf("\nStub control interface: %lu requests, %.1f usec average service time\n",
+	       stub_requests,
+	       stub_requests ? stub_busy_ns / stub_requests / 1000.0 : 0.0);
+	if (errors)
+		printf("%d errors\n", errors);
+
+out:
+	stop_dut();
+	if (stub_sock >= 0)
+		close(stub_sock);
+	snprintf(path, sizeof(path), "rm -rf %s", work_dir);
+	if (system(path) != 0)
+		fprintf(stderr, "Failed to remove %s\n", work_dir);
+	return errors ? 1 : 0;
+}
@@ -11200,6 +11200,10 @@ static void sta_reset_default_wcn(struct sigma_dut *dut, const char *intf,
 		wcn_sta_set_ampdu(dut, intf, 1);
 
 #ifdef NL80211_SUPPORT
+		/* The HE defaults below are independent test config settings,
+		 * so send them packed into as few commands as possible. */
+		wcn_wifi_test_config_batch_start(dut, intf);
+
 		if (wcn_set_he_ltf(dut, intf, QCA_WLAN_HE_LTF_AUTO)) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"Set LTF config to default in sta_reset_default_wcn failed");
@@ -11265,6 +11269,8 @@ static void sta_reset_default_wcn(struct sigma_dut *dut, const char *intf,
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"Setting of +HTC-HE support failed");
 		}
+
+		wcn_wifi_test_config_batch_commit(dut);
 #endif /* NL80211_SUPPORT */
 
 		if (sta_set_tx_beamformee(dut, intf, 1)) {
@@ -11307,6 +11313,8 @@ static void sta_reset_default_wcn(struct sigma_dut *dut, const char *intf,
 			iwpriv_sta_set_amsdu(dut, intf, "0");
 
 #ifdef NL80211_SUPPORT
+			wcn_wifi_test_config_batch_start(dut, intf);
+
 			/* HE fragmentation default off */
 			if (sta_set_he_fragmentation(dut, intf,
 						     HE_FRAG_DISABLE)) {
@@ -11347,6 +11355,8 @@ static void sta_reset_default_wcn(struct sigma_dut *dut, const char *intf,
 
 			/* Disable VHT support in 2.4 GHz for testbed */
 			sta_set_2g_vht_supp(dut, intf, 0);
+
+			wcn_wifi_test_config_batch_commit(dut);
 #endif /* NL80211_SUPPORT */
 
 			/* Enable WEP/TKIP with HE capability in testbed */
@@ -12107,98 +12117,100 @@ static void cmd_set_max_he_mcs(struct sigma_dut *dut, const char *intf,
 
 
 struct wait_event {
-	struct sigma_dut *dut;
 	int cmd;
 	unsigned int twt_op;
 };
 
 #ifdef NL80211_SUPPORT
 
-static int twt_event_handler(struct nl_msg *msg, void *arg)
+/* Vendor data of a TWT event, copied out of the event ring */
+struct twt_event {
+	uint8_t *data;
+	size_t len;
+};
+
+
+/* Called with the nl80211 event lock held; only copies the event data */
+static int twt_event_match(struct sigma_dut *dut,
+			   const struct nl80211_event *ev, void *arg)
 {
-	struct wait_event *wait = arg;
-	struct genlmsghdr *gnlh = nlmsg_data(nlmsg_hdr(msg));
+	struct twt_event *twt = arg;
+	struct genlmsghdr *gnlh = nlmsg_data(ev->msg);
 	struct nlattr *tb[NL80211_ATTR_MAX + 1];
-	uint32_t subcmd;
-	uint8_t *data = NULL;
-	size_t len = 0;
-	struct nlattr *twt_rsp[QCA_WLAN_VENDOR_ATTR_CONFIG_TWT_MAX + 1];
-	struct nlattr *twt_status[QCA_WLAN_VENDOR_ATTR_TWT_SETUP_MAX + 1];
-	int cmd_id;
-	unsigned char val;
 
-	if (!wait)
-		return NL_SKIP;
-
-	if (gnlh->cmd != NL80211_CMD_VENDOR) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
-				"%s: NL cmd is not vendor %d", __func__,
-				gnlh->cmd);
-		return NL_SKIP;
-	}
+	if (ev->cmd != NL80211_CMD_VENDOR || !ev->vendor_id ||
+	    ev->vendor_subcmd != QCA_NL80211_VENDOR_SUBCMD_CONFIG_TWT)
+		return 0;
 
 	nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
 		  genlmsg_attrlen(gnlh, 0), NULL);
 
-	if (!tb[NL80211_ATTR_VENDOR_ID] || !tb[NL80211_ATTR_VENDOR_SUBCMD]) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
-				"%s: vendor ID not found", __func__);
-		return NL_SKIP;
+	twt->data = NULL;
+	twt->len = 0;
+	if (tb[NL80211_ATTR_VENDOR_DATA] &&
+	    nla_len(tb[NL80211_ATTR_VENDOR_DATA]) > 0) {
+		twt->len = nla_len(tb[NL80211_ATTR_VENDOR_DATA]);
+		twt->data = malloc(twt->len);
+		if (twt->data)
+			memcpy(twt->data, nla_data(tb[NL80211_ATTR_VENDOR_DATA]),
+			       twt->len);
+		else
+			twt->len = 0;
 	}
-	subcmd = nla_get_u32(tb[NL80211_ATTR_VENDOR_SUBCMD]);
 
-	if (subcmd != QCA_NL80211_VENDOR_SUBCMD_CONFIG_TWT) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
-				"%s: Not a TWT_cmd %d", __func__, subcmd);
-		return NL_SKIP;
-	}
-	if (tb[NL80211_ATTR_VENDOR_DATA]) {
-		data = nla_data(tb[NL80211_ATTR_VENDOR_DATA]);
-		len = nla_len(tb[NL80211_ATTR_VENDOR_DATA]);
-	} else {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
-				"%s: vendor data not present", __func__);
-		return NL_SKIP;
-	}
-	if (!data || !len) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
+	return 1;
+}
+
+
+/* Returns 1 if the event is the response to wait->twt_op, 0 otherwise */
+static int twt_event_parse(struct sigma_dut *dut, const struct twt_event *twt,
+			   struct wait_event *wait)
+{
+	struct nlattr *twt_rsp[QCA_WLAN_VENDOR_ATTR_CONFIG_TWT_MAX + 1];
+	struct nlattr *twt_status[QCA_WLAN_VENDOR_ATTR_TWT_SETUP_MAX + 1];
+	int cmd_id;
+	unsigned char val;
+
+	if (!twt->data || !twt->len) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"Invalid vendor data or len");
-		return NL_SKIP;
+		return 0;
 	}
-	sigma_dut_print(wait->dut, DUT_MSG_DEBUG,
-			"event data len %ld", len);
-	hex_dump(wait->dut, data, len);
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"event data len %ld", twt->len);
+	hex_dump(dut, twt->data, twt->len);
 	if (nla_parse(twt_rsp, QCA_WLAN_VENDOR_ATTR_CONFIG_TWT_MAX,
-		      (struct nlattr *) data, len, NULL)) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
+		      (struct nlattr *) twt->data, twt->len, NULL) ||
+	    !twt_rsp[QCA_WLAN_VENDOR_ATTR_CONFIG_TWT_OPERATION]) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"vendor data parse error");
-		return NL_SKIP;
+		return 0;
 	}
 
 	val = nla_get_u8(twt_rsp[QCA_WLAN_VENDOR_ATTR_CONFIG_TWT_OPERATION]);
 	if (val != wait->twt_op) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
+		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"Invalid TWT operation, expected %d, rcvd %d",
 				wait->twt_op, val);
-		return NL_SKIP;
+		return 0;
 	}
 	if (nla_parse_nested(twt_status, QCA_WLAN_VENDOR_ATTR_TWT_SETUP_MAX,
 			     twt_rsp[QCA_WLAN_VENDOR_ATTR_CONFIG_TWT_PARAMS],
 			     NULL)) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
+		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"nla_parse failed for TWT event");
-		return NL_SKIP;
+		return 0;
 	}
 
 	cmd_id = QCA_WLAN_VENDOR_ATTR_TWT_SETUP_STATUS;
 	if (!twt_status[cmd_id]) {
-		sigma_dut_print(wait->dut, DUT_MSG_ERROR,
+		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"%s TWT resp status missing", __func__);
 		wait->cmd = -1;
 	} else {
 		val = nla_get_u8(twt_status[cmd_id]);
 		if (val != QCA_WLAN_VENDOR_TWT_STATUS_OK) {
-			sigma_dut_print(wait->dut, DUT_MSG_ERROR,
+			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"%s TWT resp status %d", __func__, val);
 			wait->cmd = -1;
 		} else {
@@ -12206,99 +12218,70 @@ static int twt_event_handler(struct nl_msg *msg, void *arg)
 		}
 	}
 
-	return NL_SKIP;
+	return 1;
 }
 
 
-static int wait_on_nl_socket(struct nl_sock *sock, struct sigma_dut *dut,
-			     unsigned int timeout)
+/*
+ * Take the event position before sending a TWT command so that its response
+ * is found even if it arrives before twt_async_event_wait() is reached.
+ */
+static unsigned long long twt_event_seq(struct sigma_dut *dut)
 {
-	fd_set read_fd_set;
-	int retval;
-	int sock_fd;
-	struct timeval time_out;
-
-	time_out.tv_sec = timeout;
-	time_out.tv_usec = 0;
-
-	FD_ZERO(&read_fd_set);
-
-	if (!sock)
-		return -1;
-
-	sock_fd = nl_socket_get_fd(sock);
-	FD_SET(sock_fd, &read_fd_set);
-
-	retval = select(sock_fd + 1, &read_fd_set, NULL, NULL, &time_out);
-
-	if (retval == 0)
+	if (dut->sta_async_twt_supp && nl80211_open_event_sock(dut))
 		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"%s: TWT event response timedout", __func__);
-
-	if (retval < 0)
-		sigma_dut_print(dut, DUT_MSG_ERROR, "%s:no NL msgs, ret=%d",
-				__func__, retval);
-
-	return retval;
+				"Failed to open nl80211 event socket");
+	return nl80211_event_seq(dut);
 }
 
 
 #define TWT_ASYNC_EVENT_WAIT_TIME_SEC   6
 
-static int twt_async_event_wait(struct sigma_dut *dut, unsigned int twt_op)
+static int twt_async_event_wait(struct sigma_dut *dut, unsigned int twt_op,
+				unsigned long long seq)
 {
-	struct nl_cb *cb = NULL;
-	int err_code = 0, select_retval = 0;
 	struct wait_event wait_info;
-
-	if (!dut->nl_ctx->event_sock && nl80211_open_event_sock(dut))
-		return -1;
-
-	cb = nl_socket_get_cb(dut->nl_ctx->event_sock);
-	if (!cb) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"event callback not found");
-		return ERROR_SEND_STATUS;
-	}
+	struct twt_event twt;
+	struct timespec now;
+	long long left_ms, deadline_ms;
+	int res, found = 0;
 
 	wait_info.cmd = 0;
-	wait_info.dut = dut;
 	wait_info.twt_op = twt_op;
 
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, twt_event_handler, &wait_info);
-
-	while (!wait_info.cmd) {
-		select_retval = wait_on_nl_socket(
-			dut->nl_ctx->event_sock, dut,
-			TWT_ASYNC_EVENT_WAIT_TIME_SEC);
-
-		if (select_retval > 0) {
-			err_code = nl_recvmsgs(dut->nl_ctx->event_sock, cb);
-			if (err_code < 0) {
-				sigma_dut_print(dut, DUT_MSG_ERROR,
-						"%s: nl rcv failed, err_code %d",
-						__func__, err_code);
-				break;
-			}
-		} else {
-			sigma_dut_print(dut, DUT_MSG_ERROR,
-					"%s: wait on socket failed %d",
-					__func__, select_retval);
-			err_code = 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	deadline_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000 +
+		TWT_ASYNC_EVENT_WAIT_TIME_SEC * 1000;
+
+	/* Events of other TWT operations are skipped until the deadline */
+	while (!found) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		left_ms = deadline_ms - (now.tv_sec * 1000LL +
+					 now.tv_nsec / 1000000);
+		if (left_ms <= 0) {
+			res = 0;
 			break;
 		}
-
+		res = nl80211_event_wait(dut, &seq, twt_event_match, &twt,
+					 left_ms);
+		if (res <= 0)
+			break;
+		found = twt_event_parse(dut, &twt, &wait_info);
+		free(twt.data);
 	}
-	nl_cb_put(cb);
-
-	if (wait_info.cmd < 0)
-		err_code = 1;
+	if (res < 0) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"%s: nl80211 event socket not open", __func__);
+		return -1;
+	}
+	if (!found)
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"%s: TWT event response timedout", __func__);
 
-	sigma_dut_print(dut, DUT_MSG_DEBUG,
-			"%s: rcvd cmd %d, err_code %d, s_ret %d",
-			__func__, wait_info.cmd, err_code, select_retval);
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "%s: rcvd cmd %d",
+			__func__, wait_info.cmd);
 
-	return err_code;
+	return wait_info.cmd > 0 ? 0 : 1;
 }
 
 #endif /* NL80211_SUPPORT */
@@ -12308,6 +12291,7 @@ static int sta_twt_send_suspend(struct sigma_dut *dut, struct sigma_conn *conn,
 				struct sigma_cmd *cmd)
 {
 #ifdef NL80211_SUPPORT
+	unsigned long long ev_seq;
 	struct nlattr *attr, *attr1;
 	struct nl_msg *msg;
 	int ifindex, ret;
@@ -12341,6 +12325,7 @@ static int sta_twt_send_suspend(struct sigma_dut *dut, struct sigma_conn *conn,
 	nla_nest_end(msg, attr1);
 	nla_nest_end(msg, attr);
 
+	ev_seq = twt_event_seq(dut);
 	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
 	if (ret) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -12352,7 +12337,7 @@ static int sta_twt_send_suspend(struct sigma_dut *dut, struct sigma_conn *conn,
 	if (!dut->sta_async_twt_supp)
 		return ret;
 
-	return twt_async_event_wait(dut, QCA_WLAN_TWT_SUSPEND);
+	return twt_async_event_wait(dut, QCA_WLAN_TWT_SUSPEND, ev_seq);
 #else /* NL80211_SUPPORT */
 	sigma_dut_print(dut, DUT_MSG_ERROR,
 			"TWT suspend cannot be done without NL80211_SUPPORT defined");
@@ -12367,6 +12352,7 @@ static int sta_twt_send_nudge(struct sigma_dut *dut, struct sigma_conn *conn,
 			      int start_sp_offset)
 {
 #ifdef NL80211_SUPPORT
+	unsigned long long ev_seq;
 	struct nlattr *attr, *attr1;
 	struct nl_msg *msg;
 	int ifindex, ret;
@@ -12411,6 +12397,7 @@ static int sta_twt_send_nudge(struct sigma_dut *dut, struct sigma_conn *conn,
 	nla_nest_end(msg, attr1);
 	nla_nest_end(msg, attr);
 
+	ev_seq = twt_event_seq(dut);
 	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
 	if (ret) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -12422,7 +12409,7 @@ static int sta_twt_send_nudge(struct sigma_dut *dut, struct sigma_conn *conn,
 	if (!dut->sta_async_twt_supp)
 		return ret;
 
-	return twt_async_event_wait(dut, QCA_WLAN_TWT_NUDGE);
+	return twt_async_event_wait(dut, QCA_WLAN_TWT_NUDGE, ev_seq);
 #else /* NL80211_SUPPORT */
 	sigma_dut_print(dut, DUT_MSG_ERROR,
 			"TWT suspend cannot be done without NL80211_SUPPORT defined");
@@ -12462,6 +12449,7 @@ static int sta_twt_resume(struct sigma_dut *dut, struct sigma_conn *conn,
 			  struct sigma_cmd *cmd)
 {
 #ifdef NL80211_SUPPORT
+	unsigned long long ev_seq;
 	struct nlattr *attr, *attr1;
 	struct nl_msg *msg;
 	int ifindex, ret;
@@ -12509,6 +12497,7 @@ static int sta_twt_resume(struct sigma_dut *dut, struct sigma_conn *conn,
 	nla_nest_end(msg, attr1);
 	nla_nest_end(msg, attr);
 
+	ev_seq = twt_event_seq(dut);
 	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
 	if (ret) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -12520,7 +12509,7 @@ static int sta_twt_resume(struct sigma_dut *dut, struct sigma_conn *conn,
 	if (!dut->sta_async_twt_supp)
 		return ret;
 
-	return twt_async_event_wait(dut, QCA_WLAN_TWT_RESUME);
+	return twt_async_event_wait(dut, QCA_WLAN_TWT_RESUME, ev_seq);
 #else /* NL80211_SUPPORT */
 	sigma_dut_print(dut, DUT_MSG_ERROR,
 			"TWT resume cannot be done without NL80211_SUPPORT defined");
@@ -12538,6 +12527,7 @@ int sta_twt_request(struct sigma_dut *dut, struct sigma_conn *conn,
 		    struct sigma_cmd *cmd)
 {
 #ifdef NL80211_SUPPORT
+	unsigned long long ev_seq;
 	struct nlattr *params;
 	struct nlattr *attr;
 	struct nl_msg *msg;
@@ -12770,6 +12760,7 @@ send_command:
 	nla_nest_end(msg, params);
 	nla_nest_end(msg, attr);
 
+	ev_seq = twt_event_seq(dut);
 	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
 	if (ret) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -12781,7 +12772,7 @@ send_command:
 	if (!dut->sta_async_twt_supp)
 		return ret;
 
-	return twt_async_event_wait(dut, QCA_WLAN_TWT_SET);
+	return twt_async_event_wait(dut, QCA_WLAN_TWT_SET, ev_seq);
 #else /* NL80211_SUPPORT */
 	sigma_dut_print(dut, DUT_MSG_ERROR,
 			"TWT request cannot be done without NL80211_SUPPORT defined");
@@ -12794,6 +12785,7 @@ static int sta_twt_teardown(struct sigma_dut *dut, struct sigma_conn *conn,
 			    struct sigma_cmd *cmd)
 {
  #ifdef NL80211_SUPPORT
+	unsigned long long ev_seq;
 	struct nlattr *params;
 	struct nlattr *attr;
 	int ifindex, ret;
@@ -12852,6 +12844,7 @@ static int sta_twt_teardown(struct sigma_dut *dut, struct sigma_conn *conn,
 	nla_nest_end(msg, params);
 	nla_nest_end(msg, attr);
 
+	ev_seq = twt_event_seq(dut);
 	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
 	if (ret) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -12863,7 +12856,7 @@ static int sta_twt_teardown(struct sigma_dut *dut, struct sigma_conn *conn,
 	if (!dut->sta_async_twt_supp)
 		return ret;
 
-	return twt_async_event_wait(dut, QCA_WLAN_TWT_TERMINATE);
+	return twt_async_event_wait(dut, QCA_WLAN_TWT_TERMINATE, ev_seq);
 #else /* NL80211_SUPPORT */
 	sigma_dut_print(dut, DUT_MSG_ERROR,
 			"TWT teardown cannot be done without NL80211_SUPPORT defined");
@@ -14533,46 +14526,6 @@ int inject_eth_frame(int s, const void *data, size_t len,
 
 #if defined(__linux__) || defined(__QNXNTO__)
 
-int inject_frame(int s, const void *data, size_t len, int encrypt)
-{
-#define	IEEE80211_RADIOTAP_F_WEP	0x04
-#define	IEEE80211_RADIOTAP_F_FRAG	0x08
-	unsigned char rtap_hdr[] = {
-		0x00, 0x00, /* radiotap version */
-		0x0e, 0x00, /* radiotap length */
-		0x02, 0xc0, 0x00, 0x00, /* bmap: flags, tx and rx flags */
-		IEEE80211_RADIOTAP_F_FRAG, /* F_FRAG (fragment if required) */
-		0x00,       /* padding */
-		0x00, 0x00, /* RX and TX flags to indicate that */
-		0x00, 0x00, /* this is the injected frame directly */
-	};
-	struct iovec iov[2] = {
-		{
-			.iov_base = &rtap_hdr,
-			.iov_len = sizeof(rtap_hdr),
-		},
-		{
-			.iov_base = (void *) data,
-			.iov_len = len,
-		}
-	};
-	struct msghdr msg = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = iov,
-		.msg_iovlen = 2,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
-	};
-
-	if (encrypt)
-		rtap_hdr[8] |= IEEE80211_RADIOTAP_F_WEP;
-
-	return sendmsg(s, &msg, 0);
-}
-
-
 int open_monitor(const char *ifname)
 {
 #ifdef __QNXNTO__
@@ -14702,11 +14655,11 @@ enum send_frame_protection {
 static int sta_inject_frame(struct sigma_dut *dut, struct sigma_conn *conn,
 			    const char *intf, enum send_frame_type frame,
 			    enum send_frame_protection protected,
-			    const char *dest, int use_monitor)
+			    const char *dest, const struct inject_params *inject)
 {
 #ifdef __linux__
 	unsigned char buf[1000], *pos;
-	int s, res;
+	int res;
 	char bssid[20], addr[20];
 	char result[32], ssid[100];
 	size_t ssid_len;
@@ -14972,29 +14925,33 @@ static int sta_inject_frame(struct sigma_dut *dut, struct sigma_conn *conn,
 		}
 	}
 
-	if (use_monitor) {
-		s = open_monitor("sigmadut");
-		if (s < 0) {
-			send_resp(dut, conn, SIGMA_ERROR,
-				  "errorCode,Failed to open monitor socket");
-			return 0;
-		}
+	if (inject) {
+		struct inject_params params = *inject;
+		unsigned int acked;
 
-		res = inject_frame(s, buf, pos - buf, protected == CORRECT_KEY);
+		params.encrypt = protected == CORRECT_KEY;
+		res = inject_frames(dut, &params, buf, pos - buf);
 		if (res < 0) {
 			send_resp(dut, conn, SIGMA_ERROR,
 				  "errorCode,Failed to inject frame");
-			close(s);
 			return 0;
 		}
-		if (res < pos - buf) {
-			send_resp(dut, conn, SIGMA_ERROR,
-				  "errorCode,Only partial frame sent");
-			close(s);
+		if (res < params.count) {
+			char resp[60];
+
+			snprintf(resp, sizeof(resp),
+				 "errorCode,Only %d of %d frames sent",
+				 res, params.count);
+			send_resp(dut, conn, SIGMA_ERROR, resp);
 			return 0;
 		}
 
-		close(s);
+		res = inject_tx_status(dut, INJECT_TX_STATUS_TIMEOUT_MS,
+				       &acked);
+		if (res > 0)
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"Injected %d frame(s): %d with TX status, %u acknowledged",
+					params.count, res, acked);
 	} else {
 #ifdef NL80211_SUPPORT
 		int freq;
@@ -15395,27 +15352,19 @@ static int cmd_sta_send_frame_hs2_dls_req(struct sigma_dut *dut,
 					  struct sigma_cmd *cmd,
 					  const char *intf, const char *dest)
 {
-	char buf[100];
+	struct inject_params params;
 
-	if (if_nametoindex("sigmadut") == 0) {
-		snprintf(buf, sizeof(buf),
-			 "iw dev %s interface add sigmadut type monitor",
-			 get_station_ifname(dut));
-		if (system(buf) != 0 ||
-		    if_nametoindex("sigmadut") == 0) {
-			sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to add "
-					"monitor interface with '%s'", buf);
-			return -2;
-		}
+	if (inject_params_parse(cmd, &params) < 0) {
+		send_resp(dut, conn, SIGMA_ERROR,
+			  "errorCode,Invalid frame injection parameters");
+		return 0;
 	}
 
-	if (system("ifconfig sigmadut up") != 0) {
-		sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to set "
-				"monitor interface up");
+	if (inject_open(dut, get_station_ifname(dut)) < 0)
 		return -2;
-	}
 
-	return sta_inject_frame(dut, conn, intf, DLS_REQ, UNPROTECTED, dest, 1);
+	return sta_inject_frame(dut, conn, intf, DLS_REQ, UNPROTECTED, dest,
+				&params);
 }
 
 
@@ -16182,12 +16131,12 @@ static enum sigma_cmd_result cmd_sta_send_frame_wpa3(struct sigma_dut *dut,
 		}
 
 		return sta_inject_frame(dut, conn, intf, SAQUERY, CORRECT_KEY,
-					NULL, 0);
+					NULL, NULL);
 	}
 
 	if (strcasecmp(val, "reassocreq") == 0)
 		return sta_inject_frame(dut, conn, intf, REASSOCREQ,
-					CORRECT_KEY, NULL, 0);
+					CORRECT_KEY, NULL, NULL);
 
 	if (strcasecmp(val, "ANQPQuery") == 0) {
 		char buf[50];
@@ -17950,6 +17899,7 @@ enum sigma_cmd_result cmd_sta_send_frame(struct sigma_dut *dut,
 	enum send_frame_protection protected;
 	char buf[100];
 	unsigned char addr[ETH_ALEN];
+	struct inject_params params;
 	int res;
 
 	if (!intf)
@@ -18123,25 +18073,17 @@ enum sigma_cmd_result cmd_sta_send_frame(struct sigma_dut *dut,
 		return 0;
 	}
 
-	if (if_nametoindex("sigmadut") == 0) {
-		snprintf(buf, sizeof(buf),
-			 "iw dev %s interface add sigmadut type monitor",
-			 get_station_ifname(dut));
-		if (system(buf) != 0 ||
-		    if_nametoindex("sigmadut") == 0) {
-			sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to add "
-					"monitor interface with '%s'", buf);
-			return -2;
-		}
+	if (inject_params_parse(cmd, &params) < 0) {
+		send_resp(dut, conn, SIGMA_ERROR,
+			  "errorCode,Invalid frame injection parameters");
+		return 0;
 	}
 
-	if (system("ifconfig sigmadut up") != 0) {
-		sigma_dut_print(dut, DUT_MSG_ERROR, "Failed to set "
-				"monitor interface up");
+	if (inject_open(dut, get_station_ifname(dut)) < 0)
 		return -2;
-	}
 
-	return sta_inject_frame(dut, conn, intf, frame, protected, NULL, 1);
+	return sta_inject_frame(dut, conn, intf, frame, protected, NULL,
+				&params);
 }
 
 
@@ -21717,10 +21659,12 @@ void sta_register_cmds(void)
 	sigma_dut_reg_cmd("sta_get_info", req_intf, cmd_sta_get_info);
 	sigma_dut_reg_cmd("sta_get_mac_address", req_intf,
 			  cmd_sta_get_mac_address);
-	sigma_dut_reg_cmd("sta_is_connected", req_intf, cmd_sta_is_connected);
+	sigma_dut_reg_cmd_flags("sta_is_connected", req_intf,
+				cmd_sta_is_connected, SIGMA_CMD_ASYNC);
 	sigma_dut_reg_cmd("sta_verify_ip_connection", req_intf,
 			  cmd_sta_verify_ip_connection);
-	sigma_dut_reg_cmd("sta_get_bssid", req_intf, cmd_sta_get_bssid);
+	sigma_dut_reg_cmd_flags("sta_get_bssid", req_intf, cmd_sta_get_bssid,
+				SIGMA_CMD_ASYNC);
 	sigma_dut_reg_cmd("sta_set_encryption", req_intf,
 			  cmd_sta_set_encryption);
 	sigma_dut_reg_cmd("sta_set_psk", req_intf, cmd_sta_set_psk);
@@ -44,6 +44,7 @@ static enum sigma_cmd_result cmd_traffic_send_ping(struct sigma_dut *dut,
 	struct in6_addr ip6_addr;
 	bool broadcast = false;
 	const char *iface;
+	struct ping_params params;
 
 	val = get_param(cmd, "Type");
 	if (!val)
@@ -129,6 +130,22 @@ static enum sigma_cmd_result cmd_traffic_send_ping(struct sigma_dut *dut,
 	}
 
 	id = dut->next_streamid++;
+
+	memset(&params, 0, sizeof(params));
+	params.ipv6 = type == 2;
+	params.dst = dst;
+	params.ifname = !dut->ndp_enable && type == 2 ? iface : NULL;
+	params.size = size;
+	params.rate = rate;
+	params.count = pkts;
+	params.tos = use_dscp ? dscp << 2 : -1;
+	params.broadcast = broadcast;
+	if (ping_native_start(dut, id, &params) == 0) {
+		snprintf(resp, sizeof(resp), "streamID,%d", id);
+		send_resp(dut, conn, SIGMA_COMPLETE, resp);
+		return STATUS_SENT;
+	}
+
 	snprintf(buf, sizeof(buf), "%s/sigma_dut-ping.%d",
 		 dut->sigma_tmpdir, id);
 	unlink(buf);
@@ -196,12 +213,18 @@ static enum sigma_cmd_result cmd_traffic_stop_ping(struct sigma_dut *dut,
 	FILE *f;
 	char buf[100];
 	int res_found = 0, sent = 0, received = 0;
+	char resp[200];
 
 	val = get_param(cmd, "streamID");
 	if (val == NULL)
 		return INVALID_SEND_STATUS;
 	id = atoi(val);
 
+	if (ping_native_stop(dut, id, resp, sizeof(resp)) == 0) {
+		send_resp(dut, conn, SIGMA_COMPLETE, resp);
+		return STATUS_SENT;
+	}
+
 	snprintf(buf, sizeof(buf), "%s/sigma_dut-ping-pid.%d",
 		 dut->sigma_tmpdir, id);
 	f = fopen(buf, "r");
@@ -429,12 +452,16 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 	FILE *f;
 	int server, ipv6 = 0;
 	char *pos;
-	int dscp, reverse = 0, rate;
-	char tos[20], client_port_str[100], bitrate[30], burst_size_str[50];
+	int dscp, tos_val = -1, reverse = 0, parallel = 1, burst_size = 0;
+	long long rate;
+	bool rate_set = false;
+	char tos[20], client_port_str[100], bitrate[30], burst_size_str[60];
+	char parallel_str[20];
 	struct hostent *host_addr;
 	char ip_addr[INET6_ADDRSTRLEN];
 	bool iperf_v2 = false;
 	char iperf_result_file[50], iperf_pid_file[50], latency_str[50];
+	const char *lower_ci = "95", *upper_ci = "99.9";
 	int res;
 	char iperf_cmd[300];
 
@@ -482,10 +509,11 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 			return ERROR_SEND_STATUS;
 
 		rate = atoi(val);
+		rate_set = true;
 		len = strlen(val);
 		rate_factor = len > 0 ? val[len - 1] : 0;
 		if (rate_factor == 'G')
-			rate *= 1024 * 1024 * 1024;
+			rate *= 1024LL * 1024 * 1024;
 		else if (rate_factor == 'M')
 			rate *= 1024 * 1024;
 		else if (rate_factor == 'K')
@@ -502,10 +530,11 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 	if (val && atoi(val) > 0) {
 		int fps, ret;
 
-		fps = rate / (atoi(val) * 8);
+		burst_size = atoi(val);
+		fps = rate / (burst_size * 8);
 		/* Use --isochronous to allow lower burst size. */
 		ret = snprintf(burst_size_str, sizeof(burst_size_str),
-			       " --isochronous=%d:%d,0 -w 2M", fps, rate);
+			       " --isochronous=%d:%lld,0 -w 2M", fps, rate);
 		if (ret < 0 || ret >= sizeof(burst_size_str))
 			return ERROR_SEND_STATUS;
 
@@ -586,6 +615,14 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 	if (val)
 		reverse = atoi(val);
 
+	parallel_str[0] = '\0';
+	val = get_param(cmd, "parallel");
+	if (val && atoi(val) > 1) {
+		parallel = atoi(val);
+		snprintf(parallel_str, sizeof(parallel_str), " -P %d",
+			 parallel);
+	}
+
 	latency_str[0] = '\0';
 	val = get_param(cmd, "latency");
 	if (!iperf_v2 && val) {
@@ -594,13 +631,13 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 		return STATUS_SENT_ERROR;
 	}
 	if (val && atoi(val)) {
-		const char *lower_ci, *upper_ci;
-
 		val = get_param(cmd, "LowerCI");
-		lower_ci = val ? val : "95";
+		if (val)
+			lower_ci = val;
 
 		val = get_param(cmd, "UpperCI");
-		upper_ci = val ? val : "99.9";
+		if (val)
+			upper_ci = val;
 
 		if (server)
 			res = snprintf(latency_str, sizeof(latency_str),
@@ -622,14 +659,52 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 				  "ErrorCode,Invalid DSCP value");
 			return STATUS_SENT_ERROR;
 		}
-		snprintf(tos, sizeof(tos), " -S 0x%02x", dscp << 2);
+		tos_val = dscp << 2;
+		snprintf(tos, sizeof(tos), " -S 0x%02x", tos_val);
 	}
 	if (domain_name) {
 		dscp = get_dscp_from_policy_table(dut, ipv6 ? IPV6 : IPV4,
 						  domain_name, src_ip, dst_port,
 						  src_port);
-		if (dscp != -1)
-			snprintf(tos, sizeof(tos), " -S 0x%02x", dscp << 2);
+		if (dscp != -1) {
+			tos_val = dscp << 2;
+			snprintf(tos, sizeof(tos), " -S 0x%02x", tos_val);
+		}
+	}
+
+	if (dut->iperf_native ||
+	    !iperf_binary_available(iperf_v2 ? "iperf" : "iperf3")) {
+		struct iperf_params params;
+
+		memset(&params, 0, sizeof(params));
+		params.server = server;
+		val = get_param(cmd, "transproto");
+		params.udp = val && strcasecmp(val, "udp") == 0;
+		/* Without transproto a server accepts both TCP and UDP */
+		params.tcp = !params.udp;
+		if (server && !val)
+			params.udp = true;
+		params.ipv6 = ipv6;
+		params.reverse = reverse;
+		params.latency = latency_str[0] != '\0';
+		params.lower_ci = atof(lower_ci);
+		params.upper_ci = atof(upper_ci);
+		params.dst = dst;
+		params.ifname = ifname;
+		params.port = dst_port ? dst_port : (iperf_v2 ? 5001 : 5201);
+		params.src_ip = src_ip[0] ? src_ip : NULL;
+		params.src_port = src_port;
+		params.duration = duration;
+		params.rate = rate_set || burst_size ? rate : 0;
+		params.burst_size = burst_size;
+		params.tos = tos_val;
+		params.parallel = parallel;
+
+		if (iperf_native_start(dut, &params, buf, sizeof(buf)) < 0) {
+			send_resp(dut, conn, SIGMA_ERROR, buf);
+			return STATUS_SENT;
+		}
+		return SUCCESS_SEND_STATUS;
 	}
 
 	res = snprintf(iperf_result_file, sizeof(iperf_result_file),
@@ -686,11 +761,12 @@ static enum sigma_cmd_result cmd_traffic_start_iperf(struct sigma_dut *dut,
 			snprintf(buf, sizeof(buf), "%s", dst);
 
 		res = snprintf(iperf_cmd, sizeof(iperf_cmd),
-			"iperf%s -c %s -t %d %s %s%s %s%s%s%s%s -i 1 %s > %s%s &\n",
+			"iperf%s -c %s -t %d %s %s%s %s%s%s%s%s%s -i 1 %s > %s%s &\n",
 			iperf_v2 ? "" : "3",
 			buf, duration, iptype, proto, bitrate, port_str,
 			client_port_str, tos, reverse ? " -R" : "",
-			burst_size_str, latency_str, dut->sigma_tmpdir,
+			parallel_str, burst_size_str, latency_str,
+			dut->sigma_tmpdir,
 			iperf_result_file);
 	}
 	if (res < 0 || res >= sizeof(iperf_cmd))
@@ -741,6 +817,7 @@ static enum sigma_cmd_result cmd_traffic_stop_iperf(struct sigma_dut *dut,
 	int pid;
 	FILE *f;
 	char buf[1024], summary_buf[1024], iperf[100], histogram_buf[1024];
+	char native_buf[4096];
 	float bandwidth, totalbytes, factor;
 	char *pos;
 	long l_bandwidth, l_totalbytes;
@@ -757,6 +834,12 @@ static enum sigma_cmd_result cmd_traffic_stop_iperf(struct sigma_dut *dut,
 	server = val && strcasecmp(val, "server") == 0;
 
 	val = get_param(cmd, "port");
+	if (iperf_native_stop(dut, server, val ? atoi(val) : 0, native_buf,
+			      sizeof(native_buf)) == 0) {
+		send_resp(dut, conn, SIGMA_COMPLETE, native_buf);
+		return STATUS_SENT;
+	}
+
 	if (val) {
 		int dst_port;
 
@@ -8,6 +8,20 @@
  */
 
 #include "sigma_dut.h"
+#include <fcntl.h>
+#include <ifaddrs.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#ifdef __linux__
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif /* __linux__ */
 #include "wpa_helpers.h"
 
 #define TG_MAX_CLIENTS_CONNECTIONS 1
@@ -17,6 +31,195 @@
 #define WFA_SEND_FIX_BITRATE_MAX             100 * 1024 * 1024
 
 
+static unsigned int latency_bucket(unsigned int usec)
+{
+	int msb;
+
+	if (usec < (1U << SIGMA_LAT_SUB_BITS))
+		return usec;
+	msb = 31 - __builtin_clz(usec);
+	return ((msb - SIGMA_LAT_SUB_BITS + 1) << SIGMA_LAT_SUB_BITS) +
+		((usec >> (msb - SIGMA_LAT_SUB_BITS)) &
+		 ((1U << SIGMA_LAT_SUB_BITS) - 1));
+}
+
+
+/* Midpoint of the latency range covered by a bucket */
+static unsigned int latency_bucket_value(unsigned int idx)
+{
+	unsigned int octave = idx >> SIGMA_LAT_SUB_BITS;
+	unsigned int sub = idx & ((1U << SIGMA_LAT_SUB_BITS) - 1);
+	unsigned long long low;
+
+	if (octave == 0)
+		return sub;
+	low = (unsigned long long) ((1U << SIGMA_LAT_SUB_BITS) + sub) <<
+		(octave - 1);
+	return low + ((1ULL << (octave - 1)) - 1) / 2;
+}
+
+
+static unsigned int latency_percentile(const struct sigma_latency_hist *h,
+				       unsigned int permille)
+{
+	unsigned long long target, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+	/* The maximum is tracked exactly, not only as a bucket */
+	if (permille >= 1000)
+		return h->max_usec;
+	target = (h->count * permille + 999) / 1000;
+	for (i = 0; i < SIGMA_LAT_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= target)
+			break;
+	}
+	if (i == SIGMA_LAT_BUCKETS)
+		return h->max_usec;
+	return latency_bucket_value(i) < h->max_usec ?
+		latency_bucket_value(i) : h->max_usec;
+}
+
+
+/* Append a full chunk of frame records to the stream's spill file */
+static int spill_frame_stats(struct sigma_dut *dut, struct sigma_stream *s)
+{
+	size_t len = s->num_stats * sizeof(struct sigma_frame_stats);
+	const char *pos = (const char *) s->stats;
+	ssize_t res;
+
+	if (!s->stats_file[0]) {
+		snprintf(s->stats_file, sizeof(s->stats_file),
+			 "%s/e2e-stream%u.bin", dut->sigma_tmpdir,
+			 s->stream_id);
+		s->stats_fd = open(s->stats_file,
+				   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+				   0600);
+		if (s->stats_fd < 0) {
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"Could not create %s: %s",
+					s->stats_file, strerror(errno));
+			s->stats_file[0] = '\0';
+			return -1;
+		}
+	}
+
+	while (len > 0) {
+		res = write(s->stats_fd, pos, len);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"Could not write %s: %s",
+					s->stats_file, strerror(errno));
+			return -1;
+		}
+		pos += res;
+		len -= res;
+	}
+
+	s->num_stats_spilled += s->num_stats;
+	s->num_stats = 0;
+	return 0;
+}
+
+
+/* Record the arrival of a timestamped frame; pkt holds at least 20 octets */
+static void record_frame(struct sigma_stream *s, const u8 *pkt,
+			 unsigned int local_sec, unsigned int local_usec)
+{
+	struct sigma_frame_stats *stats;
+	unsigned int remote_sec = WPA_GET_BE32(&pkt[12]);
+	unsigned int remote_usec = WPA_GET_BE32(&pkt[16]);
+
+	if (s->latency) {
+		struct sigma_latency_hist *h = s->latency;
+		long long diff;
+
+		diff = ((long long) local_sec - remote_sec) * 1000000 +
+			((long long) local_usec - remote_usec);
+		if (diff < 0) {
+			h->negative++;
+			diff = 0;
+		} else if (diff > UINT_MAX) {
+			diff = UINT_MAX;
+		}
+		h->count++;
+		h->buckets[latency_bucket(diff)]++;
+		if (diff > h->max_usec)
+			h->max_usec = diff;
+	}
+
+	if (s->num_stats == MAX_SIGMA_STATS) {
+		/* Without e2e files the records are not needed past the
+		 * histogram; keep the most recent chunk only */
+		if (!s->dut->write_stats ||
+		    spill_frame_stats(s->dut, s) < 0)
+			s->num_stats = 0;
+	}
+
+	stats = &s->stats[s->num_stats++];
+	stats->seqnum = WPA_GET_BE32(&pkt[8]);
+	stats->local_sec = local_sec;
+	stats->local_usec = local_usec;
+	stats->remote_sec = remote_sec;
+	stats->remote_usec = remote_usec;
+}
+
+
+static void free_frame_stats(struct sigma_stream *s)
+{
+	if (s->stats_file[0]) {
+		close(s->stats_fd);
+		unlink(s->stats_file);
+		s->stats_file[0] = '\0';
+	}
+	free(s->stats);
+	s->stats = NULL;
+	s->num_stats = 0;
+	s->num_stats_spilled = 0;
+	free(s->latency);
+	s->latency = NULL;
+}
+
+
+/*
+ * Return the entry for the next stream ID, growing the table as needed. The
+ * entry only becomes visible to get_stream() once num_streams is incremented,
+ * so a configuration that fails validation leaves it for the next attempt.
+ */
+static struct sigma_stream * alloc_stream(struct sigma_dut *dut)
+{
+	struct sigma_stream **streams;
+	void *ptr;
+	int size;
+
+	if (dut->num_streams == dut->streams_alloc) {
+		size = dut->streams_alloc ? dut->streams_alloc * 2 : 16;
+		streams = realloc(dut->streams, size * sizeof(*streams));
+		if (!streams)
+			return NULL;
+		memset(&streams[dut->streams_alloc], 0,
+		       (size - dut->streams_alloc) * sizeof(*streams));
+		dut->streams = streams;
+		dut->streams_alloc = size;
+	}
+
+	if (!dut->streams[dut->num_streams]) {
+		/* Stream threads hold pointers, so entries are never moved */
+		if (posix_memalign(&ptr, __alignof__(struct sigma_stream),
+				   sizeof(struct sigma_stream)) != 0)
+			return NULL;
+		memset(ptr, 0, sizeof(struct sigma_stream));
+		dut->streams[dut->num_streams] = ptr;
+	}
+
+	return dut->streams[dut->num_streams];
+}
+
+
 static enum sigma_cmd_result cmd_traffic_agent_config(struct sigma_dut *dut,
 						      struct sigma_conn *conn,
 						      struct sigma_cmd *cmd)
@@ -31,8 +234,10 @@ static enum sigma_cmd_result cmd_traffic_agent_config(struct sigma_dut *dut,
 		return STATUS_SENT;
 	}
 
-	s = &dut->streams[dut->num_streams];
-	free(s->stats);
+	s = alloc_stream(dut);
+	if (!s)
+		return ERROR_SEND_STATUS;
+	free_frame_stats(s);
 	memset(s, 0, sizeof(*s));
 	s->sock = -1;
 	s->no_timestamps = dut->no_timestamps;
@@ -174,6 +379,26 @@ static enum sigma_cmd_result cmd_traffic_agent_config(struct sigma_dut *dut,
 	if (val)
 		s->burst_periodicity_us = atoi(val);
 
+	val = get_param(cmd, "busyPoll");
+	if (val)
+		s->busy_poll_usec = atoi(val);
+
+	val = get_param(cmd, "rcvBuf");
+	if (val)
+		s->rcvbuf_size = atoi(val);
+
+	val = get_param(cmd, "txTime");
+	if (val)
+		s->use_txtime = atoi(val);
+
+	val = get_param(cmd, "rxTimestamp");
+	if (val) {
+		if (strcasecmp(val, "hw") == 0)
+			s->rx_hw_timestamp = true;
+		else if (strcasecmp(val, "sw") != 0)
+			return INVALID_SEND_STATUS;
+	}
+
 	if (dut->throughput_pktsize && s->frame_rate == 0 && s->sender &&
 	    dut->throughput_pktsize != s->payload_size &&
 	    (s->profile == SIGMA_PROFILE_FILE_TRANSFER ||
@@ -201,8 +426,11 @@ static enum sigma_cmd_result cmd_traffic_agent_config(struct sigma_dut *dut,
 	{
 		s->stats = calloc(MAX_SIGMA_STATS,
 				  sizeof(struct sigma_frame_stats));
-		if (s->stats == NULL)
+		s->latency = calloc(1, sizeof(*s->latency));
+		if (s->stats == NULL || s->latency == NULL) {
+			free_frame_stats(s);
 			return ERROR_SEND_STATUS;
+		}
 	}
 
 	val = get_param(cmd, "dscp");
@@ -219,14 +447,23 @@ static enum sigma_cmd_result cmd_traffic_agent_config(struct sigma_dut *dut,
 }
 
 
+static int ta_engine_add(struct sigma_dut *dut, struct sigma_stream *s);
+static void ta_engine_wait(struct sigma_stream *s);
+static void ta_engine_deinit(struct sigma_dut *dut);
+
+
+static void ta_sock_release(struct sigma_stream *s);
+static void ta_sock_flush(void);
+
+
 static void stop_stream(struct sigma_stream *s)
 {
 	if (s && s->started) {
-		pthread_join(s->thr, NULL);
-		if (s->sock != -1) {
-			close(s->sock);
-			s->sock = -1;
-		}
+		if (s->worker)
+			ta_engine_wait(s);
+		else
+			pthread_join(s->thr, NULL);
+		ta_sock_release(s);
 
 		s->started = 0;
 	}
@@ -239,27 +476,51 @@ static enum sigma_cmd_result cmd_traffic_agent_reset(struct sigma_dut *dut,
 {
 	int i;
 	for (i = 0; i < dut->num_streams; i++) {
-		struct sigma_stream *s = &dut->streams[i];
+		struct sigma_stream *s = dut->streams[i];
 		s->stop = 1;
 		stop_stream(s);
 	}
+	for (i = 0; i < dut->streams_alloc; i++) {
+		if (dut->streams[i])
+			free_frame_stats(dut->streams[i]);
+		free(dut->streams[i]);
+	}
+	free(dut->streams);
+	dut->streams = NULL;
+	dut->streams_alloc = 0;
+	ta_engine_deinit(dut);
+	/* Addressing may change before the next test */
+	ta_sock_flush();
 	dut->num_streams = 0;
-	memset(&dut->streams, 0, sizeof(dut->streams));
+	dut->stream_id_base = dut->stream_id;
 	return SUCCESS_SEND_STATUS;
 }
 
 
-static int get_stream_id(const char *str, int streams[MAX_SIGMA_STREAMS])
+/* Parse a space separated streamID list into an allocated array */
+static int get_stream_id(const char *str, int **streams)
 {
-	int count;
+	const char *pos;
+	int count, max;
+
+	max = 1;
+	for (pos = str; *pos; pos++) {
+		if (*pos == ' ')
+			max++;
+	}
+	if (max > MAX_SIGMA_STREAMS)
+		max = MAX_SIGMA_STREAMS;
+	*streams = calloc(max, sizeof(int));
+	if (*streams == NULL)
+		return -1;
 
 	count = 0;
 	for (;;) {
-		if (count == MAX_SIGMA_STREAMS)
-			return -1;
-		streams[count] = atoi(str);
-		if (streams[count] == 0)
-			return -1;
+		if (count == max)
+			goto fail;
+		(*streams)[count] = atoi(str);
+		if ((*streams)[count] == 0)
+			goto fail;
 		count++;
 		str = strchr(str, ' ');
 		if (str == NULL)
@@ -269,6 +530,10 @@ static int get_stream_id(const char *str, int streams[MAX_SIGMA_STREAMS])
 	}
 
 	return count;
+fail:
+	free(*streams);
+	*streams = NULL;
+	return -1;
 }
 
 
@@ -368,14 +633,13 @@ static int open_socket_multicast(struct sigma_dut *dut, struct sigma_stream *s)
 }
 
 
-static int set_socket_prio(struct sigma_stream *s)
+/* TOS for the stream's traffic class or -1 if the user priority is invalid */
+static int stream_tc_tos(struct sigma_stream *s)
 {
 	int tos = 0x00;
 
-	if (s->tos) {
-		tos = s->tos;
-		goto set_tos;
-	}
+	if (s->tos)
+		return s->tos;
 
 	switch (s->tc) {
 	case SIGMA_TC_VOICE:
@@ -424,7 +688,17 @@ static int set_socket_prio(struct sigma_stream *s)
 		break;
 	}
 
-set_tos:
+	return tos;
+}
+
+
+static int set_socket_prio(struct sigma_stream *s)
+{
+	int tos = stream_tc_tos(s);
+
+	if (tos < 0)
+		return -1;
+
 	if (setsockopt(s->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
 		perror("setsockopt");
 		return -1;
@@ -434,10 +708,285 @@ set_tos:
 }
 
 
+/*
+ * Idle UDP sockets kept open between traffic_agent_send cycles until
+ * traffic_agent_reset, so that restarting a stream with the same addressing
+ * skips socket(), bind(), connect() and setsockopt(). All of these sockets
+ * are connected, so a parked socket never receives traffic meant for
+ * another socket bound to the same port. connect() also fixed the source
+ * address, so the key includes the source address and interface that a new
+ * socket would get now. TCP sockets cannot be reused and multicast receivers
+ * carry group membership, so neither is cached.
+ */
+#define TA_SOCK_CACHE_SIZE 32
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif /* UDP_SEGMENT */
+
+struct ta_sock_key {
+	int sender;
+	struct in_addr peer;
+	int local_port;
+	int peer_port;
+	struct in_addr local;
+	int ifindex; /* interface that has the local address */
+};
+
+struct ta_cached_sock {
+	struct ta_sock_key key;
+	int sock;
+	int tos;
+	unsigned int last_used;
+};
+
+static struct ta_cached_sock ta_sock_cache[TA_SOCK_CACHE_SIZE];
+static int ta_sock_cache_num;
+static unsigned int ta_sock_cache_clock;
+static pthread_mutex_t ta_sock_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* TOS that open_socket() sets for the stream, -1 if it would fail */
+static int stream_tos(struct sigma_stream *s)
+{
+	switch (s->profile) {
+	case SIGMA_PROFILE_IPTV:
+		return stream_tc_tos(s);
+	case SIGMA_PROFILE_BURST:
+		return s->use_dscp ? s->dscp << 2 : 0;
+	default:
+		return 0;
+	}
+}
+
+
+/* Fill in the local address of a connected socket and its interface */
+static bool ta_sock_key_local(int sock, struct ta_sock_key *key)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct ifaddrs *ifa, *pos;
+
+	if (getsockname(sock, (struct sockaddr *) &addr, &len) < 0 ||
+	    getifaddrs(&ifa) < 0)
+		return false;
+
+	key->local = addr.sin_addr;
+	key->ifindex = 0;
+	for (pos = ifa; pos; pos = pos->ifa_next) {
+		if (pos->ifa_addr && pos->ifa_addr->sa_family == AF_INET &&
+		    ((struct sockaddr_in *) pos->ifa_addr)->sin_addr.s_addr ==
+		    addr.sin_addr.s_addr) {
+			key->ifindex = if_nametoindex(pos->ifa_name);
+			break;
+		}
+	}
+	freeifaddrs(ifa);
+
+	return key->ifindex > 0;
+}
+
+
+/*
+ * Cache key of the stream. With sock < 0, the local address is the one that
+ * routing picks for a new socket to the peer now.
+ */
+static bool ta_sock_key(struct sigma_stream *s, int sock,
+			struct ta_sock_key *key)
+{
+	struct sockaddr_in addr;
+	bool ret;
+
+	if (s->trans_proto != IPPROTO_UDP ||
+	    s->profile == SIGMA_PROFILE_START_SYNC ||
+	    (s->profile == SIGMA_PROFILE_MULTICAST && !s->sender))
+		return false;
+
+	memset(key, 0, sizeof(*key));
+	key->sender = s->sender;
+	key->peer = s->sender ? s->dst : s->src;
+	key->local_port = s->sender ? s->src_port : s->dst_port;
+	key->peer_port = s->sender ? s->dst_port : s->src_port;
+
+	if (sock >= 0)
+		return ta_sock_key_local(sock, key);
+
+	/* Route lookup only; the probe is never bound to the stream's port */
+	sock = socket(PF_INET, SOCK_DGRAM, 0);
+	if (sock < 0)
+		return false;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr = key->peer;
+	addr.sin_port = htons(key->peer_port);
+	ret = connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+		ta_sock_key_local(sock, key);
+	close(sock);
+
+	return ret;
+}
+
+
+/* Close all parked sockets */
+static void ta_sock_flush(void)
+{
+	int i;
+
+	pthread_mutex_lock(&ta_sock_cache_lock);
+	for (i = 0; i < ta_sock_cache_num; i++)
+		close(ta_sock_cache[i].sock);
+	ta_sock_cache_num = 0;
+	pthread_mutex_unlock(&ta_sock_cache_lock);
+}
+
+
+static int ta_sock_take(struct sigma_dut *dut, struct sigma_stream *s)
+{
+	struct ta_sock_key key;
+	struct ta_cached_sock *c = NULL;
+	char buf[64];
+	int i, tos, err;
+	socklen_t len;
+
+	tos = stream_tos(s);
+	if (tos < 0 || !ta_sock_key(s, -1, &key))
+		return -1;
+
+	pthread_mutex_lock(&ta_sock_cache_lock);
+	for (i = 0; i < ta_sock_cache_num; i++) {
+		if (memcmp(&ta_sock_cache[i].key, &key, sizeof(key)) == 0) {
+			c = &ta_sock_cache[i];
+			break;
+		}
+	}
+	if (!c) {
+		pthread_mutex_unlock(&ta_sock_cache_lock);
+		return -1;
+	}
+	s->sock = c->sock;
+	if (c->tos != tos &&
+	    setsockopt(s->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+		perror("setsockopt");
+		close(s->sock);
+		s->sock = -1;
+	}
+	*c = ta_sock_cache[--ta_sock_cache_num];
+	pthread_mutex_unlock(&ta_sock_cache_lock);
+
+	if (s->sock < 0)
+		return -1;
+
+	/* Drop whatever arrived while parked and any queued ICMP error */
+	while (recv(s->sock, buf, sizeof(buf), MSG_DONTWAIT | MSG_TRUNC) >= 0)
+		;
+	len = sizeof(err);
+	getsockopt(s->sock, SOL_SOCKET, SO_ERROR, &err, &len);
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"Traffic agent: reuse cached socket %d for stream %d",
+			s->sock, s->stream_id);
+	return 0;
+}
+
+
+/* Park the stream's socket in the cache or close it */
+/*
+ * Undo the per-stream settings that ta_rx_setup() and the event-loop engine
+ * apply to any socket: the engine makes it non-blocking, but stream threads
+ * expect blocking sockets, and receive timestamps and timeout are only set for
+ * receivers.
+ */
+static int ta_sock_reset(int sock)
+{
+	struct timeval tv;
+	int flags;
+#ifdef SO_TIMESTAMPING
+	int ts_flags = 0;
+#endif /* SO_TIMESTAMPING */
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags < 0 ||
+	    ((flags & O_NONBLOCK) &&
+	     fcntl(sock, F_SETFL, flags & ~O_NONBLOCK) < 0))
+		return -1;
+
+#ifdef SO_TIMESTAMPING
+	if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &ts_flags,
+		       sizeof(ts_flags)) < 0)
+		return -1;
+#endif /* SO_TIMESTAMPING */
+
+	memset(&tv, 0, sizeof(tv));
+	return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+
+static void ta_sock_release(struct sigma_stream *s)
+{
+	struct ta_sock_key key;
+	struct ta_cached_sock *c;
+	int i, tos;
+
+	if (s->sock < 0)
+		return;
+
+	/* Per-stream socket tuning must not leak into another stream. Sockets
+	 * with settings that cannot be cleared are not cached. */
+	tos = stream_tos(s);
+	if (tos < 0 || s->use_txtime || s->busy_poll_usec > 0 ||
+	    s->rcvbuf_size > 0 || ta_sock_reset(s->sock) < 0 ||
+	    !ta_sock_key(s, s->sock, &key)) {
+		close(s->sock);
+		s->sock = -1;
+		return;
+	}
+	if (s->sender) {
+		int segment_size = 0;
+
+		setsockopt(s->sock, SOL_UDP, UDP_SEGMENT, &segment_size,
+			   sizeof(segment_size));
+	}
+
+	pthread_mutex_lock(&ta_sock_cache_lock);
+	for (i = 0; i < ta_sock_cache_num; i++) {
+		if (memcmp(&ta_sock_cache[i].key, &key, sizeof(key)) == 0)
+			break;
+	}
+	if (i < ta_sock_cache_num) {
+		/* Another stream with the same addressing is parked */
+		pthread_mutex_unlock(&ta_sock_cache_lock);
+		close(s->sock);
+		s->sock = -1;
+		return;
+	}
+
+	if (ta_sock_cache_num < TA_SOCK_CACHE_SIZE) {
+		c = &ta_sock_cache[ta_sock_cache_num++];
+	} else {
+		c = &ta_sock_cache[0];
+		for (i = 1; i < ta_sock_cache_num; i++) {
+			if (ta_sock_cache[i].last_used < c->last_used)
+				c = &ta_sock_cache[i];
+		}
+		close(c->sock);
+	}
+	c->key = key;
+	c->sock = s->sock;
+	c->tos = tos;
+	c->last_used = ++ta_sock_cache_clock;
+	pthread_mutex_unlock(&ta_sock_cache_lock);
+
+	s->sock = -1;
+}
+
+
 static int open_socket(struct sigma_dut *dut, struct sigma_stream *s)
 {
 	int tos = 0;
 
+	if (ta_sock_take(dut, s) == 0)
+		return 0;
+
 	switch (s->profile) {
 	case SIGMA_PROFILE_FILE_TRANSFER:
 		return open_socket_file_transfer(dut, s);
@@ -473,90 +1022,474 @@ static int open_socket(struct sigma_dut *dut, struct sigma_stream *s)
 }
 
 
-static void send_file_fast(struct sigma_stream *s, char *pkt)
+/*
+ * Publish the stream counters for traffic_agent_get_stats. Called only from
+ * the thread that owns the stream, so the counters themselves need no locking;
+ * readers use live_seq to get a consistent copy.
+ */
+static void stream_stats_publish(struct sigma_stream *s)
 {
-	struct timeval stop, now;
-	int res;
-	unsigned int counter = 0;
+	struct sigma_stream_live *live = &s->live;
+	struct sigma_stream_sample *cur = &live->cur;
+	struct timespec ts;
+	unsigned int seq = s->live_seq;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	__atomic_store_n(&s->live_seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	cur->time_usec = (unsigned long long) ts.tv_sec * 1000000 +
+		ts.tv_nsec / 1000;
+	cur->tx_frames = s->tx_frames;
+	cur->rx_frames = s->rx_frames;
+	cur->rx_max_seq = s->rx_max_seq;
+	cur->out_of_seq_frames = s->out_of_seq_frames;
+	cur->tx_payload_bytes = s->tx_payload_bytes;
+	cur->rx_payload_bytes = s->rx_payload_bytes;
+
+	if (live->window_len == 0 ||
+	    cur->time_usec - live->window[live->window_pos].time_usec >=
+	    SIGMA_LIVE_SAMPLE_USEC) {
+		if (live->window_len)
+			live->window_pos = (live->window_pos + 1) %
+				SIGMA_LIVE_SAMPLES;
+		if (live->window_len < SIGMA_LIVE_SAMPLES)
+			live->window_len++;
+		live->window[live->window_pos] = *cur;
+	}
+
+	__atomic_store_n(&s->live_seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-	gettimeofday(&stop, NULL);
-	stop.tv_sec += s->duration;
 
-	while (!s->stop) {
-		counter++;
-		WPA_PUT_BE32(&pkt[8], counter);
+/* Wake up this early and spin for the rest to hit the deadline precisely */
+#define TA_PACE_SPIN_NS 50000
+/* With SO_TXTIME the kernel holds the frame; submit this long in advance */
+#define TA_TXTIME_LEAD_NS 200000
+/* Forget a larger backlog instead of sending it as a burst */
+#define TA_PACE_MAX_DEBT 10
+
+struct ta_pacer {
+	long long interval_ns;
+	long long next_ns; /* CLOCK_MONOTONIC deadline of the next frame */
+	long long txtime_ns; /* deadline of the frame being sent */
+	long long last_ns; /* actual send time of the previous frame */
+	long long txtime_offset_ns; /* CLOCK_TAI - CLOCK_MONOTONIC */
+	bool txtime;
+
+	/* Achieved inter-frame gaps */
+	unsigned long long gaps;
+	long long gap_sum_ns;
+	long long gap_dev_sum_ns;
+	long long gap_max_ns;
+};
 
-		if ((counter & 0xf) == 0) {
-			gettimeofday(&now, NULL);
-			if (now.tv_sec > stop.tv_sec ||
-			    (now.tv_sec == stop.tv_sec &&
-			     now.tv_usec >= stop.tv_usec))
-				break;
-		}
 
-		s->tx_act_frames++;
-		res = send(s->sock, pkt, s->payload_size, MSG_DONTWAIT);
-		if (res >= 0) {
-			s->tx_frames++;
-			s->tx_payload_bytes += res;
+static long long ta_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+static void ta_pacer_init(struct ta_pacer *p, struct sigma_stream *s,
+			  long long interval_ns)
+{
+	memset(p, 0, sizeof(*p));
+	p->interval_ns = interval_ns;
+	p->next_ns = ta_clock_ns(CLOCK_MONOTONIC);
+
+#if defined(__linux__) && defined(SO_TXTIME)
+	if (s->use_txtime) {
+		struct sock_txtime cfg;
+
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.clockid = CLOCK_TAI;
+		if (setsockopt(s->sock, SOL_SOCKET, SO_TXTIME, &cfg,
+			       sizeof(cfg)) == 0) {
+			p->txtime = true;
+			p->txtime_offset_ns = ta_clock_ns(CLOCK_TAI) -
+				ta_clock_ns(CLOCK_MONOTONIC);
 		} else {
-			switch (errno) {
-			case EAGAIN:
-			case ENOBUFS:
-				usleep(1000);
-				break;
-			case ECONNRESET:
-			case EPIPE:
-				s->stop = 1;
-				break;
-			default:
-				perror("send");
-				break;
-			}
+			sigma_dut_print(s->dut, DUT_MSG_INFO,
+					"Traffic agent: SO_TXTIME failed: %s",
+					strerror(errno));
 		}
 	}
+#endif /* __linux__ && SO_TXTIME */
 }
 
 
-static void send_file(struct sigma_stream *s)
+static void ta_pacer_catch_up(struct ta_pacer *p, long long now)
 {
-	char *pkt;
-	struct timeval stop, now, start;
-	int res;
-	unsigned int counter = 0, total_sleep_usec = 0, total_pkts;
-	unsigned int error_again = 0, error_nobufs = 0;
-	int sleep_usec = 0;
+	if (now - p->next_ns > TA_PACE_MAX_DEBT * p->interval_ns)
+		p->next_ns = now;
+}
 
-	if (s->duration <= 0 || s->frame_rate < 0 || s->payload_size < 20)
-		return;
 
-	pkt = malloc(s->payload_size);
-	if (pkt == NULL)
-		return;
-	memset(pkt, 1, s->payload_size);
-	strlcpy(pkt, "1345678", s->payload_size);
+/* Account for the gap achieved by a frame sent now and move to the next
+ * deadline. The gap is always measured from the actual send time; with
+ * SO_TXTIME this is when the frame is handed to the kernel, not the scheduled
+ * transmit time, so the statistics still reflect pacing jitter. */
+static void ta_pacer_advance(struct ta_pacer *p, long long now)
+{
+	long long gap;
+
+	if (p->last_ns) {
+		gap = now - p->last_ns;
+		p->gaps++;
+		p->gap_sum_ns += gap;
+		p->gap_dev_sum_ns += gap > p->interval_ns ?
+			gap - p->interval_ns : p->interval_ns - gap;
+		if (gap > p->gap_max_ns)
+			p->gap_max_ns = gap;
+	}
+	p->last_ns = now;
+	p->txtime_ns = p->next_ns;
+	p->next_ns += p->interval_ns;
+}
 
-	if (s->frame_rate == 0 && s->no_timestamps) {
-		send_file_fast(s, pkt);
-		free(pkt);
+
+/* Wait until the next frame is due and account for the achieved gap */
+static void ta_pacer_wait(struct ta_pacer *p)
+{
+	long long now, wake;
+	struct timespec ts;
+
+	now = ta_clock_ns(CLOCK_MONOTONIC);
+	ta_pacer_catch_up(p, now);
+
+	wake = p->next_ns - (p->txtime ? TA_TXTIME_LEAD_NS : TA_PACE_SPIN_NS);
+	if (now < wake) {
+		ts.tv_sec = wake / 1000000000LL;
+		ts.tv_nsec = wake % 1000000000LL;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				       NULL) == EINTR)
+			;
+	}
+	if (!p->txtime) {
+		do {
+			now = ta_clock_ns(CLOCK_MONOTONIC);
+		} while (now < p->next_ns);
+	}
+
+	ta_pacer_advance(p, now);
+}
+
+
+/* Send a frame at the deadline passed by the last ta_pacer_wait() */
+static int ta_pacer_send(struct ta_pacer *p, struct sigma_stream *s,
+			 const char *pkt, size_t len, int flags)
+{
+#if defined(__linux__) && defined(SO_TXTIME)
+	if (p->txtime) {
+		union {
+			char buf[CMSG_SPACE(sizeof(uint64_t))];
+			struct cmsghdr align;
+		} u;
+		struct iovec iov = { (void *) pkt, len };
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		uint64_t txtime = p->txtime_ns + p->txtime_offset_ns;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = u.buf;
+		msg.msg_controllen = sizeof(u.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(txtime));
+		memcpy(CMSG_DATA(cmsg), &txtime, sizeof(txtime));
+		return sendmsg(s->sock, &msg, flags);
+	}
+#endif /* __linux__ && SO_TXTIME */
+
+	return send(s->sock, pkt, len, flags);
+}
+
+
+static void ta_pacer_report(struct ta_pacer *p, struct sigma_stream *s,
+			    const char *name)
+{
+	if (!p->gaps)
 		return;
+	s->tx_gap_req_usec = p->interval_ns / 1000;
+	s->tx_gap_avg_usec = p->gap_sum_ns / p->gaps / 1000;
+	s->tx_gap_dev_usec = p->gap_dev_sum_ns / p->gaps / 1000;
+	s->tx_gap_max_usec = p->gap_max_ns / 1000;
+	sigma_dut_print(s->dut, DUT_MSG_INFO,
+			"%s: requested gap %u us, achieved avg %u us, mean deviation %u us, max %u us%s",
+			name, s->tx_gap_req_usec, s->tx_gap_avg_usec,
+			s->tx_gap_dev_usec, s->tx_gap_max_usec,
+			p->txtime ? " (SO_TXTIME)" : "");
+}
+
+
+/* Wait for socket buffer space instead of sleeping for a fixed time */
+static void ta_tx_backoff(struct sigma_stream *s, int err)
+{
+	struct pollfd pfd;
+
+	if (err == ENOBUFS) {
+		/* Queue full below the socket; POLLOUT would not block */
+		usleep(100);
+		return;
+	}
+
+	pfd.fd = s->sock;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	poll(&pfd, 1, 10);
+}
+
+
+#ifdef __linux__
+
+/* Frames queued per sendmmsg() call */
+#define TA_TX_BATCH 32
+/* Upper bound on the size of a UDP GSO super-packet */
+#define TA_GSO_MAX_BYTES 65000
+#define TA_GSO_MAX_SEGS 64
+
+
+static int ta_set_gso(struct sigma_stream *s, int segment_size)
+{
+	return setsockopt(s->sock, SOL_UDP, UDP_SEGMENT, &segment_size,
+			  sizeof(segment_size));
+}
+
+
+/*
+ * Unpaced UDP transmit for file-transfer streams. A ring of preformatted
+ * frames is sent with sendmmsg(); only the counter and the timestamp fields
+ * are rewritten before each batch. When the kernel supports UDP GSO, every
+ * message carries several frames that are segmented below the socket layer.
+ * Returns -1 if the batch sender could not be set up, so that the caller can
+ * use the per-frame path.
+ */
+static int send_file_batch(struct sigma_stream *s)
+{
+	struct mmsghdr msgs[TA_TX_BATCH];
+	struct iovec iov[TA_TX_BATCH];
+	struct timeval stop, now;
+	unsigned int segs = 1, counter = 0, frames, i, j;
+	unsigned int sent_msgs = 0, head = 0, pending = 0;
+	size_t msg_len;
+	char *ring, *pkt;
+	int gso, res;
+
+	gso = s->payload_size <= 1472 ?
+		TA_GSO_MAX_BYTES / s->payload_size : 1;
+	if (gso > TA_GSO_MAX_SEGS)
+		gso = TA_GSO_MAX_SEGS;
+	if (gso > 1 && ta_set_gso(s, s->payload_size) == 0)
+		segs = gso;
+
+	ring = malloc((size_t) TA_TX_BATCH * segs * s->payload_size);
+	if (!ring) {
+		if (segs > 1)
+			ta_set_gso(s, 0);
+		return -1;
+	}
+
+rebuild:
+	msg_len = (size_t) segs * s->payload_size;
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < TA_TX_BATCH * segs; i++) {
+		pkt = ring + (size_t) i * s->payload_size;
+		memset(pkt, 1, s->payload_size);
+		strlcpy(pkt, "1345678", s->payload_size);
+	}
+	for (i = 0; i < TA_TX_BATCH; i++) {
+		iov[i].iov_base = ring + i * msg_len;
+		iov[i].iov_len = msg_len;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
 	}
+	sigma_dut_print(s->dut, DUT_MSG_DEBUG,
+			"send_file_batch: %u frames per message%s", segs,
+			segs > 1 ? " (UDP GSO)" : "");
 
 	gettimeofday(&stop, NULL);
 	stop.tv_sec += s->duration;
 
-	total_pkts = s->duration * s ->frame_rate;
+	while (!s->stop) {
+		gettimeofday(&now, NULL);
+		if (!timercmp(&now, &stop, <))
+			break;
+
+		/* Refill the messages sent by the previous call */
+		for (i = 0; i < TA_TX_BATCH - pending; i++) {
+			unsigned int m = (head + pending + i) % TA_TX_BATCH;
+
+			for (j = 0; j < segs; j++) {
+				pkt = (char *) iov[m].iov_base +
+					j * s->payload_size;
+				counter++;
+				WPA_PUT_BE32(&pkt[8], counter);
+				if (!s->no_timestamps) {
+					WPA_PUT_BE32(&pkt[12], now.tv_sec);
+					WPA_PUT_BE32(&pkt[16], now.tv_usec);
+				}
+			}
+		}
+		s->tx_act_frames += (TA_TX_BATCH - pending) * segs;
+		pending = TA_TX_BATCH;
+
+		/* sendmmsg() needs a contiguous array; send up to the wrap */
+		res = sendmmsg(s->sock, &msgs[head],
+			       head ? TA_TX_BATCH - head : TA_TX_BATCH,
+			       MSG_DONTWAIT);
+		if (res < 0) {
+			switch (errno) {
+			case EAGAIN:
+			case ENOBUFS:
+				ta_tx_backoff(s, errno);
+				break;
+			case EINVAL:
+			case EIO:
+				if (segs > 1 && sent_msgs == 0) {
+					/* GSO not usable on this path */
+					ta_set_gso(s, 0);
+					s->tx_act_frames -= pending * segs;
+					segs = 1;
+					pending = head = 0;
+					counter = 0;
+					goto rebuild;
+				}
+				perror("sendmmsg");
+				s->stop = 1;
+				break;
+			case ECONNRESET:
+			case EPIPE:
+				s->stop = 1;
+				break;
+			default:
+				perror("sendmmsg");
+				break;
+			}
+			continue;
+		}
+
+		for (i = 0; i < (unsigned int) res; i++) {
+			frames = msgs[head + i].msg_len / s->payload_size;
+			s->tx_frames += frames;
+			s->tx_payload_bytes += msgs[head + i].msg_len;
+		}
+		sent_msgs += res;
+		head = (head + res) % TA_TX_BATCH;
+		pending -= res;
+		stream_stats_publish(s);
+	}
+
+	/* Frames that were formatted but never handed to the kernel */
+	s->tx_act_frames -= pending * segs;
+	sigma_dut_print(s->dut, DUT_MSG_DEBUG,
+			"send_file_batch: messages %u frames %d", sent_msgs,
+			s->tx_frames);
+	if (segs > 1)
+		ta_set_gso(s, 0);
+	free(ring);
+	return 0;
+}
+
+#endif /* __linux__ */
+
+
+static void send_file_fast(struct sigma_stream *s, char *pkt)
+{
+	struct timeval stop, now;
+	int res;
+	unsigned int counter = 0;
 
-	gettimeofday(&start, NULL);
+	gettimeofday(&stop, NULL);
+	stop.tv_sec += s->duration;
 
 	while (!s->stop) {
 		counter++;
 		WPA_PUT_BE32(&pkt[8], counter);
 
-		if (sleep_usec) {
-			usleep(sleep_usec);
-			total_sleep_usec += sleep_usec;
+		if ((counter & 0xf) == 0) {
+			gettimeofday(&now, NULL);
+			if (now.tv_sec > stop.tv_sec ||
+			    (now.tv_sec == stop.tv_sec &&
+			     now.tv_usec >= stop.tv_usec))
+				break;
+			stream_stats_publish(s);
+		}
+
+		s->tx_act_frames++;
+		res = send(s->sock, pkt, s->payload_size, MSG_DONTWAIT);
+		if (res >= 0) {
+			s->tx_frames++;
+			s->tx_payload_bytes += res;
+		} else {
+			switch (errno) {
+			case EAGAIN:
+			case ENOBUFS:
+				ta_tx_backoff(s, errno);
+				break;
+			case ECONNRESET:
+			case EPIPE:
+				s->stop = 1;
+				break;
+			default:
+				perror("send");
+				break;
+			}
 		}
+	}
+}
+
+
+static void send_file(struct sigma_stream *s)
+{
+	char *pkt;
+	struct timeval stop, now;
+	struct ta_pacer pacer;
+	int res;
+	unsigned int counter = 0, total_pkts;
+	unsigned int error_again = 0, error_nobufs = 0;
+
+	if (s->duration <= 0 || s->frame_rate < 0 || s->payload_size < 20)
+		return;
+
+#ifdef __linux__
+	if (s->frame_rate == 0 && s->trans_proto == IPPROTO_UDP &&
+	    send_file_batch(s) == 0)
+		return;
+#endif /* __linux__ */
+
+	pkt = malloc(s->payload_size);
+	if (pkt == NULL)
+		return;
+	memset(pkt, 1, s->payload_size);
+	strlcpy(pkt, "1345678", s->payload_size);
+
+	if (s->frame_rate == 0 && s->no_timestamps) {
+		send_file_fast(s, pkt);
+		free(pkt);
+		return;
+	}
+
+	gettimeofday(&stop, NULL);
+	stop.tv_sec += s->duration;
+
+	total_pkts = s->duration * s ->frame_rate;
+	if (s->frame_rate)
+		ta_pacer_init(&pacer, s, 1000000000LL / s->frame_rate);
+
+	while (!s->stop) {
+		counter++;
+		WPA_PUT_BE32(&pkt[8], counter);
+
+		if (s->frame_rate)
+			ta_pacer_wait(&pacer);
 
 		gettimeofday(&now, NULL);
 		if (now.tv_sec > stop.tv_sec ||
@@ -566,32 +1499,16 @@ static void send_file(struct sigma_stream *s)
 		if (s->frame_rate && (unsigned int) s->tx_frames >= total_pkts)
 			break;
 
-		if (s->frame_rate == 0 || s->tx_frames == 0)
-			sleep_usec = 0;
-		else if (sleep_usec || s->frame_rate < 10 ||
-			 counter % (s->frame_rate / 10) == 0) {
-			/* Recalculate sleep_usec for every 100 ms approximately
-			 */
-			struct timeval tmp;
-			int diff, duration;
-
-			timersub(&now, &start, &tmp);
-
-			diff = tmp.tv_sec * 1000000 + tmp.tv_usec;
-			duration = (1000000 / s->frame_rate) * s->tx_frames;
-
-			if (duration > diff)
-				sleep_usec = (total_sleep_usec +
-					      (duration - diff)) / s->tx_frames;
-			else
-				sleep_usec = 0;
-		}
-
 		WPA_PUT_BE32(&pkt[12], now.tv_sec);
 		WPA_PUT_BE32(&pkt[16], now.tv_usec);
 
 		s->tx_act_frames++;
-		res = send(s->sock, pkt, s->payload_size, MSG_DONTWAIT);
+		if (s->frame_rate)
+			res = ta_pacer_send(&pacer, s, pkt, s->payload_size,
+					    MSG_DONTWAIT);
+		else
+			res = send(s->sock, pkt, s->payload_size,
+				   MSG_DONTWAIT);
 		if (res >= 0) {
 			s->tx_frames++;
 			s->tx_payload_bytes += res;
@@ -601,7 +1518,9 @@ static void send_file(struct sigma_stream *s)
 				error_again++;
 			case ENOBUFS:
 				error_nobufs++;
-				usleep(1000);
+				/* A paced stream just misses this slot */
+				if (!s->frame_rate)
+					ta_tx_backoff(s, errno);
 				break;
 			case ECONNRESET:
 			case EPIPE:
@@ -612,53 +1531,29 @@ static void send_file(struct sigma_stream *s)
 				break;
 			}
 		}
+		stream_stats_publish(s);
 	}
 
 	sigma_dut_print(s->dut, DUT_MSG_DEBUG,
-			"send_file: counter %u s->tx_frames %d total_sleep_usec %u EAGAIN %u ENOBUFS %u",
-			counter, s->tx_frames, total_sleep_usec, error_again,
+			"send_file: counter %u s->tx_frames %d EAGAIN %u ENOBUFS %u",
+			counter, s->tx_frames, error_again,
 			error_nobufs - error_again);
+	if (s->frame_rate)
+		ta_pacer_report(&pacer, s, "send_file");
 
 	free(pkt);
 }
 
 
-static int itime_diff(struct timeval *t1, struct timeval *t2)
-{
-	int sec = t2->tv_sec - t1->tv_sec;
-	int usec = t2->tv_usec - t1->tv_usec;
-
-	if (sec < 0)
-		return 0;
-
-	if (sec == 0) {
-		if (usec >= 0)
-			return usec;
-		return 0;
-	}
-
-	if (usec < 0) {
-		sec--;
-		usec += 1000000;
-	}
-
-	return sec * 1000000 + usec;
-
-}
-
-
 static int send_burst(struct sigma_stream *s)
 {
 	char *pkt = NULL;
 	int bytes_sent, rate;
-	int over_time_cnt = 0, duration = 0, over_send = 0;
-	/* sleep mil-sec per sending */
-	int sleep_total = 0, extra_time_spend_on_sending = 0;
 	int counter = 0, i; /* frame data sending count */
-	int difftime;
-	struct timeval before, after, stime;
+	int bursts = 0, retries = 0;
+	struct timeval now, stime;
 	struct timeval stop;
-	int run_loop = 1;
+	struct ta_pacer pacer;
 
 	if (s->burst_periodicity_us == 0 || s->duration == 0 ||
 	    s->payload_size < 20) {
@@ -694,10 +1589,19 @@ static int send_burst(struct sigma_stream *s)
 	gettimeofday(&stop, NULL);
 	stop.tv_sec += s->duration;
 
-	while (run_loop) {
-		gettimeofday(&before, NULL);
-		/* Send data per second loop */
-		for (i = 0; i < s->no_of_pkts_burst; i++) {
+	/* Each burst starts on an absolute deadline; frames within a burst
+	 * are sent back to back */
+	ta_pacer_init(&pacer, s, (long long) s->burst_periodicity_us * 1000);
+
+	while (!s->stop) {
+		ta_pacer_wait(&pacer);
+
+		gettimeofday(&now, NULL);
+		if (now.tv_sec > stop.tv_sec ||
+		    (now.tv_sec == stop.tv_sec && now.tv_usec >= stop.tv_usec))
+			break;
+
+		for (i = 0; i < s->no_of_pkts_burst && !s->stop; i++) {
 			counter++;
 			/* Fill in the counter */
 			WPA_PUT_BE32(&pkt[8], counter);
@@ -707,7 +1611,8 @@ static int send_burst(struct sigma_stream *s)
 			WPA_PUT_BE32(&pkt[12], stime.tv_sec);
 			WPA_PUT_BE32(&pkt[16], stime.tv_usec);
 
-			bytes_sent = send(s->sock, pkt, s->payload_size, 0);
+			bytes_sent = ta_pacer_send(&pacer, s, pkt,
+						   s->payload_size, 0);
 			if (bytes_sent >= 0) {
 				s->tx_frames++;
 				s->tx_payload_bytes += bytes_sent;
@@ -715,7 +1620,7 @@ static int send_burst(struct sigma_stream *s)
 				int err = errno;
 
 				counter--;
-				sleep_total++;
+				retries++;
 				i--;
 
 				if (err)
@@ -725,7 +1630,7 @@ static int send_burst(struct sigma_stream *s)
 				switch (err) {
 				case EAGAIN:
 				case ENOBUFS:
-					usleep(100);
+					ta_tx_backoff(s, err);
 					break;
 				case ECONNRESET:
 				case EPIPE:
@@ -734,80 +1639,17 @@ static int send_burst(struct sigma_stream *s)
 				}
 			}
 		} /* for loop per burst sending */
-		duration++;
-
-		/* Calculate second rest part need to sleep */
-		gettimeofday(&after, NULL);
-		difftime = itime_diff(&before, &after);
-		if (difftime < 0 || difftime >= s->burst_periodicity_us) {
-			/* Over time used, no sleep, go back to send */
-			over_time_cnt++;
-			if (difftime > s->burst_periodicity_us)
-				extra_time_spend_on_sending +=
-					(difftime - s->burst_periodicity_us);
-			usleep(500);
-			sleep_total++;
-			continue;
-		}
-
-		if (after.tv_sec > stop.tv_sec ||
-		    (after.tv_sec == stop.tv_sec &&
-		     after.tv_usec >= stop.tv_usec))
-			break;
-
-		/* difftime < 1 sec case, use sleep to catch up time
-		 * as 1 sec per sending
-		 */
-		/* check with accumulated extra time spend on previous
-		 * sending, difftime < 1 sec case
-		 */
-		if (extra_time_spend_on_sending > 0) {
-			if (extra_time_spend_on_sending >
-			    (s->burst_periodicity_us - difftime)) {
-				/* reduce sleep time to catch up
-				 * over all on time sending */
-				extra_time_spend_on_sending -=
-					(s->burst_periodicity_us) - difftime;
-				usleep(500);
-				sleep_total++;
-				continue;
-			} else { /* usec used to */
-				difftime += extra_time_spend_on_sending;
-				extra_time_spend_on_sending = 0;
-			}
-		}
-
-
-		if (s->burst_periodicity_us - difftime > 0) {
-			/* only sleep if there is extrac time with in the
-			 * second did not spend on sending */
-			usleep(s->burst_periodicity_us - difftime);
-			sleep_total += (s->burst_periodicity_us - difftime) /
-				1000;
-		}
-
-		if (s->duration * 1000 * 1000 <
-		    (duration * s->burst_periodicity_us)) {
-			over_send++;
-			/* This should not happen */
-			if (over_send > 1000) {
-				sigma_dut_print(s->dut, DUT_MSG_DEBUG,
-						"duration: %d, Loop: %d",
-						duration, run_loop);
-				break;
-			}
-		}
+		bursts++;
+		stream_stats_publish(s);
 	}
 
 	free(pkt);
 
-	extra_time_spend_on_sending /= 1000;
 	sigma_dut_print(s->dut, DUT_MSG_DEBUG,
-			"send_burst Count=%i txFrames=%i totalByteSent=%lli sleep_total=%d msec extra_time_spend_on_sending=%d over_time_cnt=%d over_send=%i BurstFrag=%d BurstPeriodUsec=%d duration=%i",
-			counter, s->tx_frames,
-			s->tx_payload_bytes, sleep_total,
-			extra_time_spend_on_sending, over_time_cnt, over_send,
-			s->no_of_pkts_burst, s->burst_periodicity_us, duration);
+			"send_burst Count=%i txFrames=%i totalByteSent=%lli retries=%d BurstFrag=%d BurstPeriodUsec=%d bursts=%i",
+			counter, s->tx_frames, s->tx_payload_bytes, retries,
+			s->no_of_pkts_burst, s->burst_periodicity_us, bursts);
+	ta_pacer_report(&pacer, s, "send_burst");
 
 	return 0;
 }
@@ -874,6 +1716,7 @@ static void send_transaction(struct sigma_stream *s)
 				break;
 			}
 		}
+		stream_stats_publish(s);
 
 		/* Wait for response */
 		tv.tv_sec = 0;
@@ -942,6 +1785,7 @@ static void * send_thread(void *ctx)
 		break;
 	}
 
+	stream_stats_publish(s);
 	return NULL;
 }
 
@@ -949,21 +1793,76 @@ static void * send_thread(void *ctx)
 struct traffic_agent_send_data {
 	struct sigma_dut *dut;
 	struct sigma_conn *conn;
-	int streams[MAX_SIGMA_STREAMS];
+	int *streams;
 	int count;
 };
 
 
+static void free_send_data(struct traffic_agent_send_data *data)
+{
+	free(data->streams);
+	free(data);
+}
+
+
 static struct sigma_stream * get_stream(struct sigma_dut *dut, int id)
 {
-	int i;
+	long long idx = (long long) id - dut->stream_id_base - 1;
 
-	for (i = 0; i < dut->num_streams; i++) {
-		if ((unsigned int) id == dut->streams[i].stream_id)
-			return &dut->streams[i];
-	}
+	if (idx < 0 || idx >= dut->num_streams)
+		return NULL;
+	return dut->streams[idx];
+}
 
-	return NULL;
+
+/* Growable response buffer for per-stream CAPI result lists */
+struct ta_resp {
+	char *buf;
+	size_t len;
+	size_t size;
+};
+
+
+static void ta_resp_printf(struct ta_resp *resp, const char *fmt, ...)
+	PRINTF_FORMAT(2, 3);
+
+static void ta_resp_printf(struct ta_resp *resp, const char *fmt, ...)
+{
+	va_list ap;
+	size_t size;
+	char *buf;
+	int ret;
+
+	for (;;) {
+		ret = 100;
+		if (resp->buf) {
+			va_start(ap, fmt);
+			ret = vsnprintf(resp->buf + resp->len,
+					resp->size - resp->len, fmt, ap);
+			va_end(ap);
+			if (ret < 0) {
+				resp->buf[resp->len] = '\0';
+				return;
+			}
+			if ((size_t) ret < resp->size - resp->len) {
+				resp->len += ret;
+				return;
+			}
+		}
+
+		size = resp->size ? resp->size * 2 : 1024;
+		if (size < resp->len + ret + 1)
+			size = resp->len + ret + 1;
+		buf = realloc(resp->buf, size);
+		if (!buf) {
+			/* Keep what fits; the response is truncated */
+			if (resp->buf)
+				resp->buf[resp->len] = '\0';
+			return;
+		}
+		resp->buf = buf;
+		resp->size = size;
+	}
 }
 
 
@@ -972,8 +1871,8 @@ static void * send_report_thread(void *ctx)
 	struct traffic_agent_send_data *data = ctx;
 	struct sigma_dut *dut = data->dut;
 	struct sigma_conn *conn = data->conn;
-	int i, ret;
-	char buf[100 + MAX_SIGMA_STREAMS * 60], *pos;
+	struct ta_resp resp = { NULL, 0, 0 };
+	int i;
 
 	for (i = 0; i < data->count; i++) {
 		sigma_dut_print(dut, DUT_MSG_DEBUG, "Traffic agent: waiting "
@@ -982,98 +1881,104 @@ static void * send_report_thread(void *ctx)
 		stop_stream(get_stream(dut, data->streams[i]));
 	}
 
-	buf[0] = '\0';
-	pos = buf;
-
-	pos += snprintf(pos, buf + sizeof(buf) - pos, "streamID,");
-	for (i = 0; i < data->count; i++) {
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", data->streams[i]);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
-	}
+	ta_resp_printf(&resp, "streamID,");
+	for (i = 0; i < data->count; i++)
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "",
+			       data->streams[i]);
 
 	if (dut->program == PROGRAM_60GHZ) {
 		sigma_dut_print(dut, DUT_MSG_INFO, "reporting tx_act_frames");
-		pos += snprintf(pos, buf + sizeof(buf) - pos, ",txActFrames,");
+		ta_resp_printf(&resp, ",txActFrames,");
 		for (i = 0; i < data->count; i++) {
 			struct sigma_stream *s;
 
 			s = get_stream(dut, data->streams[i]);
 			if (!s)
 				continue;
-			ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-				       i > 0 ? " " : "", s->tx_act_frames);
-			if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-				break;
-			pos += ret;
+			ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "",
+				       s->tx_act_frames);
 		}
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",txFrames,");
+	ta_resp_printf(&resp, ",txFrames,");
 	for (i = 0; i < data->count; i++) {
 		struct sigma_stream *s = get_stream(dut, data->streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", s->tx_frames);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "", s->tx_frames);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",rxFrames,");
+	ta_resp_printf(&resp, ",rxFrames,");
 	for (i = 0; i < data->count; i++) {
 		struct sigma_stream *s = get_stream(dut, data->streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", s->rx_frames);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "", s->rx_frames);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",txPayloadBytes,");
+	ta_resp_printf(&resp, ",txPayloadBytes,");
 	for (i = 0; i < data->count; i++) {
 		struct sigma_stream *s = get_stream(dut, data->streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%llu",
-			       i > 0 ? " " : "", s->tx_payload_bytes);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%llu", i > 0 ? " " : "",
+			       s->tx_payload_bytes);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",rxPayloadBytes,");
+	ta_resp_printf(&resp, ",rxPayloadBytes,");
 	for (i = 0; i < data->count; i++) {
 		struct sigma_stream *s = get_stream(dut, data->streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%llu",
-			       i > 0 ? " " : "", s->rx_payload_bytes);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%llu", i > 0 ? " " : "",
+			       s->rx_payload_bytes);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",outOfSequenceFrames,");
+	ta_resp_printf(&resp, ",outOfSequenceFrames,");
 	for (i = 0; i < data->count; i++) {
 		struct sigma_stream *s = get_stream(dut, data->streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", s->out_of_seq_frames);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "",
+			       s->out_of_seq_frames);
+	}
+
+	for (i = 0; i < data->count; i++) {
+		struct sigma_stream *s = get_stream(dut, data->streams[i]);
+
+		if (s && s->tx_gap_req_usec)
 			break;
-		pos += ret;
+	}
+	if (i < data->count) {
+		/* Requested vs. achieved inter-frame (or burst) gap */
+		const char *names[] = { "txGapRequestedUs", "txGapAvgUs",
+					"txGapDeviationUs", "txGapMaxUs" };
+		int f;
+
+		for (f = 0; f < (int) ARRAY_SIZE(names); f++) {
+			ta_resp_printf(&resp, ",%s,", names[f]);
+			for (i = 0; i < data->count; i++) {
+				struct sigma_stream *s;
+				unsigned int val = 0;
+
+				s = get_stream(dut, data->streams[i]);
+				if (s && f == 0)
+					val = s->tx_gap_req_usec;
+				else if (s && f == 1)
+					val = s->tx_gap_avg_usec;
+				else if (s && f == 2)
+					val = s->tx_gap_dev_usec;
+				else if (s)
+					val = s->tx_gap_max_usec;
+				ta_resp_printf(&resp, "%s%u", i > 0 ? " " : "",
+					       val);
+			}
+		}
 	}
 
 	for (i = 0; i < data->count; i++) {
@@ -1095,15 +2000,15 @@ static void * send_report_thread(void *ctx)
 		}
 	}
 
-	buf[sizeof(buf) - 1] = '\0';
-
 	if (conn->s < 0)
 		sigma_dut_print(dut, DUT_MSG_INFO, "Cannot send traffic_agent response since control socket has already been closed");
 	else
-		send_resp(dut, conn, SIGMA_COMPLETE, buf);
+		send_resp(dut, conn, SIGMA_COMPLETE,
+			  resp.buf ? resp.buf : "");
 	conn->waiting_completion = 0;
 
-	free(data);
+	free(resp.buf);
+	free_send_data(data);
 
 	return NULL;
 }
@@ -1128,9 +2033,9 @@ static enum sigma_cmd_result cmd_traffic_agent_send(struct sigma_dut *dut,
 	data->dut = dut;
 	data->conn = conn;
 
-	data->count = get_stream_id(val, data->streams);
+	data->count = get_stream_id(val, &data->streams);
 	if (data->count < 0) {
-		free(data);
+		free_send_data(data);
 		return ERROR_SEND_STATUS;
 	}
 	for (i = 0; i < data->count; i++) {
@@ -1140,25 +2045,25 @@ static enum sigma_cmd_result cmd_traffic_agent_send(struct sigma_dut *dut,
 			snprintf(buf, sizeof(buf), "errorCode,StreamID %d "
 				 "not configured", data->streams[i]);
 			send_resp(dut, conn, SIGMA_INVALID, buf);
-			free(data);
+			free_send_data(data);
 			return STATUS_SENT;
 		}
 		for (j = 0; j < i; j++)
 			if (data->streams[i] == data->streams[j]) {
-				free(data);
+				free_send_data(data);
 				return ERROR_SEND_STATUS;
 			}
 		if (!s->sender) {
 			snprintf(buf, sizeof(buf), "errorCode,Not configured "
 				 "as sender for streamID %d", data->streams[i]);
 			send_resp(dut, conn, SIGMA_INVALID, buf);
-			free(data);
+			free_send_data(data);
 			return STATUS_SENT;
 		}
 		if (s->ta_send_in_progress) {
 			send_resp(dut, conn, SIGMA_ERROR,
 				  "errorCode,Multiple concurrent send cmds on same streamID not supported");
-			free(data);
+			free_send_data(data);
 			return STATUS_SENT;
 		}
 	}
@@ -1171,7 +2076,7 @@ static enum sigma_cmd_result cmd_traffic_agent_send(struct sigma_dut *dut,
 		sigma_dut_print(dut, DUT_MSG_DEBUG, "Traffic agent: open "
 				"socket for send stream %d", data->streams[i]);
 		if (open_socket(dut, s) < 0) {
-			free(data);
+			free_send_data(data);
 			return ERROR_SEND_STATUS;
 		}
 	}
@@ -1190,11 +2095,15 @@ static enum sigma_cmd_result cmd_traffic_agent_send(struct sigma_dut *dut,
 
 		sigma_dut_print(dut, DUT_MSG_DEBUG, "Traffic agent: start "
 				"send for stream %d", data->streams[i]);
+		if (ta_engine_add(dut, s) == 0) {
+			s->started = 1;
+			continue;
+		}
 		res = pthread_create(&s->thr, NULL, send_thread, s);
 		if (res) {
 			sigma_dut_print(dut, DUT_MSG_INFO, "pthread_create "
 					"failed: %d", res);
-			free(data);
+			free_send_data(data);
 			return ERROR_SEND_STATUS;
 		}
 		s->started = 1;
@@ -1206,7 +2115,7 @@ static enum sigma_cmd_result cmd_traffic_agent_send(struct sigma_dut *dut,
 	if (res) {
 		sigma_dut_print(dut, DUT_MSG_INFO, "pthread_create failed: %d",
 				res);
-		free(data);
+		free_send_data(data);
 		conn->waiting_completion = 0;
 		return ERROR_SEND_STATUS;
 	}
@@ -1224,21 +2133,781 @@ static enum sigma_cmd_result cmd_traffic_agent_send(struct sigma_dut *dut,
 }
 
 
-static void receive_file(struct sigma_stream *s)
-{
-	struct timeval tv, now;
-	fd_set rfds;
-	int res;
-	char *pkt;
-	int pktlen;
-	unsigned int last_rx = 0, counter;
+#ifdef __linux__
 
-	pktlen = 65536 + 1;
-	pkt = malloc(pktlen);
-	if (pkt == NULL)
-		return;
+/* Datagrams drained per recvmmsg() call */
+#define TA_RX_BATCH 32
+#define TA_RX_BUF_LEN (65536 + 1)
 
-	while (!s->stop) {
+struct ta_rx_ctrl {
+	union {
+		char buf[CMSG_SPACE(sizeof(struct scm_timestamping))];
+		struct cmsghdr align;
+	} u;
+};
+
+
+static void ta_rx_setup(struct sigma_stream *s)
+{
+	int flags;
+	struct timeval tv;
+
+	if (s->rcvbuf_size > 0 &&
+	    setsockopt(s->sock, SOL_SOCKET, SO_RCVBUFFORCE, &s->rcvbuf_size,
+		       sizeof(s->rcvbuf_size)) < 0 &&
+	    setsockopt(s->sock, SOL_SOCKET, SO_RCVBUF, &s->rcvbuf_size,
+		       sizeof(s->rcvbuf_size)) < 0)
+		sigma_dut_print(s->dut, DUT_MSG_INFO,
+				"Traffic agent: SO_RCVBUF %d failed: %s",
+				s->rcvbuf_size, strerror(errno));
+
+	if (s->busy_poll_usec > 0 &&
+	    setsockopt(s->sock, SOL_SOCKET, SO_BUSY_POLL, &s->busy_poll_usec,
+		       sizeof(s->busy_poll_usec)) < 0)
+		sigma_dut_print(s->dut, DUT_MSG_INFO,
+				"Traffic agent: SO_BUSY_POLL %d failed: %s",
+				s->busy_poll_usec, strerror(errno));
+
+	/*
+	 * Hardware timestamps are in the NIC clock domain and only comparable
+	 * with the sender's clock when the PHC is synchronized to system time.
+	 */
+	flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+	if (s->rx_hw_timestamp)
+		flags |= SOF_TIMESTAMPING_RX_HARDWARE |
+			SOF_TIMESTAMPING_RAW_HARDWARE;
+	if (s->stats &&
+	    setsockopt(s->sock, SOL_SOCKET, SO_TIMESTAMPING, &flags,
+		       sizeof(flags)) < 0)
+		sigma_dut_print(s->dut, DUT_MSG_INFO,
+				"Traffic agent: SO_TIMESTAMPING failed: %s",
+				strerror(errno));
+
+	/* Blocking receive so that busy polling applies; wake up to check
+	 * s->stop */
+	tv.tv_sec = 0;
+	tv.tv_usec = 300000;
+	setsockopt(s->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+}
+
+
+/* Kernel arrival time of a datagram; 0 if no timestamp was delivered */
+static int ta_rx_timestamp(struct sigma_stream *s, struct msghdr *msg,
+			   struct timespec *ts)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		struct scm_timestamping *tss;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_TIMESTAMPING)
+			continue;
+		tss = (struct scm_timestamping *) CMSG_DATA(cmsg);
+		if (s->rx_hw_timestamp &&
+		    (tss->ts[2].tv_sec || tss->ts[2].tv_nsec)) {
+			*ts = tss->ts[2];
+			return 1;
+		}
+		if (tss->ts[0].tv_sec || tss->ts[0].tv_nsec) {
+			*ts = tss->ts[0];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+
+static void ta_rx_init(struct mmsghdr *msgs, struct iovec *iov, char *bufs)
+{
+	int i;
+
+	memset(msgs, 0, TA_RX_BATCH * sizeof(*msgs));
+	for (i = 0; i < TA_RX_BATCH; i++) {
+		iov[i].iov_base = bufs + (size_t) i * TA_RX_BUF_LEN;
+		iov[i].iov_len = TA_RX_BUF_LEN;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+
+static void ta_rx_reset(struct mmsghdr *msgs, struct ta_rx_ctrl *ctrl)
+{
+	int i;
+
+	for (i = 0; i < TA_RX_BATCH; i++) {
+		msgs[i].msg_hdr.msg_control = ctrl[i].u.buf;
+		msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i].u.buf);
+		msgs[i].msg_hdr.msg_flags = 0;
+	}
+}
+
+
+/* Account for a batch of datagrams returned by recvmmsg() */
+static void receive_frames(struct sigma_stream *s, struct mmsghdr *msgs,
+			   int num, unsigned int *last_rx)
+{
+	struct timeval now;
+	bool have_now = false;
+	unsigned int counter;
+	int i;
+
+	for (i = 0; i < num; i++) {
+		const u8 *pkt = msgs[i].msg_hdr.msg_iov->iov_base;
+		struct timespec ts;
+
+		s->rx_frames++;
+		s->rx_payload_bytes += msgs[i].msg_len;
+		if (msgs[i].msg_len < 12)
+			continue;
+
+		counter = WPA_GET_BE32(&pkt[8]);
+		if (counter < *last_rx)
+			s->out_of_seq_frames++;
+		*last_rx = counter;
+		if (counter > s->rx_max_seq)
+			s->rx_max_seq = counter;
+
+		if (msgs[i].msg_len < 20 || !s->stats)
+			continue;
+
+		if (ta_rx_timestamp(s, &msgs[i].msg_hdr, &ts)) {
+			record_frame(s, pkt, ts.tv_sec, ts.tv_nsec / 1000);
+			continue;
+		}
+		if (!have_now) {
+			gettimeofday(&now, NULL);
+			have_now = true;
+		}
+		record_frame(s, pkt, now.tv_sec, now.tv_usec);
+	}
+}
+
+
+/*
+ * UDP receive engine: drains the socket in batches with recvmmsg() and takes
+ * per-frame arrival times from the kernel for the latency records. Returns -1
+ * if the buffers could not be allocated so that the caller can use the
+ * per-frame path.
+ */
+static int receive_file_batch(struct sigma_stream *s)
+{
+	struct mmsghdr msgs[TA_RX_BATCH];
+	struct iovec iov[TA_RX_BATCH];
+	struct ta_rx_ctrl *ctrl;
+	unsigned int last_rx = 0;
+	char *bufs;
+	int res;
+
+	bufs = malloc((size_t) TA_RX_BATCH * TA_RX_BUF_LEN);
+	ctrl = calloc(TA_RX_BATCH, sizeof(*ctrl));
+	if (!bufs || !ctrl) {
+		free(bufs);
+		free(ctrl);
+		return -1;
+	}
+
+	ta_rx_setup(s);
+	ta_rx_init(msgs, iov, bufs);
+
+	while (!s->stop) {
+		ta_rx_reset(msgs, ctrl);
+		res = recvmmsg(s->sock, msgs, TA_RX_BATCH, MSG_WAITFORONE,
+			       NULL);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			perror("recvmmsg");
+			break;
+		}
+
+		receive_frames(s, msgs, res, &last_rx);
+		stream_stats_publish(s);
+	}
+
+	free(ctrl);
+	free(bufs);
+	return 0;
+}
+
+
+
+/*
+ * Event-loop engine (-8): instead of a thread per stream, paced UDP senders
+ * and UDP receivers are multiplexed on a fixed set of worker threads that are
+ * pinned to CPUs and driven by epoll. Senders are clocked by a timerfd armed
+ * at the pacer's absolute deadlines. Stream state used on the hot path lives
+ * in a slot array owned by the worker; streams are handed over through the
+ * pending list and the worker's eventfd.
+ */
+
+/* epoll data of the eventfd; streams use slot << 1 | is_sender */
+#define TA_WORKER_CTRL UINT64_MAX
+#define TA_WORKER_EVENTS 64
+/* recvmmsg() calls per readiness event before serving other streams */
+#define TA_WORKER_RX_ROUNDS 8
+
+struct ta_slot {
+	struct sigma_stream *s;
+	int timer_fd;
+	char *pkt;
+	struct ta_pacer pacer;
+	long long stop_ns;
+	unsigned int counter;
+	unsigned int total_pkts;
+	unsigned int last_rx;
+};
+
+struct ta_worker {
+	struct sigma_dut *dut;
+	pthread_t thr;
+	bool started;
+	int epoll_fd;
+	int event_fd;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond; /* signaled when a stream is done */
+	struct sigma_stream *pending; /* protected by lock */
+	int num_streams; /* protected by lock */
+	bool exit; /* protected by lock */
+
+	/* Owned by the worker thread */
+	struct ta_slot *slots;
+	int num_slots;
+	struct mmsghdr msgs[TA_RX_BATCH];
+	struct iovec iov[TA_RX_BATCH];
+	struct ta_rx_ctrl ctrl[TA_RX_BATCH];
+	char *rx_bufs;
+};
+
+struct ta_engine {
+	struct ta_worker *workers;
+	int num_workers;
+};
+
+
+static void ta_worker_kick(struct ta_worker *w)
+{
+	uint64_t one = 1;
+
+	if (write(w->event_fd, &one, sizeof(one)) < 0)
+		perror("write(eventfd)");
+}
+
+
+static void ta_worker_done(struct ta_worker *w, struct sigma_stream *s)
+{
+	pthread_mutex_lock(&w->lock);
+	s->worker_done = 1;
+	w->num_streams--;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+
+static void ta_worker_detach(struct ta_worker *w, int idx)
+{
+	struct ta_slot *slot = &w->slots[idx];
+	struct sigma_stream *s = slot->s;
+
+	if (s->sender) {
+		if (slot->timer_fd >= 0)
+			close(slot->timer_fd);
+		ta_pacer_report(&slot->pacer, s, "send_file");
+	} else {
+		epoll_ctl(w->epoll_fd, EPOLL_CTL_DEL, s->sock, NULL);
+	}
+	free(slot->pkt);
+	slot->pkt = NULL;
+	slot->s = NULL;
+
+	stream_stats_publish(s);
+	ta_worker_done(w, s);
+}
+
+
+static void ta_worker_arm(struct ta_slot *slot)
+{
+	struct itimerspec its;
+	long long at = slot->pacer.next_ns;
+
+	if (slot->pacer.txtime)
+		at -= TA_TXTIME_LEAD_NS;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = at / 1000000000LL;
+	its.it_value.tv_nsec = at % 1000000000LL;
+	if (timerfd_settime(slot->timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		perror("timerfd_settime");
+}
+
+
+static void ta_worker_attach(struct ta_worker *w, struct sigma_stream *s)
+{
+	struct ta_slot *slot;
+	struct epoll_event ev;
+	long long start;
+	int idx, fd, flags;
+
+	for (idx = 0; idx < w->num_slots; idx++) {
+		if (!w->slots[idx].s)
+			break;
+	}
+	if (idx == w->num_slots) {
+		slot = realloc(w->slots, (w->num_slots + 16) * sizeof(*slot));
+		if (!slot) {
+			ta_worker_done(w, s);
+			return;
+		}
+		memset(&slot[w->num_slots], 0, 16 * sizeof(*slot));
+		w->slots = slot;
+		w->num_slots += 16;
+	}
+
+	slot = &w->slots[idx];
+	memset(slot, 0, sizeof(*slot));
+	slot->s = s;
+	slot->timer_fd = -1;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+
+	if (s->sender) {
+		if (s->duration <= 0 || s->payload_size < 20)
+			goto fail;
+		slot->pkt = malloc(s->payload_size);
+		if (!slot->pkt)
+			goto fail;
+		memset(slot->pkt, 1, s->payload_size);
+		strlcpy(slot->pkt, "1345678", s->payload_size);
+
+		slot->total_pkts = s->duration * s->frame_rate;
+		ta_pacer_init(&slot->pacer, s, 1000000000LL / s->frame_rate);
+		start = slot->pacer.next_ns + s->start_delay * 1000000000LL;
+		slot->pacer.next_ns = start;
+		slot->stop_ns = start + s->duration * 1000000000LL;
+
+		slot->timer_fd = timerfd_create(CLOCK_MONOTONIC,
+						TFD_NONBLOCK | TFD_CLOEXEC);
+		if (slot->timer_fd < 0)
+			goto fail;
+		fd = slot->timer_fd;
+		ev.data.u64 = ((uint64_t) idx << 1) | 1;
+	} else {
+		ta_rx_setup(s);
+		flags = fcntl(s->sock, F_GETFL);
+		if (flags < 0 ||
+		    fcntl(s->sock, F_SETFL, flags | O_NONBLOCK) < 0)
+			goto fail;
+		fd = s->sock;
+		ev.data.u64 = (uint64_t) idx << 1;
+	}
+
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		sigma_dut_print(w->dut, DUT_MSG_ERROR,
+				"Traffic agent: epoll_ctl(ADD) for stream %u failed: %s",
+				s->stream_id, strerror(errno));
+		goto fail;
+	}
+	if (s->sender)
+		ta_worker_arm(slot);
+	return;
+
+fail:
+	ta_worker_detach(w, idx);
+}
+
+
+/* Send every frame that is due and re-arm the timer for the next one */
+static void ta_worker_send(struct ta_worker *w, int idx)
+{
+	struct ta_slot *slot = &w->slots[idx];
+	struct sigma_stream *s = slot->s;
+	uint64_t expirations;
+	struct timeval tv;
+	long long now, lead;
+	int res;
+
+	if (read(slot->timer_fd, &expirations, sizeof(expirations)) < 0)
+		return;
+
+	lead = slot->pacer.txtime ? TA_TXTIME_LEAD_NS : 0;
+	now = ta_clock_ns(CLOCK_MONOTONIC);
+	ta_pacer_catch_up(&slot->pacer, now);
+
+	while (!s->stop && slot->pacer.next_ns <= now + lead &&
+	       slot->pacer.next_ns < slot->stop_ns &&
+	       (unsigned int) s->tx_frames < slot->total_pkts) {
+		slot->counter++;
+		WPA_PUT_BE32(&slot->pkt[8], slot->counter);
+		gettimeofday(&tv, NULL);
+		WPA_PUT_BE32(&slot->pkt[12], tv.tv_sec);
+		WPA_PUT_BE32(&slot->pkt[16], tv.tv_usec);
+
+		ta_pacer_advance(&slot->pacer, ta_clock_ns(CLOCK_MONOTONIC));
+		s->tx_act_frames++;
+		res = ta_pacer_send(&slot->pacer, s, slot->pkt,
+				    s->payload_size, MSG_DONTWAIT);
+		if (res >= 0) {
+			s->tx_frames++;
+			s->tx_payload_bytes += res;
+		} else if (errno == ECONNRESET || errno == EPIPE) {
+			s->stop = 1;
+		} else if (errno != EAGAIN && errno != ENOBUFS) {
+			/* A paced stream just misses this slot */
+			perror("send");
+		}
+	}
+	stream_stats_publish(s);
+
+	if (s->stop || slot->pacer.next_ns >= slot->stop_ns ||
+	    (unsigned int) s->tx_frames >= slot->total_pkts)
+		ta_worker_detach(w, idx);
+	else
+		ta_worker_arm(slot);
+}
+
+
+static void ta_worker_receive(struct ta_worker *w, int idx)
+{
+	struct ta_slot *slot = &w->slots[idx];
+	struct sigma_stream *s = slot->s;
+	int i, res = 0;
+
+	for (i = 0; i < TA_WORKER_RX_ROUNDS; i++) {
+		ta_rx_reset(w->msgs, w->ctrl);
+		res = recvmmsg(s->sock, w->msgs, TA_RX_BATCH, MSG_DONTWAIT,
+			       NULL);
+		if (res <= 0)
+			break;
+		receive_frames(s, w->msgs, res, &slot->last_rx);
+		if (res < TA_RX_BATCH)
+			break;
+	}
+	stream_stats_publish(s);
+
+	if (res < 0 && errno != EAGAIN && errno != EINTR) {
+		perror("recvmmsg");
+		ta_worker_detach(w, idx);
+	}
+}
+
+
+/* Take over newly added streams and release stopped ones */
+static bool ta_worker_ctrl(struct ta_worker *w)
+{
+	struct sigma_stream *pending, *s;
+	uint64_t val;
+	bool exit;
+	int i;
+
+	if (read(w->event_fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+		perror("read(eventfd)");
+
+	pthread_mutex_lock(&w->lock);
+	pending = w->pending;
+	w->pending = NULL;
+	exit = w->exit;
+	pthread_mutex_unlock(&w->lock);
+
+	while (pending) {
+		s = pending;
+		pending = s->worker_next;
+		ta_worker_attach(w, s);
+	}
+
+	for (i = 0; i < w->num_slots; i++) {
+		if (w->slots[i].s && (exit || w->slots[i].s->stop))
+			ta_worker_detach(w, i);
+	}
+
+	return exit;
+}
+
+
+static void * ta_worker_thread(void *ctx)
+{
+	struct ta_worker *w = ctx;
+	struct epoll_event ev[TA_WORKER_EVENTS];
+	struct sigma_stream *s;
+	int i, n, idx;
+
+	/* The timers are the pacing clock; do not let the kernel defer them */
+	prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+	for (;;) {
+		n = epoll_wait(w->epoll_fd, ev, TA_WORKER_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			usleep(10000);
+			continue;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (ev[i].data.u64 == TA_WORKER_CTRL) {
+				if (ta_worker_ctrl(w))
+					return NULL;
+				continue;
+			}
+
+			/* Skip events of a slot released earlier in this
+			 * batch */
+			idx = ev[i].data.u64 >> 1;
+			if (idx >= w->num_slots)
+				continue;
+			s = w->slots[idx].s;
+			if (!s || !s->sender != !(ev[i].data.u64 & 1))
+				continue;
+
+			if (s->sender)
+				ta_worker_send(w, idx);
+			else
+				ta_worker_receive(w, idx);
+		}
+	}
+
+	return NULL;
+}
+
+
+static void ta_worker_free(struct ta_worker *w)
+{
+	if (w->epoll_fd >= 0)
+		close(w->epoll_fd);
+	if (w->event_fd >= 0)
+		close(w->event_fd);
+	free(w->slots);
+	free(w->rx_bufs);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+}
+
+
+static void ta_engine_deinit(struct sigma_dut *dut)
+{
+	struct ta_engine *e = dut->ta_engine;
+	struct ta_worker *w;
+	int i;
+
+	if (!e)
+		return;
+
+	for (i = 0; i < e->num_workers; i++) {
+		w = &e->workers[i];
+		if (!w->started)
+			continue;
+		pthread_mutex_lock(&w->lock);
+		w->exit = true;
+		pthread_mutex_unlock(&w->lock);
+		ta_worker_kick(w);
+		pthread_join(w->thr, NULL);
+	}
+
+	for (i = 0; i < e->num_workers; i++)
+		ta_worker_free(&e->workers[i]);
+
+	free(e->workers);
+	free(e);
+	dut->ta_engine = NULL;
+}
+
+
+static int ta_engine_init(struct sigma_dut *dut)
+{
+	struct ta_engine *e;
+	struct ta_worker *w;
+	struct epoll_event ev;
+	cpu_set_t allowed, cpus;
+	int i, cpu, ncpu, res;
+
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return -1;
+	ncpu = CPU_COUNT(&allowed);
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return -1;
+	e->num_workers = dut->ta_workers > 0 ? dut->ta_workers : ncpu;
+	e->workers = calloc(e->num_workers, sizeof(*e->workers));
+	if (!e->workers) {
+		free(e);
+		return -1;
+	}
+	dut->ta_engine = e;
+	for (i = 0; i < e->num_workers; i++) {
+		e->workers[i].epoll_fd = -1;
+		e->workers[i].event_fd = -1;
+	}
+
+	for (i = 0; i < e->num_workers; i++) {
+		w = &e->workers[i];
+		w->dut = dut;
+		pthread_mutex_init(&w->lock, NULL);
+		pthread_cond_init(&w->cond, NULL);
+		w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		w->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		w->rx_bufs = malloc((size_t) TA_RX_BATCH * TA_RX_BUF_LEN);
+		if (w->epoll_fd < 0 || w->event_fd < 0 || !w->rx_bufs)
+			goto fail;
+		ta_rx_init(w->msgs, w->iov, w->rx_bufs);
+
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u64 = TA_WORKER_CTRL;
+		if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev) < 0)
+			goto fail;
+
+		res = pthread_create(&w->thr, NULL, ta_worker_thread, w);
+		if (res) {
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"pthread_create failed: %d", res);
+			goto fail;
+		}
+		w->started = true;
+
+		/* Spread the workers over the CPUs this process may use */
+		for (cpu = 0, res = i % ncpu; cpu < CPU_SETSIZE; cpu++) {
+			if (CPU_ISSET(cpu, &allowed) && res-- == 0)
+				break;
+		}
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		res = pthread_setaffinity_np(w->thr, sizeof(cpus), &cpus);
+		if (res)
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"Traffic agent: could not pin worker %d to CPU %d: %s",
+					i, cpu, strerror(res));
+	}
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"Traffic agent: started %d event-loop workers",
+			e->num_workers);
+	return 0;
+
+fail:
+	sigma_dut_print(dut, DUT_MSG_ERROR,
+			"Traffic agent: could not start event-loop workers");
+	/* Only the workers before this one were fully set up */
+	ta_worker_free(&e->workers[i]);
+	e->num_workers = i;
+	ta_engine_deinit(dut);
+	return -1;
+}
+
+
+/*
+ * Hand a stream whose socket is open over to the least loaded worker.
+ * Returns -1 if the engine is disabled or does not handle this kind of stream
+ * so that the caller starts a stream thread instead.
+ */
+static int ta_engine_add(struct sigma_dut *dut, struct sigma_stream *s)
+{
+	struct ta_engine *e;
+	struct ta_worker *w;
+	int i, load, best = INT_MAX;
+
+	if (!dut->ta_workers || s->trans_proto != IPPROTO_UDP)
+		return -1;
+
+	switch (s->profile) {
+	case SIGMA_PROFILE_FILE_TRANSFER:
+	case SIGMA_PROFILE_MULTICAST:
+	case SIGMA_PROFILE_IPTV:
+		/* Unpaced senders keep a CPU busy; leave them a thread */
+		if (s->sender && s->frame_rate <= 0)
+			return -1;
+		break;
+	case SIGMA_PROFILE_BURST:
+		if (s->sender)
+			return -1;
+		break;
+	default:
+		return -1;
+	}
+
+	if (!dut->ta_engine && ta_engine_init(dut) < 0)
+		return -1;
+	e = dut->ta_engine;
+
+	w = &e->workers[0];
+	for (i = 0; i < e->num_workers; i++) {
+		pthread_mutex_lock(&e->workers[i].lock);
+		load = e->workers[i].num_streams;
+		pthread_mutex_unlock(&e->workers[i].lock);
+		if (load < best) {
+			best = load;
+			w = &e->workers[i];
+		}
+	}
+
+	pthread_mutex_lock(&w->lock);
+	s->worker = w;
+	s->worker_done = 0;
+	s->worker_next = w->pending;
+	w->pending = s;
+	w->num_streams++;
+	pthread_mutex_unlock(&w->lock);
+	ta_worker_kick(w);
+
+	return 0;
+}
+
+
+/* Wait for an engine stream to complete, or to notice s->stop */
+static void ta_engine_wait(struct sigma_stream *s)
+{
+	struct ta_worker *w = s->worker;
+
+	ta_worker_kick(w);
+	pthread_mutex_lock(&w->lock);
+	while (!s->worker_done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+	s->worker = NULL;
+}
+
+#else /* __linux__ */
+
+static void ta_engine_deinit(struct sigma_dut *dut)
+{
+}
+
+
+static int ta_engine_add(struct sigma_dut *dut, struct sigma_stream *s)
+{
+	return -1;
+}
+
+
+static void ta_engine_wait(struct sigma_stream *s)
+{
+}
+
+#endif /* __linux__ */
+
+
+static void receive_file(struct sigma_stream *s)
+{
+	struct timeval tv, now;
+	fd_set rfds;
+	int res;
+	char *pkt;
+	int pktlen;
+	unsigned int last_rx = 0, counter;
+
+#ifdef __linux__
+	if (s->trans_proto == IPPROTO_UDP && receive_file_batch(s) == 0)
+		return;
+#endif /* __linux__ */
+
+	pktlen = 65536 + 1;
+	pkt = malloc(pktlen);
+	if (pkt == NULL)
+		return;
+
+	while (!s->stop) {
 		FD_ZERO(&rfds);
 		FD_SET(s->sock, &rfds);
 		tv.tv_sec = 0;
@@ -1257,22 +2926,18 @@ static void receive_file(struct sigma_stream *s)
 				if (counter < last_rx)
 					s->out_of_seq_frames++;
 				last_rx = counter;
+				if (counter > s->rx_max_seq)
+					s->rx_max_seq = counter;
+				stream_stats_publish(s);
 			} else {
 				perror("recv");
 				break;
 			}
 
-			if (res >= 20 && s->stats &&
-			    s->num_stats < MAX_SIGMA_STATS) {
-				struct sigma_frame_stats *stats;
-				stats = &s->stats[s->num_stats];
-				s->num_stats++;
+			if (res >= 20 && s->stats) {
 				gettimeofday(&now, NULL);
-				stats->seqnum = counter;
-				stats->local_sec = now.tv_sec;
-				stats->local_usec = now.tv_usec;
-				stats->remote_sec = WPA_GET_BE32(&pkt[12]);
-				stats->remote_usec = WPA_GET_BE32(&pkt[16]);
+				record_frame(s, (const u8 *) pkt, now.tv_sec,
+					     now.tv_usec);
 			}
 		}
 	}
@@ -1335,6 +3000,7 @@ static void receive_transaction(struct sigma_stream *s)
 				s->tx_frames++;
 				s->tx_payload_bytes += res;
 			}
+			stream_stats_publish(s);
 		}
 	}
 
@@ -1393,25 +3059,20 @@ static void * receive_thread(void *ctx)
 		break;
 	}
 
+	stream_stats_publish(s);
 	return NULL;
 }
 
 
 static enum sigma_cmd_result
-cmd_traffic_agent_receive_start(struct sigma_dut *dut, struct sigma_conn *conn,
-				struct sigma_cmd *cmd)
+traffic_agent_receive_start(struct sigma_dut *dut, struct sigma_conn *conn,
+			    struct sigma_cmd *cmd, const int *streams,
+			    int count)
 {
 	const char *val;
-	int streams[MAX_SIGMA_STREAMS];
-	int i, j, count;
+	int i, j;
 	char buf[100];
 
-	val = get_param(cmd, "streamID");
-	if (val == NULL)
-		return INVALID_SEND_STATUS;
-	count = get_stream_id(val, streams);
-	if (count < 0)
-		return ERROR_SEND_STATUS;
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
@@ -1464,6 +3125,10 @@ cmd_traffic_agent_receive_start(struct sigma_dut *dut, struct sigma_conn *conn,
 
 		sigma_dut_print(dut, DUT_MSG_DEBUG, "Traffic agent: start "
 				"receive for stream %d", streams[i]);
+		if (ta_engine_add(dut, s) == 0) {
+			s->started = 1;
+			continue;
+		}
 		res = pthread_create(&s->thr, NULL, receive_thread, s);
 		if (res) {
 			sigma_dut_print(dut, DUT_MSG_INFO, "pthread_create "
@@ -1477,12 +3142,48 @@ cmd_traffic_agent_receive_start(struct sigma_dut *dut, struct sigma_conn *conn,
 }
 
 
+static enum sigma_cmd_result
+cmd_traffic_agent_receive_start(struct sigma_dut *dut, struct sigma_conn *conn,
+				struct sigma_cmd *cmd)
+{
+	enum sigma_cmd_result res;
+	const char *val;
+	int *streams;
+	int count;
+
+	val = get_param(cmd, "streamID");
+	if (val == NULL)
+		return INVALID_SEND_STATUS;
+	count = get_stream_id(val, &streams);
+	if (count < 0)
+		return ERROR_SEND_STATUS;
+	res = traffic_agent_receive_start(dut, conn, cmd, streams, count);
+	free(streams);
+	return res;
+}
+
+
+static void write_frame_stat_records(FILE *f,
+				     const struct sigma_frame_stats *stats,
+				     unsigned int num)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		fprintf(f, "%u:%u:%u:%u:%u\n", stats[i].seqnum,
+			stats[i].local_sec, stats[i].local_usec,
+			stats[i].remote_sec, stats[i].remote_usec);
+	}
+}
+
+
+/* Convert the spilled and the in-memory frame records to an e2e text file */
 static void write_frame_stats(struct sigma_dut *dut, struct sigma_stream *s,
 			      int id)
 {
 	char fname[128];
 	FILE *f;
-	unsigned int i;
+	int fd = -1;
 
 	snprintf(fname, sizeof(fname), "%s/e2e%u-%d.txt",
 		 dut->sigma_tmpdir, (unsigned int) time(NULL), id);
@@ -1494,35 +3195,35 @@ static void write_frame_stats(struct sigma_dut *dut, struct sigma_stream *s,
 	}
 	fprintf(f, "seqnum:local_sec:local_usec:remote_sec:remote_usec\n");
 
-	sigma_dut_print(dut, DUT_MSG_DEBUG, "Writing frame stats to %s",
-			fname);
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"Writing %llu frame stats to %s",
+			s->num_stats_spilled + s->num_stats, fname);
+
+	if (s->stats_file[0])
+		fd = open(s->stats_file, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) {
+		struct sigma_frame_stats chunk[256];
+		ssize_t res;
 
-	for (i = 0; i < s->num_stats; i++) {
-		struct sigma_frame_stats *stats = &s->stats[i];
-		fprintf(f, "%u:%u:%u:%u:%u\n", stats->seqnum,
-			stats->local_sec, stats->local_usec,
-			stats->remote_sec, stats->remote_usec);
+		while ((res = read(fd, chunk, sizeof(chunk))) > 0)
+			write_frame_stat_records(f, chunk,
+						 res / sizeof(chunk[0]));
+		close(fd);
 	}
+	write_frame_stat_records(f, s->stats, s->num_stats);
 
 	fclose(f);
 }
 
 
 static enum sigma_cmd_result
-cmd_traffic_agent_receive_stop(struct sigma_dut *dut, struct sigma_conn *conn,
-			       struct sigma_cmd *cmd)
+traffic_agent_receive_stop(struct sigma_dut *dut, struct sigma_conn *conn,
+			   struct sigma_cmd *cmd, const int *streams, int count)
 {
-	const char *val;
-	int streams[MAX_SIGMA_STREAMS];
-	int i, j, ret, count;
-	char buf[100 + MAX_SIGMA_STREAMS * 60], *pos;
+	struct ta_resp resp = { NULL, 0, 0 };
+	int i, j;
+	char buf[100];
 
-	val = get_param(cmd, "streamID");
-	if (val == NULL)
-		return INVALID_SEND_STATUS;
-	count = get_stream_id(val, streams);
-	if (count < 0)
-		return ERROR_SEND_STATUS;
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
@@ -1560,119 +3261,291 @@ cmd_traffic_agent_receive_stop(struct sigma_dut *dut, struct sigma_conn *conn,
 		stop_stream(s);
 	}
 
-	buf[0] = '\0';
-	pos = buf;
-
-	pos += snprintf(pos, buf + sizeof(buf) - pos, "streamID,");
-	for (i = 0; i < count; i++) {
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", streams[i]);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
-	}
+	ta_resp_printf(&resp, "streamID,");
+	for (i = 0; i < count; i++)
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "", streams[i]);
 
 	if (dut->program == PROGRAM_60GHZ) {
-		pos += snprintf(pos, buf + sizeof(buf) - pos, ",txActFrames,");
+		ta_resp_printf(&resp, ",txActFrames,");
 		for (i = 0; i < count; i++) {
 			struct sigma_stream *s = get_stream(dut, streams[i]);
 
 			if (!s)
 				continue;
-			ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-				       i > 0 ? " " : "", s->tx_act_frames);
-			if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-				break;
-			pos += ret;
+			ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "",
+				       s->tx_act_frames);
 		}
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",txFrames,");
+	ta_resp_printf(&resp, ",txFrames,");
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", s->tx_frames);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "", s->tx_frames);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",rxFrames,");
+	ta_resp_printf(&resp, ",rxFrames,");
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", s->rx_frames);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "", s->rx_frames);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",txPayloadBytes,");
+	ta_resp_printf(&resp, ",txPayloadBytes,");
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%llu",
-			       i > 0 ? " " : "", s->tx_payload_bytes);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%llu", i > 0 ? " " : "",
+			       s->tx_payload_bytes);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",rxPayloadBytes,");
+	ta_resp_printf(&resp, ",rxPayloadBytes,");
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%llu",
-			       i > 0 ? " " : "", s->rx_payload_bytes);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%llu", i > 0 ? " " : "",
+			       s->rx_payload_bytes);
 	}
 
-	pos += snprintf(pos, buf + sizeof(buf) - pos, ",outOfSequenceFrames,");
+	ta_resp_printf(&resp, ",outOfSequenceFrames,");
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
 		if (!s)
 			continue;
-		ret = snprintf(pos, buf + sizeof(buf) - pos, "%s%d",
-			       i > 0 ? " " : "", s->out_of_seq_frames);
-		if (ret < 0 || ret >= buf + sizeof(buf) - pos)
-			break;
-		pos += ret;
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "",
+			       s->out_of_seq_frames);
 	}
 
-	buf[sizeof(buf) - 1] = '\0';
+	for (i = 0; i < count; i++) {
+		struct sigma_stream *s = get_stream(dut, streams[i]);
 
-	send_resp(dut, conn, SIGMA_COMPLETE, buf);
+		if (s && s->latency && s->latency->count)
+			break;
+	}
+	if (i < count) {
+		/* End-to-end latency percentiles in microseconds */
+		const char *names[] = { "latencyP50", "latencyP95",
+					"latencyP99", "latencyMax" };
+		const unsigned int permille[] = { 500, 950, 990, 1000 };
+		int p;
+
+		for (p = 0; p < (int) ARRAY_SIZE(names); p++) {
+			ta_resp_printf(&resp, ",%s,", names[p]);
+			for (i = 0; i < count; i++) {
+				struct sigma_stream *s;
+				unsigned int val = 0;
+
+				s = get_stream(dut, streams[i]);
+				if (s && s->latency)
+					val = latency_percentile(s->latency,
+								 permille[p]);
+				ta_resp_printf(&resp, "%s%u", i > 0 ? " " : "",
+					       val);
+			}
+		}
+	}
+
+	send_resp(dut, conn, SIGMA_COMPLETE, resp.buf ? resp.buf : "");
+	free(resp.buf);
 
 	for (i = 0; i < count; i++) {
 		struct sigma_stream *s = get_stream(dut, streams[i]);
 
 		if (!s)
 			continue;
-		if (s->profile == SIGMA_PROFILE_IPTV && s->num_stats > 0 &&
+		if (s->latency && s->latency->negative)
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"Traffic agent: stream %d: %u of %llu frames arrived before their send time; check clock sync",
+					streams[i], s->latency->negative,
+					s->latency->count);
+		if (s->profile == SIGMA_PROFILE_IPTV &&
+		    s->num_stats + s->num_stats_spilled > 0 &&
 		    dut->write_stats)
 			write_frame_stats(dut, s, streams[i]);
-		free(s->stats);
-		s->stats = NULL;
-		s->num_stats = 0;
+		free_frame_stats(s);
 	}
 
 	return STATUS_SENT;
 }
 
 
+static enum sigma_cmd_result
+cmd_traffic_agent_receive_stop(struct sigma_dut *dut, struct sigma_conn *conn,
+			       struct sigma_cmd *cmd)
+{
+	enum sigma_cmd_result res;
+	const char *val;
+	int *streams;
+	int count;
+
+	val = get_param(cmd, "streamID");
+	if (val == NULL)
+		return INVALID_SEND_STATUS;
+	count = get_stream_id(val, &streams);
+	if (count < 0)
+		return ERROR_SEND_STATUS;
+	res = traffic_agent_receive_stop(dut, conn, cmd, streams, count);
+	free(streams);
+	return res;
+}
+
+
+static void stream_stats_read(struct sigma_stream *s,
+			      struct sigma_stream_live *live)
+{
+	unsigned int seq;
+
+	for (;;) {
+		seq = __atomic_load_n(&s->live_seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(live, &s->live, sizeof(*live));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&s->live_seq, __ATOMIC_RELAXED) == seq)
+			break;
+	}
+}
+
+
+static enum sigma_cmd_result
+traffic_agent_get_stats(struct sigma_dut *dut, struct sigma_conn *conn,
+			struct sigma_cmd *cmd, const int *streams, int count)
+{
+	struct sigma_stream_live *live;
+	const char *fields[] = { "txFrames", "rxFrames", "txPayloadBytes",
+				 "rxPayloadBytes", "outOfSequenceFrames",
+				 "txMbps", "rxMbps", "lossPercent" };
+	struct ta_resp resp = { NULL, 0, 0 };
+	int i, f;
+	char buf[100];
+
+	live = calloc(count, sizeof(*live));
+	if (!live)
+		return ERROR_SEND_STATUS;
+	for (i = 0; i < count; i++) {
+		struct sigma_stream *s = get_stream(dut, streams[i]);
+
+		if (!s) {
+			snprintf(buf, sizeof(buf), "errorCode,StreamID %d "
+				 "not configured", streams[i]);
+			send_resp(dut, conn, SIGMA_INVALID, buf);
+			free(live);
+			return STATUS_SENT;
+		}
+		stream_stats_read(s, &live[i]);
+	}
+
+	ta_resp_printf(&resp, "streamID,");
+	for (i = 0; i < count; i++)
+		ta_resp_printf(&resp, "%s%d", i > 0 ? " " : "", streams[i]);
+
+	for (f = 0; f < (int) ARRAY_SIZE(fields); f++) {
+		ta_resp_printf(&resp, ",%s,", fields[f]);
+
+		for (i = 0; i < count; i++) {
+			const struct sigma_stream_sample *cur = &live[i].cur;
+			const struct sigma_stream_sample *old;
+			unsigned long long usec = 0;
+			unsigned int seqs, frames;
+
+			/* Sliding window: oldest retained sample to now */
+			old = &live[i].window[(live[i].window_pos +
+					       SIGMA_LIVE_SAMPLES + 1 -
+					       live[i].window_len) %
+					      SIGMA_LIVE_SAMPLES];
+			if (live[i].window_len)
+				usec = cur->time_usec - old->time_usec;
+
+			switch (f) {
+			case 0:
+				ta_resp_printf(&resp,
+					       "%s%u", i > 0 ? " " : "",
+					       cur->tx_frames);
+				break;
+			case 1:
+				ta_resp_printf(&resp,
+					       "%s%u", i > 0 ? " " : "",
+					       cur->rx_frames);
+				break;
+			case 2:
+				ta_resp_printf(&resp,
+					       "%s%llu", i > 0 ? " " : "",
+					       cur->tx_payload_bytes);
+				break;
+			case 3:
+				ta_resp_printf(&resp,
+					       "%s%llu", i > 0 ? " " : "",
+					       cur->rx_payload_bytes);
+				break;
+			case 4:
+				ta_resp_printf(&resp,
+					       "%s%u", i > 0 ? " " : "",
+					       cur->out_of_seq_frames);
+				break;
+			case 5:
+			case 6:
+				ta_resp_printf(&resp,
+					       "%s%.2f", i > 0 ? " " : "",
+					       usec == 0 ? 0.0 :
+					       8.0 * (f == 5 ?
+						      cur->tx_payload_bytes -
+						      old->tx_payload_bytes :
+						      cur->rx_payload_bytes -
+						      old->rx_payload_bytes) /
+					       usec);
+				break;
+			case 7:
+				seqs = cur->rx_max_seq - old->rx_max_seq;
+				frames = cur->rx_frames - old->rx_frames;
+				ta_resp_printf(&resp,
+					       "%s%.2f", i > 0 ? " " : "",
+					       seqs == 0 || frames >= seqs ?
+					       0.0 :
+					       100.0 * (seqs - frames) / seqs);
+				break;
+			}
+		}
+	}
+
+	send_resp(dut, conn, SIGMA_COMPLETE, resp.buf ? resp.buf : "");
+	free(resp.buf);
+	free(live);
+	return STATUS_SENT;
+}
+
+
+static enum sigma_cmd_result
+cmd_traffic_agent_get_stats(struct sigma_dut *dut, struct sigma_conn *conn,
+			    struct sigma_cmd *cmd)
+{
+	enum sigma_cmd_result res;
+	const char *val;
+	int *streams;
+	int count;
+
+	val = get_param(cmd, "streamID");
+	if (val == NULL)
+		return INVALID_SEND_STATUS;
+	count = get_stream_id(val, &streams);
+	if (count < 0)
+		return ERROR_SEND_STATUS;
+	res = traffic_agent_get_stats(dut, conn, cmd, streams, count);
+	free(streams);
+	return res;
+}
+
+
 static enum sigma_cmd_result cmd_traffic_agent_version(struct sigma_dut *dut,
 						       struct sigma_conn *conn,
 						       struct sigma_cmd *cmd)
@@ -1696,4 +3569,21 @@ void traffic_agent_register_cmds(void)
 			  cmd_traffic_agent_receive_stop);
 	sigma_dut_reg_cmd("traffic_agent_version", NULL,
 			  cmd_traffic_agent_version);
+	sigma_dut_reg_cmd("traffic_agent_get_stats", NULL,
+			  cmd_traffic_agent_get_stats);
+}
+
+
+void traffic_agent_close(struct sigma_dut *dut)
+{
+	int i;
+
+	/* Streams handed to the engine must be done before it goes away */
+	for (i = 0; i < dut->num_streams; i++) {
+		struct sigma_stream *s = dut->streams[i];
+		s->stop = 1;
+		stop_stream(s);
+	}
+	ta_engine_deinit(dut);
+	ta_sock_flush();
 }
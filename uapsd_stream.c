@@ -246,6 +246,10 @@ struct apts_pkt wmm_ac_apts_pkts[] = {
 #define MAX_HELLO 20
 #define MAX_STOP 10
 #define LI_INT  2000000
+#define UAPSD_PKT_SIZE 512
+#define UAPSD_TX_PKT_LEN 256
+#define UAPSD_HELLO_INTERVAL 1000000
+#define UAPSD_IDLE_WAIT 100000
 
 enum uapsd_psave {
 	PS_OFF = 0,
@@ -931,22 +935,123 @@ static void create_apts_pkt(int msg, unsigned int txbuf[], size_t txbuf_len,
 }
 
 
+static int uapsd_tos_cmsg_unsupported;
+
+/*
+ * Send a frame with the given TOS. The TOS is carried per packet in an
+ * IP_TOS control message so that the TX and RX threads do not race on the
+ * sticky socket option and no extra setsockopt() is needed per frame.
+ * Kernels that do not accept IP_TOS as ancillary data fall back to the
+ * socket option.
+ */
+static ssize_t uapsd_send(struct sigma_stream *s, const void *buf, size_t len,
+			  int tos)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t res;
+
+	if (!uapsd_tos_cmsg_unsupported) {
+		iov.iov_base = (void *) buf;
+		iov.iov_len = len;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof(control.buf);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type = IP_TOS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+		res = sendmsg(s->sock, &msg, 0);
+		if (res >= 0 || errno != EINVAL)
+			return res;
+		sigma_dut_print(s->dut, DUT_MSG_DEBUG,
+				"uapsd: IP_TOS cmsg not supported - use socket option");
+		uapsd_tos_cmsg_unsupported = 1;
+	}
+
+	setsockopt(s->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
+	return send(s->sock, buf, len, 0);
+}
+
+
+static void uapsd_deadline_add(struct timespec *ts, u32 usec)
+{
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (usec % 1000000) * 1000L;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+
+static void uapsd_deadline(struct timespec *ts, u32 usec)
+{
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	uapsd_deadline_add(ts, usec);
+}
+
+
+/*
+ * Block the TX state machine until the absolute CLOCK_MONOTONIC deadline,
+ * the stream stopping, or - if wait_rx is set - the RX state machine moving
+ * on from rx_state, whichever comes first. Returns 1 if the stream was
+ * stopped.
+ */
+static int uapsd_tx_wait(struct sigma_stream *s, const struct timespec *deadline,
+			 int wait_rx, unsigned int rx_state)
+{
+	int stop;
+
+	pthread_mutex_lock(&s->tx_thr_mutex);
+	while (!s->stop && !(wait_rx && s->uapsd_rx_state != rx_state)) {
+		if (pthread_cond_timedwait(&s->uapsd_rx_cond, &s->tx_thr_mutex,
+					   deadline) == ETIMEDOUT)
+			break;
+	}
+	stop = s->stop;
+	pthread_mutex_unlock(&s->tx_thr_mutex);
+
+	return stop;
+}
+
+
+static int uapsd_tx_sleep(struct sigma_stream *s, u32 usec)
+{
+	struct timespec deadline;
+
+	uapsd_deadline(&deadline, usec);
+	return uapsd_tx_wait(s, &deadline, 0, 0);
+}
+
+
+/* Wake up the TX state machine after an RX state change or stop */
+static void uapsd_rx_notify(struct sigma_stream *s)
+{
+	pthread_mutex_lock(&s->tx_thr_mutex);
+	pthread_cond_broadcast(&s->uapsd_rx_cond);
+	pthread_mutex_unlock(&s->tx_thr_mutex);
+}
+
+
 static int uapsd_tx_start(struct sigma_stream *s,
 			  u32 usr_priority, enum uapsd_psave ps,
 			  u32 sleep_duration)
 {
-	unsigned int *tpkt;
-	int pktlen = 256;
+	unsigned int *tpkt = s->uapsd_txbuf;
 	struct sigma_dut *dut = s->dut;
+	struct timespec deadline;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO, "send_uapsd: Enter uapsd_tx_start");
-	tpkt = malloc(s->payload_size);
-	if (tpkt == NULL) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"send_uapsd: Send buffer allocation failed");
-		return -1;
-	}
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "send_uapsd: Enter uapsd_tx_start");
 
 	/* check whether a test case is received */
 	if (s->uapsd_rx_state > 0) {
@@ -954,12 +1059,12 @@ static int uapsd_tx_start(struct sigma_stream *s,
 	} else {
 		set_ps(s->ifname, dut, 0);
 		if (s->tx_hello_cnt <= MAX_HELLO) {
-			memset(tpkt, 0, s->payload_size);
+			memset(tpkt, 0, UAPSD_PKT_SIZE);
 			/* if test is for WMM-AC set APTS HELLO to 39 */
 			msgid = sigma_wmm_ac ? WMMAC_APTS_HELLO : APTS_HELLO;
-			create_apts_hello_pkt(msgid, tpkt, s->payload_size,
+			create_apts_hello_pkt(msgid, tpkt, UAPSD_PKT_SIZE,
 					      s->tx_hello_cnt);
-			if (send(s->sock, tpkt, pktlen, 0) <= 0) {
+			if (send(s->sock, tpkt, UAPSD_TX_PKT_LEN, 0) <= 0) {
 				sigma_dut_print(dut, DUT_MSG_ERROR,
 						"send_uapsd: Send failed");
 			}
@@ -967,7 +1072,9 @@ static int uapsd_tx_start(struct sigma_stream *s,
 			sigma_dut_print(dut, DUT_MSG_INFO,
 					"send_uapsd: Hello Sent cnt %d",
 					s->tx_hello_cnt);
-			sleep(1);
+			/* Resend Hello unless the test case arrives first */
+			uapsd_deadline(&deadline, UAPSD_HELLO_INTERVAL);
+			uapsd_tx_wait(s, &deadline, 1, 0);
 		} else {
 			printf("\n send_uapsd: Too many Hellos Sent... \n");
 			sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -976,8 +1083,7 @@ static int uapsd_tx_start(struct sigma_stream *s,
 		}
 	}
 
-	free(tpkt);
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Exit uapsd_tx_start uapsd_sta_tc %d uapsd_tx_state %d",
 			s->uapsd_sta_tc, s->uapsd_tx_state);
 
@@ -989,36 +1095,26 @@ static int uapsd_tx_confirm(struct sigma_stream *s,
 			    u32 usr_priority, enum uapsd_psave ps,
 			    u32 sleep_duration)
 {
-	unsigned int *tpkt;
-	int pktlen = 256;
+	unsigned int *tpkt = s->uapsd_txbuf;
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"send_uapsd: Enter uapsd_tx_confirm");
-	tpkt = malloc(s->payload_size);
-	if (tpkt == NULL) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"send_uapsd: Send buffer allocation failed");
-		return -1;
-	}
-
-	usleep(sleep_duration);
+	if (uapsd_tx_sleep(s, sleep_duration))
+		return 0;
 	set_ps(s->ifname, dut, ps);
-	memset(tpkt, 0, s->payload_size);
+	memset(tpkt, 0, UAPSD_PKT_SIZE);
 	/* if test is for WMM-AC set APTS CONFIRM to 41 */
 	msgid = sigma_wmm_ac ? WMMAC_APTS_CONFIRM : APTS_CONFIRM;
-	create_apts_pkt(msgid, tpkt, s->payload_size, usr_priority, s);
-	setsockopt(s->sock, IPPROTO_IP, IP_TOS, &usr_priority,
-		   sizeof(usr_priority));
-	if (send(s->sock, tpkt, pktlen, 0) > 0) {
+	create_apts_pkt(msgid, tpkt, UAPSD_PKT_SIZE, usr_priority, s);
+	if (uapsd_send(s, tpkt, UAPSD_TX_PKT_LEN, usr_priority) > 0) {
 		s->uapsd_tx_state++;
 	} else {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"send_uapsd: Send failed");
 	}
-	free(tpkt);
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Exit uapsd_tx_confirm uapsd_sta_tc %d uapsd_tx_state %d",
 			s->uapsd_sta_tc, s->uapsd_tx_state);
 
@@ -1030,36 +1126,27 @@ static int uapsd_tx_data(struct sigma_stream *s,
 			 u32 usr_priority, enum uapsd_psave ps,
 			 u32 sleep_duration)
 {
-	unsigned int *tpkt;
-	int pktlen = 256;
+	unsigned int *tpkt = s->uapsd_txbuf;
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO, "send_uapsd: Enter uapsd_tx_data");
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "send_uapsd: Enter uapsd_tx_data");
 
-	tpkt = malloc(s->payload_size);
-	if (tpkt == NULL) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"send_uapsd: Send buffer allocation failed");
-		return -1;
-	}
-	usleep(sleep_duration);
+	if (uapsd_tx_sleep(s, sleep_duration))
+		return 0;
 	set_ps(s->ifname, dut, ps);
-	memset(tpkt, 0, s->payload_size);
+	memset(tpkt, 0, UAPSD_PKT_SIZE);
 	/* if test is for WMM-AC set APTS DEFAULT to 38 */
 	msgid = sigma_wmm_ac ? WMMAC_APTS_DEFAULT : APTS_DEFAULT;
-	create_apts_pkt(msgid, tpkt, s->payload_size, usr_priority, s);
-	setsockopt(s->sock, IPPROTO_IP, IP_TOS, &usr_priority,
-		   sizeof(usr_priority));
-	if (send(s->sock, tpkt, pktlen, 0) > 0) {
+	create_apts_pkt(msgid, tpkt, UAPSD_PKT_SIZE, usr_priority, s);
+	if (uapsd_send(s, tpkt, UAPSD_TX_PKT_LEN, usr_priority) > 0) {
 		s->uapsd_tx_state++;
 	} else {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"send_uapsd: Send failed");
 	}
 
-	free(tpkt);
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Exit uapsd_tx_data uapsd_sta_tc %d uapsd_tx_state %d",
 			s->uapsd_sta_tc, s->uapsd_tx_state);
 
@@ -1071,29 +1158,22 @@ static int uapsd_tx_data_twice(struct sigma_stream *s,
 			       u32 usr_priority, enum uapsd_psave ps,
 			       u32 sleep_duration)
 {
-	unsigned int *tpkt;
-	int pktlen = 256, i = 0, tx_status = 0;
+	unsigned int *tpkt = s->uapsd_txbuf;
+	int i = 0, tx_status = 0;
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"send_uapsd: Enter uapsd_tx_data_twice");
-	tpkt = malloc(s->payload_size);
-	if (tpkt == NULL) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"send_uapsd: Send buffer allocation failed");
-		return -1;
-	}
-	usleep(sleep_duration);
+	if (uapsd_tx_sleep(s, sleep_duration))
+		return 0;
 	set_ps(s->ifname, dut, ps);
-	memset(tpkt, 0, s->payload_size);
+	memset(tpkt, 0, UAPSD_PKT_SIZE);
 	/* if test is for WMM-AC set APTS DEFAULT to 38 */
 	msgid = sigma_wmm_ac ? WMMAC_APTS_DEFAULT : APTS_DEFAULT;
-	create_apts_pkt(msgid, tpkt, s->payload_size, usr_priority, s);
-	setsockopt(s->sock, IPPROTO_IP, IP_TOS, &usr_priority,
-		   sizeof(usr_priority));
+	create_apts_pkt(msgid, tpkt, UAPSD_PKT_SIZE, usr_priority, s);
 	for(i = 0; i < 2; i++) {
-		if (send(s->sock, tpkt, pktlen, 0) <= 0) {
+		if (uapsd_send(s, tpkt, UAPSD_TX_PKT_LEN, usr_priority) <= 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"send_uapsd: Send failed");
 			tx_status = -1;
@@ -1101,8 +1181,7 @@ static int uapsd_tx_data_twice(struct sigma_stream *s,
 	}
 	if (tx_status == 0)
 		s->uapsd_tx_state++;
-	free(tpkt);
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Exit uapsd_tx_data_twice uapsd_sta_tc %d uapsd_tx_state %d",
 			s->uapsd_sta_tc, s->uapsd_tx_state);
 
@@ -1114,29 +1193,33 @@ static int uapsd_tx_cyclic(struct sigma_stream *s,
 			   u32 usr_priority, enum uapsd_psave ps,
 			   u32 sleep_duration)
 {
-	unsigned int *tpkt;
-	int pktlen = 256, i = 0, tx_status = 0;
+	unsigned int *tpkt = s->uapsd_txbuf;
+	int i = 0, tx_status = 0;
 	struct sigma_dut *dut = s->dut;
+	struct timespec next;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO, "send_uapsd: Enter uapsd_tx_cyclic");
-	tpkt = malloc(s->payload_size);
-	if (tpkt == NULL) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"send_uapsd: Send buffer allocation failed");
-		return -1;
-	}
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
+			"send_uapsd: Enter uapsd_tx_cyclic");
 
 	set_ps(s->ifname, dut, ps);
+	memset(tpkt, 0, UAPSD_PKT_SIZE);
+	/* if test is for WMM-AC set APTS DEFAULT to 38 */
+	msgid = sigma_wmm_ac ? WMMAC_APTS_DEFAULT : APTS_DEFAULT;
+	create_apts_pkt(msgid, tpkt, UAPSD_PKT_SIZE, usr_priority, s);
+
+	/*
+	 * Frames go out on a fixed period from the first deadline so that
+	 * send and wakeup latency does not accumulate over the cycle.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &next);
 	for (i = 0; i < 3000; i++) {
-		usleep(sleep_duration);
-		memset(tpkt, 0, s->payload_size);
-		/* if test is for WMM-AC set APTS DEFAULT to 38 */
-		msgid = sigma_wmm_ac ? WMMAC_APTS_DEFAULT : APTS_DEFAULT;
-		create_apts_pkt(msgid, tpkt, s->payload_size, usr_priority, s);
-		setsockopt(s->sock, IPPROTO_IP, IP_TOS, &usr_priority,
-			   sizeof(usr_priority));
-		if (send(s->sock, tpkt, pktlen, 0) <= 0) {
+		uapsd_deadline_add(&next, sleep_duration);
+		if (uapsd_tx_wait(s, &next, 0, 0))
+			return 0;
+		/* The cookie follows the latest frame from the console */
+		tpkt[0] = s->rx_cookie;
+		if (uapsd_send(s, tpkt, UAPSD_TX_PKT_LEN, usr_priority) <= 0) {
 			sigma_dut_print(dut, DUT_MSG_ERROR,
 					"send_uapsd: Send failed");
 			tx_status = -1;
@@ -1144,8 +1227,7 @@ static int uapsd_tx_cyclic(struct sigma_stream *s,
 	}
 	if (tx_status == 0)
 		s->uapsd_tx_state++;
-	free(tpkt);
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Exit uapsd_tx_cyclic uapsd_sta_tc %d uapsd_tx_state %d",
 			s->uapsd_sta_tc, s->uapsd_tx_state);
 
@@ -1157,29 +1239,21 @@ static int uapsd_tx_stop(struct sigma_stream *s,
 			 u32 usr_priority, enum uapsd_psave ps,
 			 u32 sleep_duration)
 {
-	unsigned int *tpkt;
-	int pktlen = 256;
+	unsigned int *tpkt = s->uapsd_txbuf;
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO, "send_uapsd: Enter uapsd_tx_stop");
-	tpkt = malloc(s->payload_size);
-	if (tpkt == NULL) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"send_uapsd: Send buffer allocation failed");
-		return -1;
-	}
-	usleep(sleep_duration);
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "send_uapsd: Enter uapsd_tx_stop");
+	/* Always send and signal; sigma_uapsd_stop() waits for it */
+	uapsd_tx_sleep(s, sleep_duration);
 	if(!s->tx_stop_cnt)
 		set_ps(s->ifname, dut, ps);
 	s->tx_stop_cnt++;
-	memset(tpkt, 0, s->payload_size);
+	memset(tpkt, 0, UAPSD_PKT_SIZE);
 	/* if test is for WMM-AC set APTS STOP to 42 */
 	msgid = sigma_wmm_ac ? WMMAC_APTS_STOP : APTS_STOP;
-	create_apts_pkt(msgid, tpkt, s->payload_size, usr_priority, s);
-	setsockopt(s->sock, IPPROTO_IP, IP_TOS, &usr_priority,
-		   sizeof(usr_priority));
-	if (send(s->sock, tpkt, pktlen, 0) <= 0) {
+	create_apts_pkt(msgid, tpkt, UAPSD_PKT_SIZE, usr_priority, s);
+	if (uapsd_send(s, tpkt, UAPSD_TX_PKT_LEN, usr_priority) <= 0) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"send_uapsd: Send failed");
 	}
@@ -1192,8 +1266,7 @@ static int uapsd_tx_stop(struct sigma_stream *s,
 				s->tx_stop_cnt);
 		s->stop = 1;
 	}
-	free(tpkt);
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"Exit uapsd_tx_stop uapsd_sta_tc %d uapsd_tx_state %d",
 			s->uapsd_sta_tc, s->uapsd_tx_state);
 
@@ -1210,7 +1283,7 @@ static int uapsd_rx_start(struct sigma_stream *s,
 
 	test_num = rxpkt[10];
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"receive_uapsd: Enter uapsd_rx_start");
 	/* if test is for WMM-AC set LAST_TC to 37 */
 	msgid = sigma_wmm_ac ? LAST_TC : M_W;
@@ -1236,7 +1309,7 @@ static int uapsd_rx_data(struct sigma_stream *s,
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"receive_uapsd: Enter uapsd_rx_data");
 	/* if test is for WMM-AC set APTS DEFAULT to 38 */
 	msgid = sigma_wmm_ac ? WMMAC_APTS_DEFAULT : APTS_DEFAULT;
@@ -1250,7 +1323,7 @@ static int uapsd_rx_data(struct sigma_stream *s,
 	     (rxpkt[1] == TOS_VO6))) {
 		s->rx_cookie = rxpkt[0];
 		(s->uapsd_rx_state)++;
-		sigma_dut_print(dut, DUT_MSG_INFO,
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
 				"receive_uapsd: Recv in uapsd_rx_data uapsd_rx_state %d",
 				s->uapsd_rx_state);
 	} else {
@@ -1259,7 +1332,7 @@ static int uapsd_rx_data(struct sigma_stream *s,
 		sigma_uapsd_reset(s);
 	}
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"receive_uapsd: Exit uapsd_rx_data");
 
 	return 0;
@@ -1272,7 +1345,7 @@ static int uapsd_rx_stop(struct sigma_stream *s,
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"receive_uapsd: Enter uapsd_rx_stop");
 	/* if test is for WMM-AC set APTS STOP to 42 */
 	msgid = sigma_wmm_ac ? WMMAC_APTS_STOP : APTS_STOP;
@@ -1283,7 +1356,7 @@ static int uapsd_rx_stop(struct sigma_stream *s,
 	} else {
 		sigma_uapsd_stop(s);
 	}
-	sigma_dut_print(dut, DUT_MSG_INFO, "receive_uapsd: Exit uapsd_rx_stop");
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "receive_uapsd: Exit uapsd_rx_stop");
 
 	return 0;
 }
@@ -1295,7 +1368,7 @@ static int uapsd_rx_cyclic_vo(struct sigma_stream *s,
 	struct sigma_dut *dut = s->dut;
 	u32 msgid, msgid2;
 
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"receive_uapsd: Enter uapsd_rx_cyclic_vo");
 	/* if test is for WMM-AC set
 	 * APTS STOP to 42 and
@@ -1322,7 +1395,7 @@ static int uapsd_rx_cyclic_vo(struct sigma_stream *s,
 	} else {
 		sigma_uapsd_stop(s);
 	}
-	sigma_dut_print(dut, DUT_MSG_INFO,
+	sigma_dut_print(dut, DUT_MSG_DEBUG,
 			"receive_uapsd: Exit uapsd_rx_cyclic_vo");
 
 	return 0;
@@ -1379,6 +1452,7 @@ static void sigma_uapsd_stop(struct sigma_stream *s)
 	pthread_cond_wait(&s->tx_thr_cond, &s->tx_thr_mutex);
 	pthread_mutex_unlock(&s->tx_thr_mutex);
 	s->stop = 1;
+	uapsd_rx_notify(s);
 	sleep(1);
 }
 
@@ -1386,7 +1460,7 @@ static void sigma_uapsd_stop(struct sigma_stream *s)
 static void sigma_uapsd_reset(struct sigma_stream *s)
 {
 	int tos = TOS_BE;
-	unsigned int *reset_pkt;
+	unsigned int reset_pkt[UAPSD_PKT_SIZE / sizeof(unsigned int)];
 	struct sigma_dut *dut = s->dut;
 	u32 msgid;
 
@@ -1395,16 +1469,12 @@ static void sigma_uapsd_reset(struct sigma_stream *s)
 	/* if reset is called from U-APSD console set it */
 	s->reset = 1;
 
-	reset_pkt = malloc(s->payload_size);
-	if (reset_pkt == NULL)
-		return;
-
+	memset(reset_pkt, 0, sizeof(reset_pkt));
 	if (s->num_retry > MAX_RETRY) {
 		/* if test is for WMM-AC set APTS RESET STOP to 49 */
 		msgid = sigma_wmm_ac ? WMMAC_APTS_RESET_STOP : APTS_RESET_STOP;
-		create_apts_pkt(msgid, reset_pkt, s->payload_size, tos, s);
-		setsockopt(s->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-		send(s->sock, reset_pkt, s->payload_size, 0);
+		create_apts_pkt(msgid, reset_pkt, sizeof(reset_pkt), tos, s);
+		uapsd_send(s, reset_pkt, sizeof(reset_pkt), tos);
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"sigma_uapsd_reset: Too many Reset retries");
 		s->stop = 1;
@@ -1413,18 +1483,15 @@ static void sigma_uapsd_reset(struct sigma_stream *s)
 	if (!(s->reset_rx)) {
 		/* if test is for WMM-AC set APTS RESET to 47 */
 		msgid = sigma_wmm_ac ? WMMAC_APTS_RESET : APTS_RESET;
-		create_apts_pkt(msgid, reset_pkt, s->payload_size, tos, s);
-		setsockopt(s->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-		send(s->sock, reset_pkt, s->payload_size, 0);
+		create_apts_pkt(msgid, reset_pkt, sizeof(reset_pkt), tos, s);
+		uapsd_send(s, reset_pkt, sizeof(reset_pkt), tos);
 	} else {
 		/* if test is for WMM-AC set APTS RESET RESP to 48 */
 		msgid = sigma_wmm_ac ? WMMAC_APTS_RESET_RESP : APTS_RESET_RESP;
-		create_apts_pkt(msgid, reset_pkt, s->payload_size, tos, s);
-		setsockopt(s->sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos));
-		send(s->sock, reset_pkt, s->payload_size, 0);
+		create_apts_pkt(msgid, reset_pkt, sizeof(reset_pkt), tos, s);
+		uapsd_send(s, reset_pkt, sizeof(reset_pkt), tos);
 		s->reset_rx = 0;
 	}
-	free(reset_pkt);
 }
 
 
@@ -1435,13 +1502,12 @@ static void * send_uapsd(void *data)
 	uapsd_tx_state_func_ptr tx_state_func;
 	u32 usr_priority, sleep_duration;
 	enum uapsd_psave ps;
+	struct timespec deadline;
 
 	sigma_dut_print(dut, DUT_MSG_INFO, "send_uapsd: Uapsd TX Start");
 
-	s->payload_size = 512;
-
 	while (!s->stop) {
-		sigma_dut_print(dut, DUT_MSG_INFO,
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
 				"send_uapsd: running  while uapsd_rx_state %d",
 				s->uapsd_rx_state);
 
@@ -1453,7 +1519,7 @@ static void * send_uapsd(void *data)
 			[s->uapsd_tx_state].sleep_dur;
 		ps = sta_uapsd_tx_tbl[s->uapsd_sta_tc][s->uapsd_tx_state].ps;
 
-		sigma_dut_print(dut, DUT_MSG_INFO,
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
 				"send_uapsd: uapsd_sta_tc %d uapsd_tx_state %d",
 				s->uapsd_sta_tc, s->uapsd_tx_state);
 		if (tx_state_func) {
@@ -1462,6 +1528,9 @@ static void * send_uapsd(void *data)
 			sigma_dut_print(dut, DUT_MSG_INFO,
 					"send_uapsd: Null Function Detected for TC : %d in uapsd_tx_state : %d",
 					s->uapsd_sta_tc, s->uapsd_tx_state);
+			/* Nothing to send; sleep until the RX side moves on */
+			uapsd_deadline(&deadline, UAPSD_IDLE_WAIT);
+			uapsd_tx_wait(s, &deadline, 1, s->uapsd_rx_state);
 		}
 	}
 
@@ -1479,40 +1548,52 @@ void receive_uapsd(struct sigma_stream *s)
 	unsigned int *rxpkt;
 	uapsd_recv_state_func_ptr recv_state_func;
 	struct sigma_dut *dut = s->dut;
+	pthread_condattr_t attr;
+	unsigned int prev_rx_state;
 	u32 msgid;
 
 	sigma_dut_print(dut, DUT_MSG_INFO, "receive_uapsd: Uapsd RX Start");
 	sigma_uapsd_init(s);
 
+	/* Both state machines run out of these for the whole test */
+	s->payload_size = UAPSD_PKT_SIZE;
+	rxpkt = malloc(UAPSD_PKT_SIZE);
+	s->uapsd_txbuf = malloc(UAPSD_PKT_SIZE);
+	if (rxpkt == NULL || s->uapsd_txbuf == NULL) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"receive_uapsd: Buffer allocation failed");
+		goto fail_buf;
+	}
+
 	ret = pthread_mutex_init(&s->tx_thr_mutex, NULL);
 	if (ret != 0) {
 		sigma_dut_print(dut, DUT_MSG_INFO,
 				"receive_uapsd: pthread_mutex_init failed");
-		return;
+		goto fail_buf;
 	}
 
 	ret = pthread_cond_init(&s->tx_thr_cond, NULL);
 	if (ret != 0) {
 		sigma_dut_print(dut, DUT_MSG_INFO,
 				"receive_uapsd: pthread_cond_init failed");
-		pthread_mutex_destroy(&s->tx_thr_mutex);
-		return;
+		goto fail_mutex;
 	}
 
-	if (pthread_create(&s->uapsd_send_thr, NULL, send_uapsd, s)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"receive_uapsd: send_uapsd tx thread creation failed");
-		pthread_cond_destroy(&s->tx_thr_cond);
-		pthread_mutex_destroy(&s->tx_thr_mutex);
-		return;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	ret = pthread_cond_init(&s->uapsd_rx_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (ret != 0) {
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"receive_uapsd: pthread_cond_init failed");
+		goto fail_cond;
 	}
 
-	s->payload_size = 512;
-	rxpkt = malloc(s->payload_size);
-	if (rxpkt == NULL) {
+	if (pthread_create(&s->uapsd_send_thr, NULL, send_uapsd, s)) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"receive_uapsd: Receive buffer allocation failed");
-		s->stop = 1;
+				"receive_uapsd: send_uapsd tx thread creation failed");
+		pthread_cond_destroy(&s->uapsd_rx_cond);
+		goto fail_cond;
 	}
 
 	while (!s->stop) {
@@ -1530,9 +1611,9 @@ void receive_uapsd(struct sigma_stream *s)
 		if (!FD_ISSET(s->sock, &rfds))
 			continue;
 
-		memset(rxpkt, 0, s->payload_size);
-		rxpkt_len = recv(s->sock, rxpkt, s->payload_size, 0);
-		sigma_dut_print(dut, DUT_MSG_INFO,
+		memset(rxpkt, 0, UAPSD_PKT_SIZE);
+		rxpkt_len = recv(s->sock, rxpkt, UAPSD_PKT_SIZE, 0);
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
 				"receive_uapsd: running res %d cookie %d dscp %d apts-pkt %d sta-id %d",
 				res, rxpkt[0], rxpkt[1], rxpkt[10],
 				rxpkt[9]);
@@ -1553,11 +1634,14 @@ void receive_uapsd(struct sigma_stream *s)
 
 			recv_state_func = sta_uapsd_recv_tbl[s->uapsd_sta_tc]
 				[s->uapsd_rx_state].state_func;
-			sigma_dut_print(dut, DUT_MSG_INFO,
+			sigma_dut_print(dut, DUT_MSG_DEBUG,
 					"receive_uapsd: running s->uapsd_sta_tc %d uapsd_rx_state %d",
 					s->uapsd_sta_tc, s->uapsd_rx_state);
 			if (recv_state_func) {
+				prev_rx_state = s->uapsd_rx_state;
 				recv_state_func(s, rxpkt, rxpkt_len);
+				if (s->uapsd_rx_state != prev_rx_state)
+					uapsd_rx_notify(s);
 			} else {
 				sigma_dut_print(dut, DUT_MSG_INFO,
 						"receive_uapsd: Null Function Detected for TC : %d in uapsd_rx_state : %d",
@@ -1570,16 +1654,24 @@ void receive_uapsd(struct sigma_stream *s)
 		}
 	}
 
-	if (rxpkt)
-		free(rxpkt);
 	sigma_dut_print(dut, DUT_MSG_INFO, "receive_uapsd: Uapsd RX End");
+	s->stop = 1;
+	/* Cut short any pending TX wait so the join does not block on it */
+	uapsd_rx_notify(s);
 	if (s->sock >= 0) {
 		pthread_join(s->uapsd_send_thr, NULL);
 		close(s->sock);
 		s->sock = -1;
 	}
+	pthread_cond_destroy(&s->uapsd_rx_cond);
+fail_cond:
 	pthread_cond_destroy(&s->tx_thr_cond);
+fail_mutex:
 	pthread_mutex_destroy(&s->tx_thr_mutex);
+fail_buf:
+	free(rxpkt);
+	free(s->uapsd_txbuf);
+	s->uapsd_txbuf = NULL;
 }
 
 
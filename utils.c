@@ -11,6 +11,13 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <poll.h>
+#ifdef __linux__
+#include <linux/wireless.h>
+#include <linux/filter.h>
+#endif /* __linux__ */
 #include "wpa_helpers.h"
 
 enum driver_type wifi_chip_type = DRIVER_NOT_SET;
@@ -760,18 +767,58 @@ static int no_seq_check(struct nl_msg *msg, void *arg)
 }
 
 
+/* Maximum number of requests in flight on nl80211_ctx::sock; bounds the
+ * ACKs (and error replies echoing the request) queued in its SOCK_BUF_SIZE
+ * receive buffer before they are collected. */
+#define NL80211_MAX_INFLIGHT 16
+
+struct nl80211_req {
+	unsigned int count;
+	unsigned int pending;
+	unsigned int seq[NL80211_MAX_INFLIGHT];
+	int *res; /* per request: 1 = pending, 0 = done, < 0 = error */
+	int (*valid_handler)(struct nl_msg *, void *);
+	void *valid_data;
+};
+
+
+static int nl80211_req_index(struct nl80211_ctx *ctx, unsigned int seq)
+{
+	struct nl80211_req *req = ctx->req;
+	unsigned int i;
+
+	if (!req)
+		return -1;
+	for (i = 0; i < req->count; i++) {
+		if (req->seq[i] == seq)
+			return i;
+	}
+	return -1;
+}
+
+
+static void nl80211_req_done(struct nl80211_ctx *ctx, unsigned int seq,
+			     int res)
+{
+	int i = nl80211_req_index(ctx, seq);
+
+	if (i < 0 || ctx->req->res[i] <= 0)
+		return;
+	ctx->req->res[i] = res;
+	ctx->req->pending--;
+}
+
+
 static int ack_handler(struct nl_msg *msg, void *arg)
 {
-	int *err = arg;
-	*err = 0;
+	nl80211_req_done(arg, nlmsg_hdr(msg)->nlmsg_seq, 0);
 	return NL_STOP;
 }
 
 
 static int finish_handler(struct nl_msg *msg, void *arg)
 {
-	int *ret = arg;
-	*ret = 0;
+	nl80211_req_done(arg, nlmsg_hdr(msg)->nlmsg_seq, 0);
 	return NL_SKIP;
 }
 
@@ -779,63 +826,132 @@ static int finish_handler(struct nl_msg *msg, void *arg)
 static int error_handler(struct sockaddr_nl *nla, struct nlmsgerr *err,
 			 void *arg)
 {
-	int *ret = arg;
-	*ret = err->error;
+	nl80211_req_done(arg, err->msg.nlmsg_seq, err->error);
 	return NL_SKIP;
 }
 
 
-int send_and_recv_msgs(struct sigma_dut *dut, struct nl80211_ctx *ctx,
-		       struct nl_msg *nlmsg,
-		       int (*valid_handler)(struct nl_msg *, void *),
-		       void *valid_data)
+static int valid_handler(struct nl_msg *msg, void *arg)
 {
-	struct nl_cb *cb;
-	int err = -ENOMEM;
+	struct nl80211_ctx *ctx = arg;
 
-	if (!nlmsg)
-		return -ENOMEM;
+	/* Drop late replies to requests that were already given up on */
+	if (nl80211_req_index(ctx, nlmsg_hdr(msg)->nlmsg_seq) < 0 ||
+	    !ctx->req->valid_handler)
+		return NL_SKIP;
+	return ctx->req->valid_handler(msg, ctx->req->valid_data);
+}
 
-	cb = nl_cb_alloc(NL_CB_DEFAULT);
-	if (!cb)
-		goto out;
 
-	err = nl_send_auto_complete(ctx->sock, nlmsg);
-	if (err < 0) {
+/* Send up to NL80211_MAX_INFLIGHT requests back to back and then collect
+ * their replies, matched by sequence number, into res[]. */
+static void nl80211_xfer(struct sigma_dut *dut, struct nl80211_ctx *ctx,
+			 struct nl_msg **msgs, int *res, unsigned int count,
+			 int (*valid_handler)(struct nl_msg *, void *),
+			 void *valid_data)
+{
+	struct nl80211_req req, *prev = ctx->req;
+	unsigned int i;
+	int err;
+
+	memset(&req, 0, sizeof(req));
+	req.count = count;
+	req.res = res;
+	req.valid_handler = valid_handler;
+	req.valid_data = valid_data;
+
+	for (i = 0; i < count; i++) {
+		/* nl_send_auto_complete() assigns the sequence number */
+		err = nl_send_auto_complete(ctx->sock, msgs[i]);
+		req.seq[i] = nlmsg_hdr(msgs[i])->nlmsg_seq;
+		if (err < 0) {
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"nl80211: failed to send err=%d", err);
+			res[i] = err;
+			continue;
+		}
+		res[i] = 1;
+		req.pending++;
+	}
+
+	ctx->req = &req;
+	while (req.pending > 0) {
+		err = nl_recvmsgs(ctx->sock, ctx->cb);
+		if (err >= 0)
+			continue;
 		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"nl80211: failed to send err=%d", err);
-		goto out;
+				"nl80211: %s->nl_recvmsgs failed: res=%d, pending=%u",
+				__func__, err, req.pending);
+		if (err != -NLE_NOMEM)
+			continue;
+		/* The receive buffer overflowed and replies were dropped */
+		for (i = 0; i < count; i++) {
+			if (res[i] > 0)
+				res[i] = -ENOBUFS;
+		}
+		break;
 	}
+	ctx->req = prev;
+}
 
-	err = 1;
 
-	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &err);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &err);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &err);
+/**
+ * nl80211_send_msgs - Send a set of requests and collect their replies
+ *
+ * The requests are pipelined: up to NL80211_MAX_INFLIGHT of them are sent
+ * before waiting for any ACK. res[i] is set to 0 or a negative error code
+ * for msgs[i] and valid_handler, if set, is called for replies to any of the
+ * requests. The messages are freed. Returns 0 if all requests succeeded or
+ * the first error otherwise.
+ */
+int nl80211_send_msgs(struct sigma_dut *dut, struct nl80211_ctx *ctx,
+		      struct nl_msg **msgs, int *res, unsigned int count,
+		      int (*valid_handler)(struct nl_msg *, void *),
+		      void *valid_data)
+{
+	unsigned int i, n;
+	int ret = 0;
+
+	for (i = 0; i < count; i += n) {
+		n = count - i;
+		if (n > NL80211_MAX_INFLIGHT)
+			n = NL80211_MAX_INFLIGHT;
+		nl80211_xfer(dut, ctx, &msgs[i], &res[i], n, valid_handler,
+			     valid_data);
+	}
 
-	if (valid_handler)
-		nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM,
-			  valid_handler, valid_data);
+	for (i = 0; i < count; i++) {
+		if (res[i] && !ret)
+			ret = res[i];
+		nlmsg_free(msgs[i]);
+	}
 
-	while (err > 0) {
-		int res = nl_recvmsgs(ctx->sock, cb);
+	return ret;
+}
+
+
+int send_and_recv_msgs(struct sigma_dut *dut, struct nl80211_ctx *ctx,
+		       struct nl_msg *nlmsg,
+		       int (*valid_handler)(struct nl_msg *, void *),
+		       void *valid_data)
+{
+	int err;
+
+	if (!nlmsg)
+		return -ENOMEM;
+
+	/* Keep the order with test config settings queued before this */
+	if (dut->test_config_batch)
+		wcn_wifi_test_config_flush(dut);
+
+	nl80211_xfer(dut, ctx, &nlmsg, &err, 1, valid_handler, valid_data);
 
-		if (res < 0) {
-			sigma_dut_print(dut, DUT_MSG_ERROR,
-					"nl80211: %s->nl_recvmsgs failed: res=%d, err=%d",
-					__func__, res, err);
-		}
-	}
- out:
-	nl_cb_put(cb);
 	if (!valid_handler && valid_data == (void *) -1) {
-		if (nlmsg) {
-			struct nlmsghdr *hdr = nlmsg_hdr(nlmsg);
-			void *data = nlmsg_data(hdr);
-			int len = hdr->nlmsg_len - NLMSG_HDRLEN;
+		struct nlmsghdr *hdr = nlmsg_hdr(nlmsg);
+		void *data = nlmsg_data(hdr);
+		int len = hdr->nlmsg_len - NLMSG_HDRLEN;
 
-			memset(data, 0, len);
-		}
+		memset(data, 0, len);
 	}
 
 	nlmsg_free(nlmsg);
@@ -915,6 +1031,7 @@ static int nl_get_multicast_id(struct sigma_dut *dut, struct nl80211_ctx *ctx,
 struct nl80211_ctx * nl80211_init(struct sigma_dut *dut)
 {
 	struct nl80211_ctx *ctx;
+	pthread_condattr_t attr;
 
 	ctx = calloc(1, sizeof(struct nl80211_ctx));
 	if (!ctx) {
@@ -922,6 +1039,11 @@ struct nl80211_ctx * nl80211_init(struct sigma_dut *dut)
 				"Failed to alloc nl80211_ctx");
 		return NULL;
 	}
+	pthread_mutex_init(&ctx->event_lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&ctx->event_cond, &attr);
+	pthread_condattr_destroy(&attr);
 
 	ctx->sock = nl_socket_alloc();
 	if (!ctx->sock) {
@@ -959,21 +1081,134 @@ struct nl80211_ctx * nl80211_init(struct sigma_dut *dut)
 		goto cleanup;
 	}
 
+	/* Replies are matched to requests by sequence number instead */
+	ctx->cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (!ctx->cb) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"Failed to alloc nl80211 callbacks");
+		goto cleanup;
+	}
+	nl_cb_set(ctx->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+	nl_cb_err(ctx->cb, NL_CB_CUSTOM, error_handler, ctx);
+	nl_cb_set(ctx->cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, ctx);
+	nl_cb_set(ctx->cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, ctx);
+	nl_cb_set(ctx->cb, NL_CB_VALID, NL_CB_CUSTOM, valid_handler, ctx);
+
 	return ctx;
 
 cleanup:
 	if (ctx->sock)
 		nl_socket_free(ctx->sock);
 
+	pthread_cond_destroy(&ctx->event_cond);
+	pthread_mutex_destroy(&ctx->event_lock);
 	free(ctx);
 	return NULL;
 }
 
 
+static int nl80211_event_valid(struct nl_msg *msg, void *arg)
+{
+	struct sigma_dut *dut = arg;
+	struct nl80211_ctx *ctx = dut->nl_ctx;
+	struct nlmsghdr *hdr = nlmsg_hdr(msg);
+	struct genlmsghdr *gnlh = nlmsg_data(hdr);
+	struct nlattr *tb[NL80211_ATTR_MAX + 1];
+	struct nl80211_event *ev;
+	struct nlmsghdr *copy;
+
+	copy = malloc(hdr->nlmsg_len);
+	if (!copy)
+		return NL_SKIP;
+	memcpy(copy, hdr, hdr->nlmsg_len);
+
+	nla_parse(tb, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+		  genlmsg_attrlen(gnlh, 0), NULL);
+
+	pthread_mutex_lock(&ctx->event_lock);
+	ev = &ctx->events[(ctx->event_seq + 1) % NL80211_EVENT_RING_SIZE];
+	free(ev->msg);
+	ev->seq = ++ctx->event_seq;
+	ev->cmd = gnlh->cmd;
+	ev->vendor_id = tb[NL80211_ATTR_VENDOR_ID] ?
+		nla_get_u32(tb[NL80211_ATTR_VENDOR_ID]) : 0;
+	ev->vendor_subcmd = tb[NL80211_ATTR_VENDOR_SUBCMD] ?
+		nla_get_u32(tb[NL80211_ATTR_VENDOR_SUBCMD]) : 0;
+	ev->ifindex = tb[NL80211_ATTR_IFINDEX] ?
+		(int) nla_get_u32(tb[NL80211_ATTR_IFINDEX]) : 0;
+	ev->msg = copy;
+
+	pthread_cond_broadcast(&ctx->event_cond);
+	pthread_mutex_unlock(&ctx->event_lock);
+
+	return NL_SKIP;
+}
+
+
+static void * nl80211_event_thread(void *arg)
+{
+	struct sigma_dut *dut = arg;
+	struct nl80211_ctx *ctx = dut->nl_ctx;
+	struct pollfd pfd[2];
+	int res;
+
+	pfd[0].fd = nl_socket_get_fd(ctx->event_sock);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ctx->event_pipe[0];
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		res = poll(pfd, 2, -1);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"nl80211: event poll failed: %s",
+					strerror(errno));
+			break;
+		}
+		if (pfd[1].revents)
+			break;
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		res = nl_recvmsgs_default(ctx->event_sock);
+		if (res < 0 && res != -NLE_AGAIN)
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"nl80211: event receive failed: %d (%s)",
+					res, nl_geterror(res));
+	}
+
+	return NULL;
+}
+
+
+static void nl80211_add_event_group(struct sigma_dut *dut,
+				    struct nl80211_ctx *ctx, const char *group)
+{
+	int ret;
+
+	ret = nl_get_multicast_id(dut, ctx, "nl80211", group);
+	if (ret >= 0)
+		ret = nl_socket_add_membership(ctx->event_sock, ret);
+	if (ret < 0) {
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"nl80211: Could not add multicast membership for %s events: %d (%s)",
+				group, ret, nl_geterror(ret));
+		/* Continue without these events */
+	}
+}
+
+
+/*
+ * Start the nl80211 event dispatcher if it is not already running. A single
+ * background thread receives the vendor events and keeps the most recent ones
+ * in a ring so that any number of nl80211_event_wait() callers can look for
+ * the events they need.
+ */
 int nl80211_open_event_sock(struct sigma_dut *dut)
 {
 	struct nl_cb *cb = NULL;
-	int ret;
 	struct nl80211_ctx *ctx = dut->nl_ctx;
 
 	if (!ctx) {
@@ -981,7 +1216,9 @@ int nl80211_open_event_sock(struct sigma_dut *dut)
 		return -1;
 	}
 
-	nl80211_close_event_sock(dut);
+	if (ctx->event_sock)
+		return 0;
+
 	ctx->event_sock = nl_socket_alloc();
 	if (!ctx->event_sock) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
@@ -994,7 +1231,7 @@ int nl80211_open_event_sock(struct sigma_dut *dut)
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"Could not connect event socket, err: %s",
 				strerror(errno));
-		return -1;
+		goto fail;
 	}
 
 	if (nl_socket_set_buffer_size(ctx->event_sock, SOCK_BUF_SIZE, 0) < 0) {
@@ -1002,45 +1239,142 @@ int nl80211_open_event_sock(struct sigma_dut *dut)
 				"Fail to set nl_socket RX buff size for event sock: %s",
 				strerror(errno));
 	}
+	nl_socket_set_nonblocking(ctx->event_sock);
 
 	cb = nl_socket_get_cb(ctx->event_sock);
 	if (!cb) {
 		sigma_dut_print(dut, DUT_MSG_INFO,
 				"Failed to get NL control block for event socket port");
-		return -1;
+		goto fail;
 	}
 
-	ret = nl_get_multicast_id(dut, ctx, "nl80211", "vendor");
-	if (ret >= 0)
-		ret = nl_socket_add_membership(ctx->event_sock, ret);
-	if (ret < 0) {
-		sigma_dut_print(dut, DUT_MSG_INFO,
-				"nl80211: Could not add multicast "
-				"membership for vendor events: %d (%s)",
-			   ret, nl_geterror(ret));
-		/* Continue without vendor events */
-	}
-	nl_cb_err(cb, NL_CB_CUSTOM, error_handler, &ret);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, finish_handler, &ret);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, ack_handler, &ret);
+	nl80211_add_event_group(dut, ctx, "vendor");
+
 	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, no_seq_check, NULL);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, nl80211_event_valid, dut);
 	nl_cb_put(cb);
 
+	if (pipe(ctx->event_pipe) < 0) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"nl80211: event pipe failed: %s",
+				strerror(errno));
+		goto fail;
+	}
+
+	if (pthread_create(&ctx->event_thread, NULL, nl80211_event_thread,
+			   dut)) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"nl80211: Failed to start event thread");
+		close(ctx->event_pipe[0]);
+		close(ctx->event_pipe[1]);
+		goto fail;
+	}
+
 	return 0;
+
+fail:
+	nl_socket_free(ctx->event_sock);
+	ctx->event_sock = NULL;
+	return -1;
+}
+
+
+/* Sequence number of the latest event; pass to nl80211_event_wait() */
+unsigned long long nl80211_event_seq(struct sigma_dut *dut)
+{
+	struct nl80211_ctx *ctx = dut->nl_ctx;
+	unsigned long long seq;
+
+	if (!ctx)
+		return 0;
+	pthread_mutex_lock(&ctx->event_lock);
+	seq = ctx->event_seq;
+	pthread_mutex_unlock(&ctx->event_lock);
+
+	return seq;
+}
+
+
+/*
+ * Wait for an event after *seq for which match() returns nonzero. Events that
+ * arrived since *seq was taken are considered first, so taking the sequence
+ * number before sending a command means its response cannot be missed. *seq
+ * is advanced past the events examined. Returns 1 on a match, 0 on timeout, or
+ * -1 if the dispatcher is not running. match() is called with the event lock
+ * held, so it should only copy out what it needs and leave logging and further
+ * processing to the caller.
+ */
+int nl80211_event_wait(struct sigma_dut *dut, unsigned long long *seq,
+		       int (*match)(struct sigma_dut *dut,
+				    const struct nl80211_event *ev, void *ctx),
+		       void *ctx, unsigned int timeout_ms)
+{
+	struct nl80211_ctx *nl = dut->nl_ctx;
+	struct nl80211_event *ev;
+	struct timespec deadline;
+	unsigned long long dropped = 0;
+	int res = 0;
+
+	if (!nl || !nl->event_sock)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&nl->event_lock);
+	for (;;) {
+		if (nl->event_seq - *seq > NL80211_EVENT_RING_SIZE) {
+			dropped += nl->event_seq - *seq -
+				NL80211_EVENT_RING_SIZE;
+			*seq = nl->event_seq - NL80211_EVENT_RING_SIZE;
+		}
+		while (*seq < nl->event_seq) {
+			(*seq)++;
+			ev = &nl->events[*seq % NL80211_EVENT_RING_SIZE];
+			if (match(dut, ev, ctx)) {
+				res = 1;
+				goto out;
+			}
+		}
+		if (pthread_cond_timedwait(&nl->event_cond, &nl->event_lock,
+					   &deadline) == ETIMEDOUT)
+			break;
+	}
+out:
+	pthread_mutex_unlock(&nl->event_lock);
+
+	if (dropped)
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"nl80211: %llu events dropped from the ring before they were examined",
+				dropped);
+
+	return res;
 }
 
 
 void nl80211_deinit(struct sigma_dut *dut, struct nl80211_ctx *ctx)
 {
+	int i;
+
 	if (!ctx) {
 		sigma_dut_print(dut, DUT_MSG_ERROR, "%s: ctx is NULL",
 				__func__);
 		return;
 	}
+	nl80211_close_event_sock(dut);
+	if (ctx->cb)
+		nl_cb_put(ctx->cb);
 	if (ctx->sock)
 		nl_socket_free(ctx->sock);
-	if (ctx->event_sock)
-		nl_socket_free(ctx->event_sock);
+	for (i = 0; i < NL80211_EVENT_RING_SIZE; i++)
+		free(ctx->events[i].msg);
+	pthread_cond_destroy(&ctx->event_cond);
+	pthread_mutex_destroy(&ctx->event_lock);
 	free(ctx);
 }
 
@@ -1049,18 +1383,68 @@ void nl80211_close_event_sock(struct sigma_dut *dut)
 {
 	struct nl80211_ctx *ctx = dut->nl_ctx;
 
-	if (ctx && ctx->event_sock) {
-		nl_socket_free(ctx->event_sock);
-		ctx->event_sock = NULL;
+	if (!ctx || !ctx->event_sock)
+		return;
+
+	if (write(ctx->event_pipe[1], "", 1) < 0)
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"nl80211: event thread wakeup failed: %s",
+				strerror(errno));
+	pthread_join(ctx->event_thread, NULL);
+	close(ctx->event_pipe[0]);
+	close(ctx->event_pipe[1]);
+	nl_socket_free(ctx->event_sock);
+	ctx->event_sock = NULL;
+}
+
+
+/* Test config settings queued by wcn_wifi_test_config_batch_start() */
+#define WCN_TEST_CONFIG_BATCH_MAX 32
+
+struct wcn_test_config_attr {
+	int id;
+	int type; /* NLA_FLAG, NLA_U8, or NLA_U16 */
+	uint16_t val;
+};
+
+struct wcn_test_config_batch {
+	char intf[IFNAMSIZ];
+	unsigned int num_attrs;
+	struct wcn_test_config_attr attrs[WCN_TEST_CONFIG_BATCH_MAX];
+};
+
+/* Consecutive attributes sent in a single vendor command */
+struct wcn_test_config_group {
+	unsigned int start;
+	unsigned int len;
+	int res;
+};
+
+
+static int wcn_test_config_put(struct nl_msg *msg,
+			       const struct wcn_test_config_attr *attr)
+{
+	switch (attr->type) {
+	case NLA_FLAG:
+		return nla_put_flag(msg, attr->id);
+	case NLA_U8:
+		return nla_put_u8(msg, attr->id, attr->val);
+	case NLA_U16:
+		return nla_put_u16(msg, attr->id, attr->val);
 	}
+	return -1;
 }
 
 
 static struct nl_msg *
-wcn_create_wifi_test_config_msg(struct sigma_dut *dut, const char *intf)
+wcn_create_wifi_test_config_msg(struct sigma_dut *dut, const char *intf,
+				const struct wcn_test_config_attr *attrs,
+				unsigned int num_attrs)
 {
 	int ifindex;
 	struct nl_msg *msg;
+	struct nlattr *params;
+	unsigned int i;
 
 	ifindex = if_nametoindex(intf);
 	if (ifindex == 0) {
@@ -1075,108 +1459,269 @@ wcn_create_wifi_test_config_msg(struct sigma_dut *dut, const char *intf)
 	    nla_put_u32(msg, NL80211_ATTR_IFINDEX, ifindex) ||
 	    nla_put_u32(msg, NL80211_ATTR_VENDOR_ID, OUI_QCA) ||
 	    nla_put_u32(msg, NL80211_ATTR_VENDOR_SUBCMD,
-			QCA_NL80211_VENDOR_SUBCMD_WIFI_TEST_CONFIGURATION)) {
+			QCA_NL80211_VENDOR_SUBCMD_WIFI_TEST_CONFIGURATION) ||
+	    !(params = nla_nest_start(msg, NL80211_ATTR_VENDOR_DATA))) {
 		nlmsg_free(msg);
 		return NULL;
 	}
 
+	for (i = 0; i < num_attrs; i++) {
+		if (wcn_test_config_put(msg, &attrs[i])) {
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"%s: err in adding test config data for %d",
+					__func__, attrs[i].id);
+			nlmsg_free(msg);
+			return NULL;
+		}
+	}
+	nla_nest_end(msg, params);
+
 	return msg;
 }
 
 
-static int wcn_send_wifi_test_config_msg(struct sigma_dut *dut,
-					 struct nl_msg *msg,
-					 struct nlattr *params, int attr_id)
+static void wcn_send_wifi_test_config_groups(
+	struct sigma_dut *dut, const char *intf,
+	const struct wcn_test_config_attr *attrs,
+	struct wcn_test_config_group *groups, unsigned int num_groups)
 {
-	int ret;
+	struct nl_msg *msgs[WCN_TEST_CONFIG_BATCH_MAX];
+	int res[WCN_TEST_CONFIG_BATCH_MAX];
+	unsigned int idx[WCN_TEST_CONFIG_BATCH_MAX];
+	unsigned int i, n = 0;
+
+	for (i = 0; i < num_groups; i++) {
+		msgs[n] = wcn_create_wifi_test_config_msg(dut, intf,
+							  &attrs[groups[i].start],
+							  groups[i].len);
+		if (!msgs[n]) {
+			groups[i].res = -1;
+			continue;
+		}
+		idx[n++] = i;
+	}
 
-	nla_nest_end(msg, params);
+	if (n == 0)
+		return;
+	nl80211_send_msgs(dut, dut->nl_ctx, msgs, res, n, NULL, NULL);
+	for (i = 0; i < n; i++)
+		groups[idx[i]].res = res[i];
+}
 
-	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
-	if (ret) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"%s: err in send_and_recv_msgs, ret=%d for %d",
-				__func__, ret, attr_id);
-	}
 
-	return ret;
+/* The driver applies the attributes of one command in its own order, so
+ * settings that reset others must not share a command with them. */
+static int wcn_test_config_is_reset(int attr_id)
+{
+	return attr_id ==
+		QCA_WLAN_VENDOR_ATTR_WIFI_TEST_CONFIG_SET_HE_TESTBED_DEFAULTS ||
+		attr_id ==
+		QCA_WLAN_VENDOR_ATTR_WIFI_TEST_CONFIG_SET_EHT_TESTBED_DEFAULTS ||
+		attr_id ==
+		QCA_WLAN_VENDOR_ATTR_WIFI_TEST_CONFIG_CLEAR_HE_OM_CTRL_CONFIG;
 }
 
 
-int wcn_wifi_test_config_set_flag(struct sigma_dut *dut, const char *intf,
-				  int attr_id)
+static int wcn_test_config_fits(const struct wcn_test_config_attr *attrs,
+				const struct wcn_test_config_group *group,
+				unsigned int next)
 {
-	struct nl_msg *msg;
-	struct nlattr *params;
+	unsigned int i;
 
-	if (!(msg = wcn_create_wifi_test_config_msg(dut, intf)) ||
-	    !(params = nla_nest_start(msg, NL80211_ATTR_VENDOR_DATA)) ||
-	    nla_put_flag(msg, attr_id)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"%s: err in adding test config data for %d",
-				__func__, attr_id);
-		nlmsg_free(msg);
-		return -1;
+	if (wcn_test_config_is_reset(attrs[next].id) ||
+	    wcn_test_config_is_reset(attrs[group->start].id))
+		return 0;
+
+	/* A repeated attribute must be applied after the earlier value */
+	for (i = group->start; i < next; i++) {
+		if (attrs[i].id == attrs[next].id)
+			return 0;
 	}
 
-	return wcn_send_wifi_test_config_msg(dut, msg, params, attr_id);
+	return 1;
 }
 
 
-int wcn_wifi_test_config_set_u8(struct sigma_dut *dut, const char *intf,
-				int attr_id, uint8_t val)
+/**
+ * wcn_wifi_test_config_flush - Send the queued test config settings
+ *
+ * The queued settings are packed into as few test config vendor commands as
+ * possible. A new command is only started where the order matters (a reset
+ * setting or a repeated attribute), so the commands are sent one after the
+ * other. If a packed command is rejected, its settings are retried one per
+ * command, pipelined, before the next command is sent so that a setting the
+ * driver does not support neither prevents the others from being applied nor
+ * moves them after a later reset.
+ */
+int wcn_wifi_test_config_flush(struct sigma_dut *dut)
 {
-	struct nl_msg *msg;
-	struct nlattr *params;
+	struct wcn_test_config_batch *batch = dut->test_config_batch;
+	struct wcn_test_config_group groups[WCN_TEST_CONFIG_BATCH_MAX];
+	struct wcn_test_config_group retry[WCN_TEST_CONFIG_BATCH_MAX];
+	struct wcn_test_config_group *group = NULL;
+	unsigned int i, j, num_retry, num_groups = 0;
+	int ret = 0;
+
+	if (!batch || batch->num_attrs == 0)
+		return 0;
 
-	if (!(msg = wcn_create_wifi_test_config_msg(dut, intf)) ||
-	    !(params = nla_nest_start(msg, NL80211_ATTR_VENDOR_DATA)) ||
-	    nla_put_u8(msg, attr_id, val)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"%s: err in adding test config data for %d",
-				__func__, attr_id);
-		nlmsg_free(msg);
-		return -1;
-	}
+	/* Detach the batch so that sending does not queue or flush again */
+	dut->test_config_batch = NULL;
 
-	return wcn_send_wifi_test_config_msg(dut, msg, params, attr_id);
-}
+	for (i = 0; i < batch->num_attrs; i++) {
+		if (!group || !wcn_test_config_fits(batch->attrs, group, i)) {
+			group = &groups[num_groups++];
+			group->start = i;
+			group->len = 0;
+		}
+		group->len++;
+	}
 
+	for (i = 0; i < num_groups; i++) {
+		group = &groups[i];
+		wcn_send_wifi_test_config_groups(dut, batch->intf,
+						 batch->attrs, group, 1);
+		if (group->res == 0)
+			continue;
 
-int wcn_wifi_test_config_set_u16(struct sigma_dut *dut, const char *intf,
-				 int attr_id, uint16_t val)
-{
-	struct nl_msg *msg;
-	struct nlattr *params;
+		if (group->len == 1) {
+			retry[0] = *group;
+			num_retry = 1;
+		} else {
+			sigma_dut_print(dut, DUT_MSG_DEBUG,
+					"%s: packed test config rejected (%d), sending %u attributes separately",
+					__func__, group->res, group->len);
+			for (j = 0; j < group->len; j++) {
+				retry[j].start = group->start + j;
+				retry[j].len = 1;
+			}
+			num_retry = group->len;
+			wcn_send_wifi_test_config_groups(dut, batch->intf,
+							 batch->attrs, retry,
+							 num_retry);
+		}
 
-	if (!(msg = wcn_create_wifi_test_config_msg(dut, intf)) ||
-	    !(params = nla_nest_start(msg, NL80211_ATTR_VENDOR_DATA)) ||
-	    nla_put_u16(msg, attr_id, val)) {
-		sigma_dut_print(dut, DUT_MSG_ERROR,
-				"%s: err in adding test config data for %d",
-				__func__, attr_id);
-		nlmsg_free(msg);
-		return -1;
+		for (j = 0; j < num_retry; j++) {
+			if (retry[j].res == 0)
+				continue;
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"%s: err in send_and_recv_msgs, ret=%d for %d",
+					__func__, retry[j].res,
+					batch->attrs[retry[j].start].id);
+			if (!ret)
+				ret = retry[j].res;
+		}
 	}
 
-	return wcn_send_wifi_test_config_msg(dut, msg, params, attr_id);
+	batch->num_attrs = 0;
+	dut->test_config_batch = batch;
+	return ret;
 }
 
-#endif /* NL80211_SUPPORT */
-
 
-static int get_wps_pin_checksum(int pin)
+/**
+ * wcn_wifi_test_config_batch_start - Queue test config settings of an interface
+ *
+ * Until wcn_wifi_test_config_batch_commit(), wcn_wifi_test_config_set_*() for
+ * intf only queue the setting and return 0; errors are reported by the commit.
+ * Queued settings are sent before any other nl80211 command, but only
+ * independent settings should be batched since their order within a packed
+ * command is up to the driver.
+ */
+void wcn_wifi_test_config_batch_start(struct sigma_dut *dut, const char *intf)
 {
-	int a = 0;
+	struct wcn_test_config_batch *batch;
 
-	while (pin > 0) {
-		a += 3 * (pin % 10);
-		pin = pin / 10;
-		a += (pin % 10);
-		pin = pin / 10;
-	}
+	wcn_wifi_test_config_batch_commit(dut);
 
-	return (10 - (a % 10)) % 10;
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return; /* settings are sent one by one instead */
+	strlcpy(batch->intf, intf, sizeof(batch->intf));
+	dut->test_config_batch = batch;
+}
+
+
+int wcn_wifi_test_config_batch_commit(struct sigma_dut *dut)
+{
+	int ret;
+
+	ret = wcn_wifi_test_config_flush(dut);
+	free(dut->test_config_batch);
+	dut->test_config_batch = NULL;
+	return ret;
+}
+
+
+static int wcn_wifi_test_config_set(struct sigma_dut *dut, const char *intf,
+				    int attr_id, int type, uint16_t val)
+{
+	struct wcn_test_config_batch *batch = dut->test_config_batch;
+	struct wcn_test_config_attr attr;
+	struct nl_msg *msg;
+	int ret;
+
+	attr.id = attr_id;
+	attr.type = type;
+	attr.val = val;
+
+	if (batch && strcmp(batch->intf, intf) == 0) {
+		if (batch->num_attrs == WCN_TEST_CONFIG_BATCH_MAX)
+			wcn_wifi_test_config_flush(dut);
+		batch->attrs[batch->num_attrs++] = attr;
+		return 0;
+	}
+
+	msg = wcn_create_wifi_test_config_msg(dut, intf, &attr, 1);
+	if (!msg)
+		return -1;
+
+	ret = send_and_recv_msgs(dut, dut->nl_ctx, msg, NULL, NULL);
+	if (ret) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"%s: err in send_and_recv_msgs, ret=%d for %d",
+				__func__, ret, attr_id);
+	}
+
+	return ret;
+}
+
+
+int wcn_wifi_test_config_set_flag(struct sigma_dut *dut, const char *intf,
+				  int attr_id)
+{
+	return wcn_wifi_test_config_set(dut, intf, attr_id, NLA_FLAG, 0);
+}
+
+
+int wcn_wifi_test_config_set_u8(struct sigma_dut *dut, const char *intf,
+				int attr_id, uint8_t val)
+{
+	return wcn_wifi_test_config_set(dut, intf, attr_id, NLA_U8, val);
+}
+
+
+int wcn_wifi_test_config_set_u16(struct sigma_dut *dut, const char *intf,
+				 int attr_id, uint16_t val)
+{
+	return wcn_wifi_test_config_set(dut, intf, attr_id, NLA_U16, val);
+}
+
+#endif /* NL80211_SUPPORT */
+
+
+static int get_wps_pin_checksum(int pin)
+{
+	int a = 0;
+
+	while (pin > 0) {
+		a += 3 * (pin % 10);
+		pin = pin / 10;
+		a += (pin % 10);
+		pin = pin / 10;
+	}
+
+	return (10 - (a % 10)) % 10;
 }
 
 
@@ -1542,3 +2087,1082 @@ u16 get_link_id_bitmask(const char *param)
 
 	return bitmask;
 }
+
+
+/* Case-insensitive (ASCII) string hash matching strcasecmp() equality */
+unsigned int str_hash_nocase(const char *str)
+{
+	unsigned int hash = 5381;
+	unsigned char c;
+
+	while ((c = *str++)) {
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+		hash = ((hash << 5) + hash) ^ c;
+	}
+
+	return hash;
+}
+
+
+/* Exit status reported by the shell when a command cannot be executed */
+#define EXEC_FAILED_STATUS (127 << 8)
+#define MAX_EXEC_ARGS 64
+
+extern char **environ;
+
+/*
+ * Run a program with the given argument vector without going through the
+ * shell. Returns the wait status of the process in the same format as
+ * system().
+ */
+int run_argv(struct sigma_dut *dut, char *const argv[])
+{
+	pid_t pid;
+	int res, status;
+
+	res = posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ);
+	if (res) {
+		sigma_dut_print(dut, DUT_MSG_INFO, "Failed to execute '%s': %s",
+				argv[0], strerror(res));
+		return EXEC_FAILED_STATUS;
+	}
+
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			sigma_dut_print(dut, DUT_MSG_INFO, "waitpid: %s",
+					strerror(errno));
+			return -1;
+		}
+	}
+
+	return status;
+}
+
+
+int set_ifc_up(struct sigma_dut *dut, const char *ifname, bool up)
+{
+	struct ifreq ifr;
+	int s, res = -1;
+
+	if (strlen(ifname) >= sizeof(ifr.ifr_name))
+		return -1;
+
+	s = socket(AF_INET, SOCK_DGRAM, 0);
+	if (s < 0)
+		return -1;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strlcpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name));
+	if (ioctl(s, SIOCGIFFLAGS, &ifr) < 0) {
+		sigma_dut_print(dut, DUT_MSG_DEBUG, "SIOCGIFFLAGS(%s): %s",
+				ifname, strerror(errno));
+		goto out;
+	}
+
+	if (!!(ifr.ifr_flags & IFF_UP) == up) {
+		res = 0;
+		goto out;
+	}
+
+	if (up)
+		ifr.ifr_flags |= IFF_UP;
+	else
+		ifr.ifr_flags &= ~IFF_UP;
+	if (ioctl(s, SIOCSIFFLAGS, &ifr) < 0) {
+		sigma_dut_print(dut, DUT_MSG_DEBUG, "SIOCSIFFLAGS(%s): %s",
+				ifname, strerror(errno));
+		goto out;
+	}
+
+	res = 0;
+out:
+	close(s);
+	return res;
+}
+
+
+/* Monitor interface used for frame injection */
+#define INJECT_IFNAME "sigmadut"
+
+struct inject_ctx {
+	int sock;
+	int ifindex; /* of INJECT_IFNAME */
+	char parent[IFNAMSIZ]; /* interface of the radio INJECT_IFNAME is on */
+	int tx_status; /* -1 = not yet known, 0 = not reported, 1 = reported */
+
+	/* TX status of the frames sent by the latest inject_frames() call,
+	 * recognized by frame type/subtype and addr1/addr2 */
+	u8 fc;
+	u8 addr[2 * ETH_ALEN];
+	unsigned int num_pending;
+	unsigned int num_status;
+	unsigned int num_acked;
+};
+
+
+static int inject_del_monitor(struct sigma_dut *dut)
+{
+	int ifindex = if_nametoindex(INJECT_IFNAME);
+
+	if (ifindex == 0)
+		return 0;
+
+#ifdef NL80211_SUPPORT
+	if (dut->nl_ctx) {
+		struct nl_msg *msg;
+
+		msg = nl80211_drv_msg(dut, dut->nl_ctx, ifindex, 0,
+				      NL80211_CMD_DEL_INTERFACE);
+		if (msg && send_and_recv_msgs(dut, dut->nl_ctx, msg,
+					      NULL, NULL) == 0)
+			return 0;
+	}
+#endif /* NL80211_SUPPORT */
+
+	if (system("iw dev " INJECT_IFNAME " del") != 0) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"Failed to remove monitor interface");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+void inject_close(struct sigma_dut *dut, bool remove_iface)
+{
+	struct inject_ctx *inj = dut->inject;
+
+	if (inj) {
+		close(inj->sock);
+		free(inj);
+		dut->inject = NULL;
+	}
+
+	if (remove_iface)
+		inject_del_monitor(dut);
+}
+
+
+#ifdef __linux__
+
+/* Frames handed to a single sendmmsg() call */
+#define INJECT_BURST 32
+/* Give up on a burst if the transmit queue makes no progress this long */
+#define INJECT_STALL_MS 1000
+#define INJECT_BACKOFF_MAX_MS 16
+
+#define RADIOTAP_FLAGS		1
+#define RADIOTAP_RATE		2
+#define RADIOTAP_TX_FLAGS	15
+#define RADIOTAP_MCS		19
+#define RADIOTAP_VHT		21
+#define RADIOTAP_EXT		31
+
+#define RADIOTAP_F_WEP		0x04
+#define RADIOTAP_F_FRAG		0x08
+#define RADIOTAP_F_TX_FAIL	0x0001
+
+#define RADIOTAP_MCS_HAVE_BW	0x01
+#define RADIOTAP_MCS_HAVE_MCS	0x02
+#define RADIOTAP_MCS_BW_40	0x01
+#define RADIOTAP_VHT_KNOWN_BW	0x0040
+
+static void put_le16(u8 *pos, u16 val)
+{
+	pos[0] = val & 0xff;
+	pos[1] = val >> 8;
+}
+
+
+static u16 get_le16(const u8 *pos)
+{
+	return pos[0] | (pos[1] << 8);
+}
+
+
+static u32 get_le32(const u8 *pos)
+{
+	return get_le16(pos) | ((u32) get_le16(pos + 2) << 16);
+}
+
+
+static int inject_add_monitor(struct sigma_dut *dut, const char *ifname)
+{
+	char buf[100];
+
+#ifdef NL80211_SUPPORT
+	struct nl_msg *msg;
+	int ifindex = if_nametoindex(ifname);
+
+	if (dut->nl_ctx && ifindex &&
+	    (msg = nl80211_drv_msg(dut, dut->nl_ctx, ifindex, 0,
+				   NL80211_CMD_NEW_INTERFACE))) {
+		if (nla_put_string(msg, NL80211_ATTR_IFNAME, INJECT_IFNAME) ||
+		    nla_put_u32(msg, NL80211_ATTR_IFTYPE,
+				NL80211_IFTYPE_MONITOR))
+			nlmsg_free(msg);
+		else if (send_and_recv_msgs(dut, dut->nl_ctx, msg,
+					    NULL, NULL) == 0)
+			return 0;
+	}
+#endif /* NL80211_SUPPORT */
+
+	snprintf(buf, sizeof(buf), "iw dev %s interface add %s type monitor",
+		 ifname, INJECT_IFNAME);
+	if (system(buf) != 0) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"Failed to add monitor interface with '%s'",
+				buf);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * inject_open - Open the frame injection channel on the radio of an interface
+ *
+ * The monitor interface and the socket bound to it are kept open across
+ * commands and are only recreated if the monitor interface disappears or
+ * injection is requested on another radio.
+ */
+int inject_open(struct sigma_dut *dut, const char *ifname)
+{
+	struct inject_ctx *inj = dut->inject;
+	int ifindex = if_nametoindex(INJECT_IFNAME);
+	/* Queue only the TX status reports of injected frames (i.e., frames
+	 * with the radiotap TX flags field), not all traffic on the channel */
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 5),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x80, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 256),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = ARRAY_SIZE(filter),
+		.filter = filter,
+	};
+
+	if (inj && inj->ifindex == ifindex && strcmp(inj->parent, ifname) == 0)
+		return 0;
+
+	if (inj && ifindex && strcmp(inj->parent, ifname) != 0) {
+		inject_close(dut, true);
+		ifindex = 0;
+	} else {
+		inject_close(dut, false);
+	}
+
+	if (ifindex == 0) {
+		if (inject_add_monitor(dut, ifname) < 0)
+			return -1;
+		ifindex = if_nametoindex(INJECT_IFNAME);
+		if (ifindex == 0) {
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"Monitor interface %s not found",
+					INJECT_IFNAME);
+			return -1;
+		}
+	}
+
+	if (set_ifc_up(dut, INJECT_IFNAME, true) < 0) {
+		sigma_dut_print(dut, DUT_MSG_ERROR,
+				"Failed to set monitor interface up");
+		return -1;
+	}
+
+	inj = calloc(1, sizeof(*inj));
+	if (!inj)
+		return -1;
+	inj->sock = open_monitor(INJECT_IFNAME);
+	if (inj->sock < 0) {
+		free(inj);
+		return -1;
+	}
+	if (setsockopt(inj->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+		       sizeof(prog)) < 0)
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"Failed to attach injection socket filter: %s",
+				strerror(errno));
+	inj->ifindex = ifindex;
+	strlcpy(inj->parent, ifname, sizeof(inj->parent));
+	inj->tx_status = -1;
+	dut->inject = inj;
+
+	sigma_dut_print(dut, DUT_MSG_DEBUG, "Frame injection on %s via %s",
+			ifname, INJECT_IFNAME);
+	return 0;
+}
+
+
+static size_t inject_radiotap(u8 *buf, const struct inject_params *params)
+{
+	u32 present = BIT(RADIOTAP_FLAGS) | BIT(RADIOTAP_TX_FLAGS);
+	u8 *pos = buf + 8;
+
+	/* Fields are aligned to their size from the start of the header */
+	*pos++ = RADIOTAP_F_FRAG | (params->encrypt ? RADIOTAP_F_WEP : 0);
+	if (params->rate) {
+		present |= BIT(RADIOTAP_RATE);
+		*pos++ = params->rate;
+	}
+	if ((pos - buf) & 1)
+		*pos++ = 0;
+	put_le16(pos, 0); /* TX flags */
+	pos += 2;
+
+	if (params->mcs >= 0 && params->nss == 0) {
+		present |= BIT(RADIOTAP_MCS);
+		*pos++ = RADIOTAP_MCS_HAVE_MCS | RADIOTAP_MCS_HAVE_BW;
+		*pos++ = params->bw == 40 ? RADIOTAP_MCS_BW_40 : 0;
+		*pos++ = params->mcs;
+	} else if (params->mcs >= 0) {
+		present |= BIT(RADIOTAP_VHT);
+		if ((pos - buf) & 1)
+			*pos++ = 0;
+		put_le16(pos, RADIOTAP_VHT_KNOWN_BW);
+		pos += 2;
+		*pos++ = 0; /* flags */
+		switch (params->bw) {
+		case 40:
+			*pos++ = 1;
+			break;
+		case 80:
+			*pos++ = 4;
+			break;
+		case 160:
+			*pos++ = 11;
+			break;
+		default:
+			*pos++ = 0;
+			break;
+		}
+		*pos++ = (params->mcs << 4) | params->nss;
+		/* mcs_nss of other users, coding, group ID, partial AID */
+		memset(pos, 0, 7);
+		pos += 7;
+	}
+
+	buf[0] = 0; /* version */
+	buf[1] = 0;
+	put_le16(buf + 2, pos - buf);
+	put_le16(buf + 4, present & 0xffff);
+	put_le16(buf + 6, present >> 16);
+
+	return pos - buf;
+}
+
+
+/* Returns the radiotap TX flags of a TX status report or -1 */
+static int inject_tx_flags(const u8 *buf, size_t len)
+{
+	/* Alignment and size of the fields preceding TX flags */
+	static const u8 fields[RADIOTAP_TX_FLAGS + 1][2] = {
+		{ 8, 8 }, /* TSFT */
+		{ 1, 1 }, /* flags */
+		{ 1, 1 }, /* rate */
+		{ 2, 4 }, /* channel */
+		{ 2, 2 }, /* FHSS */
+		{ 1, 1 }, /* dBm antenna signal */
+		{ 1, 1 }, /* dBm antenna noise */
+		{ 2, 2 }, /* lock quality */
+		{ 2, 2 }, /* TX attenuation */
+		{ 2, 2 }, /* dB TX attenuation */
+		{ 1, 1 }, /* dBm TX power */
+		{ 1, 1 }, /* antenna */
+		{ 1, 1 }, /* dB antenna signal */
+		{ 1, 1 }, /* dB antenna noise */
+		{ 2, 2 }, /* RX flags */
+		{ 2, 2 }, /* TX flags */
+	};
+	size_t rt_len, off = 8;
+	u32 present, ext;
+	unsigned int i;
+
+	if (len < 8)
+		return -1;
+	rt_len = get_le16(buf + 2);
+	present = ext = get_le32(buf + 4);
+	if (rt_len > len || !(present & BIT(RADIOTAP_TX_FLAGS)))
+		return -1;
+
+	while (ext & BIT(RADIOTAP_EXT)) {
+		if (off + 4 > rt_len)
+			return -1;
+		ext = get_le32(buf + off);
+		off += 4;
+	}
+
+	for (i = 0; i <= RADIOTAP_TX_FLAGS; i++) {
+		if (!(present & BIT(i)))
+			continue;
+		off = (off + fields[i][0] - 1) & ~(fields[i][0] - 1);
+		if (off + fields[i][1] > rt_len)
+			return -1;
+		if (i == RADIOTAP_TX_FLAGS)
+			return get_le16(buf + off);
+		off += fields[i][1];
+	}
+
+	return -1;
+}
+
+
+/* mac80211 reports the TX status of an injected frame by passing the frame
+ * back to the monitor interfaces with the radiotap TX flags field. */
+static void inject_read_status(struct inject_ctx *inj)
+{
+	u8 buf[256];
+	ssize_t len;
+	size_t rt_len;
+	int flags;
+
+	while ((len = recv(inj->sock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		flags = inject_tx_flags(buf, len);
+		if (flags < 0 || inj->num_status >= inj->num_pending)
+			continue;
+		rt_len = get_le16(buf + 2);
+		if ((size_t) len < rt_len + 4 + sizeof(inj->addr) ||
+		    buf[rt_len] != inj->fc ||
+		    memcmp(&buf[rt_len + 4], inj->addr, sizeof(inj->addr)) != 0)
+			continue;
+		inj->tx_status = 1;
+		inj->num_status++;
+		if (!(flags & RADIOTAP_F_TX_FAIL))
+			inj->num_acked++;
+	}
+}
+
+
+/**
+ * inject_frames - Inject params->count copies of an IEEE 802.11 frame
+ *
+ * Requires inject_open(). The copies are queued to the monitor interface with
+ * as few system calls as possible, waiting for the transmit queue to drain
+ * whenever it is full. Returns the number of copies sent or -1 if none could
+ * be sent.
+ */
+int inject_frames(struct sigma_dut *dut, const struct inject_params *params,
+		  const void *frame, size_t len)
+{
+	struct inject_ctx *inj = dut->inject;
+	u8 rtap[32];
+	struct iovec iov[2];
+	struct mmsghdr msgs[INJECT_BURST];
+	unsigned int i, n, sent = 0;
+	unsigned int backoff_ms = 1, stalled_ms = 0;
+	int res;
+
+	if (!inj || len < 4 + sizeof(inj->addr))
+		return -1;
+
+	iov[0].iov_base = rtap;
+	iov[0].iov_len = inject_radiotap(rtap, params);
+	iov[1].iov_base = (void *) frame;
+	iov[1].iov_len = len;
+
+	/* Forget status reports for frames of earlier commands */
+	inj->num_pending = 0;
+	inject_read_status(inj);
+	inj->num_status = inj->num_acked = 0;
+	inj->fc = ((const u8 *) frame)[0];
+	memcpy(inj->addr, (const u8 *) frame + 4, sizeof(inj->addr));
+
+	while (sent < (unsigned int) params->count) {
+		/* Keep the status reports of a long burst from overflowing
+		 * the socket receive buffer */
+		inject_read_status(inj);
+
+		n = params->count - sent;
+		if (n > INJECT_BURST)
+			n = INJECT_BURST;
+		memset(msgs, 0, n * sizeof(msgs[0]));
+		for (i = 0; i < n; i++) {
+			msgs[i].msg_hdr.msg_iov = iov;
+			msgs[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		res = sendmmsg(inj->sock, msgs, n, 0);
+		if (res < 0 && errno == ENOBUFS &&
+		    stalled_ms < INJECT_STALL_MS) {
+			/* Transmit queue full; give it time to drain */
+			usleep(backoff_ms * 1000);
+			stalled_ms += backoff_ms;
+			if (backoff_ms < INJECT_BACKOFF_MAX_MS)
+				backoff_ms *= 2;
+			continue;
+		}
+		if (res <= 0) {
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"Frame injection failed: %s",
+					strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < (unsigned int) res; i++) {
+			if (msgs[i].msg_len < iov[0].iov_len + len) {
+				sigma_dut_print(dut, DUT_MSG_ERROR,
+						"Only partial frame injected");
+				return sent ? (int) sent : -1;
+			}
+			sent++;
+			inj->num_pending++;
+		}
+		backoff_ms = 1;
+		stalled_ms = 0;
+	}
+
+	return sent ? (int) sent : -1;
+}
+
+
+/**
+ * inject_tx_status - Wait for the TX status of the latest injected frames
+ *
+ * Waits up to timeout_ms for the status of all frames sent by the latest
+ * inject_frames() call. Returns the number of frames whose status was
+ * reported and sets *acked to the number of those that were acknowledged.
+ * If the driver does not report TX status for injected frames, later calls
+ * return 0 without waiting.
+ */
+int inject_tx_status(struct sigma_dut *dut, int timeout_ms,
+		     unsigned int *acked)
+{
+	struct inject_ctx *inj = dut->inject;
+	struct timespec now, deadline;
+	struct pollfd pfd;
+	int wait_ms;
+
+	if (!inj)
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pfd.fd = inj->sock;
+	pfd.events = POLLIN;
+	inject_read_status(inj);
+	while (inj->num_status < inj->num_pending && inj->tx_status != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+			(deadline.tv_nsec - now.tv_nsec) / 1000000;
+		if (wait_ms <= 0)
+			break;
+		if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+			break;
+		inject_read_status(inj);
+	}
+
+	if (inj->tx_status < 0 && inj->num_pending && !inj->num_status) {
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"No TX status reported for injected frames");
+		inj->tx_status = 0;
+	}
+
+	if (acked)
+		*acked = inj->num_acked;
+	return inj->num_status;
+}
+
+#else /* __linux__ */
+
+int inject_open(struct sigma_dut *dut, const char *ifname)
+{
+	return -1;
+}
+
+
+int inject_frames(struct sigma_dut *dut, const struct inject_params *params,
+		  const void *frame, size_t len)
+{
+	return -1;
+}
+
+
+int inject_tx_status(struct sigma_dut *dut, int timeout_ms,
+		     unsigned int *acked)
+{
+	return -1;
+}
+
+#endif /* __linux__ */
+
+
+void inject_params_init(struct inject_params *params)
+{
+	memset(params, 0, sizeof(*params));
+	params->mcs = -1;
+	params->count = 1;
+}
+
+
+/**
+ * inject_params_parse - Get injection parameters from a command
+ *
+ * Parses the optional InjectRate (Mbps), InjectMCS, InjectNSS (selects a VHT
+ * rate), InjectBW (MHz), and InjectCount parameters. Returns 0 on success or
+ * -1 if one of them is invalid.
+ */
+int inject_params_parse(struct sigma_cmd *cmd, struct inject_params *params)
+{
+	const char *val;
+
+	inject_params_init(params);
+
+	val = get_param(cmd, "InjectRate");
+	if (val) {
+		params->rate = (int) (atof(val) * 2);
+		if (params->rate <= 0 || params->rate > 255)
+			return -1;
+	}
+
+	val = get_param(cmd, "InjectNSS");
+	if (val) {
+		params->nss = atoi(val);
+		if (params->nss < 1 || params->nss > 8)
+			return -1;
+	}
+
+	val = get_param(cmd, "InjectMCS");
+	if (val) {
+		params->mcs = atoi(val);
+		if (params->mcs < 0 || params->mcs > (params->nss ? 9 : 31))
+			return -1;
+	} else if (params->nss) {
+		return -1;
+	}
+
+	val = get_param(cmd, "InjectBW");
+	if (val) {
+		params->bw = atoi(val);
+		if (params->bw != 20 && params->bw != 40 &&
+		    params->bw != 80 && params->bw != 160)
+			return -1;
+		/* 80 and 160 MHz need a VHT rate */
+		if (params->bw > 40 && !params->nss)
+			return -1;
+	}
+
+	val = get_param(cmd, "InjectCount");
+	if (val) {
+		params->count = atoi(val);
+		if (params->count < 1 || params->count > 10000)
+			return -1;
+	}
+
+	return 0;
+}
+
+
+static int run_builtin(struct sigma_dut *dut, int argc, char *argv[])
+{
+	const char *ifname = NULL, *state = NULL;
+
+	/* ifconfig <ifname> up|down */
+	if (argc == 3 && strcmp(argv[0], "ifconfig") == 0) {
+		ifname = argv[1];
+		state = argv[2];
+	}
+
+	/* ip link set [dev] <ifname> up|down */
+	if ((argc == 5 || argc == 6) && strcmp(argv[0], "ip") == 0 &&
+	    strcmp(argv[1], "link") == 0 && strcmp(argv[2], "set") == 0) {
+		if (argc == 6 && strcmp(argv[3], "dev") != 0)
+			return -1;
+		ifname = argv[argc - 2];
+		state = argv[argc - 1];
+	}
+
+	if (!ifname || (strcmp(state, "up") != 0 && strcmp(state, "down") != 0))
+		return -1;
+
+	return set_ifc_up(dut, ifname, strcmp(state, "up") == 0);
+}
+
+
+/*
+ * Run a command line without the shell when that does not change its
+ * meaning, i.e., it is a plain list of words with no shell syntax. Interface
+ * up/down commands are handled with ioctl() without starting a process.
+ * Returns false if the command needs to be run through the shell.
+ */
+bool run_cmd_direct(struct sigma_dut *dut, const char *cmd, int *status)
+{
+	static const char *const shell_builtins[] = {
+		".", "alias", "cd", "eval", "exec", "exit", "export", "read",
+		"set", "shift", "source", "trap", "ulimit", "umask", "unset",
+		"wait", NULL
+	};
+	char *buf, *pos, *argv[MAX_EXEC_ARGS + 1];
+	int argc = 0, i;
+
+	if (strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~{}\n"))
+		return false;
+
+	buf = strdup(cmd);
+	if (!buf)
+		return false;
+
+	pos = buf;
+	for (;;) {
+		while (*pos == ' ' || *pos == '\t')
+			*pos++ = '\0';
+		if (*pos == '\0')
+			break;
+		if (argc == MAX_EXEC_ARGS) {
+			free(buf);
+			return false;
+		}
+		argv[argc++] = pos;
+		while (*pos && *pos != ' ' && *pos != '\t')
+			pos++;
+	}
+	argv[argc] = NULL;
+
+	/* Variable assignments and shell builtins need the shell */
+	if (argc == 0 || strchr(argv[0], '=')) {
+		free(buf);
+		return false;
+	}
+	for (i = 0; shell_builtins[i]; i++) {
+		if (strcmp(argv[0], shell_builtins[i]) == 0) {
+			free(buf);
+			return false;
+		}
+	}
+
+	if (run_builtin(dut, argc, argv) == 0)
+		*status = 0;
+	else
+		*status = run_argv(dut, argv);
+	free(buf);
+	return true;
+}
+
+
+/*
+ * Batched driver private commands
+ *
+ * While batching is active, run_iwpriv() calls are queued instead of being
+ * run one at a time. iwpriv_batch_flush(), also called by iwpriv_batch_end(),
+ * submits the whole list in a single pass. When the private command tool is
+ * iwpriv, the commands are issued directly as wireless extensions private
+ * ioctls over one socket with the private ioctl description table fetched
+ * once per interface; anything that cannot be handled that way is run through
+ * the command line tool.
+ * run_system() flushes the batch first so that the order of operations with
+ * other commands is maintained.
+ */
+
+struct iwpriv_batch_item {
+	char *ifname;
+	char *args;
+};
+
+
+void iwpriv_batch_start(struct sigma_dut *dut)
+{
+	dut->iwpriv_batching = true;
+}
+
+
+int iwpriv_batch_end(struct sigma_dut *dut)
+{
+	dut->iwpriv_batching = false;
+	return iwpriv_batch_flush(dut);
+}
+
+
+int iwpriv_batch_add(struct sigma_dut *dut, const char *ifname,
+		     const char *args)
+{
+	struct iwpriv_batch_item *item;
+
+	if (dut->iwpriv_batch_len == dut->iwpriv_batch_size) {
+		size_t size = dut->iwpriv_batch_size ?
+			dut->iwpriv_batch_size * 2 : 32;
+
+		item = realloc(dut->iwpriv_batch, size * sizeof(*item));
+		if (!item)
+			return -1;
+		dut->iwpriv_batch = item;
+		dut->iwpriv_batch_size = size;
+	}
+
+	item = &dut->iwpriv_batch[dut->iwpriv_batch_len];
+	item->ifname = strdup(ifname);
+	item->args = strdup(args);
+	if (!item->ifname || !item->args) {
+		free(item->ifname);
+		free(item->args);
+		return -1;
+	}
+	dut->iwpriv_batch_len++;
+
+	return 0;
+}
+
+
+#ifdef __linux__
+
+struct wext_priv_table {
+	char ifname[IFNAMSIZ];
+	struct iw_priv_args *args;
+	int num;
+};
+
+
+static int wext_get_priv_table(int s, const char *ifname,
+			       struct wext_priv_table *table)
+{
+	struct iwreq wrq;
+	struct iw_priv_args *args = NULL, *tmp;
+	int num = 16;
+
+	free(table->args);
+	table->args = NULL;
+	table->num = 0;
+	strlcpy(table->ifname, ifname, sizeof(table->ifname));
+
+	for (;;) {
+		tmp = realloc(args, num * sizeof(*args));
+		if (!tmp)
+			break;
+		args = tmp;
+
+		memset(&wrq, 0, sizeof(wrq));
+		strlcpy(wrq.ifr_name, ifname, sizeof(wrq.ifr_name));
+		wrq.u.data.pointer = args;
+		wrq.u.data.length = num;
+		if (ioctl(s, SIOCGIWPRIV, &wrq) == 0) {
+			table->args = args;
+			table->num = wrq.u.data.length;
+			return 0;
+		}
+		if (errno != E2BIG || num >= 1024)
+			break;
+		num *= 2;
+	}
+
+	free(args);
+	return -1;
+}
+
+
+static int wext_priv_size(__u16 args)
+{
+	switch (args & IW_PRIV_TYPE_MASK) {
+	case IW_PRIV_TYPE_BYTE:
+	case IW_PRIV_TYPE_CHAR:
+		return args & IW_PRIV_SIZE_MASK;
+	case IW_PRIV_TYPE_INT:
+		return (args & IW_PRIV_SIZE_MASK) * sizeof(__u32);
+	case IW_PRIV_TYPE_FLOAT:
+		return (args & IW_PRIV_SIZE_MASK) * sizeof(struct iw_freq);
+	case IW_PRIV_TYPE_ADDR:
+		return (args & IW_PRIV_SIZE_MASK) * sizeof(struct sockaddr);
+	default:
+		return 0;
+	}
+}
+
+
+/*
+ * Issue a "<name> [arg...]" private command the same way iwpriv does,
+ * including sub-ioctls that share a real ioctl number. Only integer and
+ * string arguments are supported. Returns 1 if the command cannot be handled
+ * here and needs to be run with the command line tool.
+ */
+static int wext_priv_set(struct sigma_dut *dut, int s,
+			 const struct wext_priv_table *table,
+			 const char *ifname, const char *cmd)
+{
+	char buf[256], *argv[32], *pos, *name;
+	const struct iw_priv_args *priv = table->args;
+	union {
+		__s32 ints[64];
+		char chars[256];
+	} data;
+	struct iwreq wrq;
+	int argc = 0, i, k, j, subcmd = 0, offset = 0, max;
+	__u16 type;
+
+	if (strlen(cmd) >= sizeof(buf))
+		return 1;
+	strlcpy(buf, cmd, sizeof(buf));
+	name = strtok_r(buf, " ", &pos);
+	if (!name)
+		return 1;
+	while (argc < (int) ARRAY_SIZE(argv) &&
+	       (argv[argc] = strtok_r(NULL, " ", &pos)))
+		argc++;
+	if (argc == ARRAY_SIZE(argv))
+		return 1;
+
+	for (k = 0; k < table->num; k++) {
+		if (strncmp(priv[k].name, name, IFNAMSIZ) == 0)
+			break;
+	}
+	if (k == table->num)
+		return 1;
+
+	if (priv[k].cmd < SIOCDEVPRIVATE) {
+		/* Sub-ioctl; find the real ioctl with matching arguments */
+		for (j = 0; j < table->num; j++) {
+			if (priv[j].name[0] == '\0' &&
+			    priv[j].set_args == priv[k].set_args &&
+			    priv[j].get_args == priv[k].get_args)
+				break;
+		}
+		if (j == table->num)
+			return 1;
+		subcmd = priv[k].cmd;
+		offset = sizeof(__u32);
+		k = j;
+	}
+
+	/* Commands that return data are left for the command line tool */
+	if (priv[k].get_args & IW_PRIV_SIZE_MASK)
+		return 1;
+
+	memset(&wrq, 0, sizeof(wrq));
+	memset(&data, 0, sizeof(data));
+	type = priv[k].set_args & IW_PRIV_TYPE_MASK;
+	max = priv[k].set_args & IW_PRIV_SIZE_MASK;
+	if (type && max) {
+		switch (type) {
+		case IW_PRIV_TYPE_INT:
+			if (max > (int) ARRAY_SIZE(data.ints))
+				return 1;
+			wrq.u.data.length = argc > max ? max : argc;
+			for (i = 0; i < wrq.u.data.length; i++)
+				data.ints[i] = (__s32) strtoll(argv[i], NULL,
+							       0);
+			break;
+		case IW_PRIV_TYPE_CHAR:
+			if (max > (int) sizeof(data.chars))
+				return 1;
+			if (argc > 0) {
+				wrq.u.data.length = strlen(argv[0]) + 1;
+				if (wrq.u.data.length > max)
+					wrq.u.data.length = max;
+				memcpy(data.chars, argv[0], wrq.u.data.length);
+				data.chars[max - 1] = '\0';
+			} else {
+				wrq.u.data.length = 1;
+			}
+			break;
+		default:
+			return 1;
+		}
+
+		if ((priv[k].set_args & IW_PRIV_SIZE_FIXED) &&
+		    wrq.u.data.length != max) {
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"iwpriv %s %s: expected %d arguments",
+					ifname, name, max);
+			return -1;
+		}
+	}
+
+	strlcpy(wrq.ifr_name, ifname, sizeof(wrq.ifr_name));
+	if ((priv[k].set_args & IW_PRIV_SIZE_FIXED) &&
+	    wext_priv_size(priv[k].set_args) + offset <= IFNAMSIZ) {
+		/* Arguments fit within the request */
+		if (offset)
+			wrq.u.mode = subcmd;
+		memcpy(wrq.u.name + offset, &data, IFNAMSIZ - offset);
+	} else {
+		wrq.u.data.pointer = &data;
+		wrq.u.data.flags = subcmd;
+	}
+
+	if (ioctl(s, priv[k].cmd, &wrq) < 0) {
+		sigma_dut_print(dut, DUT_MSG_INFO, "iwpriv %s %s: %s",
+				ifname, cmd, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+#endif /* __linux__ */
+
+
+/* Returns the number of batched commands that failed */
+int iwpriv_batch_flush(struct sigma_dut *dut)
+{
+	struct iwpriv_batch_item *items = dut->iwpriv_batch;
+	size_t i, len = dut->iwpriv_batch_len;
+	int res, failed = 0;
+	char *buf;
+#ifdef __linux__
+	struct wext_priv_table table;
+	int s = -1;
+
+	memset(&table, 0, sizeof(table));
+	if (len && strcmp(dut->priv_cmd, "iwpriv") == 0)
+		s = socket(AF_INET, SOCK_DGRAM, 0);
+#endif /* __linux__ */
+
+	dut->iwpriv_batch = NULL;
+	dut->iwpriv_batch_len = 0;
+	dut->iwpriv_batch_size = 0;
+
+	if (len)
+		sigma_dut_print(dut, DUT_MSG_DEBUG,
+				"Submit %zu batched %s commands",
+				len, dut->priv_cmd);
+
+	for (i = 0; i < len; i++) {
+		res = 1;
+#ifdef __linux__
+		if (s >= 0 && strcmp(table.ifname, items[i].ifname) != 0)
+			wext_get_priv_table(s, items[i].ifname, &table);
+		if (s >= 0 && table.args)
+			res = wext_priv_set(dut, s, &table, items[i].ifname,
+					    items[i].args);
+#endif /* __linux__ */
+		if (res > 0) {
+			size_t size = strlen(dut->priv_cmd) +
+				strlen(items[i].ifname) +
+				strlen(items[i].args) + 3;
+
+			buf = malloc(size);
+			if (buf) {
+				snprintf(buf, size, "%s %s %s", dut->priv_cmd,
+					 items[i].ifname, items[i].args);
+				res = run_system(dut, buf) == 0 ? 0 : -1;
+				free(buf);
+			} else {
+				res = -1;
+			}
+		}
+		if (res) {
+			sigma_dut_print(dut, DUT_MSG_ERROR,
+					"Batched command %zu/%zu failed: %s %s %s",
+					i + 1, len, dut->priv_cmd,
+					items[i].ifname, items[i].args);
+			failed++;
+		}
+		free(items[i].ifname);
+		free(items[i].args);
+	}
+
+#ifdef __linux__
+	free(table.args);
+	if (s >= 0)
+		close(s);
+#endif /* __linux__ */
+	free(items);
+
+	return failed;
+}
@@ -9,6 +9,12 @@
 
 #include "sigma_dut.h"
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef __linux__
+#include <limits.h>
+#include <sys/inotify.h>
+#endif /* __linux__ */
 #include "wpa_ctrl.h"
 #include "wpa_helpers.h"
 
@@ -112,25 +118,189 @@ void dut_ifc_reset(struct sigma_dut *dut)
 }
 
 
+/*
+ * Request sockets to wpa_supplicant/hostapd are kept open across commands
+ * instead of creating a new client socket for each request. Connections are
+ * pooled per control interface path; a connection is removed from the pool
+ * while a request is in progress so that concurrent users get their own
+ * socket.
+ */
+struct wpa_ctrl_conn {
+	struct wpa_ctrl_conn *next;
+	struct wpa_ctrl *ctrl;
+	char ctrl_path[256];
+	char ifname[IFNAMSIZ + 1];
+};
+
+static struct wpa_ctrl_conn *wpa_ctrl_conns;
+static pthread_mutex_t wpa_ctrl_conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static struct wpa_ctrl_conn * wpa_ctrl_conn_get(const char *path,
+						const char *ifname,
+						int *reused)
+{
+	struct wpa_ctrl_conn *conn, *prev = NULL;
+	char buf[256];
+	int res, fd;
+
+	res = snprintf(buf, sizeof(buf), "%s%s", path, ifname);
+	if (res < 0 || res >= (int) sizeof(buf))
+		return NULL;
+
+	pthread_mutex_lock(&wpa_ctrl_conns_lock);
+	for (conn = wpa_ctrl_conns; conn; prev = conn, conn = conn->next) {
+		if (strcmp(conn->ctrl_path, buf) != 0)
+			continue;
+		if (prev)
+			prev->next = conn->next;
+		else
+			wpa_ctrl_conns = conn->next;
+		conn->next = NULL;
+		pthread_mutex_unlock(&wpa_ctrl_conns_lock);
+		*reused = 1;
+		return conn;
+	}
+	pthread_mutex_unlock(&wpa_ctrl_conns_lock);
+
+	*reused = 0;
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+	conn->ctrl = wpa_ctrl_open2(buf, client_socket_path);
+	if (!conn->ctrl) {
+		printf("wpa_command: wpa_ctrl_open2(%s) failed\n", buf);
+		free(conn);
+		return NULL;
+	}
+	/* Do not leak the cached socket into the processes we start */
+	fd = wpa_ctrl_get_fd(conn->ctrl);
+	if (fd >= 0)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+	strlcpy(conn->ctrl_path, buf, sizeof(conn->ctrl_path));
+	strlcpy(conn->ifname, ifname, sizeof(conn->ifname));
+
+	return conn;
+}
+
+
+static void wpa_ctrl_conn_free(struct wpa_ctrl_conn *conn)
+{
+	wpa_ctrl_close(conn->ctrl);
+	free(conn);
+}
+
+
+static void wpa_ctrl_conn_put(struct wpa_ctrl_conn *conn)
+{
+	pthread_mutex_lock(&wpa_ctrl_conns_lock);
+	conn->next = wpa_ctrl_conns;
+	wpa_ctrl_conns = conn;
+	pthread_mutex_unlock(&wpa_ctrl_conns_lock);
+}
+
+
+/*
+ * Send a request over a pooled control interface connection. A cached
+ * connection that fails (e.g., because the daemon was restarted and the
+ * control socket was recreated) is replaced with a new one and the request
+ * is retried once. Returns 0 on success, -1 if the control interface could
+ * not be reached, or -2 if the request failed.
+ */
+static int wpa_ctrl_pool_request(const char *path, const char *ifname,
+				 const char *cmd, char *reply,
+				 size_t *reply_len)
+{
+	struct wpa_ctrl_conn *conn;
+	size_t len;
+	int reused, res;
+
+	for (;;) {
+		conn = wpa_ctrl_conn_get(path, ifname, &reused);
+		if (!conn)
+			return -1;
+		len = *reply_len;
+		res = wpa_ctrl_request(conn->ctrl, cmd, strlen(cmd), reply,
+				       &len, NULL);
+		if (res == 0) {
+			wpa_ctrl_conn_put(conn);
+			*reply_len = len;
+			return 0;
+		}
+		/*
+		 * Do not reuse the socket after a failure; a timed out request
+		 * could still get a late response that would be mistaken as
+		 * the response to the next request.
+		 */
+		wpa_ctrl_conn_free(conn);
+		if (!reused || res != -1)
+			return -2;
+	}
+}
+
+
+static void wpa_ctrl_flush_conns(const char *path, const char *ifname)
+{
+	struct wpa_ctrl_conn *conn, *prev = NULL, *next;
+	size_t path_len = strlen(path);
+
+	pthread_mutex_lock(&wpa_ctrl_conns_lock);
+	for (conn = wpa_ctrl_conns; conn; conn = next) {
+		next = conn->next;
+		if (strncmp(conn->ctrl_path, path, path_len) != 0 ||
+		    (ifname && strcmp(conn->ifname, ifname) != 0)) {
+			prev = conn;
+			continue;
+		}
+		if (prev)
+			prev->next = next;
+		else
+			wpa_ctrl_conns = next;
+		wpa_ctrl_conn_free(conn);
+	}
+	pthread_mutex_unlock(&wpa_ctrl_conns_lock);
+}
+
+
+void flush_wpa_ctrl_conns(const char *ifname)
+{
+	wpa_ctrl_flush_conns(sigma_wpas_ctrl, ifname);
+}
+
+
+void flush_hapd_ctrl_conns(const char *ifname)
+{
+	const char *path = sigma_hapd_ctrl ? sigma_hapd_ctrl :
+		DEFAULT_HAPD_CTRL_PATH;
+
+	wpa_ctrl_flush_conns(path, ifname);
+}
+
+
+void flush_all_ctrl_conns(void)
+{
+	struct wpa_ctrl_conn *conn;
+
+	pthread_mutex_lock(&wpa_ctrl_conns_lock);
+	while (wpa_ctrl_conns) {
+		conn = wpa_ctrl_conns;
+		wpa_ctrl_conns = conn->next;
+		wpa_ctrl_conn_free(conn);
+	}
+	pthread_mutex_unlock(&wpa_ctrl_conns_lock);
+}
+
+
 int wpa_ctrl_command(const char *path, const char *ifname, const char *cmd)
 {
-	struct wpa_ctrl *ctrl;
 	char buf[128];
 	size_t len;
 
-	snprintf(buf, sizeof(buf), "%s%s", path, ifname);
-	ctrl = wpa_ctrl_open2(buf, client_socket_path);
-	if (ctrl == NULL) {
-		printf("wpa_command: wpa_ctrl_open2(%s) failed\n", buf);
-		return -1;
-	}
-	len = sizeof(buf);
-	if (wpa_ctrl_request(ctrl, cmd, strlen(cmd), buf, &len, NULL) < 0) {
+	len = sizeof(buf) - 1;
+	if (wpa_ctrl_pool_request(path, ifname, cmd, buf, &len) < 0) {
 		printf("wpa_command: wpa_ctrl_request failed\n");
-		wpa_ctrl_close(ctrl);
 		return -1;
 	}
-	wpa_ctrl_close(ctrl);
 	buf[len] = '\0';
 	if (strncmp(buf, "FAIL", 4) == 0) {
 		printf("wpa_command: Command failed (FAIL received)\n");
@@ -164,23 +334,13 @@ int hapd_command(const char *ifname, const char *cmd)
 int wpa_ctrl_command_resp(const char *path, const char *ifname,
 			  const char *cmd, char *resp, size_t resp_size)
 {
-	struct wpa_ctrl *ctrl;
-	char buf[128];
 	size_t len;
 
-	snprintf(buf, sizeof(buf), "%s%s", path, ifname);
-	ctrl = wpa_ctrl_open2(buf, client_socket_path);
-	if (ctrl == NULL) {
-		printf("wpa_command: wpa_ctrl_open2(%s) failed\n", buf);
-		return -1;
-	}
 	len = resp_size;
-	if (wpa_ctrl_request(ctrl, cmd, strlen(cmd), resp, &len, NULL) < 0) {
+	if (wpa_ctrl_pool_request(path, ifname, cmd, resp, &len) < 0) {
 		printf("wpa_command: wpa_ctrl_request failed\n");
-		wpa_ctrl_close(ctrl);
 		return -1;
 	}
-	wpa_ctrl_close(ctrl);
 	resp[len] = '\0';
 	return 0;
 }
@@ -239,6 +399,190 @@ struct wpa_ctrl * open_hapd_mon(const char *ifname)
 }
 
 
+static int ms_until(const struct timespec *deadline)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+		(deadline->tv_nsec - now.tv_nsec) / 1000000;
+	return ms > 0 ? ms : 0;
+}
+
+
+static int is_ctrl_socket(const char *path)
+{
+	struct stat s;
+
+	return stat(path, &s) == 0 && S_ISSOCK(s.st_mode);
+}
+
+
+/*
+ * Wait for the control socket to be created. inotify on the control
+ * directory wakes us up as soon as hostapd binds the socket; if the directory
+ * does not exist yet (or inotify is unavailable), fall back to short polls.
+ */
+static int wait_ctrl_socket(struct sigma_dut *dut, const char *dir,
+			    const char *path, const struct timespec *deadline)
+{
+#ifdef __linux__
+	int ifd, wd = -1;
+	char ev[sizeof(struct inotify_event) + NAME_MAX + 1];
+
+	ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif /* __linux__ */
+
+	for (;;) {
+		int ms;
+
+		if (is_ctrl_socket(path))
+			break;
+		ms = ms_until(deadline);
+		if (ms == 0)
+			break;
+#ifdef __linux__
+		if (ifd >= 0 && wd < 0) {
+			wd = inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO);
+			if (wd >= 0)
+				continue; /* recheck to close the race */
+		}
+		if (wd >= 0) {
+			struct pollfd pfd = { .fd = ifd, .events = POLLIN };
+
+			if (poll(&pfd, 1, ms) > 0)
+				while (read(ifd, ev, sizeof(ev)) > 0)
+					;
+			continue;
+		}
+#endif /* __linux__ */
+		usleep((ms < 20 ? ms : 20) * 1000);
+	}
+
+#ifdef __linux__
+	if (ifd >= 0)
+		close(ifd);
+#endif /* __linux__ */
+
+	if (!is_ctrl_socket(path)) {
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"hostapd control socket %s did not appear",
+				path);
+		return -1;
+	}
+	return 0;
+}
+
+
+/*
+ * Wait until hostapd has completed interface setup: the control socket exists
+ * and the interface is either enabled or has moved on to a long-running
+ * channel procedure (DFS CAC, ACS, 20/40 scan) that callers do not wait for.
+ * Returns 0 when ready, -1 on timeout.
+ */
+int wait_hostapd_ready(struct sigma_dut *dut, const char *ctrl_dir,
+		       const char *ifname, unsigned int timeout_ms)
+{
+	const char *events[] = { "AP-ENABLED", "DFS-CAC-START", "ACS-STARTED",
+				 NULL };
+	struct timespec deadline;
+	struct wpa_ctrl *mon = NULL;
+	char dir[256], path[256], buf[4096];
+	size_t len;
+	int fd, ret = -1;
+
+	if (!ctrl_dir)
+		ctrl_dir = DEFAULT_HAPD_CTRL_PATH;
+	len = strlen(ctrl_dir);
+	snprintf(dir, sizeof(dir), "%s%s", ctrl_dir,
+		 len && ctrl_dir[len - 1] != '/' ? "/" : "");
+	snprintf(path, sizeof(path), "%s%s", dir, ifname);
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	if (wait_ctrl_socket(dut, dir, path, &deadline) < 0)
+		return -1;
+
+	/* The socket may exist slightly before hostapd starts serving it */
+	while (!(mon = open_wpa_ctrl_mon(dir, ifname))) {
+		int ms = ms_until(&deadline);
+
+		if (ms == 0) {
+			sigma_dut_print(dut, DUT_MSG_INFO,
+					"Could not attach to %s", path);
+			return -1;
+		}
+		usleep((ms < 20 ? ms : 20) * 1000);
+	}
+
+	/* Attached first so that a state change after STATUS is not missed */
+	len = sizeof(buf) - 1;
+	if (wpa_ctrl_request(mon, "STATUS", 6, buf, &len, NULL) == 0) {
+		char *state;
+
+		buf[len] = '\0';
+		state = strstr(buf, "state=");
+		if (state &&
+		    (strncmp(state + 6, "ENABLED", 7) == 0 ||
+		     strncmp(state + 6, "DFS", 3) == 0 ||
+		     strncmp(state + 6, "ACS", 3) == 0 ||
+		     strncmp(state + 6, "HT_SCAN", 7) == 0)) {
+			ret = 0;
+			goto out;
+		}
+	}
+
+	fd = wpa_ctrl_get_fd(mon);
+	for (;;) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int i, ms;
+		char *pos;
+
+		ms = ms_until(&deadline);
+		if (ms == 0 || poll(&pfd, 1, ms) <= 0)
+			break;
+		len = sizeof(buf) - 1;
+		if (wpa_ctrl_recv(mon, buf, &len) < 0)
+			break;
+		buf[len] = '\0';
+		pos = strchr(buf, '>');
+		if (!pos)
+			continue;
+		for (i = 0; events[i]; i++) {
+			if (strncmp(pos + 1, events[i], strlen(events[i])) == 0)
+				break;
+		}
+		if (events[i]) {
+			sigma_dut_print(dut, DUT_MSG_DEBUG,
+					"hostapd ready: %s", pos + 1);
+			ret = 0;
+			goto out;
+		}
+	}
+
+	/* Interface setup did not complete in time; accept a live daemon */
+	len = sizeof(buf) - 1;
+	if (wpa_ctrl_request(mon, "PING", 4, buf, &len, NULL) == 0 &&
+	    len >= 4 && strncmp(buf, "PONG", 4) == 0) {
+		sigma_dut_print(dut, DUT_MSG_INFO,
+				"hostapd on %s responds but is not enabled yet",
+				ifname);
+		ret = 0;
+	}
+out:
+	wpa_ctrl_detach(mon);
+	wpa_ctrl_close(mon);
+	return ret;
+}
+
+
 int get_wpa_cli_events_timeout(struct sigma_dut *dut, struct wpa_ctrl *mon,
 			       const char **events, char *buf, size_t buf_size,
 			       unsigned int timeout)
@@ -353,29 +697,25 @@ int get_wpa_cli_event(struct sigma_dut *dut, struct wpa_ctrl *mon,
 int get_wpa_signal_poll(struct sigma_dut *dut, const char *ifname,
 			const char *field, char *obuf, size_t obuf_size)
 {
-	struct wpa_ctrl *ctrl;
 	char buf[4096];
 	char *pos, *end;
 	size_t len, flen;
+	int res;
 
-	snprintf(buf, sizeof(buf), "%s%s", sigma_wpas_ctrl, ifname);
-	ctrl = wpa_ctrl_open2(buf, client_socket_path);
-	if (!ctrl) {
+	len = sizeof(buf) - 1;
+	res = wpa_ctrl_pool_request(sigma_wpas_ctrl, ifname, "SIGNAL_POLL",
+				    buf, &len);
+	if (res == -1) {
 		sigma_dut_print(dut, DUT_MSG_ERROR,
 				"Failed to connect to wpa_supplicant");
 		return -1;
 	}
-
-	len = sizeof(buf);
-	if (wpa_ctrl_request(ctrl, "SIGNAL_POLL", 11, buf, &len, NULL) < 0) {
-		wpa_ctrl_close(ctrl);
+	if (res < 0) {
 		sigma_dut_print(dut, DUT_MSG_ERROR, "ctrl request failed");
 		return -1;
 	}
 	buf[len] = '\0';
 
-	wpa_ctrl_close(ctrl);
-
 	flen = strlen(field);
 	pos = buf;
 	while (pos + flen < buf + len) {
@@ -514,23 +854,12 @@ static int get_wpa_ctrl_mlo_status(const char *path, const char *ifname,
 				   const char *cmd, char *obuf,
 				   size_t obuf_size)
 {
-	struct wpa_ctrl *ctrl;
 	char buf[4096];
 	size_t len;
-	int res;
 
-	res = snprintf(buf, sizeof(buf), "%s%s", path, ifname);
-	if (res < 0 || res >= sizeof(buf))
-		return -1;
-	ctrl = wpa_ctrl_open2(buf, client_socket_path);
-	if (!ctrl)
+	len = sizeof(buf) - 1;
+	if (wpa_ctrl_pool_request(path, ifname, cmd, buf, &len) < 0)
 		return -1;
-	len = sizeof(buf);
-	if (wpa_ctrl_request(ctrl, cmd, strlen(cmd), buf, &len, NULL) < 0) {
-		wpa_ctrl_close(ctrl);
-		return -1;
-	}
-	wpa_ctrl_close(ctrl);
 	buf[len] = '\0';
 
 	if (len >= obuf_size)
@@ -674,21 +1003,13 @@ static int get_wpa_ctrl_status_field(const char *path, const char *ifname,
 				     const char *cmd, const char *field,
 				     char *obuf, size_t obuf_size)
 {
-	struct wpa_ctrl *ctrl;
 	char buf[4096];
 	char *pos, *end;
 	size_t len, flen;
 
-	snprintf(buf, sizeof(buf), "%s%s", path, ifname);
-	ctrl = wpa_ctrl_open2(buf, client_socket_path);
-	if (ctrl == NULL)
-		return -1;
-	len = sizeof(buf);
-	if (wpa_ctrl_request(ctrl, cmd, strlen(cmd), buf, &len, NULL) < 0) {
-		wpa_ctrl_close(ctrl);
+	len = sizeof(buf) - 1;
+	if (wpa_ctrl_pool_request(path, ifname, cmd, buf, &len) < 0)
 		return -1;
-	}
-	wpa_ctrl_close(ctrl);
 	buf[len] = '\0';
 
 	flen = strlen(field);
@@ -1071,6 +1392,7 @@ void stop_sta_mode(struct sigma_dut *dut)
 {
 	if (is_60g_sigma_dut(dut)) {
 		wpa_command(get_main_ifname(dut), "TERMINATE");
+		flush_wpa_ctrl_conns(NULL);
 		return;
 	}
 
@@ -1086,6 +1408,7 @@ void stop_sta_mode(struct sigma_dut *dut)
 		wpa_command(dut->station_ifname_2g, "TERMINATE");
 	if (dut->station_ifname_5g)
 		wpa_command(dut->station_ifname_5g, "TERMINATE");
+	flush_wpa_ctrl_conns(NULL);
 	dut->sta_2g_started = 0;
 	dut->sta_5g_started = 0;
 }
@@ -21,6 +21,9 @@ int wpa_command_resp(const char *ifname, const char *cmd,
 		     char *resp, size_t resp_size);
 int hapd_command_resp(const char *ifname, const char *cmd,
 		      char *resp, size_t resp_size);
+void flush_wpa_ctrl_conns(const char *ifname);
+void flush_hapd_ctrl_conns(const char *ifname);
+void flush_all_ctrl_conns(void);
 int get_wpa_status(const char *ifname, const char *field, char *obuf,
 		   size_t obuf_size);
 int get_wpa_signal_poll(struct sigma_dut *dut, const char *ifname,
@@ -40,6 +43,8 @@ int ap_get_mlo_link_id(struct sigma_dut *dut, const char *ifname);
 int get_connected_mlo_link_ids(struct sigma_dut *dut, const char *ifname);
 struct wpa_ctrl * open_wpa_mon(const char *ifname);
 struct wpa_ctrl * open_hapd_mon(const char *ifname);
+int wait_hostapd_ready(struct sigma_dut *dut, const char *ctrl_dir,
+		       const char *ifname, unsigned int timeout_ms);
 int wait_ip_addr(struct sigma_dut *dut, const char *ifname, int timeout);
 int get_wpa_cli_event(struct sigma_dut *dut, struct wpa_ctrl *mon,
 		      const char *event, char *buf, size_t buf_size);